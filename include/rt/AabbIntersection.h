@@ -25,7 +25,10 @@ public:
 	static bool isPointInside( const Aabb& box, const vr::vec3f& point );
 
 private:
-	static void clip( vr::vec3f vertexBuffer[8], vr::vec3f tempBuffer[8], 
+	// A triangle clipped by 6 planes has up to 9 vertices, round-off in near-parallel cases may add a few more
+	static const uint32 MAX_CLIP_VERTICES = 16;
+
+	static void clip( vr::vec3f vertexBuffer[MAX_CLIP_VERTICES], vr::vec3f tempBuffer[MAX_CLIP_VERTICES], 
 		              uint32& vertexCount, float pos, float dir, RTenum dim );
 
 	// Triangle-ABB Overlap Axis Tests
@@ -26,6 +26,8 @@ struct Instance;
 struct Plugins;
 struct Scene;
 class Sample;
+struct Ray;
+struct Hit;
 
 class Context
 {
@@ -44,8 +46,20 @@ public:
 
 	void renderFrame();
 	void traceNearest( Sample& sample );
+	// Traces count coherent samples at once, see IAccStruct::traceNearestInstancePacket
+	void traceNearestPacket( Sample* samples, uint32 count );
 	bool traceAny( Sample& sample );
 
+	// Ray streams: trace count rays and store hits only, nothing is shaded (e.g. visibility or collision queries).
+	// Each ray is traced between the ray epsilon and its tfar, only orig, dir and tfar are read.
+	// Rays are reordered by direction octant and origin, so that neighbors in the order form coherent packets.
+	// The scene is used as of its last update (see checkAndUpdateInstances), and several threads may trace
+	// separate streams at once.
+	// Nearest hit of each ray, with a NULL instance if ray hits nothing
+	void traceNearestStream( const Ray* rays, Hit* hits, uint32 count );
+	// Whether anything blocks each ray, see traceAny
+	void traceAnyStream( const Ray* rays, bool* blocked, uint32 count );
+
 	// Plugins
 	void setAccStructBuilder( rt::IAccStructBuilder* accBuilder );
 	rt::IAccStructBuilder* getAccStructBuilder() const;
@@ -98,6 +112,11 @@ public:
 	void instantiateGeometry( uint32 instanceId, uint32 geometryId );
 	void instantiateLastGeometry( uint32 instanceId );
 
+	// Replaces all vertex positions of a geometry while keeping its triangles, e.g. to play keyframe animations.
+	// Vertices are xyz triples, one per geometry vertex, transformed by current matrix as in addVertex.
+	// Normals are optional, pass NULL to keep current ones.
+	void updateGeometryVertices( uint32 geometryId, float const * const vertices, float const * const normals );
+
 	Geometry* getGeometry( uint32 id ) const;
 	uint32 getGeometryCount() const;
 	Instance* getInstance( uint32 id ) const;
@@ -116,6 +135,13 @@ public:
 	void setMediumRefractionIndex( float index );
 	float getMediumRefractionIndex() const;
 
+	// Widest SIMD instruction set used by kernels, one of RT_SIMD_*. Detected when the context is created, 
+	// may be lowered to compare kernels. Levels are clamped to the range from RT_SIMD_NONE to the detected one.
+	// With RT_SIMD_NONE, triangle blocks are tested one triangle at a time and packets are traced ray by ray.
+	// Structures without scalar kernels, such as QbvhAccStruct, always use SSE.
+	void setSimdLevel( RTenum level );
+	RTenum getSimdLevel() const;
+
 	// Force scene update
 	void checkAndUpdateInstances();
 
@@ -124,6 +150,13 @@ private:
 	Context();
 	~Context();
 
+	// Instance box is the box of its geometry transformed to world space
+	void updateInstanceBox( Instance& instance );
+
+	// Ray ids of a stream sorted by direction octant, then by Morton code of origin inside the scene box.
+	// Each entry holds the sort key in its upper 32 bits and the ray id in its lower 32 bits.
+	void sortStream( const Ray* rays, uint32 count, std::vector<uint64>& order ) const;
+
 	Plugins* _plugins;
 	Scene* _scene;
 	MatrixStack _matrixStack;
@@ -131,6 +164,10 @@ private:
 	PrimitiveBuilder _primBuilder;
 
 	bool _instancesDirty;
+	// Instance count changed or builder was replaced, instance structure must be rebuilt from scratch
+	bool _instancesRebuild;
+	// Instances moved since last update
+	std::vector<uint32> _changedInstances;
 	uint32 _currentMaterialId;
 	uint32 _currentGeometryId;
 
@@ -138,6 +175,7 @@ private:
 	float _rayEpsilon;
 	uint32 _maxRecursionDepth;
 	float _mediumRefractionIndex;
+	RTenum _simdLevel;
 };
 
 } // namespace rt
@@ -0,0 +1,24 @@
+#ifndef _RT_CPUINFO_H_
+#define _RT_CPUINFO_H_
+
+#include <rt/common.h>
+
+namespace rt {
+
+// Instruction sets of the running CPU, queried with CPUID
+class CpuInfo
+{
+public:
+	static bool hasSse();
+	static bool hasSse2();
+
+	// Widest instruction set with kernel implementations, one of RT_SIMD_*
+	static RTenum getSimdLevel();
+
+	// Name of a RT_SIMD_* level, for log messages
+	static const char* getSimdLevelName( RTenum level );
+};
+
+} // namespace rt
+
+#endif // _RT_CPUINFO_H_
@@ -12,6 +12,14 @@ class Geometry : public vr::RefCounted
 public:
 	void clear();
 
+	// (Re)builds a TriAccel for each triangle from the current vertices. Triangles keep their ids,
+	// degenerate ones get an empty TriAccel which is never hit.
+	void buildTriAccel();
+
+	// True if every triangle has its TriAccel. Geometry loaded for a compact BVH has none, see
+	// rt::IAccStructBuilder::needsTriAccel.
+	inline bool hasTriAccel() const;
+
 	// vertexIdx must be 0, 1 or 2
 	inline const vr::vec3f& getVertex( uint32 t, uint32 vertexIdx ) const;
 	inline const vr::vec3f& getNormal( uint32 t, uint32 vertexIdx ) const;
@@ -31,6 +39,11 @@ private:
 	inline const vr::vec3f& getVertexData( T& data, uint32 t, uint32 vertexIdx ) const;
 };
 
+inline bool Geometry::hasTriAccel() const
+{
+	return ( triAccel.size() == triDesc.size() );
+}
+
 inline const vr::vec3f& Geometry::getVertex( uint32 t, uint32 vertexIdx ) const
 {
 	return getVertexData( vertices, t, vertexIdx );
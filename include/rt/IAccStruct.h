@@ -15,18 +15,38 @@ public:
 	virtual void setBoundingBox( const rt::Aabb& bbox );
 	virtual const rt::Aabb& getBoundingBox() const;
 
-	// Ray must be transformed to local space prior to calling traceNearestGeometry
+	// Traces sample's ray from the ray epsilon on with findNearestInstance, 
+	// then shades the hit's material, or the environment if nothing was hit
 	virtual void traceNearestInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample );
 
+	// Finds nearest hit of ray between ray.tnear and ray.tfar, nothing is shaded.
+	// Ray must be updated and hit initialized beforehand: no instance, distance Mathf::MAX_VALUE.
+	// Hit's instance stays NULL if nothing is hit, ray may be clipped to the structure's box.
+	// Ray must be transformed to local space prior to calling traceNearestGeometry
+	virtual void findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit );
+
 	// Ray is already transformed to instance local space
 	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
 
-	// Ray must be transformed to local space prior to calling traceNearestGeometry
+	// Occlusion test for shadow rays: returns true as soon as any triangle blocks sample's ray between 
+	// the ray epsilon and ray.tfar (e.g. the light's distance). Nothing is shaded and sample's hit is left untouched.
+	// Ray must be transformed to local space prior to calling traceAnyGeometry
 	virtual bool traceAnyInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample );
 
-	// Ray is already transformed to instance local space
+	// Ray is already transformed to instance local space. 
+	// Returns true at the first triangle hit between ray.tnear and ray.tfar, hit is not modified.
+	// The default tests every triangle of the geometry, structures override it with an early-exit traversal.
 	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
 
+	// Packet versions of traceNearestInstance and traceNearestGeometry, for count coherent rays (e.g. neighbor pixels).
+	// Structures supporting packet traversal share it among rays, default implementations trace each ray on its own.
+	virtual void traceNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Sample* samples, uint32 count );
+	virtual void traceNearestGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count );
+
+	// Packet version of findNearestInstance, for ray streams (see Context::traceNearestStream)
+	virtual void findNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Ray* rays, rt::Hit* hits, 
+		                                    uint32 count );
+
 protected:
 	rt::Aabb _bbox;
 };
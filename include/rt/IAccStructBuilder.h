@@ -14,7 +14,22 @@ class IAccStructBuilder : public IPlugin
 public:
 	// Default implementation: do nothing
 	virtual void buildGeometry( rt::Geometry* geometry );
+
+	// Called when geometry's vertices moved but its triangles stayed the same, e.g. in keyframe animations.
+	// Default implementation: rebuild from scratch
+	virtual void updateGeometry( rt::Geometry* geometry );
 	virtual IAccStruct* buildInstance( const std::vector<rt::Instance> instances );
+
+	// Called instead of buildInstance when accStruct was built by this builder for the same instances
+	// and only the ones in changedIds have moved since. Returns accStruct itself if it was updated in place.
+	// Default implementation: rebuild from scratch
+	virtual IAccStruct* updateInstance( IAccStruct* accStruct, const std::vector<rt::Instance>& instances, 
+		                                const std::vector<uint32>& changedIds );
+
+	// Whether geometry structures of this builder test triangles through the geometry's TriAccel's.
+	// If not, the context loads and updates geometry without them, see Geometry::buildTriAccel.
+	// Default implementation: true
+	virtual bool needsTriAccel() const;
 };
 
 } // namespace rt
@@ -16,6 +16,9 @@ public:
 
 	void begin( RTenum primitiveType, Geometry* geometry );
 
+	// Without TriAccel's, only the TriDesc's of valid triangles are stored. Enabled by default.
+	void setStoreTriAccel( bool enabled );
+
 	void setMaterial( rt::IMaterial* material );
 	Transform& getTransform();
 	AttributeBinding& getBindings();
@@ -43,6 +46,7 @@ private:
 	Geometry* _geometry;
 	rt::IMaterial* _material;
 	uint32 _startVertex;
+	bool _storeTriAccel;
 	Transform _transform;
 	AttributeBinding _bindings;
 
@@ -11,7 +11,15 @@ namespace rt {
 class RayTriIntersection
 {
 public:
-	static void hitWald( const rt::TriAccel& acc, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+	// Hits are accepted inside [ray.tnear - HIT_EPSILON, ray.tfar + HIT_EPSILON]
+	static const float HIT_EPSILON;
+
+	// Inline, since it is the kernel of all acceleration structures
+	static inline void hitWald( const rt::TriAccel& acc, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+
+	// Occlusion version of hitWald: only tells whether ray hits triangle between tnear and tfar
+	static inline bool hitAnyWald( const rt::TriAccel& acc, const rt::Ray& ray );
+
 	static void hitMT1( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
 	static void hitMT2( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
 	static void hitMT3( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
@@ -28,6 +36,73 @@ private:
 	static uint32 s_modulo[8];
 };
 
+inline void RayTriIntersection::hitWald( const rt::TriAccel& acc, const rt::Ray& ray, rt::Hit& hit, float& bestDistance )
+{
+	const uint32 ku = s_modulo[acc.k+1];
+	const uint32 kv = s_modulo[acc.k+2];
+
+	// Start high-latency division as early as possible
+	const float nd = 1.0f / ( ray.dir[acc.k] + acc.n_u * ray.dir[ku] + acc.n_v * ray.dir[kv] );
+	const float f = nd * ( acc.n_d - ray.orig[acc.k] - acc.n_u * ray.orig[ku] - acc.n_v * ray.orig[kv] );
+
+	// Check for valid distance
+	// TODO: find a correct way to get rid of these epsilons and check scene06 for any errors
+	if( ( f >= bestDistance ) || ( f < ray.tnear - HIT_EPSILON ) || ( f > ray.tfar + HIT_EPSILON ) )
+		return;
+
+	// Compute hit point positions on uv plane
+	const float hu = ray.orig[ku] + f * ray.dir[ku];
+	const float hv = ray.orig[kv] + f * ray.dir[kv];
+
+	// Check first barycentric coordinate
+	const float lambda = hu * acc.b_nu + hv * acc.b_nv + acc.b_d;
+	if( lambda < 0.0f )
+		return;
+
+	// Check second barycentric coordinate
+	const float mue = hu * acc.c_nu + hv * acc.c_nv + acc.c_d;
+	if( mue < 0.0f )
+		return;
+
+	// Check third barycentric coordinate
+	const float psi = 1.0f - lambda - mue;
+	if( psi < 0.0f )
+		return;
+
+	// Have a valid hit point here. Store it.
+	bestDistance = f;
+	hit.triangleId = acc.triangleId;
+	hit.v0Coord = psi;
+	hit.v1Coord = lambda;
+	hit.v2Coord = mue;
+}
+
+inline bool RayTriIntersection::hitAnyWald( const rt::TriAccel& acc, const rt::Ray& ray )
+{
+	const uint32 ku = s_modulo[acc.k+1];
+	const uint32 kv = s_modulo[acc.k+2];
+
+	const float nd = 1.0f / ( ray.dir[acc.k] + acc.n_u * ray.dir[ku] + acc.n_v * ray.dir[kv] );
+	const float f = nd * ( acc.n_d - ray.orig[acc.k] - acc.n_u * ray.orig[ku] - acc.n_v * ray.orig[kv] );
+
+	// Same tolerance as hitWald. Comparisons against NaN's are false, so rays parallel to the triangle never hit it.
+	if( !( ( f >= ray.tnear - HIT_EPSILON ) && ( f <= ray.tfar + HIT_EPSILON ) ) )
+		return false;
+
+	const float hu = ray.orig[ku] + f * ray.dir[ku];
+	const float hv = ray.orig[kv] + f * ray.dir[kv];
+
+	const float lambda = hu * acc.b_nu + hv * acc.b_nv + acc.b_d;
+	if( lambda < 0.0f )
+		return false;
+
+	const float mue = hu * acc.c_nu + hv * acc.c_nv + acc.c_d;
+	if( mue < 0.0f )
+		return false;
+
+	return ( 1.0f - lambda - mue >= 0.0f );
+}
+
 } // namespace rt
 
 #endif // _RT_RAYTRIINTERSECTION_H_
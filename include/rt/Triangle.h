@@ -25,6 +25,9 @@ struct TriAccel
 	void buildFrom( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2 );
 	bool valid() const;
 
+	// Never hit by any ray, replaces triangles that become degenerate during an animation
+	void buildEmpty();
+
 	// first 16 byte half cache line
 	RTenum k; // projection dimension
 	// plane:
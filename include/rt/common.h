@@ -110,4 +110,8 @@ typedef uint32 RTenum;
 #define RT_INTENSITY				0x2407
 */
 
+// SIMD instruction sets used by intersection and traversal kernels, from narrowest to widest
+#define RT_SIMD_NONE				0x2500
+#define RT_SIMD_SSE					0x2501
+
 #endif // _RT_COMMON_H_
@@ -21,6 +21,7 @@ public:
 	GpuRenderer();
 
 	void setAnimationEnabled( bool enabled );
+	bool isAnimationEnabled() const;
 
 	virtual void newFrame();
 	virtual void render();
@@ -0,0 +1,63 @@
+#ifndef _RTP_ACCSTRUCTBENCHMARK_H_
+#define _RTP_ACCSTRUCTBENCHMARK_H_
+
+#include <rt/IAccStructBuilder.h>
+#include <rt/Ray.h>
+#include <rt/Hit.h>
+
+namespace rtp {
+
+// Compares acceleration structures on the same geometry: traces a fixed set of random rays
+// through the structure created by each builder and reports throughput and disagreements.
+// The first run is taken as reference for the following ones.
+class AccStructBenchmark
+{
+public:
+	AccStructBenchmark();
+
+	void setRayCount( uint32 count );
+	uint32 getRayCount() const;
+
+	// Rays start outside the box and point towards random positions inside it
+	void generateRays( const rt::Aabb& bbox );
+
+	// Rays start at a viewpoint outside the box and cover it like the pixels of a square image, in blocks of 4x4 pixels
+	// so that consecutive rays are coherent. Ray count is rounded down to a square of a multiple of 4.
+	void generatePrimaryRays( const rt::Aabb& bbox );
+
+	// Rays start at random positions inside the box and point in random directions, like secondary rays
+	void generateSecondaryRays( const rt::Aabb& bbox );
+
+	// Rays connect pairs of random positions inside the box and end at the second one (tfar = 1), like shadow rays
+	void generateShadowRays( const rt::Aabb& bbox );
+
+	// Rays are traced with traceAnyGeometry, which only reports whether they hit anything.
+	// Then only hits and misses are compared with the reference, not distances.
+	// Structures without their own traceAnyGeometry test every triangle (see IAccStruct), which says nothing about their traversal.
+	void setAnyHit( bool enabled );
+	bool getAnyHit() const;
+
+	// Consecutive rays are traced in packets of this size with traceNearestGeometryPacket, 1 traces each ray on its own
+	void setPacketSize( uint32 size );
+	uint32 getPacketSize() const;
+
+	// Builds geometry's acceleration structure with builder, then traces all rays through it.
+	// Geometry's previous acceleration structure is restored afterwards. Missing TriAccel's are built first
+	// if builder needs them.
+	void run( const char* name, rt::Geometry* geometry, rt::IAccStructBuilder* builder );
+
+	// Forget reference hits, next run becomes the new reference
+	void resetReference();
+
+private:
+	std::vector<rt::Ray> _rays;
+	std::vector<rt::Hit> _reference;
+	uint32 _rayCount;
+	uint32 _packetSize;
+	bool _anyHit;
+	bool _referenceAnyHit;
+};
+
+} // namespace rtp
+
+#endif // _RTP_ACCSTRUCTBENCHMARK_H_
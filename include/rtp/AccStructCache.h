@@ -0,0 +1,92 @@
+#ifndef _RTP_ACCSTRUCTCACHE_H_
+#define _RTP_ACCSTRUCTCACHE_H_
+
+#include <rt/Aabb.h>
+#include <rt/Geometry.h>
+#include <rtp/MappedFile.h>
+#include <stdio.h>
+
+namespace rtp {
+
+// Keeps built acceleration structures in a directory, one binary file per geometry and builder settings.
+// Files start with a header identifying format version, structure type, settings and geometry, followed by
+// blocks of raw data, each one aligned to a cache line so that loaded arrays can be used in place.
+// Loading maps the file into memory. A file that does not match the expected header is treated as missing,
+// builders then rebuild the structure and overwrite the file.
+class AccStructCache
+{
+public:
+	// Increase whenever the file layout or a cached structure's memory layout changes
+	static const uint32 VERSION = 2;
+
+	enum Type
+	{
+		KD_TREE = 1,
+		UNIFORM_GRID = 2
+	};
+
+	// Identifies a cached structure. The box of the triangles is stored next to the hash, 
+	// so that a hash collision alone cannot load the structure of another geometry.
+	struct Key
+	{
+		uint64 geometryHash;
+		rt::Aabb geometryBox;
+		uint32 type;
+		uint32 settings;
+		uint32 triangleCount;
+	};
+
+	AccStructCache();
+	~AccStructCache();
+
+	// Empty directory disables the cache (default)
+	void setDirectory( const std::string& directory );
+	const std::string& getDirectory() const;
+	bool isEnabled() const;
+
+	// Settings must be a hash of all builder parameters that change the built structure
+	Key makeKey( const rt::Geometry* geometry, Type type, uint32 settings ) const;
+
+	// 64-bit FNV-1a over the vertices of every triangle, so that vertex order and triangle order both count
+	static uint64 hashGeometry( const rt::Geometry* geometry );
+	static uint32 hashData( const void* data, uint32 size, uint32 hash = 2166136261u );
+
+	// Maps the file of key and checks its header. Returns false if there is no valid file.
+	bool load( const Key& key );
+
+	// Next block of a loaded file, NULL if its size is not the expected one or the file is truncated
+	const void* readBlock( uint32 size );
+
+	// Mapping of the loaded file, must be kept alive while its blocks are used
+	MappedFile* getMappedFile() const;
+	void endLoad();
+
+	// Writes to a temporary file which replaces the file of key in endSave, so that an interrupted
+	// save never leaves a partial file behind. Returns false if the file could not be written.
+	bool beginSave( const Key& key );
+	void writeBlock( const void* data, uint32 size );
+	bool endSave();
+
+	// File holding the structure of key
+	std::string filename( const Key& key ) const;
+
+private:
+	struct Header;
+
+	std::string _directory;
+
+	// Loading
+	vr::ref_ptr<MappedFile> _mappedFile;
+	uint32 _readOffset;
+
+	// Saving
+	FILE* _file;
+	std::string _saveFilename;
+	Key _saveKey;
+	uint32 _writeOffset;
+	bool _writeFailed;
+};
+
+} // namespace rtp
+
+#endif // _RTP_ACCSTRUCTCACHE_H_
@@ -0,0 +1,163 @@
+#ifndef _RTP_BVHACCSTRUCT_H_
+#define _RTP_BVHACCSTRUCT_H_
+
+#include <rt/IAccStruct.h>
+#include <rtp/TriangleIntersectors.h>
+#include <rtp/QuantizedTriangle.h>
+#include <rt/Stack.h>
+
+namespace rtp {
+
+// 32 bytes: nodes are stored in depth-first order, so left child always follows its parent
+class BvhNode
+{
+public:
+	void setInternalNode( const rt::Aabb& box, uint32 axis, uint32 rightChild );
+	void setLeafNode( const rt::Aabb& box, uint32 elementStart, uint32 elementCount );
+
+	inline uint32 isLeaf() const;
+	inline uint32 axis() const;
+	inline uint32 rightChild() const;
+	inline uint32 elemStart() const;
+	inline uint32 elemCount() const;
+
+	rt::Aabb bbox;
+
+private:
+	//--- If internal node ---
+	// bits 0..1 : split axis
+	// bit 31 (sign) : flag whether node is a leaf
+	//--- If leaf node ---
+	// bits 0..30 : number of elements stored in leaf
+	// bit 31 (sign) : flag whether node is a leaf
+	uint32 _data;
+
+	//--- If internal node ---
+	// index of right child
+	//--- If leaf node ---
+	// offset to start of elements
+	uint32 _offset;
+};
+
+inline uint32 BvhNode::isLeaf() const
+{
+	return ( _data & 0x80000000 );
+}
+
+inline uint32 BvhNode::axis() const
+{
+	return ( _data & 0x3 );
+}
+
+inline uint32 BvhNode::rightChild() const
+{
+	return _offset;
+}
+
+inline uint32 BvhNode::elemStart() const
+{
+	return _offset;
+}
+
+inline uint32 BvhNode::elemCount() const
+{
+	return ( _data & 0x7FFFFFFF );
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Geometry hierarchies test triangles with WaldIntersector, see BvhAccStructT for other kernels
+class BvhAccStruct : public rt::IAccStruct
+{
+public:
+	static const unsigned int MAX_STACK_SIZE = 128;
+
+	typedef rt::Stack<uint32, MAX_STACK_SIZE> TraversalStack;
+
+	BvhAccStruct();
+
+	virtual void clear();
+
+	virtual void findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit );
+	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+
+	// Replaces elements by quantizedTriangles, quantized relative to their leaf's box
+	void buildQuantizedTriangles( const rt::Geometry& geometry );
+
+	std::vector<BvhNode> nodes;
+	std::vector<uint32> elements;
+
+	// Compact geometry hierarchies only, see BvhAccStructBuilder::setQuantizedTriangles.
+	// Leaves index these instead of elements, which are then empty. Always tested with Moller-Trumbore.
+	std::vector<QuantizedTriangle> quantizedTriangles;
+
+	// SAH cost relative to root area right after build, refits compare their cost against it
+	float buildCost;
+
+	// Refit data: sum of node costs kept up to date by refits, parent of each node, leaf of each element
+	// and a mark per node for instance refits, cleared again after each one. Maps are created by the first refit.
+	// The sum is a double, since instance refits subtract and add node costs on every update.
+	double nodeCostSum;
+	std::vector<uint32> parents;
+	std::vector<uint32> elementLeaves;
+	std::vector<bool> refitMarks;
+
+protected:
+	// Geometry traversals with kernel Intersector inlined into the leaf loop.
+	// Instantiated in BvhAccStruct.cpp for the policies of TriangleIntersectors.h.
+	template<class Intersector>
+	void traceNearest( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	template<class Intersector>
+	bool traceAny( const rt::Instance& instance, rt::Ray& ray );
+
+private:
+	// Slab test against [ray.tnear, tfar], does not modify the ray
+	static inline bool hitBox( const rt::Aabb& box, const rt::Ray& ray, float tfar );
+};
+
+// Bounding volume hierarchy whose geometry traversal tests triangles with kernel Intersector,
+// created by BvhAccStructBuilderT. The kernel is chosen once per ray by the virtual call.
+template<class Intersector>
+class BvhAccStructT : public BvhAccStruct
+{
+public:
+	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+};
+
+inline bool BvhAccStruct::hitBox( const rt::Aabb& box, const rt::Ray& ray, float tfar )
+{
+	float tmin = ray.tnear;
+	float tmax = tfar;
+
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		const float t0 = ( box.minv[i] - ray.orig[i] ) * ray.invDir[i];
+		const float t1 = ( box.maxv[i] - ray.orig[i] ) * ray.invDir[i];
+
+		// Written so that NaN's (0 * INF) never shrink the interval
+		const float tNearSlab = ray.dirSignBits[i] ? t1 : t0;
+		const float tFarSlab = ray.dirSignBits[i] ? t0 : t1;
+		tmin = ( tNearSlab > tmin ) ? tNearSlab : tmin;
+		tmax = ( tFarSlab < tmax ) ? tFarSlab : tmax;
+	}
+
+	return ( tmin <= tmax );
+}
+
+template<class Intersector>
+void BvhAccStructT<Intersector>::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	traceNearest<Intersector>( instance, ray, hit );
+}
+
+template<class Intersector>
+bool BvhAccStructT<Intersector>::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	return traceAny<Intersector>( instance, ray );
+}
+
+} // namespace rtp
+
+#endif // _RTP_BVHACCSTRUCT_H_
@@ -0,0 +1,210 @@
+#ifndef _RTP_BVHACCSTRUCTBUILDER_H_
+#define _RTP_BVHACCSTRUCTBUILDER_H_
+
+#include <rt/IAccStructBuilder.h>
+#include <rtp/BvhAccStruct.h>
+
+namespace rtp {
+
+// Binned SAH bounding volume hierarchy.
+// Faster to build and smaller than the kd-tree, since primitives are never duplicated.
+// Optionally, geometry hierarchies also consider spatial splits (SBVH): where child boxes would overlap,
+// triangles straddling a split plane may be clipped into one reference per side, like in a kd-tree.
+class BvhAccStructBuilder : public rt::IAccStructBuilder
+{
+public:
+	static const uint32 BIN_COUNT = 16;
+	static const uint32 SPATIAL_BIN_COUNT = 16;
+
+	BvhAccStructBuilder();
+
+	virtual void buildGeometry( rt::Geometry* geometry );
+	virtual rt::IAccStruct* buildInstance( const std::vector<rt::Instance> instances );
+
+	// Refits node boxes to the moved triangles in parallel, keeping the hierarchy.
+	// Rebuilds instead if refitting degrades the hierarchy beyond the max refit cost.
+	virtual void updateGeometry( rt::Geometry* geometry );
+
+	// Refits boxes of the leaves holding changed instances and of their ancestors, keeping the hierarchy.
+	// Rebuilds instead if refitting degrades the hierarchy beyond the max refit cost.
+	virtual rt::IAccStruct* updateInstance( rt::IAccStruct* accStruct, const std::vector<rt::Instance>& instances, 
+		                                    const std::vector<uint32>& changedIds );
+
+	// Builds hierarchy over arbitrary element boxes, element ids are indices into boxes.
+	// Used by builders that post-process the binary hierarchy, such as QbvhAccStructBuilder
+	BvhAccStruct* buildFromBoxes( const std::vector<rt::Aabb>& boxes );
+
+	// Leaves larger than this are always split, if possible
+	void setMaxLeafSize( uint32 size );
+	uint32 getMaxLeafSize() const;
+
+	// Refitted hierarchies whose SAH cost grows above this factor times their build cost are rebuilt
+	void setMaxRefitCost( float factor );
+	float getMaxRefitCost() const;
+
+	// Number of threads used to refit geometry hierarchies, 1 refits serially
+	void setThreadCount( uint32 count );
+	uint32 getThreadCount() const;
+
+	// Spatial splits are only tried at geometry level, where they pay off for static scenes traced many times.
+	// Hierarchies with duplicated triangles are rebuilt instead of refitted. Disabled by default.
+	void setSpatialSplits( bool enabled );
+	bool getSpatialSplits() const;
+
+	// Maximum number of references added by spatial splits, as a fraction of the triangle count.
+	// Once used up, remaining nodes only get object splits.
+	void setSpatialSplitBudget( float fraction );
+	float getSpatialSplitBudget() const;
+
+	// Compact geometry mode, for scenes that do not fit in memory otherwise. Geometry hierarchies store their
+	// triangles as QuantizedTriangle's: 24 bytes each, 16 bit vertex coordinates relative to their leaf's box.
+	// Triangles are quantized from the vertices. The context creates no TriAccel's (48 bytes per triangle) 
+	// while this builder is set (see needsTriAccel), and existing ones are released after the build together 
+	// with the hierarchy's element ids (4 bytes per triangle). Other acceleration structures can then not be 
+	// built on the geometry until rt::Geometry::buildTriAccel is called. Vertices and TriDesc's are kept for shading.
+	// Triangles are decoded and tested with Moller-Trumbore during traversal. The extra work per triangle is about
+	// made up for by leaves reading their triangles from one contiguous block, see AccStructBenchmark.
+	// Decoded vertices are off by up to leaf size / 131070 per axis.
+	// Spatial splits are ignored, and updates always rebuild. Disabled by default.
+	void setQuantizedTriangles( bool enabled );
+	bool getQuantizedTriangles() const;
+
+	// False in compact geometry mode
+	virtual bool needsTriAccel() const;
+
+protected:
+	// Empty structure for geometry hierarchies, BvhAccStructBuilderT creates other kernels' structures
+	virtual BvhAccStruct* newGeometryAccStruct() const;
+
+private:
+	struct Bin
+	{
+		rt::Aabb bbox;
+		uint32 count;
+	};
+
+	struct SpatialBin
+	{
+		rt::Aabb bbox;
+		uint32 entries;	// references starting in this bin
+		uint32 exits;	// references ending in this bin
+	};
+
+	// Best binned split of elements by centroid
+	struct ObjectSplit
+	{
+		float cost;
+		uint32 axis;
+		uint32 bin;
+		rt::Aabb leftBox;
+		rt::Aabb rightBox;
+	};
+
+	// Best split plane of references, counting straddling references on both sides
+	struct SpatialSplit
+	{
+		float cost;
+		uint32 axis;
+		float position;
+		rt::Aabb leftBox;
+		rt::Aabb rightBox;
+		uint32 leftCount;
+		uint32 rightCount;
+	};
+
+	// Fills _boxes with triangle boxes of geometry
+	void computeTriangleBoxes( rt::Geometry* geometry );
+
+	// Builds hierarchy over _boxes, which must be filled beforehand
+	void buildHierarchy( BvhAccStruct* bvh );
+	uint32 recursiveBuild( BvhAccStruct* bvh, uint32 begin, uint32 end, uint32 treeDepth );
+	uint32 leafNode( BvhAccStruct* bvh, const rt::Aabb& bbox, uint32 begin, uint32 end, uint32 treeDepth );
+
+	// Cost is MAX_VALUE if all centroids coincide
+	void findObjectSplit( const uint32* ids, uint32 count, const rt::Aabb& centroidBox, float invArea, 
+		                  ObjectSplit& split ) const;
+
+	// Spatial split build: _boxes, _centroids and _triangleIds hold one entry per reference and grow with each
+	// clipped triangle. Each node owns its reference ids, leaves append their triangle ids to bvh->elements.
+	// Budget is the number of references a subtree may add, on return it holds the unused part.
+	// Children get shares proportional to their reference count, the right one also what the left one left over.
+	void buildSpatialHierarchy( BvhAccStruct* bvh, rt::Geometry* geometry );
+	uint32 recursiveSpatialBuild( BvhAccStruct* bvh, std::vector<uint32>& ids, uint32& budget, uint32 treeDepth );
+
+	// Cost is MAX_VALUE if box is flat along all axes
+	void findSpatialSplit( const std::vector<uint32>& ids, const rt::Aabb& bbox, float invArea, SpatialSplit& split ) const;
+
+	// Distributes references to sides of split. Straddling ones are clipped into one reference per side,
+	// or moved entirely to one side when that is cheaper. Returns false if a side ends up empty.
+	bool performSpatialSplit( const std::vector<uint32>& ids, const SpatialSplit& split, 
+		                      std::vector<uint32>& left, std::vector<uint32>& right );
+
+	// Part of reference's triangle inside box, intersected with reference's box
+	rt::Aabb clipReference( uint32 id, const rt::Aabb& box ) const;
+
+	// Stores SAH cost of a newly built hierarchy, for later refits
+	void storeBuildCost( BvhAccStruct* bvh ) const;
+
+	// Recomputes all node boxes from _boxes. Subtrees are refitted in parallel, then the nodes above them.
+	void refitHierarchy( BvhAccStruct* bvh ) const;
+
+	// Recomputes box of a single node from _boxes, or from its children which must be up to date
+	void refitNode( BvhAccStruct* bvh, uint32 nodeId ) const;
+
+	// Creates parent and element leaf maps of hierarchy
+	void createRefitMaps( BvhAccStruct* bvh ) const;
+
+	// SAH cost of a single node, not normalized by root area
+	float computeNodeCost( const BvhNode& node ) const;
+
+	// Per-element data used only during build
+	std::vector<rt::Aabb> _boxes;
+	std::vector<vr::vec3f> _centroids;
+	std::vector<uint32> _ids;
+
+	// Nodes refitted by the current instance update, kept between updates
+	std::vector<uint32> _refitNodes;
+
+	// Spatial split build data: triangle of each reference, geometry being built
+	std::vector<uint32> _triangleIds;
+	rt::Geometry* _geometry;
+
+	float _traversalCost;
+	float _intersectionCost;
+	uint32 _maxLeafSize;
+	float _maxRefitCost;
+	uint32 _threadCount;
+	bool _spatialSplits;
+	float _spatialSplitBudget;
+	bool _quantizedTriangles;
+
+	// Spatial splits are only tried where object split children overlap by a fraction of the root area
+	float _rootArea;
+
+	// Statistics
+	uint32 _leafCount;
+	uint32 _treeDepth;
+	uint32 _spatialSplitCount;
+};
+
+// Builds geometry hierarchies that test triangles with kernel Intersector inlined, see TriangleIntersectors.h.
+// Instance hierarchies are the same as BvhAccStructBuilder's.
+template<class Intersector>
+class BvhAccStructBuilderT : public BvhAccStructBuilder
+{
+protected:
+	virtual BvhAccStruct* newGeometryAccStruct() const;
+};
+
+template<class Intersector>
+BvhAccStruct* BvhAccStructBuilderT<Intersector>::newGeometryAccStruct() const
+{
+	return new BvhAccStructT<Intersector>();
+}
+
+// Bounding volume hierarchy plugin with Moller-Trumbore triangle tests
+typedef BvhAccStructBuilderT<MollerTrumboreIntersector> MtBvhAccStructBuilder;
+
+} // namespace rtp
+
+#endif // _RTP_BVHACCSTRUCTBUILDER_H_
@@ -4,36 +4,53 @@
 #include <rt/IAccStruct.h>
 #include <rt/SplitPlane.h>
 #include <rt/Stack.h>
+#include <rt/IAccStructBuilder.h>
+#include <rtp/MappedFile.h>
+#include <rtp/RayPacket.h>
+#include <rtp/TriAccel4.h>
+#include <rtp/TriangleIntersectors.h>
 
 namespace rtp {
 
+// Forward declarations
+class KdTreeAccStructBuilder;
+
+// 8 bytes: children of a node are always stored next to each other, so only the left child's index is kept.
+// Indices instead of pointers keep the node size independent of the platform's pointer size.
 class KdNode
 {
 public:
-	void setInternalNode( const rt::SplitPlane& plane, const KdNode* leftChild );
+	// Maximum node index that fits in the node's bits
+	static const uint32 MAX_INDEX = 0x1FFFFFFF;
+
+	void setInternalNode( const rt::SplitPlane& plane, uint32 leftChild );
 	void setLeafNode( uint32 elementStart, uint32 elementCount );
+	void setUnbuiltNode( uint32 subtreeId );
 
 	inline uint32 isLeaf() const;
+	inline uint32 isUnbuilt() const; // only valid for leaves
 	inline uint32 axis() const;
 	inline float splitPos() const;
-	inline const KdNode* leftChild() const;
+	inline uint32 leftChild() const;
 	inline uint32 elemStart() const;
 	inline uint32 elemCount() const;
+	inline uint32 subtreeId() const;
 
 private:
 	//--- If internal node ---
 	// bits 0..1 : split axis
-	// bits 2..30 : pointer to left child
+	// bits 2..30 : index of left child, right child is next to it
 	// bit 31 (sign) : flag whether node is a leaf
 	//--- If leaf node ---
-	// bits 0..30 : number of elements stored in leaf
+	// bits 0..29 : number of elements stored in leaf
+	// bit 30 : flag whether leaf is an unbuilt subtree of a lazy build
 	// bit 31 (sign) : flag whether node is a leaf
 	uint32 _data;
 
 	//--- If internal node ---
 	// split position along specified axis
 	//--- If leaf node ---
-	// offset to start of elements
+	// offset to start of elements, or index of unbuilt subtree
 	union
 	{
 		float _split;
@@ -46,6 +63,11 @@ inline uint32 KdNode::isLeaf() const
 	return ( _data & 0x80000000 );
 }
 
+inline uint32 KdNode::isUnbuilt() const
+{
+	return ( _data & 0x40000000 );
+}
+
 inline uint32 KdNode::axis() const
 {
 	return ( _data & 0x3 );
@@ -56,11 +78,9 @@ inline float KdNode::splitPos() const
 	return _split;
 }
 
-inline const KdNode* KdNode::leftChild() const
+inline uint32 KdNode::leftChild() const
 {
-#pragma warning( disable : 4312 )
-	return reinterpret_cast<const KdNode*>( _data & 0x7FFFFFFC );
-#pragma warning( default : 4312 )
+	return ( _data & 0x7FFFFFFF ) >> 2;
 }
 
 inline uint32 KdNode::elemStart() const
@@ -70,7 +90,12 @@ inline uint32 KdNode::elemStart() const
 
 inline uint32 KdNode::elemCount() const
 {
-	return ( _data & 0x7FFFFFFF );
+	return ( _data & 0x3FFFFFFF );
+}
+
+inline uint32 KdNode::subtreeId() const
+{
+	return _elements;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -86,11 +111,22 @@ public:
 		const KdNode* node;
 		float tnear;
 		float tfar;
-		int32 pad;
+		KdTreeAccStruct* tree; // tree holding node, a subtree of this one in lazy builds
 	};
 
 	typedef rt::Stack<TraversalData, MAX_STACK_SIZE> TraversalStack;
 
+	// Packet traversal stack information, ray intervals per lane
+	struct PacketTraversalData
+	{
+		const KdNode* node;
+		KdTreeAccStruct* tree;
+		float tnear[RayPacket::SIZE];
+		float tfar[RayPacket::SIZE];
+	};
+
+	typedef rt::Stack<PacketTraversalData, MAX_STACK_SIZE> PacketTraversalStack;
+
 	KdTreeAccStruct();
 	// Cannot make destructor to avoid accidental deletion of data.
 	// Example: resize in vector<geometry> will _shallow_ copy two geometries, and their kdtree.
@@ -99,16 +135,139 @@ public:
 
 	virtual void clear();
 
-	virtual void traceNearestInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample );
+	virtual void findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit );
 	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
 
+	// Shadow rays: same traversal, but stops at the first leaf element that blocks the ray
+	virtual bool traceAnyInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample );
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+
+	// Coherent rays are traced in packets of RayPacket::SIZE sharing one traversal, others one by one
+	virtual void traceNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Sample* samples, uint32 count );
+	virtual void traceNearestGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count );
+	virtual void findNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Ray* rays, rt::Hit* hits, 
+		                                    uint32 count );
+
+	// Allocates nodeCount nodes, the root is aligned to a cache line boundary
+	void allocateNodes( uint32 nodeCount );
+	void allocateElements( uint32 elementCount );
+
+	uint32 getNodeCount() const;
+	uint32 getElementCount() const;
+
+	// Packs the triangles of all leaves into SIMD blocks. Leaves must start at multiples of 4 and fill 
+	// the rest of their last block with copies of their triangles, see KdTreeAccStructBuilder::setTriangleBlocks.
+	void buildTriangleBlocks( const std::vector<rt::TriAccel>& triAccel );
+
+	// Uses nodes and elements stored inside a mapped file instead of own memory, they must not be modified.
+	// File is kept mapped until the tree is cleared.
+	void useMappedData( MappedFile* file, const KdNode* nodes, uint32 nodeCount, const uint32* elementIds, uint32 elementCount );
+
+	// Lazy build: stores the data needed to build the subtree of an unbuilt leaf, returns the leaf's subtree id.
+	// Triangles are swapped out. Builder is kept to build subtrees when rays reach them.
+	uint32 addUnbuiltSubtree( std::vector<uint32>& triangles, const rt::Aabb& bbox, uint32 treeDepth );
+	void setLazyBuilder( KdTreeAccStructBuilder* builder );
+
 	KdNode* root;
 	uint32* elements;
 
+	// Instance trees only: SAH cost relative to root area right after build, updates compare their cost against it
+	float buildCost;
+
+	// Triangles of leaf n are blocks[n.elemStart() / 4 ..], ( n.elemCount() + 3 ) / 4 blocks.
+	// Empty for instance trees and trees built without triangle blocks, which test elements one by one.
+	std::vector<TriAccel4> blocks;
+
+protected:
+	// Geometry traversals with kernel Intersector inlined into the leaf loop. Triangle blocks are only tested with simd.
+	// Instantiated in KdTreeAccStruct.cpp for the policies of TriangleIntersectors.h.
+	template<class Intersector>
+	void traceNearest( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit, bool simd );
+	template<class Intersector>
+	bool traceAny( const rt::Instance& instance, rt::Ray& ray, bool simd );
+
+	// Whether the current context's SIMD level allows SSE kernels, read once per traversal call
+	static bool simdEnabled();
+
 private:
-	void findLeaf( const KdNode*& node, rt::Ray& ray, TraversalStack& stack );
+	struct UnbuiltSubtree;
+
+	// Unaligned node memory, root points inside it
+	KdNode* _nodeMemory;
+	uint32 _nodeCount;
+	uint32 _elementCount;
+
+	// Holds nodes and elements of trees loaded from a cache
+	vr::ref_ptr<MappedFile> _mappedFile;
+
+	// Lazy build
+	std::vector<UnbuiltSubtree*> _unbuiltSubtrees;
+	vr::ref_ptr<rt::IAccStructBuilder> _lazyBuilder;
+
+	// Descends to the next leaf, moving into (and building if needed) the subtrees of unbuilt leaves
+	static void findLeaf( const KdNode*& node, KdTreeAccStruct*& tree, rt::Ray& ray, TraversalStack& stack, 
+		                  rt::Geometry* geometry );
+
+	// Packets of at most RayPacket::SIZE coherent rays. traceInstancePacket shades the hits of findInstancePacket.
+	void traceInstancePacket( const std::vector<rt::Instance>& instances, rt::Sample* samples, uint32 count );
+	void findInstancePacket( const std::vector<rt::Instance>& instances, rt::Ray* rays, rt::Hit* hits, uint32 count );
+	void traceGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count );
+
+	// Packet version of findLeaf: descends into a child while any active ray crosses it, 
+	// rays that do not cross the child are inactive inside it
+	static void findPacketLeaf( const KdNode*& node, KdTreeAccStruct*& tree, RayPacket& packet, 
+		                        PacketTraversalStack& stack, rt::Geometry* geometry );
+
+	// Continues with the next node on stack, ray intervals are clipped to the nearest hits found so far.
+	// Returns false if stack is empty.
+	static bool popPacket( const KdNode*& node, KdTreeAccStruct*& tree, RayPacket& packet, 
+		                   PacketTraversalStack& stack, const __m128* bestDistance );
+
+	// Subtree of an unbuilt leaf, built by the first thread that gets here
+	KdTreeAccStruct* unbuiltSubtree( uint32 subtreeId, rt::Geometry* geometry );
+};
+
+// Kd-tree whose geometry traversal tests triangles with kernel Intersector, created by KdTreeAccStructBuilderT.
+// The kernel is chosen once per ray by the virtual call. Triangle blocks and packets implement Wald's test only, 
+// so they are skipped for other kernels.
+template<class Intersector>
+class KdTreeAccStructT : public KdTreeAccStruct
+{
+public:
+	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	virtual void traceNearestGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count );
 };
 
+template<class Intersector>
+void KdTreeAccStructT<Intersector>::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	traceNearest<Intersector>( instance, ray, hit, simdEnabled() );
+}
+
+template<class Intersector>
+bool KdTreeAccStructT<Intersector>::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	return traceAny<Intersector>( instance, ray, simdEnabled() );
+}
+
+template<class Intersector>
+void KdTreeAccStructT<Intersector>::traceNearestGeometryPacket( const rt::Instance& instance, rt::Ray* rays, 
+															    rt::Hit* hits, uint32 count )
+{
+	if( Intersector::USES_TRIACCEL )
+	{
+		KdTreeAccStruct::traceNearestGeometryPacket( instance, rays, hits, count );
+		return;
+	}
+
+	// Kernels other than Wald's have no triangle blocks
+	for( uint32 i = 0; i < count; ++i )
+	{
+		traceNearest<Intersector>( instance, rays[i], hits[i], false );
+	}
+}
+
 } // namespace rtp
 
 #endif // _RTP_KDTREEACCSTRUCT_H_
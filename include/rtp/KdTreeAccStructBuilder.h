@@ -2,31 +2,154 @@
 #define _RTP_KDTREEACCSTRUCTBUILDER_H_
 
 #include <rt/IAccStructBuilder.h>
+#include <rtp/AccStructCache.h>
+#include <rtp/KdTreeAccStruct.h>
 
 namespace rtp {
 
 // Forward declarations
 struct RawKdTree;
-class KdTreeAccStruct;
+struct RawKdNode;
 class TriangleTreeBuilder;
 class InstanceTreeBuilder;
 
 class KdTreeAccStructBuilder : public rt::IAccStructBuilder
 {
 public:
+	enum BuildMode
+	{
+		// Event lists are rebuilt and sorted at every node: O( n log^2 n )
+		SORT_PER_NODE,
+		// Event lists are sorted once at the root and kept sorted during partition: O( n log n )
+		PRESORTED_EVENTS
+	};
+
+	enum NodeLayout
+	{
+		// Level by level, as produced by a queue
+		BREADTH_FIRST,
+		// Sibling pairs clustered into subtrees that fit in one 64 byte cache line each
+		TREELETS
+	};
+
 	KdTreeAccStructBuilder();
 	~KdTreeAccStructBuilder();
 
 	virtual void buildGeometry( rt::Geometry* geometry );
+
+	// Rebuilds the tree of moved vertices without reading or writing the cache, 
+	// since keyframes of animated geometry are never built again
+	virtual void updateGeometry( rt::Geometry* geometry );
+
 	virtual rt::IAccStruct* buildInstance( const std::vector<rt::Instance> instances );
 
+	// Keeps all split planes and moves the changed instances to the leaves their boxes overlap now
+	virtual rt::IAccStruct* updateInstance( rt::IAccStruct* accStruct, const std::vector<rt::Instance>& instances, 
+		                                    const std::vector<uint32>& changedIds );
+
+	// Updated instance trees whose SAH cost grows above this factor times their build cost are rebuilt
+	void setMaxRefitCost( float factor );
+	float getMaxRefitCost() const;
+
+	// Only affects triangle trees
+	void setBuildMode( BuildMode mode );
+	BuildMode getBuildMode() const;
+
+	// Number of threads used to build each tree, 1 builds serially.
+	// Parallel builds produce the same trees as serial ones.
+	void setThreadCount( uint32 count );
+	uint32 getThreadCount() const;
+
+	// Order of nodes in memory, does not change the tree itself
+	void setNodeLayout( NodeLayout layout );
+	NodeLayout getNodeLayout() const;
+
+	// Lazy build: only the given number of levels of a triangle tree are built up front, deeper subtrees
+	// stay unbuilt leaves until the first ray reaches them and are then built the same number of levels at a time.
+	// 0 builds whole trees (default).
+	void setLazyDepth( uint32 levels );
+	uint32 getLazyDepth() const;
+
+	// Triangles of geometry tree leaves are packed into blocks of 4 (TriAccel4) tested with one SIMD 
+	// instruction sequence. Each leaf is padded to a multiple of 4 element ids. Enabled by default.
+	void setTriangleBlocks( bool enabled );
+	bool getTriangleBlocks() const;
+
+	// Geometry trees are saved to this directory after being built, and loaded from it instead of
+	// being rebuilt while geometry and settings stay the same. Empty disables the cache (default).
+	// Lazy builds are never cached.
+	void setCacheDirectory( const std::string& directory );
+	const std::string& getCacheDirectory() const;
+
+	// Builds the subtree of an unbuilt leaf during traversal, may be called by several threads at once
+	KdTreeAccStruct* buildSubtree( rt::Geometry* geometry, const std::vector<uint32>& triangles, 
+		                           const rt::Aabb& bbox, uint32 treeDepth );
+
+protected:
+	// Empty tree, KdTreeAccStructBuilderT creates other kernels' trees
+	virtual KdTreeAccStruct* newAccStruct() const;
+
 private:
-	KdTreeAccStruct* convertRawTree( RawKdTree* tree );
+	void buildTree( rt::Geometry* geometry, bool useCache );
+
+	// With padLeaves, each leaf's element ids are padded to a multiple of 4 for triangle blocks
+	KdTreeAccStruct* convertRawTree( RawKdTree* tree, bool padLeaves );
+	void layoutBreadthFirst( RawKdTree* tree, KdTreeAccStruct* result, bool padLeaves );
+	void layoutTreelets( RawKdTree* tree, KdTreeAccStruct* result, bool padLeaves );
+	void storeLeaf( RawKdNode* leaf, KdNode& node, KdTreeAccStruct* result, uint32& dstElemId, bool padLeaves );
+
+	// Instance updates: SAH cost of the subtree of nodeId, whose cell is bbox, not normalized by root area.
+	// reinsertInstances also drops the moved instances from its leaves, adds the ones of instanceIds 
+	// reaching them and appends the new element ids of each leaf to _refitElements.
+	float computeInstanceCost( const KdTreeAccStruct* tree, uint32 nodeId, const rt::Aabb& bbox ) const;
+	float reinsertInstances( KdTreeAccStruct* tree, uint32 nodeId, const rt::Aabb& bbox, 
+		                     const std::vector<uint32>& instanceIds );
+
+	// Cache
+	uint32 cacheSettings() const;
+	KdTreeAccStruct* loadCachedTree( const AccStructCache::Key& key );
+	void saveCachedTree( const AccStructCache::Key& key, KdTreeAccStruct* tree );
 
 	TriangleTreeBuilder* _triangleTreeBuilder;
 	InstanceTreeBuilder* _instanceTreeBuilder;
+	NodeLayout _nodeLayout;
+	bool _triangleBlocks;
+	AccStructCache _cache;
+
+	// Instance updates
+	float _maxRefitCost;
+	const std::vector<rt::Instance>* _refitInstances;
+	std::vector<bool> _movedInstances;
+	std::vector<uint32> _refitElements;
+};
+
+// Kd-tree plugin whose geometry trees test triangles with kernel Intersector (see TriangleIntersectors.h).
+// Triangle blocks are only built for kernels using TriAccel's.
+template<class Intersector>
+class KdTreeAccStructBuilderT : public KdTreeAccStructBuilder
+{
+public:
+	KdTreeAccStructBuilderT();
+
+protected:
+	virtual KdTreeAccStruct* newAccStruct() const;
 };
 
+template<class Intersector>
+KdTreeAccStructBuilderT<Intersector>::KdTreeAccStructBuilderT()
+{
+	setTriangleBlocks( Intersector::USES_TRIACCEL );
+}
+
+template<class Intersector>
+KdTreeAccStruct* KdTreeAccStructBuilderT<Intersector>::newAccStruct() const
+{
+	return new KdTreeAccStructT<Intersector>();
+}
+
+// Kd-tree plugin with Moller-Trumbore triangle tests
+typedef KdTreeAccStructBuilderT<MollerTrumboreIntersector> MtKdTreeAccStructBuilder;
+
 } // namespace rtp
 
 #endif // _RTP_KDTREEACCSTRUCTBUILDER_H_
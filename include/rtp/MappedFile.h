@@ -0,0 +1,37 @@
+#ifndef _RTP_MAPPEDFILE_H_
+#define _RTP_MAPPEDFILE_H_
+
+#include <rt/common.h>
+#include <vr/ref_counting.h>
+
+namespace rtp {
+
+// Read-only memory mapping of a whole file. Pages are loaded by the OS on first access,
+// so data can be used in place without reading the file up front.
+// The mapping is released when the last reference goes away.
+class MappedFile : public vr::RefCounted
+{
+public:
+	// Returns NULL if file does not exist, is empty or cannot be mapped
+	static MappedFile* open( const std::string& filename );
+
+	// Start of the mapping, aligned to a page boundary
+	const char* data() const;
+	uint32 size() const;
+
+protected:
+	MappedFile();
+	~MappedFile();
+
+private:
+	const char* _data;
+	uint32 _size;
+
+	// Platform handles: file and mapping objects on Windows, file descriptor on others
+	void* _file;
+	void* _mapping;
+};
+
+} // namespace rtp
+
+#endif // _RTP_MAPPEDFILE_H_
@@ -0,0 +1,170 @@
+#ifndef _RTP_QBVHACCSTRUCT_H_
+#define _RTP_QBVHACCSTRUCT_H_
+
+#include <rt/IAccStruct.h>
+#include <rt/Stack.h>
+#include <xmmintrin.h>
+
+namespace rtp {
+
+// 128 bytes: boxes of all 4 children are stored transposed (SoA), so that a single SIMD slab test
+// intersects the ray against all of them at once
+struct QbvhNode
+{
+	static const uint32 LEAF_FLAG = 0x80000000;
+
+	// bounds[0..2][i] : min x, y, z of child i
+	// bounds[3..5][i] : max x, y, z of child i
+	// Empty children have inverted bounds, which are never hit
+	float bounds[6][4];
+
+	//--- If internal child ---
+	// index of child node
+	//--- If leaf child ---
+	// bits 0..30 : offset to first element (instance level) or triangle block (geometry level)
+	// bit 31 (sign) : flag whether child is a leaf
+	uint32 children[4];
+
+	// Number of elements or triangle blocks of leaf children, 0 otherwise
+	uint32 counts[4];
+};
+
+// Block of 4 triangles transposed (SoA) for a SIMD Moller-Trumbore test against a single ray.
+// Unused lanes hold degenerate triangles, which are never hit
+struct QbvhTriangle4
+{
+	float v0[3][4];
+	float e1[3][4]; // v1 - v0
+	float e2[3][4]; // v2 - v0
+	uint32 triangleIds[4];
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// 4-wide bounding volume hierarchy traversed with SSE, see QbvhAccStructBuilder.
+// Node and triangle data is accessed with unaligned loads, since std::vector does not guarantee
+// 16 byte alignment of its elements.
+class QbvhAccStruct : public rt::IAccStruct
+{
+public:
+	// Each visited node pushes at most 3 more entries than it pops
+	static const unsigned int MAX_STACK_SIZE = 512;
+
+	struct StackEntry
+	{
+		uint32 child;
+		uint32 count;
+		float tnear;
+	};
+
+	typedef rt::Stack<StackEntry, MAX_STACK_SIZE> TraversalStack;
+
+	virtual void clear();
+
+	virtual void findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit );
+	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+
+	std::vector<QbvhNode> nodes;
+
+	// Leaf data, either instance ids or triangle blocks
+	std::vector<uint32> elements;
+	std::vector<QbvhTriangle4> triangles;
+
+private:
+	// Ray data replicated across all 4 lanes
+	struct SimdRay
+	{
+		__m128 orig[3];
+		__m128 dir[3];
+		__m128 invDir[3];
+		__m128 tnear;
+		uint32 nearBounds[3]; // index into QbvhNode::bounds of near plane per axis
+	};
+
+	static inline void initSimdRay( const rt::Ray& ray, SimdRay& simdRay );
+
+	// Returns bit mask of children hit within [ray.tnear, tfar], and stores their entry distances
+	static inline int32 hitChildren( const QbvhNode& node, const SimdRay& ray, float tfar, float* tnear );
+
+	// Pushes children in mask onto stack, sorted so that the nearest child is on top
+	static inline void pushChildren( TraversalStack& stack, const QbvhNode& node, int32 mask, const float* tnear );
+
+	// Returns bit mask of triangles of block hit within [tnear, tfar], and stores their barycentric coordinates and distances
+	static inline int32 intersectTriangles( const QbvhTriangle4& block, const SimdRay& ray, __m128 tnear, float tfar,
+		                                    __m128& u, __m128& v, __m128& f );
+
+	static inline void hitTriangles( const QbvhTriangle4& block, const SimdRay& ray, float tfar,
+		                             rt::Hit& hit, float& bestDistance );
+
+	// Occlusion version of hitTriangles: only tells whether ray hits any triangle of block within [tnear, tfar]
+	static inline bool hitAnyTriangles( const QbvhTriangle4& block, const SimdRay& ray, __m128 tnear, float tfar );
+};
+
+inline void QbvhAccStruct::initSimdRay( const rt::Ray& ray, SimdRay& simdRay )
+{
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		simdRay.orig[i] = _mm_set1_ps( ray.orig[i] );
+		simdRay.dir[i] = _mm_set1_ps( ray.dir[i] );
+		simdRay.invDir[i] = _mm_set1_ps( ray.invDir[i] );
+		simdRay.nearBounds[i] = ray.dirSignBits[i] ? i + 3 : i;
+	}
+
+	simdRay.tnear = _mm_set1_ps( ray.tnear );
+}
+
+inline int32 QbvhAccStruct::hitChildren( const QbvhNode& node, const SimdRay& ray, float tfar, float* tnear )
+{
+	__m128 tmin = ray.tnear;
+	__m128 tmax = _mm_set1_ps( tfar );
+
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		const uint32 nearIdx = ray.nearBounds[i];
+		const uint32 farIdx = ( nearIdx + 3 ) % 6;
+
+		const __m128 t0 = _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( node.bounds[nearIdx] ), ray.orig[i] ), ray.invDir[i] );
+		const __m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_loadu_ps( node.bounds[farIdx] ), ray.orig[i] ), ray.invDir[i] );
+
+		// Min/max return their second operand if any is NaN (0 * INF), so NaN's never shrink the interval
+		tmin = _mm_max_ps( t0, tmin );
+		tmax = _mm_min_ps( t1, tmax );
+	}
+
+	_mm_storeu_ps( tnear, tmin );
+	return _mm_movemask_ps( _mm_cmple_ps( tmin, tmax ) );
+}
+
+inline void QbvhAccStruct::pushChildren( TraversalStack& stack, const QbvhNode& node, int32 mask, const float* tnear )
+{
+	// Collect hit children, sorted from far to near by insertion sort
+	uint32 order[4];
+	uint32 count = 0;
+
+	for( uint32 i = 0; i < 4; ++i )
+	{
+		if( !( mask & ( 1 << i ) ) )
+			continue;
+
+		uint32 j = count++;
+		for( ; ( j > 0 ) && ( tnear[order[j-1]] < tnear[i] ); --j )
+		{
+			order[j] = order[j-1];
+		}
+		order[j] = i;
+	}
+
+	for( uint32 j = 0; j < count; ++j )
+	{
+		const uint32 i = order[j];
+		stack.push();
+		stack.top().child = node.children[i];
+		stack.top().count = node.counts[i];
+		stack.top().tnear = tnear[i];
+	}
+}
+
+} // namespace rtp
+
+#endif // _RTP_QBVHACCSTRUCT_H_
@@ -0,0 +1,50 @@
+#ifndef _RTP_QBVHACCSTRUCTBUILDER_H_
+#define _RTP_QBVHACCSTRUCTBUILDER_H_
+
+#include <rt/IAccStructBuilder.h>
+#include <rtp/BvhAccStructBuilder.h>
+
+namespace rtp {
+
+// Forward declarations
+class BvhAccStruct;
+class QbvhAccStruct;
+
+// 4-wide bounding volume hierarchy: a binary SAH hierarchy is built first and then collapsed,
+// pulling up the largest grandchildren until each node has 4 children.
+// At geometry level, leaf triangles are packed into transposed blocks of 4.
+class QbvhAccStructBuilder : public rt::IAccStructBuilder
+{
+public:
+	QbvhAccStructBuilder();
+
+	virtual void buildGeometry( rt::Geometry* geometry );
+	virtual rt::IAccStruct* buildInstance( const std::vector<rt::Instance> instances );
+
+	// Subtrees with at most this many elements become a single leaf
+	void setMaxLeafSize( uint32 size );
+	uint32 getMaxLeafSize() const;
+
+private:
+	QbvhAccStruct* collapseHierarchy( BvhAccStruct* bvh );
+	uint32 collapseNode( BvhAccStruct* bvh, uint32 bvhNodeId, uint32 treeDepth );
+	void leafChild( BvhAccStruct* bvh, uint32 bvhNodeId, uint32 nodeId, uint32 child, uint32 treeDepth );
+
+	// Range of elements referenced by all leaves of a binary subtree, which is contiguous
+	void subtreeRange( BvhAccStruct* bvh, uint32 bvhNodeId, uint32& begin, uint32& end ) const;
+
+	BvhAccStructBuilder _bvhBuilder;
+	uint32 _maxLeafSize;
+
+	// Current geometry, NULL when building instance level
+	rt::Geometry* _geometry;
+	QbvhAccStruct* _qbvh;
+
+	// Statistics
+	uint32 _leafCount;
+	uint32 _treeDepth;
+};
+
+} // namespace rtp
+
+#endif // _RTP_QBVHACCSTRUCTBUILDER_H_
@@ -0,0 +1,62 @@
+#ifndef _RTP_QUANTIZEDTRIANGLE_H_
+#define _RTP_QUANTIZEDTRIANGLE_H_
+
+#include <rtp/TriangleIntersectors.h>
+#include <rt/Aabb.h>
+
+namespace rtp {
+
+// 24 bytes: triangle whose vertices are stored as 16 bit fixed point coordinates relative to a box, 
+// the box of the BVH leaf holding it. Half the size of a TriAccel alone, and needs neither TriAccel nor element id.
+// Vertices are decoded in registers and tested with MollerTrumboreIntersector. Decoded vertices lie within
+// box size / 131070 of the original ones on each axis, so neighbor triangles in different leaves may show
+// cracks or overlaps of that size.
+struct QuantizedTriangle
+{
+	static const uint32 MAX_VALUE = 0xFFFF;
+
+	// Decoding of a box's coordinates: vertex = origin + q * scale
+	struct Frame
+	{
+		void load( const rt::Aabb& box );
+
+		vr::vec3f origin;
+		vr::vec3f scale;
+	};
+
+	// Quantizes vertices v0, v1, v2 relative to box, which should contain them
+	void set( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, const rt::Aabb& box, uint32 id );
+
+	// Vertex i decoded with frame
+	inline vr::vec3f vertex( const Frame& frame, uint32 i ) const;
+
+	// Same as MollerTrumboreIntersector's tests, on the decoded triangle
+	inline void hit( const Frame& frame, const rt::Ray& ray, rt::Hit& hit, float& bestDistance ) const;
+	inline bool hitAny( const Frame& frame, const rt::Ray& ray ) const;
+
+	uint16 v[3][3];
+	uint16 pad;
+	uint32 triangleId;
+};
+
+inline vr::vec3f QuantizedTriangle::vertex( const Frame& frame, uint32 i ) const
+{
+	return vr::vec3f( frame.origin.x + v[i][0] * frame.scale.x, 
+		              frame.origin.y + v[i][1] * frame.scale.y, 
+		              frame.origin.z + v[i][2] * frame.scale.z );
+}
+
+inline void QuantizedTriangle::hit( const Frame& frame, const rt::Ray& ray, rt::Hit& hit, float& bestDistance ) const
+{
+	MollerTrumboreIntersector::hit( vertex( frame, 0 ), vertex( frame, 1 ), vertex( frame, 2 ), triangleId, 
+		                            ray, hit, bestDistance );
+}
+
+inline bool QuantizedTriangle::hitAny( const Frame& frame, const rt::Ray& ray ) const
+{
+	return MollerTrumboreIntersector::hitAny( vertex( frame, 0 ), vertex( frame, 1 ), vertex( frame, 2 ), ray );
+}
+
+} // namespace rtp
+
+#endif // _RTP_QUANTIZEDTRIANGLE_H_
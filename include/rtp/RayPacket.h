@@ -0,0 +1,137 @@
+#ifndef _RTP_RAYPACKET_H_
+#define _RTP_RAYPACKET_H_
+
+#include <rt/Ray.h>
+#include <rt/Hit.h>
+#include <rt/Triangle.h>
+#include <rt/RayTriIntersection.h>
+#include <xmmintrin.h>
+
+namespace rtp {
+
+// Forward declarations
+struct PacketHit;
+
+// Up to 16 rays stored transposed (SoA) in 4 groups of 4, so that one SSE instruction processes a whole group.
+// All rays must share the sign of each direction component, since traversal orders children for the whole packet.
+// Lanes without a ray, or whose ray missed, are inactive: their tnear is above their tfar and they are never hit.
+struct RayPacket
+{
+	static const uint32 SIZE = 16;
+	static const uint32 GROUP_COUNT = SIZE / 4;
+
+	// Rays are coherent enough for packet traversal if they share all direction signs
+	static bool isCoherent( const rt::Ray* rays, uint32 count );
+
+	// Rays must be coherent and updated
+	void load( const rt::Ray* rays, uint32 count );
+	void deactivate( uint32 lane );
+
+	// Bit i is set if ray i is active
+	inline int32 activeMask() const;
+
+	// Wald's projection test of one triangle against group g, SIMD version of RayTriIntersection::hitWald
+	inline void hitWald( const rt::TriAccel& acc, uint32 g, PacketHit& hit ) const;
+
+	__m128 orig[3][GROUP_COUNT];
+	__m128 dir[3][GROUP_COUNT];
+	__m128 invDir[3][GROUP_COUNT];
+	__m128 tnear[GROUP_COUNT];
+	__m128 tfar[GROUP_COUNT];
+
+	// Shared by all rays
+	int32 dirSignBits[3];
+};
+
+// Nearest hits of a ray packet, one lane per ray.
+// Distances are kept in SIMD registers for the hit tests, the rest is only written when a ray hits.
+struct PacketHit
+{
+	// Best distances start at the distances of hits, so that previous hits are never replaced by farther ones
+	void load( const rt::Hit* hits, uint32 count );
+
+	// Writes back lanes that found a nearer hit, setting their instance
+	void store( rt::Hit* hits, uint32 count, const rt::Instance* instance ) const;
+
+	__m128 distance[RayPacket::GROUP_COUNT];
+	uint32 triangleId[RayPacket::SIZE];
+	float v1Coord[RayPacket::SIZE];
+	float v2Coord[RayPacket::SIZE];
+};
+
+inline int32 RayPacket::activeMask() const
+{
+	int32 mask = 0;
+	for( uint32 g = 0; g < GROUP_COUNT; ++g )
+	{
+		mask |= _mm_movemask_ps( _mm_cmple_ps( tnear[g], tfar[g] ) ) << ( g * 4 );
+	}
+	return mask;
+}
+
+inline void RayPacket::hitWald( const rt::TriAccel& acc, uint32 g, PacketHit& hit ) const
+{
+	const __m128 epsilon = _mm_set1_ps( rt::RayTriIntersection::HIT_EPSILON );
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps( 1.0f );
+
+	const uint32 k = acc.k;
+	const uint32 ku = ( k == 2 ) ? 0 : k + 1;
+	const uint32 kv = ( k == 0 ) ? 2 : k - 1;
+
+	const __m128 nu = _mm_set1_ps( acc.n_u );
+	const __m128 nv = _mm_set1_ps( acc.n_v );
+
+	// Start high-latency division as early as possible
+	const __m128 nd = _mm_div_ps( one, _mm_add_ps( _mm_add_ps( dir[k][g], _mm_mul_ps( nu, dir[ku][g] ) ), _mm_mul_ps( nv, dir[kv][g] ) ) );
+	const __m128 f = _mm_mul_ps( nd, _mm_sub_ps( _mm_sub_ps( _mm_sub_ps( _mm_set1_ps( acc.n_d ), orig[k][g] ),
+		                                                     _mm_mul_ps( nu, orig[ku][g] ) ), _mm_mul_ps( nv, orig[kv][g] ) ) );
+
+	// Check for valid distance. Comparisons against NaN's are false, so such lanes are always rejected
+	__m128 valid = _mm_cmplt_ps( f, hit.distance[g] );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( f, _mm_sub_ps( tnear[g], epsilon ) ) );
+	valid = _mm_and_ps( valid, _mm_cmple_ps( f, _mm_add_ps( tfar[g], epsilon ) ) );
+	if( !_mm_movemask_ps( valid ) )
+		return;
+
+	// Compute hit point positions on uv plane
+	const __m128 hu = _mm_add_ps( orig[ku][g], _mm_mul_ps( f, dir[ku][g] ) );
+	const __m128 hv = _mm_add_ps( orig[kv][g], _mm_mul_ps( f, dir[kv][g] ) );
+
+	// Check barycentric coordinates
+	const __m128 lambda = _mm_add_ps( _mm_add_ps( _mm_mul_ps( hu, _mm_set1_ps( acc.b_nu ) ), _mm_mul_ps( hv, _mm_set1_ps( acc.b_nv ) ) ),
+		                              _mm_set1_ps( acc.b_d ) );
+	const __m128 mue = _mm_add_ps( _mm_add_ps( _mm_mul_ps( hu, _mm_set1_ps( acc.c_nu ) ), _mm_mul_ps( hv, _mm_set1_ps( acc.c_nv ) ) ),
+		                           _mm_set1_ps( acc.c_d ) );
+	const __m128 psi = _mm_sub_ps( _mm_sub_ps( one, lambda ), mue );
+
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( lambda, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( mue, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( psi, zero ) );
+
+	const int32 mask = _mm_movemask_ps( valid );
+	if( !mask )
+		return;
+
+	// Have valid hit points here. Store them.
+	hit.distance[g] = _mm_or_ps( _mm_and_ps( valid, f ), _mm_andnot_ps( valid, hit.distance[g] ) );
+
+	float lambdas[4];
+	float mues[4];
+	_mm_storeu_ps( lambdas, lambda );
+	_mm_storeu_ps( mues, mue );
+
+	for( uint32 i = 0; i < 4; ++i )
+	{
+		if( !( mask & ( 1 << i ) ) )
+			continue;
+
+		hit.triangleId[g * 4 + i] = acc.triangleId;
+		hit.v1Coord[g * 4 + i] = lambdas[i];
+		hit.v2Coord[g * 4 + i] = mues[i];
+	}
+}
+
+} // namespace rtp
+
+#endif // _RTP_RAYPACKET_H_
@@ -0,0 +1,68 @@
+#ifndef _RTP_RAYTRIBENCHMARK_H_
+#define _RTP_RAYTRIBENCHMARK_H_
+
+#include <rt/Geometry.h>
+#include <rt/Ray.h>
+
+namespace rtp {
+
+// Compares the ray-triangle intersection kernels of RayTriIntersection: every kernel tests the same list
+// of ray-triangle pairs, then time per test, throughput and disagreements with hitWald are reported.
+// hitWald, the kernel used by all acceleration structures, is the reference.
+class RayTriBenchmark
+{
+public:
+	enum TestMix
+	{
+		HIT,		// rays aim at random points inside their triangle
+		MISS,		// rays aim at random points outside their triangle, in its plane
+		GRAZING		// rays aim at points on the edges of their triangle, or run almost parallel to it
+	};
+
+	RayTriBenchmark();
+
+	void setTestCount( uint32 count );
+	uint32 getTestCount() const;
+
+	// Tests are run this many times per kernel, so that short runs are still measurable
+	void setRepeatCount( uint32 count );
+	uint32 getRepeatCount() const;
+
+	// Replaces geometry's triangles with count random triangles of varied size and shape inside the unit cube
+	static void generateTriangles( rt::Geometry& geometry, uint32 count );
+
+	// Pairs random triangles of geometry with rays of the given mix. Geometry must outlive the tests.
+	// Geometry without TriAccel's gets no tests, see rt::Geometry::hasTriAccel.
+	void generateTests( const rt::Geometry& geometry, TestMix mix );
+
+	// Runs all kernels over current tests
+	void run( const char* name );
+
+	// Generates and runs the tests of each mix over geometry's triangles. Geometry without TriAccel's
+	// gets them for the benchmark only.
+	void runMixes( const char* name, rt::Geometry& geometry );
+
+private:
+	typedef void (*Kernel)( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+
+	// Tests all pairs with kernel, distances are MAX_VALUE for misses
+	double runKernel( Kernel kernel, std::vector<float>& distances ) const;
+
+	// Same signature as the other kernels
+	static void hitWald( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+
+	struct Test
+	{
+		rt::Ray ray;
+		uint32 triangleId;
+	};
+
+	const rt::Geometry* _geometry;
+	std::vector<Test> _tests;
+	uint32 _testCount;
+	uint32 _repeatCount;
+};
+
+} // namespace rtp
+
+#endif // _RTP_RAYTRIBENCHMARK_H_
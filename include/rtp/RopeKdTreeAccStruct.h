@@ -0,0 +1,147 @@
+#ifndef _RTP_ROPEKDTREEACCSTRUCT_H_
+#define _RTP_ROPEKDTREEACCSTRUCT_H_
+
+#include <rt/IAccStruct.h>
+#include <rtp/KdTreeAccStruct.h>
+
+namespace rtp {
+
+// 56 bytes: box of a leaf and its ropes, the links to the nodes on the other side of each face
+struct RopeLeaf
+{
+	static const uint32 NO_ROPE = 0xFFFFFFFF;
+
+	// bounds[0..2] : min x, y, z
+	// bounds[3..5] : max x, y, z
+	// Face f is the side of the box lying on bounds[f]
+	float bounds[6];
+
+	// Deepest node whose box still covers the whole face f, NO_ROPE if face lies on the tree's boundary
+	uint32 ropes[6];
+
+	uint32 elemStart;
+	uint32 elemCount;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Kd-tree with ropes, see RopeKdTreeAccStructBuilder.
+// Traversal needs no stack: it starts at the leaf containing the ray's entry point (for rays starting inside
+// the tree, the leaf of their origin) and moves from leaf to leaf through the ropes of the faces the ray exits.
+// Nodes are stored breadth-first as KdNode's, leaves store the index of their RopeLeaf in place of the element start.
+class RopeKdTreeAccStruct : public rt::IAccStruct
+{
+public:
+	virtual void clear();
+
+	virtual void findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit );
+	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+
+	std::vector<KdNode> nodes;
+	std::vector<RopeLeaf> leaves;
+	std::vector<uint32> elements;
+
+private:
+	// Descends from node to the leaf containing point. Points on a split plane go to the side the ray heads to,
+	// unless the near side is a flat cell, which must be visited for the triangles lying in the plane.
+	// Near bounds are the node's bounds facing the ray's origin, Mathf::MAX_VALUE where unknown.
+	inline const RopeLeaf& findLeaf( uint32 nodeId, const vr::vec3f& point, const rt::Ray& ray, vr::vec3f nearBounds ) const;
+
+	// Near bounds of the whole tree, for descents from the root
+	inline vr::vec3f nearBounds( const rt::Ray& ray ) const;
+
+	// Leaf behind exitFace of leaf, which ray crosses at distance t.
+	// Only the rope node's bound on the exit axis is known: it lies on the face.
+	inline const RopeLeaf& ropeLeaf( const RopeLeaf& leaf, uint32 exitFace, float t, const rt::Ray& ray ) const;
+
+	// Distance at which ray leaves the box of leaf, and face it crosses
+	static inline float exitDistance( const RopeLeaf& leaf, const rt::Ray& ray, uint32& exitFace );
+
+	// Point where ray at distance t crosses exitFace of leaf, snapped onto the face so that rounding
+	// never leads back into leaf or past the face's neighbors
+	static inline vr::vec3f exitPoint( const RopeLeaf& leaf, const rt::Ray& ray, float t, uint32 exitFace );
+};
+
+inline const RopeLeaf& RopeKdTreeAccStruct::findLeaf( uint32 nodeId, const vr::vec3f& point, const rt::Ray& ray, 
+													  vr::vec3f nearBounds ) const
+{
+	const KdNode* node = &nodes[nodeId];
+
+	while( !node->isLeaf() )
+	{
+		const RTenum axis = node->axis();
+		const float split = node->splitPos();
+		const uint32 nearChild = ray.dirSignBits[axis];
+
+		uint32 child;
+		if( point[axis] < split )
+			child = 0;
+		else if( point[axis] > split )
+			child = 1;
+		else
+			child = ( nearBounds[axis] == split ) ? nearChild : !nearChild;
+
+		if( child != nearChild )
+			nearBounds[axis] = split;
+
+		node = &nodes[node->leftChild() + child];
+	}
+
+	return leaves[node->elemStart()];
+}
+
+inline vr::vec3f RopeKdTreeAccStruct::nearBounds( const rt::Ray& ray ) const
+{
+	vr::vec3f bounds;
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		bounds[i] = ray.dirSignBits[i] ? _bbox.maxv[i] : _bbox.minv[i];
+	}
+	return bounds;
+}
+
+inline const RopeLeaf& RopeKdTreeAccStruct::ropeLeaf( const RopeLeaf& leaf, uint32 exitFace, float t, const rt::Ray& ray ) const
+{
+	vr::vec3f bounds( vr::Mathf::MAX_VALUE, vr::Mathf::MAX_VALUE, vr::Mathf::MAX_VALUE );
+	bounds[exitFace % 3] = leaf.bounds[exitFace];
+	return findLeaf( leaf.ropes[exitFace], exitPoint( leaf, ray, t, exitFace ), ray, bounds );
+}
+
+inline float RopeKdTreeAccStruct::exitDistance( const RopeLeaf& leaf, const rt::Ray& ray, uint32& exitFace )
+{
+	float exit = vr::Mathf::MAX_VALUE;
+	exitFace = 0;
+
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		// Far face along the ray's direction. Rays parallel to the faces give INF or NaN, which is never nearer.
+		const uint32 face = ray.dirSignBits[i] ? i : i + 3;
+		const float t = ( leaf.bounds[face] - ray.orig[i] ) * ray.invDir[i];
+
+		if( t < exit )
+		{
+			exit = t;
+			exitFace = face;
+		}
+	}
+
+	return exit;
+}
+
+inline vr::vec3f RopeKdTreeAccStruct::exitPoint( const RopeLeaf& leaf, const rt::Ray& ray, float t, uint32 exitFace )
+{
+	vr::vec3f point = ray.orig + ray.dir * t;
+
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		point[i] = vr::max( vr::min( point[i], leaf.bounds[i + 3] ), leaf.bounds[i] );
+	}
+
+	point[exitFace % 3] = leaf.bounds[exitFace];
+	return point;
+}
+
+} // namespace rtp
+
+#endif // _RTP_ROPEKDTREEACCSTRUCT_H_
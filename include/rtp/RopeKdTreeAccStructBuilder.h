@@ -0,0 +1,52 @@
+#ifndef _RTP_ROPEKDTREEACCSTRUCTBUILDER_H_
+#define _RTP_ROPEKDTREEACCSTRUCTBUILDER_H_
+
+#include <rt/IAccStructBuilder.h>
+#include <rtp/KdTreeAccStructBuilder.h>
+
+namespace rtp {
+
+// Forward declarations
+struct RawKdTree;
+class RopeKdTreeAccStruct;
+class TriangleTreeBuilder;
+class InstanceTreeBuilder;
+
+// Kd-tree with ropes (Havran; Popov et al. 2007): the same SAH tree as KdTreeAccStructBuilder, whose leaves
+// also store their box and a rope per face to the neighboring node, so that traversal needs no stack.
+// Ropes are pushed down to the deepest node still covering the whole face, which shortens the descent
+// from a rope to the next leaf. Costs 56 bytes per leaf on top of the kd-tree.
+class RopeKdTreeAccStructBuilder : public rt::IAccStructBuilder
+{
+public:
+	RopeKdTreeAccStructBuilder();
+	~RopeKdTreeAccStructBuilder();
+
+	virtual void buildGeometry( rt::Geometry* geometry );
+	virtual rt::IAccStruct* buildInstance( const std::vector<rt::Instance> instances );
+
+	// Only affects triangle trees, both modes produce the same SAH tree
+	void setBuildMode( KdTreeAccStructBuilder::BuildMode mode );
+	KdTreeAccStructBuilder::BuildMode getBuildMode() const;
+
+	// Number of threads used to build each tree, 1 builds serially
+	void setThreadCount( uint32 count );
+	uint32 getThreadCount() const;
+
+private:
+	// Stores nodes breadth-first, then links leaves with ropes
+	RopeKdTreeAccStruct* convertRawTree( RawKdTree* tree );
+
+	// Passes ropes of node's faces down to its leaves, a child's rope on the split plane is its sibling
+	void buildRopes( RopeKdTreeAccStruct* result, uint32 nodeId, const rt::Aabb& bbox, const uint32* ropes );
+
+	// Descends from rope towards face f of box while a single child still covers the whole face
+	uint32 optimizeRope( RopeKdTreeAccStruct* result, uint32 rope, uint32 face, const rt::Aabb& bbox ) const;
+
+	TriangleTreeBuilder* _triangleTreeBuilder;
+	InstanceTreeBuilder* _instanceTreeBuilder;
+};
+
+} // namespace rtp
+
+#endif // _RTP_ROPEKDTREEACCSTRUCTBUILDER_H_
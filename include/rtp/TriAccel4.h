@@ -0,0 +1,157 @@
+#ifndef _RTP_TRIACCEL4_H_
+#define _RTP_TRIACCEL4_H_
+
+#include <rt/Triangle.h>
+#include <rt/Ray.h>
+#include <rt/Hit.h>
+#include <xmmintrin.h>
+#include <vector>
+
+namespace rtp {
+
+// 208 bytes: block of 4 TriAccel's transposed (SoA) for a SIMD version of Wald's test against a single ray.
+// Each TriAccel is stored in 3D form, its projection axis k folded into the vectors (n[k] = 1, n[ku] = n_u,
+// n[kv] = n_v, b[k] = c[k] = 0), so that all lanes run the same instructions whatever their axis.
+// Builders fill unused lanes with copies of a triangle of the same block, which cost nothing but a lane.
+// Data is accessed with unaligned loads, since std::vector does not guarantee 16 byte alignment of its elements.
+struct TriAccel4
+{
+	// Ray data replicated across all 4 lanes
+	struct SimdRay
+	{
+		// Copies origin and direction, and the hit interval [ray.tnear, ray.tfar]
+		void load( const rt::Ray& ray );
+
+		// Hits are accepted inside [tnear, tfar], with the same tolerance as RayTriIntersection
+		void setInterval( float tnear, float tfar );
+
+		__m128 orig[3];
+		__m128 dir[3];
+		__m128 tnear;
+		__m128 tfar;
+	};
+
+	// Stores acc in lane
+	void set( uint32 lane, const rt::TriAccel& acc );
+
+	// Packs triangles ids[0..count-1] of accels into (count + 3) / 4 blocks appended to blocks
+	static void pack( const std::vector<rt::TriAccel>& accels, const uint32* ids, uint32 count,
+		              std::vector<TriAccel4>& blocks );
+
+	// SIMD version of RayTriIntersection::hitWald, keeps the nearest of the 4 hits
+	inline void hit( const SimdRay& ray, rt::Hit& hit, float& bestDistance ) const;
+
+	// SIMD version of RayTriIntersection::hitAnyWald
+	inline bool hitAny( const SimdRay& ray ) const;
+
+	float n[3][4];
+	float n_d[4];
+	float b[3][4];
+	float b_d[4];
+	float c[3][4];
+	float c_d[4];
+	uint32 triangleIds[4];
+};
+
+inline void TriAccel4::hit( const SimdRay& ray, rt::Hit& hit, float& bestDistance ) const
+{
+	const __m128 one = _mm_set1_ps( 1.0f );
+	const __m128 zero = _mm_setzero_ps();
+
+	const __m128 nx = _mm_loadu_ps( n[0] );
+	const __m128 ny = _mm_loadu_ps( n[1] );
+	const __m128 nz = _mm_loadu_ps( n[2] );
+
+	// Start high-latency division as early as possible
+	const __m128 nd = _mm_div_ps( one, _mm_add_ps( _mm_add_ps( _mm_mul_ps( ray.dir[0], nx ), _mm_mul_ps( ray.dir[1], ny ) ),
+		                                           _mm_mul_ps( ray.dir[2], nz ) ) );
+	const __m128 f = _mm_mul_ps( nd, _mm_sub_ps( _mm_loadu_ps( n_d ),
+		                         _mm_add_ps( _mm_add_ps( _mm_mul_ps( ray.orig[0], nx ), _mm_mul_ps( ray.orig[1], ny ) ),
+		                                     _mm_mul_ps( ray.orig[2], nz ) ) ) );
+
+	// Check for valid distance. Comparisons against NaN's are false, so such lanes are always rejected
+	__m128 valid = _mm_and_ps( _mm_cmpge_ps( f, ray.tnear ), _mm_cmple_ps( f, ray.tfar ) );
+	valid = _mm_and_ps( valid, _mm_cmplt_ps( f, _mm_set1_ps( bestDistance ) ) );
+	if( !_mm_movemask_ps( valid ) )
+		return;
+
+	// Hit point, only its u and v coordinates matter since b[k] and c[k] are zero
+	const __m128 px = _mm_add_ps( ray.orig[0], _mm_mul_ps( f, ray.dir[0] ) );
+	const __m128 py = _mm_add_ps( ray.orig[1], _mm_mul_ps( f, ray.dir[1] ) );
+	const __m128 pz = _mm_add_ps( ray.orig[2], _mm_mul_ps( f, ray.dir[2] ) );
+
+	// Check barycentric coordinates
+	const __m128 lambda = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( px, _mm_loadu_ps( b[0] ) ), _mm_mul_ps( py, _mm_loadu_ps( b[1] ) ) ),
+		                                          _mm_mul_ps( pz, _mm_loadu_ps( b[2] ) ) ), _mm_loadu_ps( b_d ) );
+	const __m128 mue = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( px, _mm_loadu_ps( c[0] ) ), _mm_mul_ps( py, _mm_loadu_ps( c[1] ) ) ),
+		                                       _mm_mul_ps( pz, _mm_loadu_ps( c[2] ) ) ), _mm_loadu_ps( c_d ) );
+	const __m128 psi = _mm_sub_ps( _mm_sub_ps( one, lambda ), mue );
+
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( lambda, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( mue, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( psi, zero ) );
+
+	const int32 mask = _mm_movemask_ps( valid );
+	if( !mask )
+		return;
+
+	float fs[4];
+	float lambdas[4];
+	float mues[4];
+	_mm_storeu_ps( fs, f );
+	_mm_storeu_ps( lambdas, lambda );
+	_mm_storeu_ps( mues, mue );
+
+	// Have valid hit points here. Store the nearest one.
+	for( uint32 i = 0; i < 4; ++i )
+	{
+		if( !( mask & ( 1 << i ) ) || ( fs[i] >= bestDistance ) )
+			continue;
+
+		bestDistance = fs[i];
+		hit.triangleId = triangleIds[i];
+		hit.v0Coord = 1.0f - lambdas[i] - mues[i];
+		hit.v1Coord = lambdas[i];
+		hit.v2Coord = mues[i];
+	}
+}
+
+inline bool TriAccel4::hitAny( const SimdRay& ray ) const
+{
+	const __m128 one = _mm_set1_ps( 1.0f );
+	const __m128 zero = _mm_setzero_ps();
+
+	const __m128 nx = _mm_loadu_ps( n[0] );
+	const __m128 ny = _mm_loadu_ps( n[1] );
+	const __m128 nz = _mm_loadu_ps( n[2] );
+
+	const __m128 nd = _mm_div_ps( one, _mm_add_ps( _mm_add_ps( _mm_mul_ps( ray.dir[0], nx ), _mm_mul_ps( ray.dir[1], ny ) ),
+		                                           _mm_mul_ps( ray.dir[2], nz ) ) );
+	const __m128 f = _mm_mul_ps( nd, _mm_sub_ps( _mm_loadu_ps( n_d ),
+		                         _mm_add_ps( _mm_add_ps( _mm_mul_ps( ray.orig[0], nx ), _mm_mul_ps( ray.orig[1], ny ) ),
+		                                     _mm_mul_ps( ray.orig[2], nz ) ) ) );
+
+	__m128 valid = _mm_and_ps( _mm_cmpge_ps( f, ray.tnear ), _mm_cmple_ps( f, ray.tfar ) );
+	if( !_mm_movemask_ps( valid ) )
+		return false;
+
+	const __m128 px = _mm_add_ps( ray.orig[0], _mm_mul_ps( f, ray.dir[0] ) );
+	const __m128 py = _mm_add_ps( ray.orig[1], _mm_mul_ps( f, ray.dir[1] ) );
+	const __m128 pz = _mm_add_ps( ray.orig[2], _mm_mul_ps( f, ray.dir[2] ) );
+
+	const __m128 lambda = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( px, _mm_loadu_ps( b[0] ) ), _mm_mul_ps( py, _mm_loadu_ps( b[1] ) ) ),
+		                                          _mm_mul_ps( pz, _mm_loadu_ps( b[2] ) ) ), _mm_loadu_ps( b_d ) );
+	const __m128 mue = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( px, _mm_loadu_ps( c[0] ) ), _mm_mul_ps( py, _mm_loadu_ps( c[1] ) ) ),
+		                                       _mm_mul_ps( pz, _mm_loadu_ps( c[2] ) ) ), _mm_loadu_ps( c_d ) );
+	const __m128 psi = _mm_sub_ps( _mm_sub_ps( one, lambda ), mue );
+
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( lambda, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( mue, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( psi, zero ) );
+
+	return ( _mm_movemask_ps( valid ) != 0 );
+}
+
+} // namespace rtp
+
+#endif // _RTP_TRIACCEL4_H_
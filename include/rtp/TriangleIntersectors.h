@@ -0,0 +1,128 @@
+#ifndef _RTP_TRIANGLEINTERSECTORS_H_
+#define _RTP_TRIANGLEINTERSECTORS_H_
+
+#include <rt/RayTriIntersection.h>
+#include <rt/Geometry.h>
+
+namespace rtp {
+
+// Intersection policies of the acceleration structure templates, e.g. BvhAccStructT and KdTreeAccStructT.
+// Each one is a ray-triangle kernel inlined into the traversal loop, with the same tolerance as RayTriIntersection:
+//   static void hit( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+//   static bool hitAny( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray );
+// USES_TRIACCEL tells whether the kernel agrees with the SIMD versions of Wald's test (TriAccel4 blocks and
+// ray packets), which structures only use for such policies.
+
+// Wald's projection test on precomputed TriAccel's, the kernel of all structures by default
+struct WaldIntersector
+{
+	static const bool USES_TRIACCEL = true;
+
+	static inline void hit( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray, rt::Hit& hit, 
+		                    float& bestDistance );
+	static inline bool hitAny( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray );
+};
+
+// Moller-Trumbore test on the triangle's vertices, needs no precomputed data.
+// Rays parallel to the triangle give an infinite or NaN determinant inverse, which fails all checks,
+// so no determinant epsilon rejects small triangles.
+struct MollerTrumboreIntersector
+{
+	static const bool USES_TRIACCEL = false;
+
+	static inline void hit( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray, rt::Hit& hit, 
+		                    float& bestDistance );
+	static inline bool hitAny( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray );
+
+	// Same tests on vertices given directly, e.g. decoded from a QuantizedTriangle
+	static inline void hit( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, uint32 triId, 
+		                    const rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+	static inline bool hitAny( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, const rt::Ray& ray );
+
+private:
+	// Distance f and barycentric coordinates u, v of the hit with the triangle's plane, false if outside triangle
+	static inline bool intersect( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, const rt::Ray& ray, 
+		                          float& f, float& u, float& v );
+};
+
+inline void WaldIntersector::hit( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray, rt::Hit& hit, 
+								  float& bestDistance )
+{
+	rt::RayTriIntersection::hitWald( geometry.triAccel[triId], ray, hit, bestDistance );
+}
+
+inline bool WaldIntersector::hitAny( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray )
+{
+	return rt::RayTriIntersection::hitAnyWald( geometry.triAccel[triId], ray );
+}
+
+inline void MollerTrumboreIntersector::hit( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray, rt::Hit& hit, 
+										    float& bestDistance )
+{
+	const rt::TriDesc& desc = geometry.triDesc[triId];
+	MollerTrumboreIntersector::hit( geometry.vertices[desc.v[0]], geometry.vertices[desc.v[1]], geometry.vertices[desc.v[2]], 
+		                            triId, ray, hit, bestDistance );
+}
+
+inline bool MollerTrumboreIntersector::hitAny( const rt::Geometry& geometry, uint32 triId, const rt::Ray& ray )
+{
+	const rt::TriDesc& desc = geometry.triDesc[triId];
+	return hitAny( geometry.vertices[desc.v[0]], geometry.vertices[desc.v[1]], geometry.vertices[desc.v[2]], ray );
+}
+
+inline void MollerTrumboreIntersector::hit( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, uint32 triId, 
+										    const rt::Ray& ray, rt::Hit& hit, float& bestDistance )
+{
+	float f;
+	float u;
+	float v;
+	if( !intersect( v0, v1, v2, ray, f, u, v ) )
+		return;
+
+	if( ( f >= bestDistance ) || ( f < ray.tnear - rt::RayTriIntersection::HIT_EPSILON ) || 
+		( f > ray.tfar + rt::RayTriIntersection::HIT_EPSILON ) )
+		return;
+
+	bestDistance = f;
+	hit.triangleId = triId;
+	hit.v0Coord = 1.0f - u - v;
+	hit.v1Coord = u;
+	hit.v2Coord = v;
+}
+
+inline bool MollerTrumboreIntersector::hitAny( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, 
+											   const rt::Ray& ray )
+{
+	float f;
+	float u;
+	float v;
+	return intersect( v0, v1, v2, ray, f, u, v ) && ( f >= ray.tnear - rt::RayTriIntersection::HIT_EPSILON ) && 
+		   ( f <= ray.tfar + rt::RayTriIntersection::HIT_EPSILON );
+}
+
+inline bool MollerTrumboreIntersector::intersect( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, 
+												  const rt::Ray& ray, float& f, float& u, float& v )
+{
+	const vr::vec3f edge1 = v1 - v0;
+	const vr::vec3f edge2 = v2 - v0;
+
+	const vr::vec3f pvec = ray.dir.cross( edge2 );
+	const float invDet = 1.0f / edge1.dot( pvec );
+
+	const vr::vec3f tvec = ray.orig - v0;
+	u = tvec.dot( pvec ) * invDet;
+	if( !( ( u >= 0.0f ) && ( u <= 1.0f ) ) )
+		return false;
+
+	const vr::vec3f qvec = tvec.cross( edge1 );
+	v = ray.dir.dot( qvec ) * invDet;
+	if( !( ( v >= 0.0f ) && ( u + v <= 1.0f ) ) )
+		return false;
+
+	f = edge2.dot( qvec ) * invDet;
+	return true;
+}
+
+} // namespace rtp
+
+#endif // _RTP_TRIANGLEINTERSECTORS_H_
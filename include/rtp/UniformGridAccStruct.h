@@ -4,13 +4,57 @@
 #include <rt/IAccStruct.h>
 #include <rt/Geometry.h>
 #include <rt/RayTriIntersection.h>
+#include <rtp/TriAccel4.h>
 
 namespace rtp {
 
+// Cells are stored flat: triangle ids of cell c are getCellTriangleIds()[offsets[c]..offsets[c+1]),
+// where offsets = getCellOffsets(). Same layout as the texCellPointers/texCellTriangleIds buffers on the GPU.
+// Two-level grids replace crowded cells by sub-grids spanning the cell. Such a cell stores a single
+// negative id, ~subGridIndex, and traversal descends into the sub-grid with a nested 3D-DDA.
+// Optional macro-cells group blocks of cells, rays cross an empty block in a single step.
+// Optional triangle blocks pack the triangles of each cell into TriAccel4's, tested 4 at a time.
 class UniformGridAccStruct : public rt::IAccStruct
 {
 public:
-	typedef std::vector<int32> Cell;
+	// Read-only view of the triangle ids stored in a cell
+	struct Cell
+	{
+		inline uint32 size() const;
+		inline bool empty() const;
+		inline int32 operator[]( uint32 i ) const;
+
+		// Cell is refined by a sub-grid instead of holding triangles
+		inline bool hasSubGrid() const;
+		inline uint32 subGridId() const;
+
+		const int32* ids;
+		uint32 count;
+	};
+
+	// Work done by a traversal, used to evaluate grid resolutions
+	struct TraversalStats
+	{
+		uint32 cellCount;
+		uint32 triangleCount;	// triangles actually tested
+		uint32 mailboxCount;	// tests avoided because triangle was already tested by the same ray
+	};
+
+	// Triangles recently tested by the current ray of a thread, hashed by triangle id.
+	// Collisions evict older entries, which only costs a redundant test.
+	struct Mailbox
+	{
+		static const uint32 SIZE = 128;
+
+		struct Entry
+		{
+			uint32 rayId;
+			int32 triangleId;
+		};
+
+		uint32 rayId;
+		Entry entries[SIZE];
+	};
 
 	UniformGridAccStruct();
 	~UniformGridAccStruct();
@@ -18,6 +62,12 @@ public:
 	virtual void clear();
 	virtual void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
 
+	// Same as above, also adds visited cells and tested triangles to stats
+	void traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit, TraversalStats& stats );
+
+	// Shadow rays: walks cells up to ray.tfar and stops at the first triangle blocking the ray
+	virtual bool traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+
 	// Must have a valid bounding box first!
 	void setResolution( int32 nCellsX, int32 nCellsY, int32 nCellsZ );
 	void getResolution( int32& nCellsX, int32& nCellsY, int32& nCellsZ ) const;
@@ -25,23 +75,76 @@ public:
 	const vr::vec3f& getCellSize() const;
 	const vr::vec3f& getInvCellSize() const;
 
-	const Cell& at( int32 x, int32 y, int32 z ) const;
-	Cell& at( int32 x, int32 y, int32 z );
+	inline uint32 cellId( int32 x, int32 y, int32 z ) const;
+	inline Cell at( int32 x, int32 y, int32 z ) const;
 
-	int32 worldToVoxel( float value, RTenum axis );
-	float voxelToWorld( int32 voxel, RTenum axis );
+	// Macro-cells span 2^shift cells in each dimension, shift 0 disables them.
+	// Must be called after setResolution, counts start at zero.
+	void setMacroCellShift( uint32 shift );
+	uint32 getMacroCellShift() const;
+	void getMacroResolution( int32& nMacroX, int32& nMacroY, int32& nMacroZ ) const;
 
-	const std::vector<Cell>& getGridData() const;
+	// Id of the macro-cell containing cell (x,y,z)
+	inline uint32 macroCellId( int32 x, int32 y, int32 z ) const;
 
-private:
-	// Main intersection routine, called whenever we find a non-empty cell
-	// Updates ray.tfar to avoid false intersections that lie outside cell boundaries
-	bool intersectTriangles( const std::vector<rt::TriAccel>& triangles, const Cell& cell, 
-		                     float maxValidDistance, rt::Ray& ray, rt::Hit& hit, float& bestDistance );
+	// Number of triangle references stored in the cells of each macro-cell
+	const std::vector<uint32>& getMacroCellCounts() const;
+	std::vector<uint32>& getMacroCellCounts();
+
+	int32 worldToVoxel( float value, RTenum axis ) const;
+	float voxelToWorld( int32 voxel, RTenum axis ) const;
 
+	// Cell count + 1 entries, last one is the total number of triangle references
+	const std::vector<uint32>& getCellOffsets() const;
+	std::vector<uint32>& getCellOffsets();
 
-	// 3D-DDA traversal
-	void traverse3ddda( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
+	const std::vector<int32>& getCellTriangleIds() const;
+	std::vector<int32>& getCellTriangleIds();
+
+	// Packs the triangles of each cell with at least a few of them, and of sub-grid cells, into blocks of 4.
+	// Must be called again whenever cells change.
+	void buildTriangleBlocks( const std::vector<rt::TriAccel>& triAccel );
+	uint32 getTriangleBlockCount() const;
+
+	// Second level, empty for single-level grids
+	const std::vector< vr::ref_ptr<UniformGridAccStruct> >& getSubGrids() const;
+	std::vector< vr::ref_ptr<UniformGridAccStruct> >& getSubGrids();
+
+private:
+	// Main intersection routine, called whenever we find a non-empty cell.
+	// Skips triangles already tested by this ray, so hits may lie outside the cell:
+	// callers must only accept bestDistance once it is not beyond the current cell.
+	void intersectTriangles( const std::vector<rt::TriAccel>& triangles, const Cell& cell, 
+		                     const rt::Ray& ray, rt::Hit& hit, float& bestDistance, TraversalStats* stats );
+
+	// Any hit version of intersectTriangles, tests triangles against the whole ray and keeps no hit data
+	bool occludeTriangles( const std::vector<rt::TriAccel>& triangles, const Cell& cell, const rt::Ray& ray, 
+		                   TraversalStats* stats );
+
+	// Cell's triangles are packed into blocks
+	inline bool hasBlocks( uint32 cellId ) const;
+
+	// Block versions of intersectTriangles and occludeTriangles. Blocks are not mailboxed: 
+	// testing a triangle again costs nothing but a lane, and finds the same distance.
+	void intersectBlocks( uint32 cellId, const TriAccel4::SimdRay& ray, rt::Hit& hit, float& bestDistance ) const;
+	bool occludeBlocks( uint32 cellId, const TriAccel4::SimdRay& ray ) const;
+
+	// 3D-DDA traversal, stats may be NULL
+	void traverse3ddda( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit, TraversalStats* stats );
+
+	// Steps through macro-cells from the empty one containing cell (x,y,z) until one holding triangles,
+	// then moves x, y, z to the cell where ray enters it and updates tEnter.
+	// Returns false if ray leaves grid or passes tEnd first.
+	bool skipMacroCells( const rt::Ray& ray, float tEnd, int32& x, int32& y, int32& z, float& tEnter, 
+		                 TraversalStats* stats ) const;
+
+	// Walks cells from distance tStart, which must lie inside grid, until leaving grid or passing tEnd.
+	// Returns true when a hit closer than hit.distance was found, bestDistance holds its distance.
+	// With anyHit, returns true at the first triangle hit inside the ray's interval, leaving hit and bestDistance alone.
+	// Triangle blocks are only tested with simd, read from the context once per ray by the entry points.
+	bool traverseCells( const std::vector<rt::TriAccel>& triangles, float tStart, float tEnd, 
+		                rt::Ray& ray, rt::Hit& hit, float& bestDistance, TraversalStats* stats, bool anyHit, 
+		                bool simd );
 
 	// Cube grid traversal
 	void traverseCubeGrid( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit );
@@ -51,11 +154,76 @@ private:
 	int32 _ny;
 	int32 _nz;
 
-	std::vector<Cell> _data;
+	std::vector<uint32> _cellOffsets;
+	std::vector<int32> _cellTriangleIds;
+	std::vector< vr::ref_ptr<UniformGridAccStruct> > _subGrids;
+
+	// Macro-cells
+	uint32 _macroShift;
+	int32 _mnx;
+	int32 _mny;
+	int32 _mnz;
+	std::vector<uint32> _macroCellCounts;
+
+	// Triangle blocks of cell c are _blocks[_cellBlockOffsets[c]..._cellBlockOffsets[c+1]), both empty if not built
+	std::vector<uint32> _cellBlockOffsets;
+	std::vector<TriAccel4> _blocks;
+
 	vr::vec3f _cellSize;
 	vr::vec3f _invCellSize;
 };
 
+inline uint32 UniformGridAccStruct::Cell::size() const
+{
+	return count;
+}
+
+inline bool UniformGridAccStruct::Cell::empty() const
+{
+	return ( count == 0 );
+}
+
+inline int32 UniformGridAccStruct::Cell::operator[]( uint32 i ) const
+{
+	return ids[i];
+}
+
+inline bool UniformGridAccStruct::Cell::hasSubGrid() const
+{
+	return ( count == 1 ) && ( ids[0] < 0 );
+}
+
+inline uint32 UniformGridAccStruct::Cell::subGridId() const
+{
+	return ~ids[0];
+}
+
+inline uint32 UniformGridAccStruct::cellId( int32 x, int32 y, int32 z ) const
+{
+	return x + y * _nx + z * _nx * _ny;
+}
+
+inline uint32 UniformGridAccStruct::macroCellId( int32 x, int32 y, int32 z ) const
+{
+	return ( x >> _macroShift ) + ( y >> _macroShift ) * _mnx + ( z >> _macroShift ) * _mnx * _mny;
+}
+
+inline UniformGridAccStruct::Cell UniformGridAccStruct::at( int32 x, int32 y, int32 z ) const
+{
+	const uint32 id = cellId( x, y, z );
+	const uint32 start = _cellOffsets[id];
+
+	Cell cell;
+	cell.ids = _cellTriangleIds.empty() ? NULL : &_cellTriangleIds[0] + start;
+	cell.count = _cellOffsets[id+1] - start;
+	return cell;
+}
+
+inline bool UniformGridAccStruct::hasBlocks( uint32 cellId ) const
+{
+	return ( _cellBlockOffsets[cellId] != _cellBlockOffsets[cellId+1] );
+}
+
 } // namespace rtp
 
 #endif // _RTP_UNIFORMGRIDACCSTRUCT_H_
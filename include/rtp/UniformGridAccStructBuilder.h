@@ -2,19 +2,170 @@
 #define _RTP_UNIFORMGRIDACCSTRUCTBUILDER_H_
 
 #include <rt/IAccStructBuilder.h>
+#include <rtp/AccStructCache.h>
+#include <map>
+#include <string>
 
 namespace rtp {
 
+// Forward declarations
+class UniformGridAccStruct;
+
 class UniformGridAccStructBuilder : public rt::IAccStructBuilder
 {
 public:
+	enum GridMode
+	{
+		SINGLE_LEVEL,	// one uniform grid, the only mode supported by GPU renderers
+		TWO_LEVEL		// crowded cells are refined by their own uniform sub-grid
+	};
+
+	UniformGridAccStructBuilder();
+
 	virtual void buildGeometry( rt::Geometry* geometry );
-	// TODO: 
+
+	// Rebuilds the grid of moved vertices without reading or writing the cache, 
+	// since keyframes of animated geometry are never built again
+	virtual void updateGeometry( rt::Geometry* geometry );
+
+	// TODO:
 	//virtual IAccStruct* buildInstance( const std::vector<rt::Instance> instances );
 
+	// Number of threads used to build each grid, 1 builds serially.
+	// Parallel builds produce the same grids as serial ones.
+	void setThreadCount( uint32 count );
+	uint32 getThreadCount() const;
+
+	void setGridMode( GridMode mode );
+	GridMode getGridMode() const;
+
+	// In two-level mode, cells holding more triangles than this get a sub-grid
+	void setSubGridThreshold( uint32 count );
+	uint32 getSubGridThreshold() const;
+
+	// When enabled, triangles are only stored in cells they actually overlap (separating axis test),
+	// instead of all cells overlapped by their bounding box
+	void setExactInsertion( bool enabled );
+	bool getExactInsertion() const;
+
+	// Triangles of each cell are packed into blocks of 4 (TriAccel4) tested with one SIMD instruction sequence.
+	// Cell arrays, and thus GPU renderers, are not affected. Disabled by default: cells hold few triangles and
+	// lose mailboxing, so blocks mostly pay off for any hit rays.
+	void setTriangleBlocks( bool enabled );
+	bool getTriangleBlocks() const;
+
+	// Macro-cells group size^3 cells so that traversal crosses empty blocks in one step.
+	// Size is rounded down to a power of two, 1 disables macro-cells. Default is 2.
+	void setMacroCellSize( uint32 size );
+	uint32 getMacroCellSize() const;
+
+	// Cells per triangle, k in the cube-root resolution heuristic
+	void setDensity( float density );
+	float getDensity() const;
+
+	// When enabled, density is chosen per geometry: grids are built with candidate densities and the one
+	// with the lowest traversal cost for a sample of probe rays wins. Results are cached per mesh.
+	void setAutoTune( bool enabled );
+	bool getAutoTune() const;
+
+	void setProbeRayCount( uint32 count );
+	uint32 getProbeRayCount() const;
+
+	// Tuned densities are loaded from this file and saved back whenever a new mesh is tuned.
+	// Empty keeps them in memory only.
+	void setTuningCacheFile( const std::string& filename );
+	const std::string& getTuningCacheFile() const;
+
+	// Grids are saved to this directory after being built, and loaded from it instead of being rebuilt
+	// (or re-tuned) while geometry and settings stay the same. Empty disables the cache (default).
+	void setCacheDirectory( const std::string& directory );
+	const std::string& getCacheDirectory() const;
+
 private:
-	void buildUniformGrid( rt::Geometry* geometry );
+	// Cells overlapped by a triangle, inclusive
+	struct CellRange
+	{
+		int32 minCell[3];
+		int32 maxCell[3];
+	};
+
+	// Tuned density of a mesh, keyed by triangle count and geometry hash
+	typedef std::map< std::pair<uint32, uint64>, float > TuningCache;
+
+	void buildUniformGrid( rt::Geometry* geometry, bool useCache );
 	void buildCubeGrid( rt::Geometry* geometry );
+
+	// Builds grid over bbox with the given density, including sub-grids
+	UniformGridAccStruct* createGrid( rt::Geometry* geometry, const rt::Aabb& bbox, float density );
+
+	// Returns cached density of geometry, or the candidate with lowest probe ray cost
+	float tuneDensity( rt::Geometry* geometry, const rt::Aabb& bbox );
+	void loadTuningCache();
+	void saveTuningCache() const;
+
+	// Cube-root heuristic: about density cells per triangle, as cubic as possible
+	void computeResolution( const rt::Aabb& bbox, int32 triCount, float density, int32& nx, int32& ny, int32& nz ) const;
+
+	// Cells overlapped by each triangle box, clamped to grid. Uses triangles 0..triCount-1 if triangleIds is NULL.
+	void computeCellRanges( rt::Geometry* geometry, UniformGridAccStruct* grid, const int32* triangleIds, 
+		                    int32 triCount, uint32 threadCount, std::vector<CellRange>& ranges ) const;
+
+	// Stores range i in all cells it covers with count, prefix-sum and scatter passes.
+	// Each thread owns a z-slab of cells, so no synchronization is needed.
+	// With exact insertion, range i belongs to triangle triangleIds[i] (or i if triangleIds is NULL) of geometry.
+	// Returns number of references before exact overlap tests.
+	uint32 insertTriangles( UniformGridAccStruct* grid, const std::vector<CellRange>& ranges, rt::Geometry* geometry, 
+		                    const int32* triangleIds, uint32 threadCount ) const;
+
+	// Calls visitor( cellId ) for each cell of range inside z-layers [z0, z1) that is overlapped by triangle.
+	// Geometry may be NULL, in which case all cells of range are visited.
+	template<class Visitor>
+	void visitCells( UniformGridAccStruct* grid, const CellRange& range, rt::Geometry* geometry, int32 triangleId, 
+		             int32 z0, int32 z1, Visitor& visitor ) const;
+
+	// Splits grid into one z-slab per thread, each holding about the same number of references.
+	// Slab s covers z-layers [slabs[s], slabs[s+1]).
+	void computeSlabs( UniformGridAccStruct* grid, const std::vector<CellRange>& ranges, 
+		               uint32 threadCount, std::vector<int32>& slabs ) const;
+
+	// Counts references of each macro-cell, one macro-cell layer per thread
+	void buildMacroCells( UniformGridAccStruct* grid ) const;
+
+	// Replaces cells above the sub-grid threshold by sub-grids
+	void buildSubGrids( rt::Geometry* geometry, UniformGridAccStruct* grid, float density );
+
+	// Cache: each grid is stored as an info block, its cell arrays and then its sub-grids.
+	// Loaded grids copy the mapped arrays, since grid storage is shared with builders and GPU renderers.
+	uint32 cacheSettings() const;
+	UniformGridAccStruct* loadCachedGrid( const AccStructCache::Key& key );
+	UniformGridAccStruct* readGrid();
+	void saveCachedGrid( const AccStructCache::Key& key, UniformGridAccStruct* grid );
+	void writeGrid( UniformGridAccStruct* grid );
+
+	uint32 _threadCount;
+	GridMode _gridMode;
+	uint32 _subGridThreshold;
+	float _density;
+	bool _exactInsertion;
+	uint32 _macroCellShift;
+	bool _triangleBlocks;
+
+	// Auto-tuning
+	bool _autoTune;
+	uint32 _probeRayCount;
+	float _traversalCost;
+	float _intersectionCost;
+	std::string _tuningCacheFile;
+	TuningCache _tuningCache;
+
+	AccStructCache _cache;
+
+	// Build data
+	std::vector<CellRange> _cellRanges;
+
+	// Statistics, summed over all grid levels
+	uint32 _referenceCount;
+	uint32 _boxReferenceCount;
 };
 
 } // namespace rtp
@@ -0,0 +1,87 @@
+#include <rt/Context.h>
+#include <rt/Geometry.h>
+#include <rt/CpuInfo.h>
+#include <rtp/RayTriBenchmark.h>
+#include <rtdb/FileManager.h>
+#include <rtdb/TriMeshLoader.h>
+#include <rtdb/ObjFileLoader.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Console version of rtview's ray-triangle kernel benchmark (key K), runs without GL window or CUDA.
+// Usage: rtbench [-tests count] [-repeat count] [geometry files]
+// The synthetic triangle set is always benchmarked, followed by each geometry of the given files.
+
+static void printUsage()
+{
+	printf( "usage: rtbench [-tests count] [-repeat count] [geometry files]\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+	rtp::RayTriBenchmark benchmark;
+	std::vector<const char*> files;
+
+	for( int i = 1; i < argc; ++i )
+	{
+		if( ( strcmp( argv[i], "-tests" ) == 0 ) && ( i + 1 < argc ) )
+		{
+			benchmark.setTestCount( atoi( argv[++i] ) );
+		}
+		else if( ( strcmp( argv[i], "-repeat" ) == 0 ) && ( i + 1 < argc ) )
+		{
+			benchmark.setRepeatCount( atoi( argv[++i] ) );
+		}
+		else if( argv[i][0] == '-' )
+		{
+			printUsage();
+			return 1;
+		}
+		else
+		{
+			files.push_back( argv[i] );
+		}
+	}
+
+	// No image loader, textures of .obj files are skipped
+	rtdb::FileManager::instance()->addFileLoader( new rtdb::TriMeshLoader() );
+	rtdb::FileManager::instance()->addFileLoader( new rtdb::ObjFileLoader() );
+
+	RTenum rtCode = rt::Context::createNew();
+	if( rtCode != RT_OK )
+	{
+		printf( "Could not initialize Ray Tracing context.\n" );
+		return 1;
+	}
+
+	rt::Context::makeCurrent( rt::Context::getNumActiveContexts() - 1 );
+	rt::Context* ctx = rt::Context::current();
+
+	printf( "simdLevel: %s\n", rt::CpuInfo::getSimdLevelName( ctx->getSimdLevel() ) );
+
+	// Random triangles
+	vr::ref_ptr<rt::Geometry> synthetic = new rt::Geometry();
+	rtp::RayTriBenchmark::generateTriangles( *synthetic, 100000 );
+	benchmark.runMixes( "synthetic", *synthetic );
+
+	// Triangles of each scene geometry, numbered from 1 like in rtview
+	for( uint32 f = 0; f < files.size(); ++f )
+	{
+		const uint32 firstGeometry = ctx->getGeometryCount();
+		if( !rtdb::FileManager::instance()->loadGeometry( vr::String( files[f] ) ) )
+		{
+			printf( "Could not load geometry file '%s'.\n", files[f] );
+			continue;
+		}
+
+		for( uint32 i = firstGeometry; i < ctx->getGeometryCount(); ++i )
+		{
+			char name[64];
+			sprintf( name, "geometry %d", i + 1 );
+			printf( "\ngeometry %d: %s\n", i + 1, files[f] );
+			benchmark.runMixes( name, *ctx->getGeometry( i ) );
+		}
+	}
+
+	return 0;
+}
@@ -6,8 +6,8 @@ void AabbIntersection::clipTriangle( const vr::vec3f& v0, const vr::vec3f& v1, c
 							         const Aabb& box, Aabb& result )
 {
 	// Sutherland-Hodgman Clipping
-	vr::vec3f vertexBuffer[8];
-	vr::vec3f tempBuffer[8];
+	vr::vec3f vertexBuffer[MAX_CLIP_VERTICES];
+	vr::vec3f tempBuffer[MAX_CLIP_VERTICES];
 
 	vertexBuffer[0] = v0;
 	vertexBuffer[1] = v1;
@@ -185,7 +185,7 @@ bool AabbIntersection::isPointInside( const Aabb& box, const vr::vec3f& point )
 /************************************************************************/
 /* Private                                                              */
 /************************************************************************/
-void AabbIntersection::clip( vr::vec3f vertexBuffer[8], vr::vec3f tempBuffer[8], 
+void AabbIntersection::clip( vr::vec3f vertexBuffer[MAX_CLIP_VERTICES], vr::vec3f tempBuffer[MAX_CLIP_VERTICES], 
 					 		 uint32& vertexCount, float pos, float dir, RTenum dim )
 {
 	bool allin = true;
@@ -3,6 +3,8 @@
 #include <rt/Plugins.h>
 #include <rt/Scene.h>
 #include <rt/Geometry.h>
+#include <rt/CpuInfo.h>
+#include <algorithm>
 
 using namespace rt;
 
@@ -11,6 +13,9 @@ static Context* s_contexts[s_maxActiveContexts] = { NULL };
 static uint32 s_activeContexts = 0;
 static uint32 s_currentContext = 0;
 
+// Ray streams are traced in chunks of this many sorted rays
+static const uint32 STREAM_CHUNK_SIZE = 256;
+
 RTenum Context::createNew()
 {
 	if( s_activeContexts < s_maxActiveContexts )
@@ -100,15 +105,88 @@ void Context::traceNearest( Sample& sample )
 	_scene->accStruct->traceNearestInstance( _scene->instances, sample );
 }
 
+void Context::traceNearestPacket( Sample* samples, uint32 count )
+{
+	if( _simdLevel < RT_SIMD_SSE )
+	{
+		for( uint32 i = 0; i < count; ++i )
+		{
+			traceNearest( samples[i] );
+		}
+		return;
+	}
+
+	_scene->accStruct->traceNearestInstancePacket( _scene->instances, samples, count );
+}
+
 bool Context::traceAny( Sample& sample )
 {
 	return _scene->accStruct->traceAnyInstance( _scene->instances, sample );
 }
 
+void Context::traceNearestStream( const Ray* rays, Hit* hits, uint32 count )
+{
+	std::vector<uint64> order;
+	sortStream( rays, count, order );
+
+	std::vector<Ray> chunkRays( vr::min( count, STREAM_CHUNK_SIZE ) );
+	std::vector<Hit> chunkHits( chunkRays.size() );
+
+	for( uint32 start = 0; start < count; start += STREAM_CHUNK_SIZE )
+	{
+		const uint32 size = vr::min( count - start, STREAM_CHUNK_SIZE );
+
+		// Gather rays in sorted order
+		for( uint32 i = 0; i < size; ++i )
+		{
+			Ray& ray = chunkRays[i];
+			ray = rays[(uint32)order[start+i]];
+			ray.tnear = _rayEpsilon;
+			ray.update();
+
+			chunkHits[i].instance = NULL;
+			chunkHits[i].distance = vr::Mathf::MAX_VALUE;
+		}
+
+		if( _simdLevel < RT_SIMD_SSE )
+		{
+			for( uint32 i = 0; i < size; ++i )
+			{
+				_scene->accStruct->findNearestInstance( _scene->instances, chunkRays[i], chunkHits[i] );
+			}
+		}
+		else
+		{
+			_scene->accStruct->findNearestInstancePacket( _scene->instances, &chunkRays[0], &chunkHits[0], size );
+		}
+
+		// Scatter hits back to the caller's order
+		for( uint32 i = 0; i < size; ++i )
+		{
+			hits[(uint32)order[start+i]] = chunkHits[i];
+		}
+	}
+}
+
+void Context::traceAnyStream( const Ray* rays, bool* blocked, uint32 count )
+{
+	std::vector<uint64> order;
+	sortStream( rays, count, order );
+
+	Sample sample;
+	for( uint32 i = 0; i < count; ++i )
+	{
+		const uint32 id = (uint32)order[i];
+		sample.ray = rays[id];
+		blocked[id] = _scene->accStruct->traceAnyInstance( _scene->instances, sample );
+	}
+}
+
 // Plugins
 void Context::setAccStructBuilder( rt::IAccStructBuilder* accBuilder )
 {
 	_plugins->accStructBuilder = accBuilder;
+	_instancesRebuild = true;
 }
 
 rt::IAccStructBuilder* Context::getAccStructBuilder() const
@@ -287,6 +365,7 @@ void Context::beginPrimitive( RTenum primitiveType )
 		return;
 
 	_primBuilder.begin( primitiveType, _scene->geometries[_currentGeometryId].get() );
+	_primBuilder.setStoreTriAccel( _plugins->accStructBuilder->needsTriAccel() );
 	_primBuilder.setMaterial( _plugins->materials[_currentMaterialId].get() );
 	_primBuilder.getBindings() = _bindingStack.top();
 	_primBuilder.getTransform().setMatrix( _matrixStack.top() );
@@ -346,6 +425,7 @@ uint32 Context::createInstances( uint32 count )
 {
 	uint32 previousSize = _scene->instances.size();
 	_scene->instances.resize( previousSize + count );
+	_instancesRebuild = true;
 	return previousSize;
 }
 
@@ -355,6 +435,8 @@ void Context::instantiateGeometry( uint32 instanceId, uint32 geometryId )
 		return;
 
 	_instancesDirty = true;
+	if( !_instancesRebuild )
+		_changedInstances.push_back( instanceId );
 
 	Instance& instance = _scene->instances[instanceId];
 	Geometry* geometry = _scene->geometries[geometryId].get();
@@ -364,37 +446,63 @@ void Context::instantiateGeometry( uint32 instanceId, uint32 geometryId )
 	instance.transform.setMatrix( _matrixStack.top() );
 
 	// Update instance bounding box according to current matrix and geometry's original bounding box
-	const Aabb& bbox = geometry->accStruct->getBoundingBox();
+	updateInstanceBox( instance );
+}
 
-	// If geometry box is degenerate, we keep it as instance's box as well
-	if( bbox.isDegenerate() )
-	{
-		instance.bbox = bbox;
+void Context::instantiateLastGeometry( uint32 instanceId )
+{
+	if( _scene->geometries.empty() )
 		return;
+
+	instantiateGeometry( instanceId, _scene->geometries.size() - 1 );
+}
+
+void Context::updateGeometryVertices( uint32 geometryId, float const * const vertices, float const * const normals )
+{
+	if( geometryId >= _scene->geometries.size() )
+		return;
+
+	Geometry* geometry = _scene->geometries[geometryId].get();
+	Transform transform;
+	transform.setMatrix( _matrixStack.top() );
+
+	for( uint32 v = 0, limit = geometry->vertices.size(); v < limit; ++v )
+	{
+		vr::vec3f& vertex = geometry->vertices[v];
+		vertex.set( vertices[3*v], vertices[3*v+1], vertices[3*v+2] );
+		transform.transformVertex( vertex );
 	}
-	
-	// Transform geometry's bbox according to instance's matrix transform
-	vr::vec3f boxVertices[8];
-	bbox.computeVertices( boxVertices );
 
-	for( uint32 v = 0; v < 8; ++v )
+	if( normals )
 	{
-		instance.transform.transformVertex( boxVertices[v] );
-		instance.bbox.expandBy( boxVertices[v] );
+		for( uint32 v = 0, limit = geometry->normals.size(); v < limit; ++v )
+		{
+			vr::vec3f& normal = geometry->normals[v];
+			normal.set( normals[3*v], normals[3*v+1], normals[3*v+2] );
+			transform.transformNormal( normal );
+			normal.normalize();
+		}
 	}
 
-	// Avoid precision problems: we extend the box a little
-	// The other option would be to add a similar tolerance to the clipRay method in AabbIntersection.
-	// But since the clipRay method is called several times per ray, we opted to put that tolerance here.
-	instance.bbox.scaleBy( 0.01f );
-}
+	// Triangles keep their ids, those that became degenerate are never hit until they recover
+	if( _plugins->accStructBuilder->needsTriAccel() )
+		geometry->buildTriAccel();
 
-void Context::instantiateLastGeometry( uint32 instanceId )
-{
-	if( _scene->geometries.empty() )
-		return;
+	_plugins->accStructBuilder->updateGeometry( geometry );
 
-	instantiateGeometry( instanceId, _scene->geometries.size() - 1 );
+	// Instances follow the new geometry box
+	for( uint32 i = 0, limit = _scene->instances.size(); i < limit; ++i )
+	{
+		Instance& instance = _scene->instances[i];
+		if( instance.geometry != geometry )
+			continue;
+
+		updateInstanceBox( instance );
+
+		_instancesDirty = true;
+		if( !_instancesRebuild )
+			_changedInstances.push_back( i );
+	}
 }
 
 Geometry* Context::getGeometry( uint32 id ) const
@@ -463,18 +571,79 @@ float Context::getMediumRefractionIndex() const
 	return _mediumRefractionIndex;
 }
 
+void Context::setSimdLevel( RTenum level )
+{
+	// Values below RT_SIMD_NONE, such as 0, are no level at all and mean no SIMD
+	_simdLevel = vr::clampTo( level, (RTenum)RT_SIMD_NONE, CpuInfo::getSimdLevel() );
+}
+
+RTenum Context::getSimdLevel() const
+{
+	return _simdLevel;
+}
+
 void Context::checkAndUpdateInstances()
 {
 	if( _instancesDirty )
 	{
-		_scene->accStruct = _plugins->accStructBuilder->buildInstance( _scene->instances );
+		if( _instancesRebuild )
+		{
+			_scene->accStruct = _plugins->accStructBuilder->buildInstance( _scene->instances );
+		}
+		else
+		{
+			// Only a few instances moved, let builder refit current structure
+			IAccStruct* updated = _plugins->accStructBuilder->updateInstance( _scene->accStruct.get(), _scene->instances, 
+				                                                              _changedInstances );
+			if( updated != _scene->accStruct.get() )
+				_scene->accStruct = updated;
+		}
+
+		_changedInstances.clear();
 		_instancesDirty = false;
+		_instancesRebuild = false;
 	}
 }
 
 /************************************************************************/
 /* Private                                                              */
 /************************************************************************/
+void Context::sortStream( const Ray* rays, uint32 count, std::vector<uint64>& order ) const
+{
+	// Origins are quantized to 9 bits per axis inside the scene box, clamped outside of it
+	const Aabb& bbox = _scene->accStruct->getBoundingBox();
+	float scale[3];
+	for( uint32 axis = 0; axis < 3; ++axis )
+	{
+		const float extent = bbox.maxv[axis] - bbox.minv[axis];
+		scale[axis] = ( extent > 0.0f ) ? 511.0f / extent : 0.0f;
+	}
+
+	vr::vectorExactResize( order, count );
+
+	for( uint32 i = 0; i < count; ++i )
+	{
+		const Ray& ray = rays[i];
+
+		// Key: direction octant in bits 27..29, Morton code of origin in bits 0..26
+		uint32 key = ( vr::signBit( ray.dir.x ) | ( vr::signBit( ray.dir.y ) << 1 ) | ( vr::signBit( ray.dir.z ) << 2 ) ) << 27;
+
+		for( uint32 axis = 0; axis < 3; ++axis )
+		{
+			const float q = ( ray.orig[axis] - bbox.minv[axis] ) * scale[axis];
+			const uint32 cell = (uint32)vr::min( vr::max( q, 0.0f ), 511.0f );
+
+			for( uint32 bit = 0; bit < 9; ++bit )
+				key |= ( ( cell >> bit ) & 1 ) << ( 3 * bit + axis );
+		}
+
+		// Ray id in the low 32 bits, so that sorting keys sorts ids
+		order[i] = ( (uint64)key << 32 ) | i;
+	}
+
+	std::sort( order.begin(), order.end() );
+}
+
 Context::Context()
 {
 	_plugins = new Plugins();
@@ -482,6 +651,7 @@ Context::Context()
 	_scene->accStruct = new IAccStruct();
 
 	_instancesDirty = false;
+	_instancesRebuild = true;
 	_currentMaterialId = 0;
 	_currentGeometryId = 0;
 
@@ -506,6 +676,9 @@ Context::Context()
 
 	// Approximation for air index
 	setMediumRefractionIndex( 1.0f );
+
+	// Widest kernels supported by this CPU
+	_simdLevel = CpuInfo::getSimdLevel();
 }
 
 Context::~Context()
@@ -513,3 +686,31 @@ Context::~Context()
 	delete _plugins;
 	delete _scene;
 }
+
+void Context::updateInstanceBox( Instance& instance )
+{
+	const Aabb& bbox = instance.geometry->accStruct->getBoundingBox();
+	instance.bbox = Aabb();
+
+	// If geometry box is degenerate, we keep it as instance's box as well
+	if( bbox.isDegenerate() )
+	{
+		instance.bbox = bbox;
+		return;
+	}
+	
+	// Transform geometry's bbox according to instance's matrix transform
+	vr::vec3f boxVertices[8];
+	bbox.computeVertices( boxVertices );
+
+	for( uint32 v = 0; v < 8; ++v )
+	{
+		instance.transform.transformVertex( boxVertices[v] );
+		instance.bbox.expandBy( boxVertices[v] );
+	}
+
+	// Avoid precision problems: we extend the box a little
+	// The other option would be to add a similar tolerance to the clipRay method in AabbIntersection.
+	// But since the clipRay method is called several times per ray, we opted to put that tolerance here.
+	instance.bbox.scaleBy( 0.01f );
+}
@@ -0,0 +1,56 @@
+#include <rt/CpuInfo.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+using namespace rt;
+
+// Feature flags of CPUID function 1, EDX register
+static const uint32 CPUID_SSE = 1 << 25;
+static const uint32 CPUID_SSE2 = 1 << 26;
+
+static uint32 featureFlags()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid( regs, 1 );
+	return (uint32)regs[3];
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+		return 0;
+	return edx;
+#endif
+}
+
+bool CpuInfo::hasSse()
+{
+	return ( featureFlags() & CPUID_SSE ) != 0;
+}
+
+bool CpuInfo::hasSse2()
+{
+	return ( featureFlags() & CPUID_SSE2 ) != 0;
+}
+
+RTenum CpuInfo::getSimdLevel()
+{
+	// Kernels only use SSE, wider instruction sets would not be picked even if present
+	return hasSse() ? RT_SIMD_SSE : RT_SIMD_NONE;
+}
+
+const char* CpuInfo::getSimdLevelName( RTenum level )
+{
+	switch( level )
+	{
+	case RT_SIMD_NONE:
+		return "none";
+	case RT_SIMD_SSE:
+		return "SSE";
+	default:
+		return "unknown";
+	}
+}
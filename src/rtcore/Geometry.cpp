@@ -14,3 +14,19 @@ void Geometry::clear()
 	vr::vectorFreeMemory( colors );
 	vr::vectorFreeMemory( texCoords );
 }
+
+void Geometry::buildTriAccel()
+{
+	vr::vectorExactResize( triAccel, triDesc.size() );
+
+	for( uint32 t = 0, limit = triDesc.size(); t < limit; ++t )
+	{
+		TriAccel& accel = triAccel[t];
+		accel.buildFrom( getVertex( t, 0 ), getVertex( t, 1 ), getVertex( t, 2 ) );
+
+		if( !accel.valid() )
+			accel.buildEmpty();
+
+		accel.triangleId = t;
+	}
+}
@@ -39,12 +39,19 @@ void IAccStruct::traceNearestInstance( const std::vector<rt::Instance>& instance
 	hit.instance = NULL;
 	hit.distance = vr::Mathf::MAX_VALUE;
 
+	findNearestInstance( instances, ray, hit );
+
+	if( hit.instance )
+		hit.instance->geometry->triDesc[hit.triangleId].material->shade( sample );
+	else
+		ctx->getEnvironment()->shade( sample );
+}
+
+void IAccStruct::findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit )
+{
 	// If not hit bbox of entire scene, no need to trace any further
 	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
-	{
-		ctx->getEnvironment()->shade( sample );
 		return;
-	}
 
 	// Save original ray to restore after instance matrix transformations
 	const rt::Ray originalRay( ray );
@@ -64,11 +71,6 @@ void IAccStruct::traceNearestInstance( const std::vector<rt::Instance>& instance
 		// Transform ray back to global space
 		ray = originalRay;
 	}
-
-	if( hit.instance )
-		hit.instance->geometry->triDesc[hit.triangleId].material->shade( sample );
-	else
-		ctx->getEnvironment()->shade( sample );
 }
 
 void IAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
@@ -82,20 +84,32 @@ void IAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ra
 	// Best distance considers any previously found hits to prevent false hits in this geometry
 	float bestDistance = hit.distance;
 
-	for( uint32 t = 0, limit = geometry.triAccel.size(); t < limit; ++t )
+	if( geometry.hasTriAccel() )
+	{
+		for( uint32 t = 0, limit = geometry.triAccel.size(); t < limit; ++t )
+		{
+			// Alternative kernels, see rtp::RayTriBenchmark for their speed and agreement with hitWald
+			rt::RayTriIntersection::hitWald( geometry.triAccel[t], ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT1( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT2( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT3( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT4( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT5( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT6( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitMT7( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitTest( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitChirkov( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitHalfSpace( geometry, t, ray, hit, bestDistance );
+			//rt::RayTriIntersection::hitSignedVolume( geometry, t, ray, hit, bestDistance );
+		}
+	}
+	else
 	{
-		rt::RayTriIntersection::hitWald( geometry.triAccel[t], ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT1( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT2( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT3( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT4( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT5( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT6( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitMT7( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitTest( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitChirkov( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitHalfSpace( geometry, t, ray, hit, bestDistance );
-		//rt::RayTriIntersection::hitSignedVolume( geometry, t, ray, hit, bestDistance );
+		// Without TriAccel's, triangles are tested from their vertices
+		for( uint32 t = 0, limit = geometry.triDesc.size(); t < limit; ++t )
+		{
+			rt::RayTriIntersection::hitMT1( geometry, t, ray, hit, bestDistance );
+		}
 	}
 
 	if( bestDistance < hit.distance )
@@ -107,16 +121,90 @@ void IAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ra
 
 bool IAccStruct::traceAnyInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample )
 {
-	// TODO: 
-	// avoid warnings
-	sample;
+	rt::Ray& ray = sample.ray;
+
+	// Init ray, keeping tfar of the shadow ray
+	ray.tnear = rt::Context::current()->getRayEpsilon();
+	ray.update();
+
+	// If not hit bbox of entire scene, nothing can block the ray
+	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	for( uint32 i = 0, limit = instances.size(); i < limit; ++i )
+	{
+		const rt::Instance& instance = instances[i];
+
+		// Transform a copy of ray to geometry's local space
+		rt::Ray localRay( ray );
+		instance.transform.inverseTransform( localRay );
+		localRay.update();
+
+		if( instance.geometry->accStruct->traceAnyGeometry( instance, localRay, sample.hit ) )
+			return true;
+	}
+
 	return false;
 }
 
 bool IAccStruct::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
 {
-	// TODO: 
-	// avoid warnings
-	instance;ray;hit;
+	// Hit is only needed by nearest hit traversals
+	hit;
+
+	// If don't hit bbox in local space, no need to trace underlying triangles
+	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	const rt::Geometry& geometry = *instance.geometry;
+
+	// Without TriAccel's, triangles are tested from their vertices
+	if( !geometry.hasTriAccel() )
+	{
+		rt::Hit anyHit;
+		for( uint32 t = 0, limit = geometry.triDesc.size(); t < limit; ++t )
+		{
+			float distance = vr::Mathf::MAX_VALUE;
+			rt::RayTriIntersection::hitMT1( geometry, t, ray, anyHit, distance );
+			if( distance < vr::Mathf::MAX_VALUE )
+				return true;
+		}
+
+		return false;
+	}
+
+	const std::vector<rt::TriAccel>& triangles = geometry.triAccel;
+
+	for( uint32 t = 0, limit = triangles.size(); t < limit; ++t )
+	{
+		if( rt::RayTriIntersection::hitAnyWald( triangles[t], ray ) )
+			return true;
+	}
+
 	return false;
 }
+
+void IAccStruct::traceNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Sample* samples, uint32 count )
+{
+	for( uint32 i = 0; i < count; ++i )
+	{
+		traceNearestInstance( instances, samples[i] );
+	}
+}
+
+void IAccStruct::traceNearestGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count )
+{
+	for( uint32 i = 0; i < count; ++i )
+	{
+		traceNearestGeometry( instance, rays[i], hits[i] );
+	}
+}
+
+void IAccStruct::findNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Ray* rays, rt::Hit* hits, 
+										    uint32 count )
+{
+	for( uint32 i = 0; i < count; ++i )
+	{
+		findNearestInstance( instances, rays[i], hits[i] );
+	}
+}
@@ -13,6 +13,11 @@ void IAccStructBuilder::buildGeometry( rt::Geometry* geometry )
 	geometry->accStruct->setBoundingBox( bbox );
 }
 
+void IAccStructBuilder::updateGeometry( rt::Geometry* geometry )
+{
+	buildGeometry( geometry );
+}
+
 IAccStruct* IAccStructBuilder::buildInstance( const std::vector<rt::Instance> instances )
 {
 	// Default degenerate box
@@ -31,3 +36,14 @@ IAccStruct* IAccStructBuilder::buildInstance( const std::vector<rt::Instance> in
 
 	return st;
 }
+
+IAccStruct* IAccStructBuilder::updateInstance( IAccStruct* accStruct, const std::vector<rt::Instance>& instances, 
+											   const std::vector<uint32>& changedIds )
+{
+	return buildInstance( instances );
+}
+
+bool IAccStructBuilder::needsTriAccel() const
+{
+	return true;
+}
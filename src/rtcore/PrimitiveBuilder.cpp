@@ -8,6 +8,7 @@ PrimitiveBuilder::PrimitiveBuilder()
 	_geometry = NULL;
 	_material = NULL;
 	_startVertex = 0;
+	_storeTriAccel = true;
 	_bindings.reset();
 
 	_currentColor.set( 1.0f, 1.0f, 1.0f );
@@ -22,6 +23,11 @@ void PrimitiveBuilder::begin( RTenum primitiveType, Geometry* geometry )
 	_startVertex = _geometry->vertices.size();
 }
 
+void PrimitiveBuilder::setStoreTriAccel( bool enabled )
+{
+	_storeTriAccel = enabled;
+}
+
 void PrimitiveBuilder::setMaterial( rt::IMaterial* material )
 {
 	_material = material;
@@ -124,7 +130,9 @@ void PrimitiveBuilder::storeValidTriangle( const TriDesc& triangle, TriAccel& ac
 
 	accel.triangleId = _geometry->triDesc.size();
 	_geometry->triDesc.push_back( triangle );
-	_geometry->triAccel.push_back( accel );
+
+	if( _storeTriAccel )
+		_geometry->triAccel.push_back( accel );
 }
 
 void PrimitiveBuilder::updateTriangles()
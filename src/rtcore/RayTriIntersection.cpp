@@ -3,50 +3,9 @@
 
 using namespace rt;
 
-static const float HIT_EPSILON = 1e-4f;
+const float RayTriIntersection::HIT_EPSILON = 1e-4f;
 uint32 RayTriIntersection::s_modulo[8] = { 0, 1, 2, 0, 1, 2, 0, 1 };
 
-#define KU s_modulo[acc.k+1]
-#define KV s_modulo[acc.k+2]
-
-void RayTriIntersection::hitWald( const rt::TriAccel& acc, const rt::Ray& ray, rt::Hit& hit, float& bestDistance )
-{
-	// Start high-latency division as early as possible
-	const float nd = 1.0f / ( ray.dir[acc.k] + acc.n_u * ray.dir[KU] + acc.n_v * ray.dir[KV] );
-	const float f = nd * ( acc.n_d - ray.orig[acc.k] - acc.n_u * ray.orig[KU] - acc.n_v * ray.orig[KV] );
-
-	// Check for valid distance
-	// TODO: find a correct way to get rid of these epsilons and check scene06 for any errors
-	if( ( f >= bestDistance ) || ( f < ray.tnear - HIT_EPSILON ) || ( f > ray.tfar + HIT_EPSILON ) )
-		return;
-
-	// Compute hit point positions on uv plane
-	const float hu = ray.orig[KU] + f * ray.dir[KU];
-	const float hv = ray.orig[KV] + f * ray.dir[KV];
-
-	// Check first barycentric coordinate
-	const float lambda = hu * acc.b_nu + hv * acc.b_nv + acc.b_d;
-	if( lambda < 0.0f )
-		return;
-
-	// Check second barycentric coordinate
-	const float mue = hu * acc.c_nu + hv * acc.c_nv + acc.c_d;
-	if( mue < 0.0f )
-		return;
-
-	// Check third barycentric coordinate
-	const float psi = 1.0f - lambda - mue;
-	if( psi < 0.0f )
-		return;
-
-	// Have a valid hit point here. Store it.
-	bestDistance = f;
-	hit.triangleId = acc.triangleId;
-	hit.v0Coord = psi;
-	hit.v1Coord = lambda;
-	hit.v2Coord = mue;
-}
-
 void RayTriIntersection::hitMT1( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, 
 							    float& bestDistance )
 {
@@ -743,6 +702,3 @@ void RayTriIntersection::hitSignedVolume( const rt::Geometry& geom, uint32 triId
 	hit.v1Coord = 1.0f;
 	hit.v2Coord = 1.0f;
 }
-
-#undef KU
-#undef KV
@@ -54,6 +54,24 @@ void TriAccel::buildFrom( const vr::vec3f& v0, const vr::vec3f& v1, const vr::ve
 	c_d  = ( c[u]*v0[v] - c[v]*v0[u] ) * invDenom;
 }
 
+void TriAccel::buildEmpty()
+{
+	// Plane lies at infinity, so hit distances are always out of range
+	k = RT_AXIS_X;
+	n_u = 0.0f;
+	n_v = 0.0f;
+	n_d = -vr::Mathf::MAX_VALUE;
+
+	// First barycentric coordinate is always negative
+	b_nu = 0.0f;
+	b_nv = 0.0f;
+	b_d = -1.0f;
+
+	c_nu = 0.0f;
+	c_nv = 0.0f;
+	c_d = 0.0f;
+}
+
 bool TriAccel::valid() const
 {
 	// Check for INFs and NaNs
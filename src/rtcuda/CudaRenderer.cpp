@@ -152,6 +152,9 @@ void CudaRenderer::initialize()
 	// Store acceleration structure
 	const rtp::UniformGridAccStruct* grid = dynamic_cast<const rtp::UniformGridAccStruct*>( geometry.accStruct.get() );
 
+	// GPU traversal only handles single-level grids
+	assert( grid->getSubGrids().empty() );
+
 	int32 nx;
 	int32 ny;
 	int32 nz;
@@ -160,39 +163,29 @@ void CudaRenderer::initialize()
 	//////////////////////////////////////////////////////////////////////////
 	// Buffer 3: grid cell pointers (point to Buffer 4)
 	//////////////////////////////////////////////////////////////////////////
-	std::vector<int32> cellPointers( nx * ny * nz * 2 );
+	const std::vector<uint32>& cellOffsets = grid->getCellOffsets();
+	const uint32 cellCount = nx * ny * nz;
+	std::vector<int32> cellPointers( cellCount * 2 );
+
+	for( uint32 c = 0; c < cellCount; ++c )
+	{
+		// Store start position of triangle ids
+		cellPointers[c*2] = cellOffsets[c];
+
+		// Set element count
+		cellPointers[c*2+1] = cellOffsets[c+1] - cellOffsets[c];
+	}
 
 	//////////////////////////////////////////////////////////////////////////
 	// Buffer 4: grid cell triangle ids (point to Buffer 1)
 	//////////////////////////////////////////////////////////////////////////
-	std::vector<int32> cellTriangleIds;
-
-	uint32 currentPos = 0;
+	const std::vector<int32>& gridTriangleIds = grid->getCellTriangleIds();
+	std::vector<int32> cellTriangleIds( gridTriangleIds.size() );
 
-	for( int32 z = 0; z < nz; ++z )
+	for( uint32 i = 0, limit = gridTriangleIds.size(); i < limit; ++i )
 	{
-		for( int32 y = 0; y < ny; ++y )
-		{
-			for( int32 x = 0; x < nx; ++x )
-			{
-				const rtp::UniformGridAccStruct::Cell& cell = grid->at( x, y, z );
-
-				// Store start position of triangle ids
-				cellPointers[currentPos] = cellTriangleIds.size();
-
-				// Set element count
-				cellPointers[currentPos+1] = cell.size();
-
-				// Append this cell's triangle ids to texture
-				for( uint32 i = 0, limit = cell.size(); i < limit; ++i )
-				{
-					// Since we have expanded the vertices and normals, triangle i is at position i*3
-					cellTriangleIds.push_back( cell[i] * 3 );
-				}
-
-				currentPos+=2;
-			}
-		}
+		// Since we have expanded the vertices and normals, triangle i is at position i*3
+		cellTriangleIds[i] = gridTriangleIds[i] * 3;
 	}
 
 	cudaTransferCellPointers( &cellPointers[0], cellPointers.size() );
@@ -40,6 +40,11 @@ void GpuRenderer::setAnimationEnabled( bool enabled )
 	_animationEnabled = enabled;
 }
 
+bool GpuRenderer::isAnimationEnabled() const
+{
+	return _animationEnabled;
+}
+
 void GpuRenderer::newFrame()
 {
 	rt::ICamera* cam = rt::Context::current()->getCamera();
@@ -0,0 +1,281 @@
+#include <rtp/AccStructBenchmark.h>
+#include <vr/random.h>
+#include <vr/timer.h>
+
+using namespace rtp;
+
+// Relative tolerance when comparing hit distances against the reference
+static const float DISTANCE_TOLERANCE = 1e-4f;
+
+AccStructBenchmark::AccStructBenchmark()
+: _rayCount( 1000000 ), _packetSize( 1 ), _anyHit( false ), _referenceAnyHit( false )
+{
+	// empty
+}
+
+void AccStructBenchmark::setRayCount( uint32 count )
+{
+	_rayCount = count;
+}
+
+uint32 AccStructBenchmark::getRayCount() const
+{
+	return _rayCount;
+}
+
+void AccStructBenchmark::generateRays( const rt::Aabb& bbox )
+{
+	_rays.resize( _rayCount );
+	vr::vectorFreeMemory( _reference );
+
+	const vr::vec3f center = ( bbox.minv + bbox.maxv ) * 0.5f;
+	const float radius = ( bbox.maxv - bbox.minv ).length();
+
+	for( uint32 i = 0; i < _rayCount; ++i )
+	{
+		rt::Ray& ray = _rays[i];
+
+		// Origin on a sphere enclosing the box
+		vr::vec3f dir( vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ) );
+		if( dir.normalize() == 0.0f )
+			dir = vr::vec3f( 0.0f, 0.0f, 1.0f );
+
+		ray.orig = center + dir * radius;
+
+		vr::vec3f target( vr::Random::real( bbox.minv.x, bbox.maxv.x ),
+			              vr::Random::real( bbox.minv.y, bbox.maxv.y ),
+						  vr::Random::real( bbox.minv.z, bbox.maxv.z ) );
+
+		ray.dir = target - ray.orig;
+		ray.dir.normalize();
+		ray.tnear = 0.0f;
+		ray.tfar = vr::Mathf::MAX_VALUE;
+		ray.update();
+	}
+}
+
+void AccStructBenchmark::generatePrimaryRays( const rt::Aabb& bbox )
+{
+	const uint32 size = vr::max( (uint32)sqrtf( (float)_rayCount ) & ~3u, 4u );
+	_rays.resize( size * size );
+	vr::vectorFreeMemory( _reference );
+
+	const vr::vec3f center = ( bbox.minv + bbox.maxv ) * 0.5f;
+	const float radius = ( bbox.maxv - bbox.minv ).length();
+
+	// Oblique view of the box center, from twice the distance that contains the whole box
+	vr::vec3f forward( -0.6f, -0.5f, -0.8f );
+	forward.normalize();
+	vr::vec3f right = forward.cross( vr::vec3f( 0.0f, 1.0f, 0.0f ) );
+	right.normalize();
+	const vr::vec3f up = right.cross( forward );
+	const vr::vec3f eye = center - forward * radius;
+
+	uint32 i = 0;
+	for( uint32 by = 0; by < size; by += 4 )
+	{
+		for( uint32 bx = 0; bx < size; bx += 4 )
+		{
+			for( uint32 y = by; y < by + 4; ++y )
+			{
+				for( uint32 x = bx; x < bx + 4; ++x )
+				{
+					const float u = ( ( x + 0.5f ) / size - 0.5f );
+					const float v = ( ( y + 0.5f ) / size - 0.5f );
+
+					rt::Ray& ray = _rays[i++];
+					ray.orig = eye;
+					ray.dir = forward + right * u + up * v;
+					ray.dir.normalize();
+					ray.tnear = 0.0f;
+					ray.tfar = vr::Mathf::MAX_VALUE;
+					ray.update();
+				}
+			}
+		}
+	}
+}
+
+void AccStructBenchmark::generateSecondaryRays( const rt::Aabb& bbox )
+{
+	_rays.resize( _rayCount );
+	vr::vectorFreeMemory( _reference );
+
+	for( uint32 i = 0; i < _rayCount; ++i )
+	{
+		rt::Ray& ray = _rays[i];
+
+		ray.orig = vr::vec3f( vr::Random::real( bbox.minv.x, bbox.maxv.x ),
+			                  vr::Random::real( bbox.minv.y, bbox.maxv.y ),
+							  vr::Random::real( bbox.minv.z, bbox.maxv.z ) );
+
+		ray.dir = vr::vec3f( vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ) );
+		if( ray.dir.normalize() == 0.0f )
+			ray.dir = vr::vec3f( 0.0f, 0.0f, 1.0f );
+
+		ray.tnear = 0.0f;
+		ray.tfar = vr::Mathf::MAX_VALUE;
+		ray.update();
+	}
+}
+
+void AccStructBenchmark::generateShadowRays( const rt::Aabb& bbox )
+{
+	_rays.resize( _rayCount );
+	vr::vectorFreeMemory( _reference );
+
+	for( uint32 i = 0; i < _rayCount; ++i )
+	{
+		rt::Ray& ray = _rays[i];
+
+		ray.orig = vr::vec3f( vr::Random::real( bbox.minv.x, bbox.maxv.x ),
+			                  vr::Random::real( bbox.minv.y, bbox.maxv.y ),
+							  vr::Random::real( bbox.minv.z, bbox.maxv.z ) );
+
+		vr::vec3f light( vr::Random::real( bbox.minv.x, bbox.maxv.x ),
+			             vr::Random::real( bbox.minv.y, bbox.maxv.y ),
+						 vr::Random::real( bbox.minv.z, bbox.maxv.z ) );
+
+		// Direction is not normalized, so that the light lies at t = 1
+		ray.dir = light - ray.orig;
+		ray.tnear = 0.0f;
+		ray.tfar = 1.0f;
+		ray.update();
+	}
+}
+
+void AccStructBenchmark::setAnyHit( bool enabled )
+{
+	_anyHit = enabled;
+}
+
+bool AccStructBenchmark::getAnyHit() const
+{
+	return _anyHit;
+}
+
+void AccStructBenchmark::setPacketSize( uint32 size )
+{
+	_packetSize = vr::max( size, 1u );
+}
+
+uint32 AccStructBenchmark::getPacketSize() const
+{
+	return _packetSize;
+}
+
+void AccStructBenchmark::run( const char* name, rt::Geometry* geometry, rt::IAccStructBuilder* builder )
+{
+	vr::ref_ptr<rt::IAccStruct> previous = geometry->accStruct;
+
+	// A previous compact structure may have released the TriAccel's
+	if( builder->needsTriAccel() && !geometry->hasTriAccel() )
+		geometry->buildTriAccel();
+
+	vr::Timer timer;
+	timer.restart();
+	builder->buildGeometry( geometry );
+	const double buildTime = timer.elapsed();
+
+	rt::Instance instance;
+	instance.geometry = geometry;
+
+	std::vector<rt::Hit> hits( _rays.size() );
+
+	std::vector<rt::Ray> packet( _packetSize );
+
+	timer.restart();
+	if( _anyHit )
+	{
+		for( uint32 i = 0, limit = _rays.size(); i < limit; ++i )
+		{
+			rt::Ray ray = _rays[i];
+			rt::Hit& hit = hits[i];
+			hit.instance = NULL;
+			hit.distance = vr::Mathf::MAX_VALUE;
+
+			if( geometry->accStruct->traceAnyGeometry( instance, ray, hit ) )
+				hit.instance = &instance;
+		}
+	}
+	else if( _packetSize > 1 )
+	{
+		for( uint32 i = 0, limit = _rays.size(); i < limit; i += _packetSize )
+		{
+			const uint32 count = vr::min( limit - i, _packetSize );
+			for( uint32 j = 0; j < count; ++j )
+			{
+				packet[j] = _rays[i + j];
+				hits[i + j].instance = NULL;
+				hits[i + j].distance = vr::Mathf::MAX_VALUE;
+			}
+
+			geometry->accStruct->traceNearestGeometryPacket( instance, &packet[0], &hits[i], count );
+		}
+	}
+	else
+	{
+		for( uint32 i = 0, limit = _rays.size(); i < limit; ++i )
+		{
+			rt::Ray ray = _rays[i];
+			rt::Hit& hit = hits[i];
+			hit.instance = NULL;
+			hit.distance = vr::Mathf::MAX_VALUE;
+
+			geometry->accStruct->traceNearestGeometry( instance, ray, hit );
+		}
+	}
+	const double traceTime = timer.elapsed();
+
+	geometry->accStruct = previous;
+
+	uint32 hitCount = 0;
+	uint32 mismatchCount = 0;
+
+	// Any hit runs have no distances to compare
+	const bool compareDistances = !_anyHit && !_referenceAnyHit;
+
+	for( uint32 i = 0, limit = hits.size(); i < limit; ++i )
+	{
+		if( !hits[i].instance )
+			continue;
+
+		++hitCount;
+
+		if( _reference.empty() )
+			continue;
+
+		const rt::Hit& ref = _reference[i];
+		if( !ref.instance || ( compareDistances &&
+			( vr::abs( ref.distance - hits[i].distance ) > DISTANCE_TOLERANCE * vr::max( ref.distance, 1.0f ) ) ) )
+		{
+			++mismatchCount;
+		}
+	}
+
+	// Count rays only hit by the reference
+	for( uint32 i = 0, limit = _reference.size(); i < limit; ++i )
+	{
+		if( _reference[i].instance && !hits[i].instance )
+			++mismatchCount;
+	}
+
+	printf( "\n***** Benchmark: %s *****\n", name );
+	printf( "buildTime: %.6f secs\n", buildTime );
+	printf( "traceTime: %.6f secs (%.3f Mrays/s)\n", traceTime,
+		    ( traceTime > 0.0 ) ? _rays.size() / traceTime * 1e-6 : 0.0 );
+	printf( "hits: %d of %d rays\n", hitCount, _rays.size() );
+
+	if( _reference.empty() )
+	{
+		_reference.swap( hits );
+		_referenceAnyHit = _anyHit;
+	}
+	else
+		printf( "mismatches: %d\n", mismatchCount );
+}
+
+void AccStructBenchmark::resetReference()
+{
+	vr::vectorFreeMemory( _reference );
+}
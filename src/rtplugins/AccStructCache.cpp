@@ -0,0 +1,272 @@
+#include <rtp/AccStructCache.h>
+#include <string.h>
+
+using namespace rtp;
+
+// "RTAC" read as a little-endian integer, also rejects files written with another byte order
+static const uint32 MAGIC = 0x43415452;
+
+// Blocks start on cache line boundaries, mappings start on page boundaries
+static const uint32 BLOCK_ALIGNMENT = 64;
+
+struct AccStructCache::Header
+{
+	uint32 magic;
+	uint32 version;
+	AccStructCache::Key key;
+	uint32 fileSize;
+};
+
+static bool sameBox( const rt::Aabb& a, const rt::Aabb& b )
+{
+	return ( a.minv.x == b.minv.x ) && ( a.minv.y == b.minv.y ) && ( a.minv.z == b.minv.z ) &&
+		   ( a.maxv.x == b.maxv.x ) && ( a.maxv.y == b.maxv.y ) && ( a.maxv.z == b.maxv.z );
+}
+
+// Each block is preceded by its size, data starts at the next aligned offset
+static uint32 alignOffset( uint32 offset )
+{
+	return ( offset + BLOCK_ALIGNMENT - 1 ) & ~( BLOCK_ALIGNMENT - 1 );
+}
+
+AccStructCache::AccStructCache()
+: _readOffset( 0 ), _file( NULL ), _writeOffset( 0 ), _writeFailed( false )
+{
+	// empty
+}
+
+AccStructCache::~AccStructCache()
+{
+	// Save was never completed, do not leave the temporary file behind
+	if( _file != NULL )
+	{
+		fclose( _file );
+		remove( ( _saveFilename + ".tmp" ).c_str() );
+	}
+}
+
+void AccStructCache::setDirectory( const std::string& directory )
+{
+	_directory = directory;
+}
+
+const std::string& AccStructCache::getDirectory() const
+{
+	return _directory;
+}
+
+bool AccStructCache::isEnabled() const
+{
+	return !_directory.empty();
+}
+
+AccStructCache::Key AccStructCache::makeKey( const rt::Geometry* geometry, Type type, uint32 settings ) const
+{
+	Key key;
+	key.type = type;
+	key.settings = settings;
+	key.triangleCount = geometry->triDesc.size();
+	key.geometryHash = hashGeometry( geometry );
+
+	for( uint32 t = 0; t < key.triangleCount; ++t )
+	{
+		for( uint32 v = 0; v < 3; ++v )
+			key.geometryBox.expandBy( geometry->getVertex( t, v ) );
+	}
+
+	return key;
+}
+
+uint64 AccStructCache::hashGeometry( const rt::Geometry* geometry )
+{
+	uint64 hash = 14695981039346656037ULL;
+
+	for( uint32 t = 0, limit = geometry->triDesc.size(); t < limit; ++t )
+	{
+		for( uint32 v = 0; v < 3; ++v )
+		{
+			const unsigned char* bytes = reinterpret_cast<const unsigned char*>( &geometry->getVertex( t, v ).x );
+
+			for( uint32 i = 0; i < 3 * sizeof( float ); ++i )
+			{
+				hash ^= bytes[i];
+				hash *= 1099511628211ULL;
+			}
+		}
+	}
+
+	return hash;
+}
+
+uint32 AccStructCache::hashData( const void* data, uint32 size, uint32 hash )
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>( data );
+
+	for( uint32 i = 0; i < size; ++i )
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+bool AccStructCache::load( const Key& key )
+{
+	endLoad();
+
+	if( !isEnabled() )
+		return false;
+
+	_mappedFile = MappedFile::open( filename( key ) );
+	if( _mappedFile == NULL )
+		return false;
+
+	// Any mismatch means the file was written by another version, for other settings or other geometry
+	const Header* header = reinterpret_cast<const Header*>( _mappedFile->data() );
+	if( ( _mappedFile->size() < sizeof( Header ) ) ||
+		( header->magic != MAGIC ) ||
+		( header->version != VERSION ) ||
+		( header->key.type != key.type ) ||
+		( header->key.settings != key.settings ) ||
+		( header->key.triangleCount != key.triangleCount ) ||
+		( header->key.geometryHash != key.geometryHash ) ||
+		!sameBox( header->key.geometryBox, key.geometryBox ) ||
+		( header->fileSize != _mappedFile->size() ) )
+	{
+		printf( "Stale acceleration structure cache: %s\n", filename( key ).c_str() );
+		endLoad();
+		return false;
+	}
+
+	_readOffset = sizeof( Header );
+	return true;
+}
+
+const void* AccStructCache::readBlock( uint32 size )
+{
+	if( _mappedFile == NULL )
+		return NULL;
+
+	const uint32 fileSize = _mappedFile->size();
+	if( _readOffset + sizeof( uint32 ) > fileSize )
+		return NULL;
+
+	const uint32 blockSize = *reinterpret_cast<const uint32*>( _mappedFile->data() + _readOffset );
+	const uint32 dataOffset = alignOffset( _readOffset + sizeof( uint32 ) );
+	if( ( blockSize != size ) || ( dataOffset > fileSize ) || ( size > fileSize - dataOffset ) )
+		return NULL;
+
+	_readOffset = dataOffset + size;
+	return _mappedFile->data() + dataOffset;
+}
+
+MappedFile* AccStructCache::getMappedFile() const
+{
+	return _mappedFile.get();
+}
+
+void AccStructCache::endLoad()
+{
+	_mappedFile = NULL;
+	_readOffset = 0;
+}
+
+bool AccStructCache::beginSave( const Key& key )
+{
+	if( !isEnabled() )
+		return false;
+
+	_saveFilename = filename( key );
+	_saveKey = key;
+	_writeFailed = false;
+
+	_file = fopen( ( _saveFilename + ".tmp" ).c_str(), "wb" );
+	if( !_file )
+	{
+		printf( "Could not write acceleration structure cache: %s\n", _saveFilename.c_str() );
+		return false;
+	}
+
+	// Header is completed in endSave
+	Header header;
+	memset( &header, 0, sizeof( Header ) );
+	_writeFailed = ( fwrite( &header, sizeof( Header ), 1, _file ) != 1 );
+	_writeOffset = sizeof( Header );
+
+	return !_writeFailed;
+}
+
+void AccStructCache::writeBlock( const void* data, uint32 size )
+{
+	if( !_file || _writeFailed )
+		return;
+
+	const char padding[BLOCK_ALIGNMENT] = { 0 };
+	const uint32 dataOffset = alignOffset( _writeOffset + sizeof( uint32 ) );
+	const uint32 paddingSize = dataOffset - _writeOffset - sizeof( uint32 );
+
+	if( ( fwrite( &size, sizeof( uint32 ), 1, _file ) != 1 ) ||
+		( fwrite( padding, 1, paddingSize, _file ) != paddingSize ) ||
+		( fwrite( data, 1, size, _file ) != size ) )
+	{
+		_writeFailed = true;
+	}
+
+	_writeOffset = dataOffset + size;
+}
+
+bool AccStructCache::endSave()
+{
+	if( !_file )
+		return false;
+
+	Header header;
+	header.magic = MAGIC;
+	header.version = VERSION;
+	header.key = _saveKey;
+	header.fileSize = _writeOffset;
+
+	if( !_writeFailed )
+	{
+		_writeFailed = ( fseek( _file, 0, SEEK_SET ) != 0 ) ||
+			           ( fwrite( &header, sizeof( Header ), 1, _file ) != 1 );
+	}
+
+	_writeFailed |= ( fclose( _file ) != 0 );
+	_file = NULL;
+
+	const std::string tmpFilename = _saveFilename + ".tmp";
+
+	// Rename does not replace existing files on all platforms
+	if( !_writeFailed )
+	{
+		remove( _saveFilename.c_str() );
+		_writeFailed = ( rename( tmpFilename.c_str(), _saveFilename.c_str() ) != 0 );
+	}
+
+	if( _writeFailed )
+	{
+		remove( tmpFilename.c_str() );
+		printf( "Could not write acceleration structure cache: %s\n", _saveFilename.c_str() );
+		return false;
+	}
+
+	return true;
+}
+
+std::string AccStructCache::filename( const Key& key ) const
+{
+	static const char* const EXTENSIONS[] = { "", "kdtree", "grid" };
+
+	char name[64];
+	sprintf( name, "%08x%08x-%u-%08x.%s", (uint32)( key.geometryHash >> 32 ), (uint32)key.geometryHash, 
+		     key.triangleCount, key.settings,
+		     ( key.type <= UNIFORM_GRID ) ? EXTENSIONS[key.type] : "bin" );
+
+	const char last = _directory[_directory.size() - 1];
+	if( ( last == '/' ) || ( last == '\\' ) )
+		return _directory + name;
+
+	return _directory + "/" + name;
+}
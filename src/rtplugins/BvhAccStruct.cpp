@@ -0,0 +1,282 @@
+#include <rtp/BvhAccStruct.h>
+#include <rt/Context.h>
+#include <rt/AabbIntersection.h>
+#include <rt/RayTriIntersection.h>
+
+using namespace rtp;
+
+void BvhNode::setInternalNode( const rt::Aabb& box, uint32 axis, uint32 rightChild )
+{
+	bbox = box;
+
+	// Store split axis, reset leaf flag
+	_data = ( axis & 0x3 );
+
+	// Left child is the next node
+	_offset = rightChild;
+}
+
+void BvhNode::setLeafNode( const rt::Aabb& box, uint32 elementStart, uint32 elementCount )
+{
+	bbox = box;
+
+	// Store start of elements
+	_offset = elementStart;
+
+	// Store number of elements
+	_data = elementCount;
+
+	// Set leaf flag
+	_data |= 0x80000000;
+}
+
+// Static and thread-safe traversal stacks
+__declspec(thread) static BvhAccStruct::TraversalStack s_instanceStack;
+__declspec(thread) static BvhAccStruct::TraversalStack s_geometryStack;
+
+BvhAccStruct::BvhAccStruct()
+: buildCost( 0.0f ), nodeCostSum( 0.0 )
+{
+	// empty
+}
+
+void BvhAccStruct::clear()
+{
+	vr::vectorFreeMemory( nodes );
+	vr::vectorFreeMemory( elements );
+	vr::vectorFreeMemory( quantizedTriangles );
+	vr::vectorFreeMemory( parents );
+	vr::vectorFreeMemory( elementLeaves );
+	vr::vectorFreeMemory( refitMarks );
+	buildCost = 0.0f;
+	nodeCostSum = 0.0;
+}
+
+void BvhAccStruct::findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit )
+{
+	// If not hit bbox of entire scene, no need to trace any further
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	const rt::Ray originalRay( ray );
+	s_instanceStack.clear();
+	s_instanceStack.push();
+	s_instanceStack.top() = 0;
+
+	while( !s_instanceStack.empty() )
+	{
+		const uint32 nodeId = s_instanceStack.top();
+		const BvhNode& node = nodes[nodeId];
+		s_instanceStack.pop();
+
+		// Skip nodes that are missed or lie beyond closest hit found so far
+		if( !hitBox( node.bbox, originalRay, vr::min( originalRay.tfar, hit.distance ) ) )
+			continue;
+
+		if( node.isLeaf() )
+		{
+			for( uint32 i = node.elemStart(), limit = i + node.elemCount(); i < limit; ++i )
+			{
+				const rt::Instance& instance = instances[elements[i]];
+
+				// Transform ray to geometry's local space
+				instance.transform.inverseTransform( ray );
+				ray.update();
+
+				// Ask geometry's acceleration structure to trace the transformed ray
+				instance.geometry->accStruct->traceNearestGeometry( instance, ray, hit );
+
+				// Transform ray back to global space
+				ray = originalRay;
+			}
+			continue;
+		}
+
+		// Visit front child first: push back child, then front child
+		const uint32 left = nodeId + 1;
+		const uint32 right = node.rightChild();
+		const uint32 bit = originalRay.dirSignBits[node.axis()];
+
+		s_instanceStack.push();
+		s_instanceStack.top() = bit ? left : right;
+		s_instanceStack.push();
+		s_instanceStack.top() = bit ? right : left;
+	}
+}
+
+void BvhAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	traceNearest<WaldIntersector>( instance, ray, hit );
+}
+
+bool BvhAccStruct::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// Hit is only needed by nearest hit traversals
+	hit;
+
+	return traceAny<WaldIntersector>( instance, ray );
+}
+
+void BvhAccStruct::buildQuantizedTriangles( const rt::Geometry& geometry )
+{
+	vr::vectorExactResize( quantizedTriangles, elements.size() );
+
+	for( uint32 n = 0, nodeCount = nodes.size(); n < nodeCount; ++n )
+	{
+		const BvhNode& node = nodes[n];
+		if( !node.isLeaf() )
+			continue;
+
+		for( uint32 i = node.elemStart(), limit = i + node.elemCount(); i < limit; ++i )
+		{
+			const uint32 triId = elements[i];
+			quantizedTriangles[i].set( geometry.getVertex( triId, 0 ), geometry.getVertex( triId, 1 ), 
+				                       geometry.getVertex( triId, 2 ), node.bbox, triId );
+		}
+	}
+
+	vr::vectorFreeMemory( elements );
+}
+
+// Protected
+template<class Intersector>
+void BvhAccStruct::traceNearest( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// If don't hit bbox in local space, no need to trace underlying triangles
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	const rt::Geometry& geometry = *instance.geometry;
+
+	// Best distance considers any previously found hits to prevent false hits in this geometry
+	float bestDistance = hit.distance;
+
+	const bool quantized = !quantizedTriangles.empty();
+
+	s_geometryStack.clear();
+	s_geometryStack.push();
+	s_geometryStack.top() = 0;
+
+	while( !s_geometryStack.empty() )
+	{
+		const uint32 nodeId = s_geometryStack.top();
+		const BvhNode& node = nodes[nodeId];
+		s_geometryStack.pop();
+
+		// Skip nodes that are missed or lie beyond closest hit found so far
+		if( !hitBox( node.bbox, ray, vr::min( ray.tfar, bestDistance ) ) )
+			continue;
+
+		if( node.isLeaf() )
+		{
+			if( quantized )
+			{
+				// Decoding of the leaf is shared by its triangles
+				QuantizedTriangle::Frame frame;
+				frame.load( node.bbox );
+
+				for( uint32 i = node.elemStart(), limit = i + node.elemCount(); i < limit; ++i )
+				{
+					quantizedTriangles[i].hit( frame, ray, hit, bestDistance );
+				}
+				continue;
+			}
+
+			for( uint32 i = node.elemStart(), limit = i + node.elemCount(); i < limit; ++i )
+			{
+				Intersector::hit( geometry, elements[i], ray, hit, bestDistance );
+			}
+			continue;
+		}
+
+		// Visit front child first: push back child, then front child
+		const uint32 left = nodeId + 1;
+		const uint32 right = node.rightChild();
+		const uint32 bit = ray.dirSignBits[node.axis()];
+
+		s_geometryStack.push();
+		s_geometryStack.top() = bit ? left : right;
+		s_geometryStack.push();
+		s_geometryStack.top() = bit ? right : left;
+	}
+
+	if( bestDistance < hit.distance )
+	{
+		hit.distance = bestDistance;
+		hit.instance = &instance;
+	}
+}
+
+template<class Intersector>
+bool BvhAccStruct::traceAny( const rt::Instance& instance, rt::Ray& ray )
+{
+	// Node boxes are tested against the ray clipped to the tree, triangles against the whole ray
+	const rt::Ray originalRay( ray );
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	const rt::Geometry& geometry = *instance.geometry;
+	const bool quantized = !quantizedTriangles.empty();
+
+	s_geometryStack.clear();
+	s_geometryStack.push();
+	s_geometryStack.top() = 0;
+
+	while( !s_geometryStack.empty() )
+	{
+		const uint32 nodeId = s_geometryStack.top();
+		const BvhNode& node = nodes[nodeId];
+		s_geometryStack.pop();
+
+		if( !hitBox( node.bbox, ray, ray.tfar ) )
+			continue;
+
+		if( node.isLeaf() )
+		{
+			if( quantized )
+			{
+				QuantizedTriangle::Frame frame;
+				frame.load( node.bbox );
+
+				for( uint32 i = node.elemStart(), limit = i + node.elemCount(); i < limit; ++i )
+				{
+					if( quantizedTriangles[i].hitAny( frame, originalRay ) )
+					{
+						ray = originalRay;
+						return true;
+					}
+				}
+				continue;
+			}
+
+			for( uint32 i = node.elemStart(), limit = i + node.elemCount(); i < limit; ++i )
+			{
+				if( Intersector::hitAny( geometry, elements[i], originalRay ) )
+				{
+					ray = originalRay;
+					return true;
+				}
+			}
+			continue;
+		}
+
+		// Order does not matter for any hit, but front child first finds near blockers sooner
+		const uint32 left = nodeId + 1;
+		const uint32 right = node.rightChild();
+		const uint32 bit = ray.dirSignBits[node.axis()];
+
+		s_geometryStack.push();
+		s_geometryStack.top() = bit ? left : right;
+		s_geometryStack.push();
+		s_geometryStack.top() = bit ? right : left;
+	}
+
+	ray = originalRay;
+	return false;
+}
+
+// Instantiations for all intersection policies
+template void BvhAccStruct::traceNearest<WaldIntersector>( const rt::Instance&, rt::Ray&, rt::Hit& );
+template bool BvhAccStruct::traceAny<WaldIntersector>( const rt::Instance&, rt::Ray& );
+template void BvhAccStruct::traceNearest<MollerTrumboreIntersector>( const rt::Instance&, rt::Ray&, rt::Hit& );
+template bool BvhAccStruct::traceAny<MollerTrumboreIntersector>( const rt::Instance&, rt::Ray& );
@@ -0,0 +1,990 @@
+#include <rtp/BvhAccStructBuilder.h>
+#include <rtp/BvhAccStruct.h>
+#include <rt/AabbIntersection.h>
+#include <vr/timer.h>
+#include <algorithm>
+
+using namespace rtp;
+
+// Spatial splits are only tried where children of the best object split overlap by more than
+// this fraction of the root box area. Keeps the clipping cost away from nodes that do not need it.
+static const float SPATIAL_SPLIT_OVERLAP = 1e-5f;
+
+// Keeps elements whose centroid falls in bins before the split bin
+class BinPredicate
+{
+public:
+	BinPredicate( const std::vector<vr::vec3f>& centroids, uint32 axis, float minPos, float scale, uint32 splitBin )
+	: _centroids( centroids ), _axis( axis ), _minPos( minPos ), _scale( scale ), _splitBin( splitBin )
+	{
+		// empty
+	}
+
+	inline bool operator()( uint32 id ) const
+	{
+		const uint32 bin = vr::min( (uint32)( ( _centroids[id][_axis] - _minPos ) * _scale ), BvhAccStructBuilder::BIN_COUNT - 1 );
+		return ( bin < _splitBin );
+	}
+
+private:
+	const std::vector<vr::vec3f>& _centroids;
+	uint32 _axis;
+	float _minPos;
+	float _scale;
+	uint32 _splitBin;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+BvhAccStructBuilder::BvhAccStructBuilder()
+: _geometry( NULL ), _traversalCost( 1.0f ), _intersectionCost( 1.4f ), _maxLeafSize( 8 ), _maxRefitCost( 1.3f ), 
+  _threadCount( 1 ), _spatialSplits( false ), _spatialSplitBudget( 0.3f ), _quantizedTriangles( false ), _rootArea( 0.0f ), 
+  _spatialSplitCount( 0 )
+{
+	// empty
+}
+
+void BvhAccStructBuilder::buildGeometry( rt::Geometry* geometry )
+{
+	vr::Timer timer;
+	timer.restart();
+
+	const uint32 triCount = geometry->triDesc.size();
+	computeTriangleBoxes( geometry );
+
+	// Quantization needs leaf boxes that contain whole triangles, which spatial splits clip
+	const bool spatialSplits = _spatialSplits && !_quantizedTriangles;
+
+	BvhAccStruct* bvh = newGeometryAccStruct();
+	if( spatialSplits )
+		buildSpatialHierarchy( bvh, geometry );
+	else
+		buildHierarchy( bvh );
+
+	geometry->accStruct = bvh;
+
+	// Print stats
+	const uint32 referenceCount = bvh->elements.size();
+	printf( "\n***** %s *****\n", spatialSplits ? "SBVH" : "BVH" );
+	printf( "nodeCount: %d (%d leaves)\n", bvh->nodes.size(), _leafCount );
+	printf( "treeDepth: %d\n", _treeDepth );
+	printf( "averageLeafSize: %5.4f\n", ( _leafCount > 0 ) ? (float)referenceCount / (float)_leafCount : 0.0f );
+
+	if( _quantizedTriangles )
+	{
+		// TriAccel's are only needed by other structures, geometry loaded for this builder has none
+		const uint32 releasedBytes = geometry->triAccel.size() * sizeof( rt::TriAccel ) + referenceCount * sizeof( uint32 );
+		bvh->buildQuantizedTriangles( *geometry );
+		vr::vectorFreeMemory( geometry->triAccel );
+
+		printf( "quantizedTriangles: %d KB (released %d KB of TriAccel's and elements)\n", 
+			    bvh->quantizedTriangles.size() * sizeof( QuantizedTriangle ) / 1024, releasedBytes / 1024 );
+	}
+
+	if( spatialSplits )
+	{
+		printf( "spatialSplits: %d (%d references, %5.2f%% duplicated)\n", _spatialSplitCount, referenceCount, 
+			    ( triCount > 0 ) ? 100.0f * ( referenceCount - triCount ) / triCount : 0.0f );
+	}
+
+	printf( "buildTime: %.6f secs\n", timer.elapsed() );
+}
+
+void BvhAccStructBuilder::updateGeometry( rt::Geometry* geometry )
+{
+	// Quantized hierarchies have no elements, so they are always rebuilt
+	BvhAccStruct* bvh = dynamic_cast<BvhAccStruct*>( geometry->accStruct.get() );
+	if( !bvh || ( bvh->elements.size() != geometry->triDesc.size() ) || bvh->nodes.empty() )
+	{
+		buildGeometry( geometry );
+		return;
+	}
+
+	computeTriangleBoxes( geometry );
+	refitHierarchy( bvh );
+
+	bvh->nodeCostSum = 0.0;
+	for( uint32 i = 0, limit = bvh->nodes.size(); i < limit; ++i )
+	{
+		bvh->nodeCostSum += computeNodeCost( bvh->nodes[i] );
+	}
+
+	const float rootArea = bvh->nodes[0].bbox.computeSurfaceArea();
+	if( ( rootArea > 0.0f ) && ( bvh->nodeCostSum / rootArea > _maxRefitCost * bvh->buildCost ) )
+	{
+		// Rebuild from the boxes just computed
+		bvh->clear();
+		if( _spatialSplits )
+			buildSpatialHierarchy( bvh, geometry );
+		else
+			buildHierarchy( bvh );
+		return;
+	}
+
+	bvh->setBoundingBox( bvh->nodes[0].bbox );
+	vr::vectorFreeMemory( _boxes );
+}
+
+rt::IAccStruct* BvhAccStructBuilder::buildInstance( const std::vector<rt::Instance> instances )
+{
+	const uint32 instanceCount = instances.size();
+	vr::vectorExactResize( _boxes, instanceCount );
+
+	for( uint32 i = 0; i < instanceCount; ++i )
+	{
+		_boxes[i] = instances[i].bbox;
+	}
+
+	BvhAccStruct* bvh = new BvhAccStruct();
+	buildHierarchy( bvh );
+	return bvh;
+}
+
+rt::IAccStruct* BvhAccStructBuilder::updateInstance( rt::IAccStruct* accStruct, const std::vector<rt::Instance>& instances, 
+												    const std::vector<uint32>& changedIds )
+{
+	BvhAccStruct* bvh = dynamic_cast<BvhAccStruct*>( accStruct );
+	if( !bvh || ( bvh->elements.size() != instances.size() ) || bvh->nodes.empty() )
+		return buildInstance( instances );
+
+	if( changedIds.empty() )
+		return bvh;
+
+	if( bvh->parents.empty() )
+		createRefitMaps( bvh );
+
+	// Mark leaves of changed instances and all their ancestors
+	std::vector<bool>& marks = bvh->refitMarks;
+	std::vector<uint32>& dirtyNodes = _refitNodes;
+	dirtyNodes.clear();
+
+	for( uint32 i = 0, limit = changedIds.size(); i < limit; ++i )
+	{
+		uint32 nodeId = bvh->elementLeaves[changedIds[i]];
+		while( !marks[nodeId] )
+		{
+			marks[nodeId] = true;
+			dirtyNodes.push_back( nodeId );
+
+			if( nodeId == 0 )
+				break;
+
+			nodeId = bvh->parents[nodeId];
+		}
+	}
+
+	// Depth-first order places children after their parent, so refit in decreasing node order
+	std::sort( dirtyNodes.begin(), dirtyNodes.end() );
+
+	for( uint32 i = dirtyNodes.size(); i > 0; --i )
+	{
+		const uint32 nodeId = dirtyNodes[i-1];
+		BvhNode& node = bvh->nodes[nodeId];
+		rt::Aabb bbox;
+
+		marks[nodeId] = false;
+
+		if( node.isLeaf() )
+		{
+			for( uint32 e = node.elemStart(), end = node.elemStart() + node.elemCount(); e < end; ++e )
+			{
+				bbox.expandBy( instances[bvh->elements[e]].bbox );
+			}
+		}
+		else
+		{
+			bbox = bvh->nodes[nodeId+1].bbox;
+			bbox.expandBy( bvh->nodes[node.rightChild()].bbox );
+		}
+
+		bvh->nodeCostSum -= computeNodeCost( node );
+		node.bbox = bbox;
+		bvh->nodeCostSum += computeNodeCost( node );
+	}
+
+	bvh->setBoundingBox( bvh->nodes[0].bbox );
+
+	const float rootArea = bvh->nodes[0].bbox.computeSurfaceArea();
+	if( ( rootArea > 0.0f ) && ( bvh->nodeCostSum / rootArea > _maxRefitCost * bvh->buildCost ) )
+		return buildInstance( instances );
+
+	return bvh;
+}
+
+BvhAccStruct* BvhAccStructBuilder::buildFromBoxes( const std::vector<rt::Aabb>& boxes )
+{
+	_boxes = boxes;
+
+	BvhAccStruct* bvh = new BvhAccStruct();
+	buildHierarchy( bvh );
+	return bvh;
+}
+
+void BvhAccStructBuilder::setMaxLeafSize( uint32 size )
+{
+	_maxLeafSize = vr::max( size, 1u );
+}
+
+uint32 BvhAccStructBuilder::getMaxLeafSize() const
+{
+	return _maxLeafSize;
+}
+
+void BvhAccStructBuilder::setMaxRefitCost( float factor )
+{
+	_maxRefitCost = factor;
+}
+
+float BvhAccStructBuilder::getMaxRefitCost() const
+{
+	return _maxRefitCost;
+}
+
+void BvhAccStructBuilder::setThreadCount( uint32 count )
+{
+	_threadCount = vr::max( count, 1u );
+}
+
+uint32 BvhAccStructBuilder::getThreadCount() const
+{
+	return _threadCount;
+}
+
+void BvhAccStructBuilder::setSpatialSplits( bool enabled )
+{
+	_spatialSplits = enabled;
+}
+
+bool BvhAccStructBuilder::getSpatialSplits() const
+{
+	return _spatialSplits;
+}
+
+void BvhAccStructBuilder::setSpatialSplitBudget( float fraction )
+{
+	_spatialSplitBudget = vr::max( fraction, 0.0f );
+}
+
+float BvhAccStructBuilder::getSpatialSplitBudget() const
+{
+	return _spatialSplitBudget;
+}
+
+void BvhAccStructBuilder::setQuantizedTriangles( bool enabled )
+{
+	_quantizedTriangles = enabled;
+}
+
+bool BvhAccStructBuilder::getQuantizedTriangles() const
+{
+	return _quantizedTriangles;
+}
+
+bool BvhAccStructBuilder::needsTriAccel() const
+{
+	return !_quantizedTriangles;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Protected
+BvhAccStruct* BvhAccStructBuilder::newGeometryAccStruct() const
+{
+	return new BvhAccStruct();
+}
+
+// Private
+//////////////////////////////////////////////////////////////////////////
+void BvhAccStructBuilder::computeTriangleBoxes( rt::Geometry* geometry )
+{
+	const int32 triCount = geometry->triDesc.size();
+	vr::vectorExactResize( _boxes, triCount );
+
+	#pragma omp parallel for if( _threadCount > 1 ) num_threads( _threadCount ) schedule( static )
+	for( int32 t = 0; t < triCount; ++t )
+	{
+		rt::Aabb& box = _boxes[t];
+		box.minv = geometry->getVertex( t, 0 );
+		box.maxv = box.minv;
+		box.expandBy( geometry->getVertex( t, 1 ) );
+		box.expandBy( geometry->getVertex( t, 2 ) );
+	}
+}
+
+void BvhAccStructBuilder::buildHierarchy( BvhAccStruct* bvh )
+{
+	const uint32 count = _boxes.size();
+
+	// Reset stats
+	_leafCount = 0;
+	_treeDepth = 0;
+
+	// Element ids are reordered in place during build, leaves reference ranges of them
+	vr::vectorExactResize( _ids, count );
+	vr::vectorExactResize( _centroids, count );
+	for( uint32 i = 0; i < count; ++i )
+	{
+		_ids[i] = i;
+		_centroids[i] = ( _boxes[i].minv + _boxes[i].maxv ) * 0.5f;
+	}
+
+	// A binary tree with n leaves has at most 2n-1 nodes
+	bvh->nodes.reserve( vr::max( 2*count, 1u ) );
+	recursiveBuild( bvh, 0, count, 0 );
+
+	// Root box is the box of entire hierarchy
+	bvh->setBoundingBox( bvh->nodes[0].bbox );
+	bvh->elements = _ids;
+	storeBuildCost( bvh );
+
+	// Cleanup
+	vr::vectorFreeMemory( _boxes );
+	vr::vectorFreeMemory( _centroids );
+	vr::vectorFreeMemory( _ids );
+}
+
+uint32 BvhAccStructBuilder::recursiveBuild( BvhAccStruct* bvh, uint32 begin, uint32 end, uint32 treeDepth )
+{
+	const uint32 count = end - begin;
+
+	// Compute node box and box of element centroids
+	rt::Aabb bbox;
+	rt::Aabb centroidBox;
+	for( uint32 i = begin; i < end; ++i )
+	{
+		bbox.expandBy( _boxes[_ids[i]] );
+		centroidBox.expandBy( _centroids[_ids[i]] );
+	}
+
+	// Trivial case, or no more room in traversal stack
+	if( ( count <= 1 ) || ( treeDepth + 2 >= BvhAccStruct::MAX_STACK_SIZE ) )
+		return leafNode( bvh, bbox, begin, end, treeDepth );
+
+	ObjectSplit split;
+	findObjectSplit( &_ids[begin], count, centroidBox, 1.0f / bbox.computeSurfaceArea(), split );
+
+	// No valid split (all centroids coincide) or splitting does not pay off
+	if( ( split.cost == vr::Mathf::MAX_VALUE ) || 
+		( ( split.cost >= _intersectionCost * count ) && ( count <= _maxLeafSize ) ) )
+	{
+		return leafNode( bvh, bbox, begin, end, treeDepth );
+	}
+
+	// Partition element ids according to chosen bin
+	const float scale = (float)BIN_COUNT * 0.9999f / ( centroidBox.maxv[split.axis] - centroidBox.minv[split.axis] );
+	BinPredicate predicate( _centroids, split.axis, centroidBox.minv[split.axis], scale, split.bin );
+	const uint32 middle = std::partition( _ids.begin() + begin, _ids.begin() + end, predicate ) - _ids.begin();
+
+	// Create node before children: depth-first order
+	const uint32 nodeId = bvh->nodes.size();
+	bvh->nodes.push_back( BvhNode() );
+
+	// Left child is always next node
+	recursiveBuild( bvh, begin, middle, treeDepth + 1 );
+	const uint32 right = recursiveBuild( bvh, middle, end, treeDepth + 1 );
+
+	bvh->nodes[nodeId].setInternalNode( bbox, split.axis, right );
+	return nodeId;
+}
+
+uint32 BvhAccStructBuilder::leafNode( BvhAccStruct* bvh, const rt::Aabb& bbox, uint32 begin, uint32 end, uint32 treeDepth )
+{
+	if( treeDepth > _treeDepth )
+		_treeDepth = treeDepth;
+
+	++_leafCount;
+
+	const uint32 nodeId = bvh->nodes.size();
+	bvh->nodes.push_back( BvhNode() );
+	bvh->nodes[nodeId].setLeafNode( bbox, begin, end - begin );
+	return nodeId;
+}
+
+void BvhAccStructBuilder::findObjectSplit( const uint32* ids, uint32 count, const rt::Aabb& centroidBox, float invArea, 
+										   ObjectSplit& split ) const
+{
+	split.cost = vr::Mathf::MAX_VALUE;
+	split.axis = 0;
+	split.bin = 0;
+
+	Bin bins[BIN_COUNT];
+	rt::Aabb rightBoxes[BIN_COUNT];
+	uint32 rightCounts[BIN_COUNT];
+
+	// Find best binned split over all 3 axis
+	for( uint32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		const float extent = centroidBox.maxv[k] - centroidBox.minv[k];
+
+		// All centroids in the same position, cannot split along this axis
+		if( extent <= 0.0f )
+			continue;
+
+		// Slightly shrink scale so that the maximum centroid falls inside last bin
+		const float scale = (float)BIN_COUNT * 0.9999f / extent;
+
+		for( uint32 b = 0; b < BIN_COUNT; ++b )
+		{
+			bins[b].bbox = rt::Aabb();
+			bins[b].count = 0;
+		}
+
+		for( uint32 i = 0; i < count; ++i )
+		{
+			const uint32 id = ids[i];
+			const uint32 b = vr::min( (uint32)( ( _centroids[id][k] - centroidBox.minv[k] ) * scale ), BIN_COUNT - 1 );
+			bins[b].bbox.expandBy( _boxes[id] );
+			++bins[b].count;
+		}
+
+		// Sweep from right to left, computing right side of each candidate split
+		rt::Aabb rightBox;
+		uint32 rightCount = 0;
+		for( uint32 b = BIN_COUNT - 1; b > 0; --b )
+		{
+			rightBox.expandBy( bins[b].bbox );
+			rightCount += bins[b].count;
+			rightBoxes[b] = rightBox;
+			rightCounts[b] = rightCount;
+		}
+
+		// Sweep from left to right, evaluating split between bins b-1 and b
+		rt::Aabb leftBox;
+		uint32 leftCount = 0;
+		for( uint32 b = 1; b < BIN_COUNT; ++b )
+		{
+			leftBox.expandBy( bins[b-1].bbox );
+			leftCount += bins[b-1].count;
+
+			if( ( leftCount == 0 ) || ( rightCounts[b] == 0 ) )
+				continue;
+
+			const float cost = _traversalCost + _intersectionCost * invArea * 
+				               ( leftBox.computeSurfaceArea() * leftCount + rightBoxes[b].computeSurfaceArea() * rightCounts[b] );
+
+			if( cost < split.cost )
+			{
+				split.cost = cost;
+				split.axis = k;
+				split.bin = b;
+				split.leftBox = leftBox;
+				split.rightBox = rightBoxes[b];
+			}
+		}
+	}
+}
+
+void BvhAccStructBuilder::buildSpatialHierarchy( BvhAccStruct* bvh, rt::Geometry* geometry )
+{
+	const uint32 count = _boxes.size();
+
+	// Reset stats
+	_leafCount = 0;
+	_treeDepth = 0;
+	_spatialSplitCount = 0;
+
+	_geometry = geometry;
+	uint32 budget = (uint32)( _spatialSplitBudget * count );
+
+	// Initially, each triangle has a single reference
+	std::vector<uint32> ids( count );
+	vr::vectorExactResize( _centroids, count );
+	vr::vectorExactResize( _triangleIds, count );
+
+	rt::Aabb rootBox;
+	for( uint32 i = 0; i < count; ++i )
+	{
+		ids[i] = i;
+		_triangleIds[i] = i;
+		_centroids[i] = ( _boxes[i].minv + _boxes[i].maxv ) * 0.5f;
+		rootBox.expandBy( _boxes[i] );
+	}
+
+	_rootArea = rootBox.computeSurfaceArea();
+
+	// References never outgrow the budget
+	_boxes.reserve( count + budget );
+	_centroids.reserve( count + budget );
+	_triangleIds.reserve( count + budget );
+
+	bvh->elements.clear();
+	bvh->elements.reserve( count + budget );
+	bvh->nodes.reserve( vr::max( 2 * ( count + budget ), 1u ) );
+	recursiveSpatialBuild( bvh, ids, budget, 0 );
+
+	// Root box is the box of entire hierarchy
+	bvh->setBoundingBox( bvh->nodes[0].bbox );
+	storeBuildCost( bvh );
+
+	// Cleanup
+	_geometry = NULL;
+	vr::vectorFreeMemory( _boxes );
+	vr::vectorFreeMemory( _centroids );
+	vr::vectorFreeMemory( _triangleIds );
+}
+
+uint32 BvhAccStructBuilder::recursiveSpatialBuild( BvhAccStruct* bvh, std::vector<uint32>& ids, uint32& budget, uint32 treeDepth )
+{
+	const uint32 count = ids.size();
+
+	// Compute node box and box of reference centroids
+	rt::Aabb bbox;
+	rt::Aabb centroidBox;
+	for( uint32 i = 0; i < count; ++i )
+	{
+		bbox.expandBy( _boxes[ids[i]] );
+		centroidBox.expandBy( _centroids[ids[i]] );
+	}
+
+	// Trivial case, or no more room in traversal stack
+	bool leaf = ( count <= 1 ) || ( treeDepth + 2 >= BvhAccStruct::MAX_STACK_SIZE );
+
+	ObjectSplit objectSplit;
+	SpatialSplit spatialSplit;
+	objectSplit.cost = vr::Mathf::MAX_VALUE;
+	spatialSplit.cost = vr::Mathf::MAX_VALUE;
+
+	if( !leaf )
+	{
+		const float invArea = 1.0f / bbox.computeSurfaceArea();
+		findObjectSplit( &ids[0], count, centroidBox, invArea, objectSplit );
+
+		// Overlap of object split children
+		float overlapArea = 0.0f;
+		if( objectSplit.cost != vr::Mathf::MAX_VALUE )
+		{
+			rt::Aabb overlap;
+			for( uint32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+			{
+				overlap.minv[k] = vr::max( objectSplit.leftBox.minv[k], objectSplit.rightBox.minv[k] );
+				overlap.maxv[k] = vr::min( objectSplit.leftBox.maxv[k], objectSplit.rightBox.maxv[k] );
+			}
+
+			if( !overlap.isDegenerate() )
+				overlapArea = overlap.computeSurfaceArea();
+		}
+
+		// Coinciding centroids can only be separated by a spatial split
+		if( ( budget > 0 ) && 
+			( ( objectSplit.cost == vr::Mathf::MAX_VALUE ) || ( overlapArea > SPATIAL_SPLIT_OVERLAP * _rootArea ) ) )
+		{
+			findSpatialSplit( ids, bbox, invArea, spatialSplit );
+
+			// Duplicated references must fit in the remaining budget
+			if( ( spatialSplit.cost != vr::Mathf::MAX_VALUE ) && 
+				( spatialSplit.leftCount + spatialSplit.rightCount - count > budget ) )
+			{
+				spatialSplit.cost = vr::Mathf::MAX_VALUE;
+			}
+		}
+
+		// No valid split or splitting does not pay off
+		const float bestCost = vr::min( objectSplit.cost, spatialSplit.cost );
+		leaf = ( bestCost == vr::Mathf::MAX_VALUE ) || 
+			   ( ( bestCost >= _intersectionCost * count ) && ( count <= _maxLeafSize ) );
+	}
+
+	std::vector<uint32> left;
+	std::vector<uint32> right;
+	uint32 axis = objectSplit.axis;
+
+	if( !leaf )
+	{
+		if( ( spatialSplit.cost < objectSplit.cost ) && performSpatialSplit( ids, spatialSplit, left, right ) )
+		{
+			axis = spatialSplit.axis;
+			++_spatialSplitCount;
+
+			const uint32 added = left.size() + right.size() - count;
+			budget -= vr::min( added, budget );
+		}
+		else if( objectSplit.cost != vr::Mathf::MAX_VALUE )
+		{
+			// Partition reference ids according to chosen bin
+			const float scale = (float)BIN_COUNT * 0.9999f / ( centroidBox.maxv[axis] - centroidBox.minv[axis] );
+			BinPredicate predicate( _centroids, axis, centroidBox.minv[axis], scale, objectSplit.bin );
+
+			for( uint32 i = 0; i < count; ++i )
+			{
+				if( predicate( ids[i] ) )
+					left.push_back( ids[i] );
+				else
+					right.push_back( ids[i] );
+			}
+		}
+		else
+		{
+			leaf = true;
+		}
+	}
+
+	if( leaf )
+	{
+		const uint32 begin = bvh->elements.size();
+		for( uint32 i = 0; i < count; ++i )
+		{
+			bvh->elements.push_back( _triangleIds[ids[i]] );
+		}
+
+		return leafNode( bvh, bbox, begin, bvh->elements.size(), treeDepth );
+	}
+
+	// Children own their references from now on
+	vr::vectorFreeMemory( ids );
+
+	// Create node before children: depth-first order
+	const uint32 nodeId = bvh->nodes.size();
+	bvh->nodes.push_back( BvhNode() );
+
+	// Share budget among children
+	const uint32 referenceCount = left.size() + right.size();
+	uint32 leftBudget = (uint32)( (double)budget * left.size() / referenceCount );
+	uint32 rightBudget = budget - leftBudget;
+
+	// Left child is always next node
+	recursiveSpatialBuild( bvh, left, leftBudget, treeDepth + 1 );
+	rightBudget += leftBudget;
+	const uint32 rightId = recursiveSpatialBuild( bvh, right, rightBudget, treeDepth + 1 );
+	budget = rightBudget;
+
+	bvh->nodes[nodeId].setInternalNode( bbox, axis, rightId );
+	return nodeId;
+}
+
+void BvhAccStructBuilder::findSpatialSplit( const std::vector<uint32>& ids, const rt::Aabb& bbox, float invArea, 
+										    SpatialSplit& split ) const
+{
+	split.cost = vr::Mathf::MAX_VALUE;
+	split.axis = 0;
+	split.position = 0.0f;
+	split.leftCount = 0;
+	split.rightCount = 0;
+
+	SpatialBin bins[SPATIAL_BIN_COUNT];
+	rt::Aabb rightBoxes[SPATIAL_BIN_COUNT];
+	uint32 rightCounts[SPATIAL_BIN_COUNT];
+
+	for( uint32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		const float extent = bbox.maxv[k] - bbox.minv[k];
+		if( extent <= 0.0f )
+			continue;
+
+		const float binSize = extent / SPATIAL_BIN_COUNT;
+		const float scale = 1.0f / binSize;
+
+		for( uint32 b = 0; b < SPATIAL_BIN_COUNT; ++b )
+		{
+			bins[b].bbox = rt::Aabb();
+			bins[b].entries = 0;
+			bins[b].exits = 0;
+		}
+
+		for( uint32 i = 0, limit = ids.size(); i < limit; ++i )
+		{
+			const uint32 id = ids[i];
+			const rt::Aabb& box = _boxes[id];
+			const uint32 first = vr::min( (uint32)vr::max( ( box.minv[k] - bbox.minv[k] ) * scale, 0.0f ), SPATIAL_BIN_COUNT - 1 );
+			const uint32 last = vr::min( (uint32)vr::max( ( box.maxv[k] - bbox.minv[k] ) * scale, 0.0f ), SPATIAL_BIN_COUNT - 1 );
+
+			if( first == last )
+			{
+				bins[first].bbox.expandBy( box );
+			}
+			else
+			{
+				// Chop reference into the bins it crosses
+				rt::Aabb binBox = bbox;
+				for( uint32 b = first; b <= last; ++b )
+				{
+					binBox.minv[k] = bbox.minv[k] + b * binSize;
+					binBox.maxv[k] = ( b + 1 < SPATIAL_BIN_COUNT ) ? bbox.minv[k] + ( b + 1 ) * binSize : bbox.maxv[k];
+					bins[b].bbox.expandBy( clipReference( id, binBox ) );
+				}
+			}
+
+			++bins[first].entries;
+			++bins[last].exits;
+		}
+
+		// Sweep from right to left, references ending right of a plane are on its right side
+		rt::Aabb rightBox;
+		uint32 rightCount = 0;
+		for( uint32 b = SPATIAL_BIN_COUNT - 1; b > 0; --b )
+		{
+			rightBox.expandBy( bins[b].bbox );
+			rightCount += bins[b].exits;
+			rightBoxes[b] = rightBox;
+			rightCounts[b] = rightCount;
+		}
+
+		// Sweep from left to right, references starting left of a plane are on its left side
+		rt::Aabb leftBox;
+		uint32 leftCount = 0;
+		for( uint32 b = 1; b < SPATIAL_BIN_COUNT; ++b )
+		{
+			leftBox.expandBy( bins[b-1].bbox );
+			leftCount += bins[b-1].entries;
+
+			if( ( leftCount == 0 ) || ( rightCounts[b] == 0 ) )
+				continue;
+
+			const float cost = _traversalCost + _intersectionCost * invArea * 
+				               ( leftBox.computeSurfaceArea() * leftCount + rightBoxes[b].computeSurfaceArea() * rightCounts[b] );
+
+			if( cost < split.cost )
+			{
+				split.cost = cost;
+				split.axis = k;
+				split.position = bbox.minv[k] + b * binSize;
+				split.leftBox = leftBox;
+				split.rightBox = rightBoxes[b];
+				split.leftCount = leftCount;
+				split.rightCount = rightCounts[b];
+			}
+		}
+	}
+}
+
+bool BvhAccStructBuilder::performSpatialSplit( const std::vector<uint32>& ids, const SpatialSplit& split, 
+											   std::vector<uint32>& left, std::vector<uint32>& right )
+{
+	const uint32 k = split.axis;
+	const float leftArea = split.leftBox.computeSurfaceArea();
+	const float rightArea = split.rightBox.computeSurfaceArea();
+	const float splitCost = leftArea * split.leftCount + rightArea * split.rightCount;
+
+	// Clipping waits until both sides are known to be non-empty
+	std::vector<uint32> straddling;
+
+	for( uint32 i = 0, limit = ids.size(); i < limit; ++i )
+	{
+		const uint32 id = ids[i];
+		const rt::Aabb& box = _boxes[id];
+
+		if( box.maxv[k] <= split.position )
+		{
+			left.push_back( id );
+		}
+		else if( box.minv[k] >= split.position )
+		{
+			right.push_back( id );
+		}
+		else
+		{
+			// Reference unsplitting: moving the whole reference to one side may be cheaper than duplicating it
+			rt::Aabb leftUnion = split.leftBox;
+			rt::Aabb rightUnion = split.rightBox;
+			leftUnion.expandBy( box );
+			rightUnion.expandBy( box );
+
+			const float leftCost = leftUnion.computeSurfaceArea() * split.leftCount + rightArea * ( split.rightCount - 1 );
+			const float rightCost = leftArea * ( split.leftCount - 1 ) + rightUnion.computeSurfaceArea() * split.rightCount;
+
+			if( ( leftCost < splitCost ) && ( leftCost <= rightCost ) )
+				left.push_back( id );
+			else if( rightCost < splitCost )
+				right.push_back( id );
+			else
+				straddling.push_back( id );
+		}
+	}
+
+	for( uint32 i = 0, limit = straddling.size(); i < limit; ++i )
+	{
+		const uint32 id = straddling[i];
+
+		rt::Aabb leftHalf = _boxes[id];
+		rt::Aabb rightHalf = _boxes[id];
+		leftHalf.maxv[k] = split.position;
+		rightHalf.minv[k] = split.position;
+
+		const rt::Aabb leftPart = clipReference( id, leftHalf );
+		const rt::Aabb rightPart = clipReference( id, rightHalf );
+
+		// Round-off may leave nothing on one side
+		if( leftPart.isDegenerate() )
+		{
+			right.push_back( id );
+			continue;
+		}
+
+		if( rightPart.isDegenerate() )
+		{
+			left.push_back( id );
+			continue;
+		}
+
+		// Left side keeps the reference, right side gets a new one
+		_boxes[id] = leftPart;
+		_centroids[id] = ( leftPart.minv + leftPart.maxv ) * 0.5f;
+		left.push_back( id );
+
+		right.push_back( _boxes.size() );
+		_boxes.push_back( rightPart );
+		_centroids.push_back( ( rightPart.minv + rightPart.maxv ) * 0.5f );
+		_triangleIds.push_back( _triangleIds[id] );
+	}
+
+	// Only possible when no reference was clipped
+	if( left.empty() || right.empty() )
+	{
+		left.clear();
+		right.clear();
+		return false;
+	}
+
+	return true;
+}
+
+rt::Aabb BvhAccStructBuilder::clipReference( uint32 id, const rt::Aabb& box ) const
+{
+	const rt::Aabb& referenceBox = _boxes[id];
+
+	rt::Aabb clipBox;
+	for( uint32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		clipBox.minv[k] = vr::max( box.minv[k], referenceBox.minv[k] );
+		clipBox.maxv[k] = vr::min( box.maxv[k], referenceBox.maxv[k] );
+	}
+
+	rt::Aabb result;
+	if( clipBox.isDegenerate() )
+		return result;
+
+	const uint32 triangleId = _triangleIds[id];
+	rt::AabbIntersection::clipTriangle( _geometry->getVertex( triangleId, 0 ), _geometry->getVertex( triangleId, 1 ), 
+		                                _geometry->getVertex( triangleId, 2 ), clipBox, result );
+	return result;
+}
+
+void BvhAccStructBuilder::refitHierarchy( BvhAccStruct* bvh ) const
+{
+	// Split hierarchy into enough subtrees to keep all threads busy.
+	// Nodes above them are collected top-down, level by level.
+	std::vector<uint32> subtrees( 1, 0 );
+	std::vector<uint32> upperNodes;
+	std::vector<uint32> nextSubtrees;
+
+	bool split = ( _threadCount > 1 );
+	while( split && ( subtrees.size() < 4 * _threadCount ) )
+	{
+		split = false;
+		nextSubtrees.clear();
+
+		for( uint32 i = 0, limit = subtrees.size(); i < limit; ++i )
+		{
+			const uint32 nodeId = subtrees[i];
+			const BvhNode& node = bvh->nodes[nodeId];
+
+			if( node.isLeaf() )
+			{
+				nextSubtrees.push_back( nodeId );
+				continue;
+			}
+
+			upperNodes.push_back( nodeId );
+			nextSubtrees.push_back( nodeId + 1 );
+			nextSubtrees.push_back( node.rightChild() );
+			split = true;
+		}
+
+		subtrees.swap( nextSubtrees );
+	}
+
+	// In depth-first order, a subtree is the node range from its root to its rightmost leaf,
+	// with children after their parent
+	const int32 subtreeCount = subtrees.size();
+
+	#pragma omp parallel for if( _threadCount > 1 ) num_threads( _threadCount ) schedule( dynamic, 1 )
+	for( int32 s = 0; s < subtreeCount; ++s )
+	{
+		uint32 last = subtrees[s];
+		while( !bvh->nodes[last].isLeaf() )
+			last = bvh->nodes[last].rightChild();
+
+		for( uint32 i = last + 1; i > subtrees[s]; --i )
+		{
+			refitNode( bvh, i - 1 );
+		}
+	}
+
+	// Deeper upper nodes come last
+	for( uint32 i = upperNodes.size(); i > 0; --i )
+	{
+		refitNode( bvh, upperNodes[i-1] );
+	}
+}
+
+void BvhAccStructBuilder::refitNode( BvhAccStruct* bvh, uint32 nodeId ) const
+{
+	BvhNode& node = bvh->nodes[nodeId];
+	rt::Aabb bbox;
+
+	if( node.isLeaf() )
+	{
+		for( uint32 e = node.elemStart(), end = node.elemStart() + node.elemCount(); e < end; ++e )
+		{
+			bbox.expandBy( _boxes[bvh->elements[e]] );
+		}
+	}
+	else
+	{
+		bbox = bvh->nodes[nodeId+1].bbox;
+		bbox.expandBy( bvh->nodes[node.rightChild()].bbox );
+	}
+
+	node.bbox = bbox;
+}
+
+void BvhAccStructBuilder::createRefitMaps( BvhAccStruct* bvh ) const
+{
+	vr::vectorExactResize( bvh->parents, bvh->nodes.size() );
+	vr::vectorExactResize( bvh->elementLeaves, bvh->elements.size() );
+
+	bvh->refitMarks.assign( bvh->nodes.size(), false );
+
+	bvh->parents[0] = 0;
+	for( uint32 i = 0, limit = bvh->nodes.size(); i < limit; ++i )
+	{
+		const BvhNode& node = bvh->nodes[i];
+
+		if( node.isLeaf() )
+		{
+			for( uint32 e = node.elemStart(), end = node.elemStart() + node.elemCount(); e < end; ++e )
+			{
+				bvh->elementLeaves[bvh->elements[e]] = i;
+			}
+		}
+		else
+		{
+			bvh->parents[i+1] = i;
+			bvh->parents[node.rightChild()] = i;
+		}
+	}
+}
+
+void BvhAccStructBuilder::storeBuildCost( BvhAccStruct* bvh ) const
+{
+	bvh->nodeCostSum = 0.0;
+	for( uint32 i = 0, limit = bvh->nodes.size(); i < limit; ++i )
+	{
+		bvh->nodeCostSum += computeNodeCost( bvh->nodes[i] );
+	}
+
+	const float rootArea = bvh->nodes[0].bbox.computeSurfaceArea();
+	bvh->buildCost = ( rootArea > 0.0f ) ? (float)( bvh->nodeCostSum / rootArea ) : 0.0f;
+}
+
+float BvhAccStructBuilder::computeNodeCost( const BvhNode& node ) const
+{
+	// Empty instances have degenerate boxes
+	if( node.bbox.isDegenerate() )
+		return 0.0f;
+
+	const float area = node.bbox.computeSurfaceArea();
+
+	if( node.isLeaf() )
+		return _intersectionCost * node.elemCount() * area;
+	else
+		return _traversalCost * area;
+}
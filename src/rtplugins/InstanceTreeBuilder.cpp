@@ -1,10 +1,22 @@
 #include "InstanceTreeBuilder.h"
 #include <rt/AabbIntersection.h>
+#include <vr/timer.h>
+#include <omp.h>
+#include <algorithm>
 
 using namespace rtp;
 
+InstanceTreeBuilder::InstanceTreeBuilder()
+: _instances( NULL ), _threadCount( 1 ), _taskDepth( 0 ), _traversalCost( 1.0f ), _intersectionCost( 1.4f )
+{
+	// empty
+}
+
 RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<rt::Instance>& instances )
 {
+	vr::Timer timer;
+	timer.restart();
+
 	// Create instance vector for entire scene
 	uint32 instanceCount = instances.size();
 
@@ -15,8 +27,7 @@ RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<rt::Instance>& inst
 	_instances = &instances;
 
 	RawKdTree* tree = new RawKdTree();
-	_stats = &tree->stats;
-	_stats->reset();
+	tree->stats.reset();
 
 	rt::Aabb& sceneBox = tree->bbox;
 	sceneBox = instances[0].bbox;
@@ -29,236 +40,221 @@ RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<rt::Instance>& inst
 		sceneBox.expandBy( instances[i].bbox );
 	}
 
+	// Defer subtrees once there are enough of them to keep all threads busy
+	_taskDepth = 3;
+	for( uint32 n = 1; n < _threadCount; n <<= 1 )
+	{
+		++_taskDepth;
+	}
+
 	// Recursive tree build
-	tree->root = recursiveBuild( initialInstances, tree->bbox, 0 );
+	tree->root = recursiveBuild( tree->stats, initialInstances, tree->bbox, 0, ( _threadCount > 1 ) );
+
+	// Build deferred subtrees in parallel
+	if( !_tasks.empty() )
+	{
+		const int32 taskCount = _tasks.size();
+
+		#pragma omp parallel for num_threads( _threadCount ) schedule( dynamic, 1 )
+		for( int32 i = 0; i < taskCount; ++i )
+		{
+			BuildTask& task = *_tasks[i];
+			vr::ref_ptr<RawKdNode> subtree = recursiveBuild( task.stats, task.instances, task.bbox, task.treeDepth, false );
+
+			// Move subtree into placeholder node, which is already linked to its parent
+			task.node->split = subtree->split;
+			task.node->left = subtree->left;
+			task.node->right = subtree->right;
+			task.node->elements.swap( subtree->elements );
+		}
+
+		for( int32 i = 0; i < taskCount; ++i )
+		{
+			const RawKdTree::Statistics& taskStats = _tasks[i]->stats;
+			tree->stats.nodeCount += taskStats.nodeCount;
+			tree->stats.leafCount += taskStats.leafCount;
+			tree->stats.elemIdCount += taskStats.elemIdCount;
+			if( taskStats.treeDepth > tree->stats.treeDepth )
+				tree->stats.treeDepth = taskStats.treeDepth;
+
+			delete _tasks[i];
+		}
+
+		_tasks.clear();
+	}
+
+	tree->stats.buildTime = timer.elapsed();
 	return tree;
 }
 
+void InstanceTreeBuilder::setThreadCount( uint32 count )
+{
+	_threadCount = vr::max( count, 1u );
+}
+
+uint32 InstanceTreeBuilder::getThreadCount() const
+{
+	return _threadCount;
+}
+
 // Private methods
 
-RawKdNode* InstanceTreeBuilder::recursiveBuild( const RawKdNode::Elements& instances, const rt::Aabb& bbox, uint32 treeDepth )
+RawKdNode* InstanceTreeBuilder::recursiveBuild( RawKdTree::Statistics& stats, const RawKdNode::Elements& instances, 
+											    const rt::Aabb& bbox, uint32 treeDepth, bool topLevel )
 {
-	++_stats->nodeCount;
+	// Lower subtrees of a parallel build are built later as independent tasks
+	if( topLevel && ( treeDepth >= _taskDepth ) )
+	{
+		BuildTask* task = new BuildTask();
+		task->node = new RawKdNode();
+		task->instances = instances;
+		task->bbox = bbox;
+		task->treeDepth = treeDepth;
+		_tasks.push_back( task );
+		return task->node;
+	}
+
+	++stats.nodeCount;
 
 	// Check trivial case
 	if( instances.size() == 1 )
-		return leafNode( instances, treeDepth );
+		return leafNode( stats, instances, treeDepth );
 	
-	// Find axis in descending order of maximum extent
-	uint32 orderedAxis[3];
-	orderAxis( orderedAxis, bbox );
-
-	uint32 axis;
+	// Find cheapest split plane, a leaf is created if none pays off
 	rt::SplitPlane plane;
-	float distance;
-	uint32 currentInstanceCount = instances.size();
-	const std::vector<rt::Instance>& originalInstances = *_instances;
-
-	// Best split data
-	float minDistance = vr::Mathf::MAX_VALUE;
-	uint32 bestInstance;
-
-	float leftMinDistance = vr::Mathf::MAX_VALUE;
-	uint32 leftBestInstance;
-	uint32 leftCount = 0;
-	float leftSplitPosition;
+	if( !findSahSplit( instances, bbox, plane ) )
+		return leafNode( stats, instances, treeDepth );
 
-	float rightMinDistance = vr::Mathf::MAX_VALUE;
-	uint32 rightBestInstance;
-	uint32 rightCount = 0;
-	float rightSplitPosition;
-
-	// Compute the center of current bbox
-	vr::vec3f center = bbox.minv + bbox.maxv;
-	center *= 0.5f;
+	const uint32 currentInstanceCount = instances.size();
+	const std::vector<rt::Instance>& originalInstances = *_instances;
 
-	// Child elements, if any
+	// Partition instances according to split plane
 	RawKdNode::Elements leftInstances;
 	RawKdNode::Elements rightInstances;
 
-	// For each axis
-	for( uint32 k = 0; k < 3; ++k )
+	for( uint32 i = 0; i < currentInstanceCount; ++i )
 	{
-		axis = orderedAxis[k];
-		leftInstances.clear();
-		rightInstances.clear();
+		const uint32 instanceId = instances[i];
+		const rt::Aabb& currentBox = originalInstances[instanceId].bbox;
 
-		// Get "best" split position: closest object border to center of bbox
-		for( uint32 i = 0; i < currentInstanceCount; ++i )
+		if( ( currentBox.minv[plane.axis] <= plane.position ) && ( currentBox.maxv[plane.axis] <= plane.position ) )
 		{
-			const uint32 instanceId = instances[i];
-			const rt::Aabb& currentBox = originalInstances[instanceId].bbox;
-
-			distance = currentBox.minv[axis] - center[axis];
-			if( distance <= 0.0f )
-			{
-				++leftCount;
-				distance = vr::abs( distance );
-				if( distance < leftMinDistance )
-				{
-					leftMinDistance = distance;
-					leftBestInstance = instanceId;
-					leftSplitPosition = currentBox.minv[axis];
-				}
-			}
-			else
-			{
-				++rightCount;
-				distance = vr::abs( distance );
-				if( distance < rightMinDistance )
-				{
-					rightMinDistance = distance;
-					rightBestInstance = instanceId;
-					rightSplitPosition = currentBox.minv[axis];
-				}
-			}
-
-			distance = currentBox.maxv[axis] - center[axis];
-			if( distance <= 0.0f )
-			{
-				++leftCount;
-				distance = vr::abs( distance );
-				if( distance < leftMinDistance )
-				{
-					leftMinDistance = distance;
-					leftBestInstance = instanceId;
-					leftSplitPosition = currentBox.maxv[axis];
-				}
-			}
-			else
-			{
-				++rightCount;
-				distance = vr::abs( distance );
-				if( distance < rightMinDistance )
-				{
-					rightMinDistance = distance;
-					rightBestInstance = instanceId;
-					rightSplitPosition = currentBox.maxv[axis];
-				}
-			}
+			// Completely on left side
+			leftInstances.push_back( instanceId );
 		}
-
-		// Get the split position that lies between cell center and object median
-		if( leftCount > rightCount )
+		else if( ( currentBox.minv[plane.axis] >= plane.position ) && ( currentBox.maxv[plane.axis] >= plane.position ) )
 		{
-			minDistance = leftMinDistance;
-			bestInstance = leftBestInstance;
-			plane.position = leftSplitPosition;
+			// Completely on right side
+			rightInstances.push_back( instanceId );
 		}
 		else
 		{
-			minDistance = rightMinDistance;
-			bestInstance = rightBestInstance;
-			plane.position = rightSplitPosition;
+			// On both sides
+			leftInstances.push_back( instanceId );
+			rightInstances.push_back( instanceId );
 		}
+	}
 
-		// Partition instances according to best split position
-		for( uint32 i = 0; i < currentInstanceCount; ++i )
-		{
-			const uint32 instanceId = instances[i];
-			const rt::Aabb& currentBox = originalInstances[instanceId].bbox;
+	// Check if split was able to partition instances
+	if( ( leftInstances.size() >= currentInstanceCount ) || ( rightInstances.size() >= currentInstanceCount ) )
+		return leafNode( stats, instances, treeDepth );
 
-			if( ( currentBox.minv[axis] <= plane.position ) && ( currentBox.maxv[axis] <= plane.position ) )
-			{
-				// Completely on left side
-				leftInstances.push_back( instanceId );
-			}
-			else if( ( currentBox.minv[axis] >= plane.position ) && ( currentBox.maxv[axis] >= plane.position ) )
-			{
-				// Completely on right side
-				rightInstances.push_back( instanceId );
-			}
-			else
-			{
-				// On both sides
-				leftInstances.push_back( instanceId );
-				rightInstances.push_back( instanceId );
-			}
-		}
+	// Split current bounding box according to chosen split plane
+	rt::Aabb leftBox;
+	rt::Aabb rightBox;
+	rt::AabbIntersection::splitAabb( bbox, plane, leftBox, rightBox );
 
-		// Check if best split was able to partition instances
-		if( ( leftInstances.size() >= currentInstanceCount ) || ( rightInstances.size() >= currentInstanceCount ) )
-			continue;
+	// Recursive tree build for both children
+	RawKdNode* left  = recursiveBuild( stats, leftInstances, leftBox, treeDepth + 1, topLevel );
+	vr::vectorFreeMemory( leftInstances );
+	RawKdNode* right = recursiveBuild( stats, rightInstances, rightBox, treeDepth + 1, topLevel );
+	vr::vectorFreeMemory( rightInstances );
 
-		// Split current bounding box according to chosen split plane
-		plane.axis = axis;
-		rt::Aabb leftBox;
-		rt::Aabb rightBox;
-		rt::AabbIntersection::splitAabb( bbox, plane, leftBox, rightBox );
+	return new RawKdNode( plane, left, right );
+}
 
-		// Recursive tree build for both children
-		RawKdNode* left  = recursiveBuild( leftInstances, leftBox, treeDepth + 1 );
-		vr::vectorFreeMemory( leftInstances );
-		RawKdNode* right = recursiveBuild( rightInstances, rightBox, treeDepth + 1 );
-		vr::vectorFreeMemory( rightInstances );
+bool InstanceTreeBuilder::findSahSplit( const RawKdNode::Elements& instances, const rt::Aabb& bbox, rt::SplitPlane& plane ) const
+{
+	const uint32 count = instances.size();
+	const std::vector<rt::Instance>& originalInstances = *_instances;
 
-		return new RawKdNode( plane, left, right );
-	}
+	const float area = bbox.computeSurfaceArea();
+	if( area <= 0.0f )
+		return false;
 
-	// No valid split plane could be found
-	return leafNode( instances, treeDepth );
-}
+	const float invArea = 1.0f / area;
+	const vr::vec3f extent = bbox.maxv - bbox.minv;
 
-void InstanceTreeBuilder::orderAxis( uint32* axis, const rt::Aabb& bbox )
-{
-	// Find axis in descending order of maximum extent
-	vr::vec3f diagonal = bbox.maxv - bbox.minv;
+	// Splitting must be cheaper than intersecting all instances
+	float bestCost = _intersectionCost * count;
+	bool found = false;
 
-	if( diagonal.x > diagonal.y )
+	std::vector<float> minPositions( count );
+	std::vector<float> maxPositions( count );
+
+	for( uint32 axis = RT_AXIS_X; axis <= RT_AXIS_Z; ++axis )
 	{
-		if( diagonal.x > diagonal.z )
-		{
-			axis[0] = RT_AXIS_X;
-			if( diagonal.y > diagonal.z )
-			{
-				axis[1] = RT_AXIS_Y;
-				axis[2] = RT_AXIS_Z;
-			}
-			else\
-			{
-				axis[1] = RT_AXIS_Z;
-				axis[2] = RT_AXIS_Y;
-			}
-		}
-		else
+		for( uint32 i = 0; i < count; ++i )
 		{
-			axis[0] = RT_AXIS_Z;
-			axis[1] = RT_AXIS_X;
-			axis[2] = RT_AXIS_Y;
+			const rt::Aabb& box = originalInstances[instances[i]].bbox;
+			minPositions[i] = box.minv[axis];
+			maxPositions[i] = box.maxv[axis];
 		}
-	}
-	else
-	{
-		if( diagonal.y > diagonal.z )
+
+		std::sort( minPositions.begin(), minPositions.end() );
+		std::sort( maxPositions.begin(), maxPositions.end() );
+
+		// Extents of the two axes parallel to split plane
+		const float u = extent[( axis + 1 ) % 3];
+		const float v = extent[( axis + 2 ) % 3];
+
+		// Sweep candidate positions in increasing order. Before each position,
+		// minPositions[0..nextMin) lie below it and maxPositions[0..nextMax) lie below or on it.
+		uint32 nextMin = 0;
+		uint32 nextMax = 0;
+
+		while( ( nextMin < count ) || ( nextMax < count ) )
 		{
-			axis[0] = RT_AXIS_Y;
-			if( diagonal.x > diagonal.z )
-			{
-				axis[1] = RT_AXIS_X;
-				axis[2] = RT_AXIS_Z;
-			}
-			else
+			const bool takeMin = ( nextMax >= count ) || ( ( nextMin < count ) && ( minPositions[nextMin] < maxPositions[nextMax] ) );
+			const float position = takeMin ? minPositions[nextMin] : maxPositions[nextMax];
+
+			const uint32 leftCount = nextMin;
+
+			while( ( nextMin < count ) && ( minPositions[nextMin] == position ) )
+				++nextMin;
+			while( ( nextMax < count ) && ( maxPositions[nextMax] <= position ) )
+				++nextMax;
+
+			const uint32 rightCount = count - nextMax;
+
+			// Planes on or outside node borders do not split anything
+			if( ( position <= bbox.minv[axis] ) || ( position >= bbox.maxv[axis] ) )
+				continue;
+
+			const float leftArea = u * v + ( u + v ) * ( position - bbox.minv[axis] );
+			const float rightArea = u * v + ( u + v ) * ( bbox.maxv[axis] - position );
+			const float cost = _traversalCost + _intersectionCost * invArea * ( leftArea * leftCount + rightArea * rightCount );
+
+			if( cost < bestCost )
 			{
-				axis[1] = RT_AXIS_Z;
-				axis[2] = RT_AXIS_X;
+				bestCost = cost;
+				plane.axis = axis;
+				plane.position = position;
+				found = true;
 			}
 		}
-		else
-		{
-			axis[0] = RT_AXIS_Z;
-			axis[1] = RT_AXIS_Y;
-			axis[2] = RT_AXIS_X;
-		}
 	}
+
+	return found;
 }
 
-RawKdNode* InstanceTreeBuilder::leafNode( const RawKdNode::Elements& instances, uint32 treeDepth )
+RawKdNode* InstanceTreeBuilder::leafNode( RawKdTree::Statistics& stats, const RawKdNode::Elements& instances, uint32 treeDepth )
 {
-	if( treeDepth > _stats->treeDepth )
-		_stats->treeDepth = treeDepth;
+	if( treeDepth > stats.treeDepth )
+		stats.treeDepth = treeDepth;
 
-	_stats->elemIdCount += instances.size();
-	++_stats->leafCount;
+	stats.elemIdCount += instances.size();
+	++stats.leafCount;
 
 	return new RawKdNode( instances );
 }
@@ -9,17 +9,41 @@ namespace rtp {
 class InstanceTreeBuilder
 {
 public:
+	InstanceTreeBuilder();
+
 	RawKdTree* buildTree( const std::vector<rt::Instance>& instances );
 
-private:
-	RawKdNode* recursiveBuild( const RawKdNode::Elements& instances, const rt::Aabb& bbox, uint32 treeDepth );
+	// 1 builds serially, otherwise lower subtrees are built as independent tasks
+	void setThreadCount( uint32 count );
+	uint32 getThreadCount() const;
 
-	// Find axis in descending order of maximum extent
-	void orderAxis( uint32* axis, const rt::Aabb& bbox );
-	RawKdNode* leafNode( const RawKdNode::Elements& instances, uint32 treeDepth );
+private:
+	// Subtree deferred by the top level of a parallel build
+	struct BuildTask
+	{
+		RawKdNode* node; // placeholder already linked to its parent
+		RawKdNode::Elements instances;
+		rt::Aabb bbox;
+		uint32 treeDepth;
+		RawKdTree::Statistics stats;
+	};
+
+	RawKdNode* recursiveBuild( RawKdTree::Statistics& stats, const RawKdNode::Elements& instances, 
+		                       const rt::Aabb& bbox, uint32 treeDepth, bool topLevel );
+
+	// Sweeps instance box borders on all axes for the split plane with lowest SAH cost.
+	// Returns false if no split is cheaper than a leaf.
+	bool findSahSplit( const RawKdNode::Elements& instances, const rt::Aabb& bbox, rt::SplitPlane& plane ) const;
+	RawKdNode* leafNode( RawKdTree::Statistics& stats, const RawKdNode::Elements& instances, uint32 treeDepth );
 
 	const std::vector<rt::Instance>* _instances;
-	RawKdTree::Statistics* _stats;
+
+	uint32 _threadCount;
+	uint32 _taskDepth;
+
+	float _traversalCost;
+	float _intersectionCost;
+	std::vector<BuildTask*> _tasks;
 };
 
 } // namespace rtp
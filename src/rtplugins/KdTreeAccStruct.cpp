@@ -1,21 +1,33 @@
 #include <rtp/KdTreeAccStruct.h>
+#include <rtp/KdTreeAccStructBuilder.h>
 #include <rt/Context.h>
 #include <rt/AabbIntersection.h>
 #include <rt/RayTriIntersection.h>
 #include <rt/IEnvironment.h>
+#include <omp.h>
 
 using namespace rtp;
 
-void KdNode::setInternalNode( const rt::SplitPlane& plane, const KdNode* leftChild )
+struct KdTreeAccStruct::UnbuiltSubtree
+{
+	std::vector<uint32> triangles;
+	rt::Aabb bbox;
+	uint32 treeDepth;
+
+	vr::ref_ptr<KdTreeAccStruct> tree;
+	// Set once tree is complete, so that traversal only needs the lock while it is NULL
+	KdTreeAccStruct* volatile builtTree;
+	omp_lock_t lock;
+};
+
+void KdNode::setInternalNode( const rt::SplitPlane& plane, uint32 leftChild )
 {
 	// Store plane information
 	_data = plane.axis;
 	_split = plane.position;
 
-	// Store pointer to left child
-#pragma warning( disable : 4311 )
-	_data += reinterpret_cast<uint32>( leftChild );
-#pragma warning( default : 4311 )
+	// Store index of left child
+	_data |= ( leftChild << 2 );
 
 	// Reset leaf flag
 	_data &= 0x7FFFFFFF;
@@ -33,93 +45,293 @@ void KdNode::setLeafNode( uint32 elementStart, uint32 elementCount )
 	_data |= 0x80000000;
 }
 
+void KdNode::setUnbuiltNode( uint32 subtreeId )
+{
+	_elements = subtreeId;
+
+	// Set leaf and unbuilt flags
+	_data = 0xC0000000;
+}
+
 // Static and thread-safe traversal stacks
 __declspec(thread) static KdTreeAccStruct::TraversalStack s_instanceStack;
 __declspec(thread) static KdTreeAccStruct::TraversalStack s_geometryStack;
+__declspec(thread) static KdTreeAccStruct::PacketTraversalStack s_instancePacketStack;
+__declspec(thread) static KdTreeAccStruct::PacketTraversalStack s_geometryPacketStack;
+
+// Cache line size in nodes
+static const uint32 CACHE_LINE_NODES = 64 / sizeof( KdNode );
 
 KdTreeAccStruct::KdTreeAccStruct()
-: root( NULL ), elements( NULL )
+: root( NULL ), elements( NULL ), buildCost( 0.0f ), _nodeMemory( NULL ), _nodeCount( 0 ), _elementCount( 0 )
 {
 }
 
 void KdTreeAccStruct::clear()
 {
-	if( root != NULL )
-		delete [] root;
+	if( _nodeMemory != NULL )
+		delete [] _nodeMemory;
+
+	// Mapped elements are released with the mapping
+	if( ( elements != NULL ) && ( _mappedFile == NULL ) )
+		delete [] elements;
+
+	_nodeMemory = NULL;
+	root = NULL;
+	elements = NULL;
+	_nodeCount = 0;
+	_elementCount = 0;
+	_mappedFile = NULL;
+	buildCost = 0.0f;
+
+	for( uint32 i = 0, size = _unbuiltSubtrees.size(); i < size; ++i )
+	{
+		UnbuiltSubtree* subtree = _unbuiltSubtrees[i];
+		if( subtree->tree != NULL )
+			subtree->tree->clear();
+
+		omp_destroy_lock( &subtree->lock );
+		delete subtree;
+	}
+
+	_unbuiltSubtrees.clear();
+	_lazyBuilder = NULL;
+
+	vr::vectorFreeMemory( blocks );
+}
+
+void KdTreeAccStruct::allocateNodes( uint32 nodeCount )
+{
+	if( _nodeMemory != NULL )
+		delete [] _nodeMemory;
+
+	// Allocate one extra cache line, then skip nodes until the first cache line boundary
+	_nodeMemory = new KdNode[nodeCount + CACHE_LINE_NODES - 1];
+
+	const size_t misalignment = reinterpret_cast<size_t>( _nodeMemory ) % ( CACHE_LINE_NODES * sizeof( KdNode ) );
+	root = _nodeMemory;
+	if( misalignment != 0 )
+		root += ( CACHE_LINE_NODES * sizeof( KdNode ) - misalignment ) / sizeof( KdNode );
+
+	_nodeCount = nodeCount;
+}
+
+void KdTreeAccStruct::allocateElements( uint32 elementCount )
+{
 	if( elements != NULL )
 		delete [] elements;
+
+	elements = new uint32[elementCount];
+	_elementCount = elementCount;
 }
 
-void KdTreeAccStruct::traceNearestInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample )
+void KdTreeAccStruct::buildTriangleBlocks( const std::vector<rt::TriAccel>& triAccel )
 {
-	rt::Ray& ray = sample.ray;
-	rt::Hit& hit = sample.hit;
+	vr::vectorFreeMemory( blocks );
+	blocks.reserve( _elementCount / 4 );
+	TriAccel4::pack( triAccel, elements, _elementCount, blocks );
+}
 
-	rt::Context* ctx = rt::Context::current();
+uint32 KdTreeAccStruct::getNodeCount() const
+{
+	return _nodeCount;
+}
 
-	// Init ray
-	ray.tnear = ctx->getRayEpsilon();
-	ray.tfar = vr::Mathf::MAX_VALUE;
-	ray.update();
+uint32 KdTreeAccStruct::getElementCount() const
+{
+	return _elementCount;
+}
 
-	// Init hit
-	hit.instance = NULL;
-	hit.distance = vr::Mathf::MAX_VALUE;
+void KdTreeAccStruct::useMappedData( MappedFile* file, const KdNode* nodes, uint32 nodeCount, 
+									 const uint32* elementIds, uint32 elementCount )
+{
+	clear();
+
+	// Traversal never writes to nodes or elements, mapped pages stay read-only
+	_mappedFile = file;
+	root = const_cast<KdNode*>( nodes );
+	elements = const_cast<uint32*>( elementIds );
+	_nodeCount = nodeCount;
+	_elementCount = elementCount;
+}
 
+uint32 KdTreeAccStruct::addUnbuiltSubtree( std::vector<uint32>& triangles, const rt::Aabb& bbox, uint32 treeDepth )
+{
+	UnbuiltSubtree* subtree = new UnbuiltSubtree();
+	subtree->triangles.swap( triangles );
+	subtree->bbox = bbox;
+	subtree->treeDepth = treeDepth;
+	subtree->builtTree = NULL;
+	omp_init_lock( &subtree->lock );
+
+	_unbuiltSubtrees.push_back( subtree );
+	return _unbuiltSubtrees.size() - 1;
+}
+
+void KdTreeAccStruct::setLazyBuilder( KdTreeAccStructBuilder* builder )
+{
+	_lazyBuilder = builder;
+}
+
+void KdTreeAccStruct::findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit )
+{
 	// If not hit bbox of entire scene, no need to trace any further
 	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
-	{
-		ctx->getEnvironment()->shade( sample );
 		return;
-	}
 
-	const rt::Ray originalRay( ray );
 	const KdNode* node = root;
+	KdTreeAccStruct* tree = this;
 	s_instanceStack.clear();
 
 	while( true )
 	{
-		findLeaf( node, ray, s_instanceStack );
+		// Instance trees are never lazy
+		findLeaf( node, tree, ray, s_instanceStack, NULL );
 
 		for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
 		{
-			const rt::Instance& instance = instances[elements[i]];
+			const rt::Instance& instance = instances[tree->elements[i]];
 
-			// Transform ray to geometry's local space
-			instance.transform.inverseTransform( ray );
-			ray.update();
+			// Transform a copy of ray, limited to the part inside leaf, to geometry's local space.
+			// Hits behind the leaf must wait for their own leaf, a nearer one may come before it.
+			rt::Ray localRay( ray );
+			instance.transform.inverseTransform( localRay );
+			localRay.update();
 
 			// Ask geometry's acceleration structure to trace the transformed ray
-			instance.geometry->accStruct->traceNearestGeometry( instance, ray, hit );
-
-			// Transform ray back to global space
-			ray = originalRay;
+			instance.geometry->accStruct->traceNearestGeometry( instance, localRay, hit );
 		}
 
-		// If found hit, return
-		if( hit.instance )
-		{
-			hit.instance->geometry->triDesc[hit.triangleId].material->shade( sample );
+		// If found hit, or no more nodes to traverse, return
+		if( hit.instance || s_instanceStack.empty() )
 			return;
+
+		// Continue traversal
+		const TraversalData& data = s_instanceStack.top();
+		s_instanceStack.pop();
+		node = data.node;
+		tree = data.tree;
+		ray.tnear = data.tnear;
+		ray.tfar = data.tfar;
+	}
+}
+
+void KdTreeAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	traceNearest<WaldIntersector>( instance, ray, hit, simdEnabled() );
+}
+
+bool KdTreeAccStruct::traceAnyInstance( const std::vector<rt::Instance>& instances, rt::Sample& sample )
+{
+	rt::Ray& ray = sample.ray;
+
+	// Init ray, keeping tfar of the shadow ray
+	ray.tnear = rt::Context::current()->getRayEpsilon();
+	ray.update();
+
+	// If not hit bbox of entire scene, nothing can block the ray
+	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	const rt::Ray originalRay( ray );
+	const KdNode* node = root;
+	KdTreeAccStruct* tree = this;
+	s_instanceStack.clear();
+
+	while( true )
+	{
+		// Instance trees are never lazy
+		findLeaf( node, tree, ray, s_instanceStack, NULL );
+
+		for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
+		{
+			const rt::Instance& instance = instances[tree->elements[i]];
+
+			// Transform a copy of ray, limited to the part inside leaf, to geometry's local space
+			rt::Ray localRay( ray );
+			instance.transform.inverseTransform( localRay );
+			localRay.update();
+
+			if( instance.geometry->accStruct->traceAnyGeometry( instance, localRay, sample.hit ) )
+			{
+				ray = originalRay;
+				return true;
+			}
 		}
 
-		// If no more nodes to traverse, return
+		// If no more nodes to traverse, ray is not blocked
 		if( s_instanceStack.empty() )
 		{
-			ctx->getEnvironment()->shade( sample );
-			return;
+			ray = originalRay;
+			return false;
 		}
 
 		// Continue traversal
 		const TraversalData& data = s_instanceStack.top();
 		s_instanceStack.pop();
 		node = data.node;
+		tree = data.tree;
 		ray.tnear = data.tnear;
 		ray.tfar = data.tfar;
 	}
 }
 
-void KdTreeAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+bool KdTreeAccStruct::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// Hit is only needed by nearest hit traversals
+	hit;
+
+	return traceAny<WaldIntersector>( instance, ray, simdEnabled() );
+}
+
+void KdTreeAccStruct::traceNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Sample* samples, 
+												   uint32 count )
+{
+	for( uint32 start = 0; start < count; start += RayPacket::SIZE )
+	{
+		traceInstancePacket( instances, samples + start, vr::min( count - start, RayPacket::SIZE ) );
+	}
+}
+
+void KdTreeAccStruct::findNearestInstancePacket( const std::vector<rt::Instance>& instances, rt::Ray* rays, rt::Hit* hits, 
+												  uint32 count )
+{
+	for( uint32 start = 0; start < count; start += RayPacket::SIZE )
+	{
+		findInstancePacket( instances, rays + start, hits + start, vr::min( count - start, RayPacket::SIZE ) );
+	}
+}
+
+void KdTreeAccStruct::traceNearestGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count )
+{
+	const bool simd = simdEnabled();
+
+	for( uint32 start = 0; start < count; start += RayPacket::SIZE )
+	{
+		const uint32 size = vr::min( count - start, RayPacket::SIZE );
+
+		// Incoherent or lone rays are traced one by one
+		if( ( size < 2 ) || !RayPacket::isCoherent( rays + start, size ) )
+		{
+			for( uint32 i = start, limit = start + size; i < limit; ++i )
+			{
+				traceNearest<WaldIntersector>( instance, rays[i], hits[i], simd );
+			}
+			continue;
+		}
+
+		traceGeometryPacket( instance, rays + start, hits + start, size );
+	}
+}
+
+// Protected
+bool KdTreeAccStruct::simdEnabled()
+{
+	return ( rt::Context::current()->getSimdLevel() >= RT_SIMD_SSE );
+}
+
+template<class Intersector>
+void KdTreeAccStruct::traceNearest( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit, bool simd )
 {
 	// If don't hit bbox in local space, no need to trace underlying triangles
 	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
@@ -127,16 +339,38 @@ void KdTreeAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ra
 
 	const rt::Geometry& geometry = *instance.geometry;
 	const KdNode* node = root;
+	KdTreeAccStruct* tree = this;
 	float bestDistance = hit.distance;
 	s_geometryStack.clear();
 
+	// Triangle blocks need SSE and a kernel agreeing with them, trees without blocks test elements one by one
+	const bool useBlocks = Intersector::USES_TRIACCEL && simd;
+	TriAccel4::SimdRay simdRay;
+	if( useBlocks )
+		simdRay.load( ray );
+
 	while( true )
 	{
-		findLeaf( node, ray, s_geometryStack );
+		findLeaf( node, tree, ray, s_geometryStack, instance.geometry );
 
-		for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
+		if( useBlocks && !tree->blocks.empty() )
 		{
-			rt::RayTriIntersection::hitWald( geometry.triAccel[elements[i]], ray, hit, bestDistance );
+			// Hits are only valid inside the leaf
+			simdRay.setInterval( ray.tnear, ray.tfar );
+
+			const TriAccel4* const treeBlocks = &tree->blocks[0];
+			for( uint32 i = node->elemStart() / 4, limit = i + ( node->elemCount() + 3 ) / 4; i < limit; ++i )
+			{
+				treeBlocks[i].hit( simdRay, hit, bestDistance );
+			}
+		}
+		else
+		{
+			const uint32* const treeElements = tree->elements;
+			for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
+			{
+				Intersector::hit( geometry, treeElements[i], ray, hit, bestDistance );
+			}
 		}
 
 		// If found hit, return
@@ -155,52 +389,318 @@ void KdTreeAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ra
 		const TraversalData& data = s_geometryStack.top();
 		s_geometryStack.pop();
 		node = data.node;
+		tree = data.tree;
+		ray.tnear = data.tnear;
+		ray.tfar = data.tfar;
+	}
+}
+
+template<class Intersector>
+bool KdTreeAccStruct::traceAny( const rt::Instance& instance, rt::Ray& ray, bool simd )
+{
+	// If don't hit bbox in local space, no need to trace underlying triangles
+	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	// Triangles are tested against the whole ray, not only the part inside their leaf: 
+	// any hit blocks the ray, and finding it in the first leaf that holds the triangle ends traversal sooner
+	const rt::Ray originalRay( ray );
+	const rt::Geometry& geometry = *instance.geometry;
+	const KdNode* node = root;
+	KdTreeAccStruct* tree = this;
+	s_geometryStack.clear();
+
+	const bool useBlocks = Intersector::USES_TRIACCEL && simd;
+	TriAccel4::SimdRay simdRay;
+	if( useBlocks )
+		simdRay.load( originalRay );
+
+	while( true )
+	{
+		findLeaf( node, tree, ray, s_geometryStack, instance.geometry );
+
+		if( useBlocks && !tree->blocks.empty() )
+		{
+			const TriAccel4* const treeBlocks = &tree->blocks[0];
+			for( uint32 i = node->elemStart() / 4, limit = i + ( node->elemCount() + 3 ) / 4; i < limit; ++i )
+			{
+				if( treeBlocks[i].hitAny( simdRay ) )
+					return true;
+			}
+		}
+		else
+		{
+			const uint32* const treeElements = tree->elements;
+			for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
+			{
+				if( Intersector::hitAny( geometry, treeElements[i], originalRay ) )
+					return true;
+			}
+		}
+
+		// If no more nodes to traverse, ray is not blocked
+		if( s_geometryStack.empty() )
+			return false;
+
+		// Continue traversal
+		const TraversalData& data = s_geometryStack.top();
+		s_geometryStack.pop();
+		node = data.node;
+		tree = data.tree;
 		ray.tnear = data.tnear;
 		ray.tfar = data.tfar;
 	}
 }
 
+// Instantiations for all intersection policies
+template void KdTreeAccStruct::traceNearest<WaldIntersector>( const rt::Instance&, rt::Ray&, rt::Hit&, bool );
+template bool KdTreeAccStruct::traceAny<WaldIntersector>( const rt::Instance&, rt::Ray&, bool );
+template void KdTreeAccStruct::traceNearest<MollerTrumboreIntersector>( const rt::Instance&, rt::Ray&, rt::Hit&, bool );
+template bool KdTreeAccStruct::traceAny<MollerTrumboreIntersector>( const rt::Instance&, rt::Ray&, bool );
+
 // Private
-void KdTreeAccStruct::findLeaf( const KdNode*& node, rt::Ray& ray, TraversalStack& stack )
+void KdTreeAccStruct::traceInstancePacket( const std::vector<rt::Instance>& instances, rt::Sample* samples, uint32 count )
 {
-	while( !node->isLeaf() )
+	rt::Context* ctx = rt::Context::current();
+	rt::Ray rays[RayPacket::SIZE];
+	rt::Hit hits[RayPacket::SIZE];
+
+	// Init rays and hits
+	for( uint32 i = 0; i < count; ++i )
 	{
-		// Need to avoid NaN's when split - ray.origin[axis] == 0 and ray.invDir[axis] == +/- INF
-		const RTenum axis = node->axis();
-		const float d = ( node->splitPos() - ray.orig[axis] ) * ray.invDir[axis];
+		rt::Ray& ray = samples[i].ray;
+		ray.tnear = ctx->getRayEpsilon();
+		ray.tfar = vr::Mathf::MAX_VALUE;
+		ray.update();
+		rays[i] = ray;
+
+		hits[i].instance = NULL;
+		hits[i].distance = vr::Mathf::MAX_VALUE;
+	}
 
-		const uint32 bit = ray.dirSignBits[axis];
+	findInstancePacket( instances, rays, hits, count );
 
-		const KdNode* const front = node->leftChild() + bit;
-		const KdNode* const back = node->leftChild() + !bit;
+	for( uint32 i = 0; i < count; ++i )
+	{
+		rt::Sample& sample = samples[i];
+		sample.hit = hits[i];
 
-		// Using < and > instead of <= and >= because of flat cells and triangles in the split plane.
-		// In this case, we must traverse both children to guarantee that we hit the triangle we want.
-		if( d < ray.tnear )
+		if( sample.hit.instance )
+			sample.hit.instance->geometry->triDesc[sample.hit.triangleId].material->shade( sample );
+		else
+			ctx->getEnvironment()->shade( sample );
+	}
+}
+
+void KdTreeAccStruct::findInstancePacket( const std::vector<rt::Instance>& instances, rt::Ray* rays, rt::Hit* hits, 
+										  uint32 count )
+{
+	// Incoherent or lone rays are traced one by one
+	if( ( count < 2 ) || !RayPacket::isCoherent( rays, count ) )
+	{
+		for( uint32 i = 0; i < count; ++i )
+		{
+			findNearestInstance( instances, rays[i], hits[i] );
+		}
+		return;
+	}
+
+	// Rays that do not hit bbox of entire scene are inactive
+	int32 missed = 0;
+	for( uint32 i = 0; i < count; ++i )
+	{
+		if( !rt::AabbIntersection::clipRay( _bbox, rays[i] ) )
+			missed |= ( 1 << i );
+	}
+
+	RayPacket packet;
+	packet.load( rays, count );
+	for( uint32 i = 0; i < count; ++i )
+	{
+		if( missed & ( 1 << i ) )
+			packet.deactivate( i );
+	}
+
+	__m128 bestDistance[RayPacket::GROUP_COUNT];
+	for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+		bestDistance[g] = _mm_set1_ps( vr::Mathf::MAX_VALUE );
+
+	// Active rays of a leaf, transformed to the local space of each instance
+	rt::Ray localRays[RayPacket::SIZE];
+	rt::Hit localHits[RayPacket::SIZE];
+	uint32 lanes[RayPacket::SIZE];
+	float tnear[RayPacket::SIZE];
+	float tfar[RayPacket::SIZE];
+	float distance[RayPacket::SIZE];
+
+	const KdNode* node = root;
+	KdTreeAccStruct* tree = this;
+	s_instancePacketStack.clear();
+
+	do
+	{
+		if( !packet.activeMask() )
+			continue;
+
+		// Instance trees are never lazy
+		findPacketLeaf( node, tree, packet, s_instancePacketStack, NULL );
+
+		const int32 active = packet.activeMask();
+		for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
 		{
-			node = back;
+			_mm_storeu_ps( tnear + g * 4, packet.tnear[g] );
+			_mm_storeu_ps( tfar + g * 4, packet.tfar[g] );
 		}
-		else if( d > ray.tfar )
+
+		for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
 		{
-			node = front;
+			const rt::Instance& instance = instances[tree->elements[i]];
+
+			uint32 localCount = 0;
+			for( uint32 lane = 0; lane < count; ++lane )
+			{
+				if( !( active & ( 1 << lane ) ) )
+					continue;
+
+				// Transform ray to geometry's local space
+				rt::Ray& ray = localRays[localCount];
+				ray = rays[lane];
+				ray.tnear = tnear[lane];
+				ray.tfar = tfar[lane];
+				instance.transform.inverseTransform( ray );
+				ray.update();
+
+				localHits[localCount] = hits[lane];
+				lanes[localCount] = lane;
+				++localCount;
+			}
+
+			// Ask geometry's acceleration structure to trace the transformed rays
+			instance.geometry->accStruct->traceNearestGeometryPacket( instance, localRays, localHits, localCount );
+
+			for( uint32 j = 0; j < localCount; ++j )
+				hits[lanes[j]] = localHits[j];
 		}
-		else
+
+		for( uint32 lane = 0; lane < RayPacket::SIZE; ++lane )
+			distance[lane] = ( lane < count ) ? hits[lane].distance : vr::Mathf::MAX_VALUE;
+		for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+			bestDistance[g] = _mm_loadu_ps( distance + g * 4 );
+	}
+	while( popPacket( node, tree, packet, s_instancePacketStack, bestDistance ) );
+}
+
+void KdTreeAccStruct::traceGeometryPacket( const rt::Instance& instance, rt::Ray* rays, rt::Hit* hits, uint32 count )
+{
+	// Rays that do not hit bbox in local space are inactive
+	int32 missed = 0;
+	for( uint32 i = 0; i < count; ++i )
+	{
+		if( !rt::AabbIntersection::clipRay( _bbox, rays[i] ) )
+			missed |= ( 1 << i );
+	}
+
+	if( missed == ( 1 << count ) - 1 )
+		return;
+
+	RayPacket packet;
+	packet.load( rays, count );
+	for( uint32 i = 0; i < count; ++i )
+	{
+		if( missed & ( 1 << i ) )
+			packet.deactivate( i );
+	}
+
+	// Best distances consider any previously found hits to prevent false hits in this geometry
+	PacketHit hit;
+	hit.load( hits, count );
+
+	const rt::Geometry& geometry = *instance.geometry;
+	const KdNode* node = root;
+	KdTreeAccStruct* tree = this;
+	s_geometryPacketStack.clear();
+
+	do
+	{
+		if( !packet.activeMask() )
+			continue;
+
+		findPacketLeaf( node, tree, packet, s_geometryPacketStack, instance.geometry );
+
+		// Only groups with active rays need to be tested
+		const int32 active = packet.activeMask();
+		const uint32* const treeElements = tree->elements;
+
+		for( uint32 i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
 		{
-			stack.push();
-			TraversalData& data = stack.top();
-
-			// Store far child for later traversal
-			data.node  = back;
-			//data.tnear = d;
-			data.tnear = ( d > ray.tnear ) ? d : ray.tnear; // avoid NaNs
-			data.tfar  = ray.tfar;
-
-			// Continue with front child
-			node = front;
-			//ray.tfar = d;
-			ray.tfar = ( d < ray.tfar ) ? d : ray.tfar; // avoid NaNs
+			const rt::TriAccel& acc = geometry.triAccel[treeElements[i]];
+			for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+			{
+				if( active & ( 0xF << ( g * 4 ) ) )
+					packet.hitWald( acc, g, hit );
+			}
 		}
 	}
+	while( popPacket( node, tree, packet, s_geometryPacketStack, hit.distance ) );
+
+	hit.store( hits, count, &instance );
+}
+
+void KdTreeAccStruct::findLeaf( const KdNode*& node, KdTreeAccStruct*& tree, rt::Ray& ray, TraversalStack& stack, 
+							    rt::Geometry* geometry )
+{
+	const KdNode* nodes = tree->root;
+
+	for( ;; )
+	{
+		while( !node->isLeaf() )
+		{
+			// Need to avoid NaN's when split - ray.origin[axis] == 0 and ray.invDir[axis] == +/- INF
+			const RTenum axis = node->axis();
+			const float d = ( node->splitPos() - ray.orig[axis] ) * ray.invDir[axis];
+
+			const uint32 bit = ray.dirSignBits[axis];
+
+			const KdNode* const front = nodes + node->leftChild() + bit;
+			const KdNode* const back = nodes + node->leftChild() + !bit;
+
+			// Using < and > instead of <= and >= because of flat cells and triangles in the split plane.
+			// In this case, we must traverse both children to guarantee that we hit the triangle we want.
+			if( d < ray.tnear )
+			{
+				node = back;
+			}
+			else if( d > ray.tfar )
+			{
+				node = front;
+			}
+			else
+			{
+				stack.push();
+				TraversalData& data = stack.top();
+
+				// Store far child for later traversal
+				data.node  = back;
+				data.tree  = tree;
+				//data.tnear = d;
+				data.tnear = ( d > ray.tnear ) ? d : ray.tnear; // avoid NaNs
+				data.tfar  = ray.tfar;
+
+				// Continue with front child
+				node = front;
+				//ray.tfar = d;
+				ray.tfar = ( d < ray.tfar ) ? d : ray.tfar; // avoid NaNs
+			}
+		}
+
+		if( !node->isUnbuilt() )
+			return;
+
+		// Lazy build: continue in the leaf's subtree
+		tree = tree->unbuiltSubtree( node->subtreeId(), geometry );
+		nodes = tree->root;
+		node = nodes;
+	}
 	
 	// alternative version by tbp & phantom (2005)
 	// approx. 26 cycles in K8
@@ -238,3 +738,124 @@ void KdTreeAccStruct::findLeaf( const KdNode*& node, rt::Ray& ray, TraversalStac
     }
     */
 }
+
+void KdTreeAccStruct::findPacketLeaf( const KdNode*& node, KdTreeAccStruct*& tree, RayPacket& packet, 
+									 PacketTraversalStack& stack, rt::Geometry* geometry )
+{
+	const KdNode* nodes = tree->root;
+	__m128 d[RayPacket::GROUP_COUNT];
+
+	for( ;; )
+	{
+		while( !node->isLeaf() )
+		{
+			const RTenum axis = node->axis();
+			const __m128 split = _mm_set1_ps( node->splitPos() );
+
+			// All rays share direction signs, so front and back children are the same for the whole packet
+			const uint32 bit = packet.dirSignBits[axis];
+
+			const KdNode* const front = nodes + node->leftChild() + bit;
+			const KdNode* const back = nodes + node->leftChild() + !bit;
+
+			// Same rules as for single rays: a ray crosses the front child unless d < tnear, 
+			// and the back child unless d > tfar. Comparisons against NaN's are false, so such rays cross both.
+			int32 needFront = 0;
+			int32 needBack = 0;
+
+			for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+			{
+				d[g] = _mm_mul_ps( _mm_sub_ps( split, packet.orig[axis][g] ), packet.invDir[axis][g] );
+
+				const __m128 active = _mm_cmple_ps( packet.tnear[g], packet.tfar[g] );
+				needFront |= _mm_movemask_ps( _mm_and_ps( active, _mm_cmpnlt_ps( d[g], packet.tnear[g] ) ) );
+				needBack |= _mm_movemask_ps( _mm_and_ps( active, _mm_cmpngt_ps( d[g], packet.tfar[g] ) ) );
+			}
+
+			if( !needFront )
+			{
+				node = back;
+			}
+			else if( !needBack )
+			{
+				node = front;
+			}
+			else
+			{
+				stack.push();
+				PacketTraversalData& data = stack.top();
+
+				// Store far child for later traversal.
+				// Min/max return their second operand if any is NaN, so NaN's never change intervals.
+				data.node = back;
+				data.tree = tree;
+				for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+				{
+					_mm_storeu_ps( data.tnear + g * 4, _mm_max_ps( d[g], packet.tnear[g] ) );
+					_mm_storeu_ps( data.tfar + g * 4, packet.tfar[g] );
+
+					// Rays that only cross the back child become inactive in the front one
+					packet.tfar[g] = _mm_min_ps( d[g], packet.tfar[g] );
+				}
+
+				// Continue with front child
+				node = front;
+			}
+		}
+
+		if( !node->isUnbuilt() )
+			return;
+
+		// Lazy build: continue in the leaf's subtree
+		tree = tree->unbuiltSubtree( node->subtreeId(), geometry );
+		nodes = tree->root;
+		node = nodes;
+	}
+}
+
+bool KdTreeAccStruct::popPacket( const KdNode*& node, KdTreeAccStruct*& tree, RayPacket& packet, 
+								 PacketTraversalStack& stack, const __m128* bestDistance )
+{
+	if( stack.empty() )
+		return false;
+
+	const PacketTraversalData& data = stack.top();
+	stack.pop();
+	node = data.node;
+	tree = data.tree;
+
+	// Rays whose nearest hit lies before the node become inactive
+	for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+	{
+		packet.tnear[g] = _mm_loadu_ps( data.tnear + g * 4 );
+		packet.tfar[g] = _mm_min_ps( _mm_loadu_ps( data.tfar + g * 4 ), bestDistance[g] );
+	}
+
+	return true;
+}
+
+KdTreeAccStruct* KdTreeAccStruct::unbuiltSubtree( uint32 subtreeId, rt::Geometry* geometry )
+{
+	UnbuiltSubtree& subtree = *_unbuiltSubtrees[subtreeId];
+
+	// Built already, no need to lock
+	KdTreeAccStruct* result = subtree.builtTree;
+	if( result != NULL )
+		return result;
+
+	// Other threads reaching the same subtree wait for it to be built
+	omp_set_lock( &subtree.lock );
+
+	if( subtree.builtTree == NULL )
+	{
+		KdTreeAccStructBuilder* builder = static_cast<KdTreeAccStructBuilder*>( _lazyBuilder.get() );
+		subtree.tree = builder->buildSubtree( geometry, subtree.triangles, subtree.bbox, subtree.treeDepth );
+		vr::vectorFreeMemory( subtree.triangles );
+		subtree.builtTree = subtree.tree.get();
+	}
+
+	result = subtree.builtTree;
+	omp_unset_lock( &subtree.lock );
+
+	return result;
+}
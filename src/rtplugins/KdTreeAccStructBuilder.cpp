@@ -2,12 +2,51 @@
 #include <rtp/KdTreeAccStruct.h>
 #include <TriangleTreeBuilder.h>
 #include <InstanceTreeBuilder.h>
+#include <rt/AabbIntersection.h>
+#include <vr/timer.h>
 #include <queue>
+#include <string.h>
 
 using namespace rtp;
 
+// Sibling pairs per treelet: 4 pairs of 8 byte nodes fill a 64 byte cache line
+static const uint32 TREELET_PAIRS = 4;
+static const uint32 CACHE_LINE_NODES = 2 * TREELET_PAIRS;
+
+// Sibling pair waiting to be placed in treelet layout
+struct PendingPair
+{
+	RawKdNode* parent;
+	uint32 parentId;
+	// Position of parent's pair inside current treelet and side of parent within it
+	uint32 sourcePair;
+	uint32 side;
+};
+
+// Element ids stored by the leaves of a tree, each leaf padded to a multiple of 4 for triangle blocks
+static uint32 paddedElementCount( RawKdNode* node )
+{
+	if( !node->isLeaf() )
+		return paddedElementCount( node->left.get() ) + paddedElementCount( node->right.get() );
+
+	return node->unbuilt ? 0 : ( node->elements.size() + 3 ) & ~3u;
+}
+
+// SAH costs of InstanceTreeBuilder, only used to compare instance trees with themselves
+static const float INSTANCE_TRAVERSAL_COST = 1.0f;
+static const float INSTANCE_INTERSECTION_COST = 1.4f;
+
+// First block of a cached tree, followed by the node and element arrays
+struct CachedTreeInfo
+{
+	rt::Aabb bbox;
+	uint32 nodeCount;
+	uint32 elementCount;
+};
+
 KdTreeAccStructBuilder::KdTreeAccStructBuilder()
-: _triangleTreeBuilder( new TriangleTreeBuilder ), _instanceTreeBuilder( new InstanceTreeBuilder )
+: _triangleTreeBuilder( new TriangleTreeBuilder ), _instanceTreeBuilder( new InstanceTreeBuilder ), 
+  _nodeLayout( TREELETS ), _triangleBlocks( true ), _maxRefitCost( 1.3f ), _refitInstances( NULL )
 {
 	// empty
 }
@@ -20,11 +59,13 @@ KdTreeAccStructBuilder::~KdTreeAccStructBuilder()
 
 void KdTreeAccStructBuilder::buildGeometry( rt::Geometry* geometry )
 {
-	// Create kd-Tree using current geometry data. Ref_ptr will delete object in the end of this method.
-	vr::ref_ptr<RawKdTree> tree = _triangleTreeBuilder->buildTree( geometry );
+	// Unbuilt subtrees cannot be stored, so lazy builds bypass the cache
+	buildTree( geometry, _cache.isEnabled() && ( getLazyDepth() == 0 ) );
+}
 
-	// Create accelerated kd tree for ray tracing
-	geometry->accStruct = convertRawTree( tree.get() );
+void KdTreeAccStructBuilder::updateGeometry( rt::Geometry* geometry )
+{
+	buildTree( geometry, false );
 }
 
 rt::IAccStruct* KdTreeAccStructBuilder::buildInstance( const std::vector<rt::Instance> instances )
@@ -32,29 +73,241 @@ rt::IAccStruct* KdTreeAccStructBuilder::buildInstance( const std::vector<rt::Ins
 	// Rebuild instance kd tree
 	vr::ref_ptr<RawKdTree> tree = _instanceTreeBuilder->buildTree( instances );
 
+	// Create accelerated kd tree for ray tracing, elements are instances
+	KdTreeAccStruct* result = convertRawTree( tree.get(), false );
+
+	const float rootArea = tree->bbox.computeSurfaceArea();
+	if( ( result->getNodeCount() > 0 ) && ( rootArea > 0.0f ) )
+		result->buildCost = computeInstanceCost( result, 0, tree->bbox ) / rootArea;
+
+	return result;
+}
+
+rt::IAccStruct* KdTreeAccStructBuilder::updateInstance( rt::IAccStruct* accStruct, const std::vector<rt::Instance>& instances, 
+													   const std::vector<uint32>& changedIds )
+{
+	// Trees without a build cost were not built by buildInstance, or have nothing to compare against
+	KdTreeAccStruct* tree = dynamic_cast<KdTreeAccStruct*>( accStruct );
+	if( !tree || ( tree->getNodeCount() == 0 ) || ( tree->buildCost <= 0.0f ) )
+		return buildInstance( instances );
+
+	if( changedIds.empty() )
+		return tree;
+
+	// Split planes partition all of space, so the scene box may simply grow with the moved instances.
+	// Instances moved several times since the last update are listed once.
+	rt::Aabb bbox = tree->getBoundingBox();
+	std::vector<uint32> movedIds;
+	_movedInstances.assign( instances.size(), false );
+
+	for( uint32 i = 0, limit = changedIds.size(); i < limit; ++i )
+	{
+		if( _movedInstances[changedIds[i]] )
+			continue;
+
+		_movedInstances[changedIds[i]] = true;
+		movedIds.push_back( changedIds[i] );
+		bbox.expandBy( instances[changedIds[i]].bbox );
+	}
+
+	_refitInstances = &instances;
+	_refitElements.clear();
+	const float cost = reinsertInstances( tree, 0, bbox, movedIds );
+	_refitInstances = NULL;
+
+	tree->allocateElements( _refitElements.size() );
+	if( !_refitElements.empty() )
+		memcpy( tree->elements, &_refitElements[0], _refitElements.size() * sizeof( uint32 ) );
+
+	tree->setBoundingBox( bbox );
+
+	const float rootArea = bbox.computeSurfaceArea();
+	if( ( rootArea > 0.0f ) && ( cost / rootArea > _maxRefitCost * tree->buildCost ) )
+		return buildInstance( instances );
+
+	return tree;
+}
+
+void KdTreeAccStructBuilder::setMaxRefitCost( float factor )
+{
+	_maxRefitCost = factor;
+}
+
+float KdTreeAccStructBuilder::getMaxRefitCost() const
+{
+	return _maxRefitCost;
+}
+
+void KdTreeAccStructBuilder::setBuildMode( BuildMode mode )
+{
+	_triangleTreeBuilder->setBuildMode( mode );
+}
+
+KdTreeAccStructBuilder::BuildMode KdTreeAccStructBuilder::getBuildMode() const
+{
+	return _triangleTreeBuilder->getBuildMode();
+}
+
+void KdTreeAccStructBuilder::setThreadCount( uint32 count )
+{
+	_triangleTreeBuilder->setThreadCount( count );
+	_instanceTreeBuilder->setThreadCount( count );
+}
+
+uint32 KdTreeAccStructBuilder::getThreadCount() const
+{
+	return _triangleTreeBuilder->getThreadCount();
+}
+
+void KdTreeAccStructBuilder::setNodeLayout( NodeLayout layout )
+{
+	_nodeLayout = layout;
+}
+
+KdTreeAccStructBuilder::NodeLayout KdTreeAccStructBuilder::getNodeLayout() const
+{
+	return _nodeLayout;
+}
+
+void KdTreeAccStructBuilder::setLazyDepth( uint32 levels )
+{
+	_triangleTreeBuilder->setLazyDepth( levels );
+}
+
+uint32 KdTreeAccStructBuilder::getLazyDepth() const
+{
+	return _triangleTreeBuilder->getLazyDepth();
+}
+
+void KdTreeAccStructBuilder::setTriangleBlocks( bool enabled )
+{
+	_triangleBlocks = enabled;
+}
+
+bool KdTreeAccStructBuilder::getTriangleBlocks() const
+{
+	return _triangleBlocks;
+}
+
+void KdTreeAccStructBuilder::setCacheDirectory( const std::string& directory )
+{
+	_cache.setDirectory( directory );
+}
+
+const std::string& KdTreeAccStructBuilder::getCacheDirectory() const
+{
+	return _cache.getDirectory();
+}
+
+KdTreeAccStruct* KdTreeAccStructBuilder::buildSubtree( rt::Geometry* geometry, const std::vector<uint32>& triangles, 
+													   const rt::Aabb& bbox, uint32 treeDepth )
+{
+	// Tree builders keep build state, so each subtree gets its own
+	TriangleTreeBuilder builder;
+	builder.setBuildMode( getBuildMode() );
+	builder.setLazyDepth( getLazyDepth() );
+
+	vr::ref_ptr<RawKdTree> tree = builder.buildSubtree( geometry, triangles, bbox, treeDepth );
+	KdTreeAccStruct* result = convertRawTree( tree.get(), _triangleBlocks );
+
+	if( _triangleBlocks )
+		result->buildTriangleBlocks( geometry->triAccel );
+
+	if( tree->stats.unbuiltCount > 0 )
+		result->setLazyBuilder( this );
+
+	return result;
+}
+
+// Protected methods
+KdTreeAccStruct* KdTreeAccStructBuilder::newAccStruct() const
+{
+	return new KdTreeAccStruct();
+}
+
+// Private methods
+
+void KdTreeAccStructBuilder::buildTree( rt::Geometry* geometry, bool useCache )
+{
+	AccStructCache::Key key;
+	if( useCache )
+	{
+		key = _cache.makeKey( geometry, AccStructCache::KD_TREE, cacheSettings() );
+
+		KdTreeAccStruct* cached = loadCachedTree( key );
+		if( cached != NULL )
+		{
+			// Blocks are not cached, they are quickly packed again from the loaded element ids
+			if( _triangleBlocks )
+				cached->buildTriangleBlocks( geometry->triAccel );
+
+			geometry->accStruct = cached;
+			return;
+		}
+	}
+
+	// Create kd-Tree using current geometry data. Ref_ptr will delete object in the end of this method.
+	vr::ref_ptr<RawKdTree> tree = _triangleTreeBuilder->buildTree( geometry );
+
+	// Print stats
+	tree->stats.print( ( getBuildMode() == PRESORTED_EVENTS ) ? "Kd-Tree (presorted events)" : "Kd-Tree (sort per node)" );
+
 	// Create accelerated kd tree for ray tracing
-	return convertRawTree( tree.get() );
+	KdTreeAccStruct* result = convertRawTree( tree.get(), _triangleBlocks );
+
+	if( _triangleBlocks )
+	{
+		result->buildTriangleBlocks( geometry->triAccel );
+		printf( "triangleBlocks: %d (%.1f%% of lanes used)\n", result->blocks.size(), 
+			    result->blocks.empty() ? 0.0f : 25.0f * tree->stats.elemIdCount / result->blocks.size() );
+	}
+
+	// Unbuilt subtrees are built later with current settings, even if this builder is gone or changed by then
+	if( tree->stats.unbuiltCount > 0 )
+	{
+		KdTreeAccStructBuilder* lazyBuilder = new KdTreeAccStructBuilder();
+		lazyBuilder->setBuildMode( getBuildMode() );
+		lazyBuilder->setNodeLayout( _nodeLayout );
+		lazyBuilder->setLazyDepth( getLazyDepth() );
+		lazyBuilder->setTriangleBlocks( _triangleBlocks );
+		result->setLazyBuilder( lazyBuilder );
+	}
+
+	if( useCache )
+		saveCachedTree( key, result );
+
+	geometry->accStruct = result;
 }
 
-KdTreeAccStruct* KdTreeAccStructBuilder::convertRawTree( RawKdTree* tree )
+KdTreeAccStruct* KdTreeAccStructBuilder::convertRawTree( RawKdTree* tree, bool padLeaves )
 {
 	// Target tree
-	KdTreeAccStruct* result = new KdTreeAccStruct();
+	KdTreeAccStruct* result = newAccStruct();
 
 	// Store bounding box
 	result->setBoundingBox( tree->bbox );
 
-	// Create optimized nodes
-	result->root = new KdNode[tree->stats.nodeCount];
-
 	// Create triangle ids
-	result->elements = new uint32[tree->stats.elemIdCount];
+	result->allocateElements( padLeaves ? paddedElementCount( tree->root.get() ) : tree->stats.elemIdCount );
+
+	// Create optimized nodes and store triangle ids
+	if( _nodeLayout == TREELETS )
+		layoutTreelets( tree, result, padLeaves );
+	else
+		layoutBreadthFirst( tree, result, padLeaves );
+
+	return result;
+}
+
+void KdTreeAccStructBuilder::layoutBreadthFirst( RawKdTree* tree, KdTreeAccStruct* result, bool padLeaves )
+{
+	// Create optimized nodes
+	result->allocateNodes( tree->stats.nodeCount );
 
 	// Store triangle ids and setup optimized nodes
 	uint32 dstNode = 0;
 	uint32 dstElemId = 0;
-	uint32 elemIdCount = 0;
-    uint32 childId = 1;
+	uint32 childId = 1;
 
 	RawKdNode* current;
 	std::queue<RawKdNode*> next;
@@ -67,31 +320,291 @@ KdTreeAccStruct* KdTreeAccStructBuilder::convertRawTree( RawKdTree* tree )
 
 		if( !current->isLeaf() )
 		{
-			result->root[dstNode].setInternalNode( current->split, &result->root[childId] );
+			result->root[dstNode].setInternalNode( current->split, childId );
 			next.push( current->left.get() );
 			next.push( current->right.get() );
 
 			// Update variables for next iteration
-            childId += 2;
-            ++dstNode;
+			childId += 2;
+			++dstNode;
 		}
 		else
 		{
-			// Store element ids
-			elemIdCount = current->elements.size();
-			for( uint32 t = 0; t < elemIdCount; ++t )
+			storeLeaf( current, result->root[dstNode], result, dstElemId, padLeaves );
+
+			// Update variables for next iteration
+			++dstNode;
+		}
+	}
+}
+
+void KdTreeAccStructBuilder::layoutTreelets( RawKdTree* tree, KdTreeAccStruct* result, bool padLeaves )
+{
+	// Each treelet holds up to TREELET_PAIRS sibling pairs, chosen breadth-first below its first pair.
+	// Treelets are emitted depth-first, so that a ray path crosses few cache lines.
+	// A treelet starts on a new cache line if it would not fit into the rest of the current one.
+	std::vector<KdNode> nodes;
+	nodes.reserve( tree->stats.nodeCount + tree->stats.nodeCount / 4 + CACHE_LINE_NODES );
+
+	uint32 dstElemId = 0;
+
+	// Root shares the first cache line with its first treelet, padding keeps pairs on even indices
+	RawKdNode* rawRoot = tree->root.get();
+	nodes.resize( 2 );
+	nodes[1].setLeafNode( 0, 0 );
+
+	std::vector<PendingPair> treeletRoots;
+	if( rawRoot->isLeaf() )
+	{
+		storeLeaf( rawRoot, nodes[0], result, dstElemId, padLeaves );
+	}
+	else
+	{
+		PendingPair rootPair = { rawRoot, 0, 0, 0 };
+		treeletRoots.push_back( rootPair );
+	}
+
+	std::vector<PendingPair> treelet;
+	uint32 placed[TREELET_PAIRS];
+
+	while( !treeletRoots.empty() )
+	{
+		treelet.clear();
+		treelet.push_back( treeletRoots.back() );
+		treeletRoots.pop_back();
+
+		// First treelet shares its cache line with the root
+		const uint32 maxPairs = ( nodes.size() == 2 ) ? TREELET_PAIRS - 1 : TREELET_PAIRS;
+
+		// Select pairs breadth-first, entries beyond maxPairs become roots of other treelets
+		for( uint32 p = 0; ( p < treelet.size() ) && ( p < maxPairs ); ++p )
+		{
+			RawKdNode* children[2] = { treelet[p].parent->left.get(), treelet[p].parent->right.get() };
+			for( uint32 side = 0; side < 2; ++side )
 			{
-				result->elements[dstElemId+t] = current->elements[t];
+				if( children[side]->isLeaf() )
+					continue;
+
+				PendingPair pair = { children[side], 0, p, side };
+				treelet.push_back( pair );
 			}
+		}
 
-			// Update optimized node
-			result->root[dstNode].setLeafNode( dstElemId, elemIdCount );
+		const uint32 pairCount = vr::min( (uint32)treelet.size(), maxPairs );
 
-			// Update variables for next iteration
-			++dstNode;
-			dstElemId += elemIdCount;
+		// Start a new cache line if treelet does not fit into current one
+		const uint32 lineUsed = nodes.size() % CACHE_LINE_NODES;
+		if( ( lineUsed != 0 ) && ( lineUsed + 2 * pairCount > CACHE_LINE_NODES ) )
+		{
+			const uint32 first = nodes.size();
+			nodes.resize( first + CACHE_LINE_NODES - lineUsed );
+			for( uint32 i = first; i < nodes.size(); ++i )
+				nodes[i].setLeafNode( 0, 0 );
+		}
+
+		for( uint32 p = 0; p < treelet.size(); ++p )
+		{
+			PendingPair& pair = treelet[p];
+
+			// Parents inside this treelet have been placed already
+			if( p > 0 )
+				pair.parentId = placed[pair.sourcePair] + pair.side;
+
+			if( p >= pairCount )
+				continue;
+
+			const uint32 childId = nodes.size();
+			nodes.resize( childId + 2 );
+			nodes[pair.parentId].setInternalNode( pair.parent->split, childId );
+			placed[p] = childId;
+
+			RawKdNode* children[2] = { pair.parent->left.get(), pair.parent->right.get() };
+			for( uint32 side = 0; side < 2; ++side )
+			{
+				if( children[side]->isLeaf() )
+					storeLeaf( children[side], nodes[childId + side], result, dstElemId, padLeaves );
+			}
+		}
+
+		// Push remaining pairs in reverse, so that the first of them is emitted next
+		for( uint32 p = treelet.size(); p > pairCount; --p )
+		{
+			treeletRoots.push_back( treelet[p-1] );
 		}
 	}
 
+	result->allocateNodes( nodes.size() );
+	std::copy( nodes.begin(), nodes.end(), result->root );
+}
+
+void KdTreeAccStructBuilder::storeLeaf( RawKdNode* leaf, KdNode& node, KdTreeAccStruct* result, uint32& dstElemId, 
+									    bool padLeaves )
+{
+	// Unbuilt subtree takes over the leaf's triangle ids
+	if( leaf->unbuilt )
+	{
+		node.setUnbuiltNode( result->addUnbuiltSubtree( leaf->elements, leaf->bbox, leaf->treeDepth ) );
+		return;
+	}
+
+	// Store element ids
+	const uint32 elemIdCount = leaf->elements.size();
+	for( uint32 t = 0; t < elemIdCount; ++t )
+	{
+		result->elements[dstElemId+t] = leaf->elements[t];
+	}
+
+	node.setLeafNode( dstElemId, elemIdCount );
+	dstElemId += elemIdCount;
+
+	// Fill the rest of the last block with copies of the last triangle
+	if( padLeaves && ( elemIdCount > 0 ) )
+	{
+		for( ; dstElemId & 3; ++dstElemId )
+		{
+			result->elements[dstElemId] = leaf->elements[elemIdCount - 1];
+		}
+	}
+}
+
+float KdTreeAccStructBuilder::computeInstanceCost( const KdTreeAccStruct* tree, uint32 nodeId, const rt::Aabb& bbox ) const
+{
+	const KdNode& node = tree->root[nodeId];
+	const float area = bbox.computeSurfaceArea();
+
+	if( node.isLeaf() )
+		return INSTANCE_INTERSECTION_COST * node.elemCount() * area;
+
+	rt::SplitPlane plane;
+	plane.axis = node.axis();
+	plane.position = node.splitPos();
+
+	rt::Aabb leftBox;
+	rt::Aabb rightBox;
+	rt::AabbIntersection::splitAabb( bbox, plane, leftBox, rightBox );
+
+	return INSTANCE_TRAVERSAL_COST * area + computeInstanceCost( tree, node.leftChild(), leftBox ) + 
+		   computeInstanceCost( tree, node.leftChild() + 1, rightBox );
+}
+
+float KdTreeAccStructBuilder::reinsertInstances( KdTreeAccStruct* tree, uint32 nodeId, const rt::Aabb& bbox, 
+												 const std::vector<uint32>& instanceIds )
+{
+	KdNode& node = tree->root[nodeId];
+	const float area = bbox.computeSurfaceArea();
+
+	if( node.isLeaf() )
+	{
+		const uint32 start = _refitElements.size();
+
+		for( uint32 e = node.elemStart(), end = node.elemStart() + node.elemCount(); e < end; ++e )
+		{
+			if( !_movedInstances[tree->elements[e]] )
+				_refitElements.push_back( tree->elements[e] );
+		}
+
+		_refitElements.insert( _refitElements.end(), instanceIds.begin(), instanceIds.end() );
+
+		const uint32 count = _refitElements.size() - start;
+		node.setLeafNode( start, count );
+		return INSTANCE_INTERSECTION_COST * count * area;
+	}
+
+	rt::SplitPlane plane;
+	plane.axis = node.axis();
+	plane.position = node.splitPos();
+
+	// Same classification as InstanceTreeBuilder
+	std::vector<uint32> leftIds;
+	std::vector<uint32> rightIds;
+
+	for( uint32 i = 0, limit = instanceIds.size(); i < limit; ++i )
+	{
+		const rt::Aabb& box = ( *_refitInstances )[instanceIds[i]].bbox;
+
+		if( ( box.minv[plane.axis] <= plane.position ) && ( box.maxv[plane.axis] <= plane.position ) )
+		{
+			leftIds.push_back( instanceIds[i] );
+		}
+		else if( ( box.minv[plane.axis] >= plane.position ) && ( box.maxv[plane.axis] >= plane.position ) )
+		{
+			rightIds.push_back( instanceIds[i] );
+		}
+		else
+		{
+			leftIds.push_back( instanceIds[i] );
+			rightIds.push_back( instanceIds[i] );
+		}
+	}
+
+	rt::Aabb leftBox;
+	rt::Aabb rightBox;
+	rt::AabbIntersection::splitAabb( bbox, plane, leftBox, rightBox );
+
+	const uint32 leftChild = node.leftChild();
+	return INSTANCE_TRAVERSAL_COST * area + reinsertInstances( tree, leftChild, leftBox, leftIds ) + 
+		   reinsertInstances( tree, leftChild + 1, rightBox, rightIds );
+}
+
+uint32 KdTreeAccStructBuilder::cacheSettings() const
+{
+	const uint32 settings[] = { getBuildMode(), _nodeLayout, sizeof( KdNode ), _triangleBlocks };
+	return AccStructCache::hashData( settings, sizeof( settings ) );
+}
+
+KdTreeAccStruct* KdTreeAccStructBuilder::loadCachedTree( const AccStructCache::Key& key )
+{
+	vr::Timer timer;
+	timer.restart();
+
+	if( !_cache.load( key ) )
+		return NULL;
+
+	const CachedTreeInfo* info = static_cast<const CachedTreeInfo*>( _cache.readBlock( sizeof( CachedTreeInfo ) ) );
+	const KdNode* nodes = NULL;
+	const uint32* elements = NULL;
+
+	if( info != NULL )
+	{
+		nodes = static_cast<const KdNode*>( _cache.readBlock( info->nodeCount * sizeof( KdNode ) ) );
+		elements = static_cast<const uint32*>( _cache.readBlock( info->elementCount * sizeof( uint32 ) ) );
+	}
+
+	// Header matched but blocks do not, file is damaged
+	if( ( nodes == NULL ) || ( elements == NULL ) || ( info->nodeCount == 0 ) )
+	{
+		printf( "Invalid acceleration structure cache: %s\n", _cache.filename( key ).c_str() );
+		_cache.endLoad();
+		return NULL;
+	}
+
+	KdTreeAccStruct* result = newAccStruct();
+	result->setBoundingBox( info->bbox );
+	result->useMappedData( _cache.getMappedFile(), nodes, info->nodeCount, elements, info->elementCount );
+	_cache.endLoad();
+
+	// Print stats
+	printf( "\n***** Kd-Tree (cached) *****\n" );
+	printf( "nodeCount: %d\n", info->nodeCount );
+	printf( "elemIdCount: %d\n", info->elementCount );
+	printf( "file: %s\n", _cache.filename( key ).c_str() );
+	printf( "loadTime: %.6f secs\n", timer.elapsed() );
+
 	return result;
 }
+
+void KdTreeAccStructBuilder::saveCachedTree( const AccStructCache::Key& key, KdTreeAccStruct* tree )
+{
+	if( !_cache.beginSave( key ) )
+		return;
+
+	CachedTreeInfo info;
+	info.bbox = tree->getBoundingBox();
+	info.nodeCount = tree->getNodeCount();
+	info.elementCount = tree->getElementCount();
+
+	_cache.writeBlock( &info, sizeof( CachedTreeInfo ) );
+	_cache.writeBlock( tree->root, info.nodeCount * sizeof( KdNode ) );
+	_cache.writeBlock( tree->elements, info.elementCount * sizeof( uint32 ) );
+	_cache.endSave();
+}
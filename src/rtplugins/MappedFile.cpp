@@ -0,0 +1,118 @@
+#include <rtp/MappedFile.h>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+using namespace rtp;
+
+MappedFile* MappedFile::open( const std::string& filename )
+{
+	MappedFile* result = new MappedFile();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL );
+	if( file == INVALID_HANDLE_VALUE )
+	{
+		delete result;
+		return NULL;
+	}
+
+	result->_file = file;
+
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( file, &size ) || ( size.HighPart != 0 ) || ( size.LowPart == 0 ) )
+	{
+		delete result;
+		return NULL;
+	}
+
+	HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( mapping == NULL )
+	{
+		delete result;
+		return NULL;
+	}
+
+	result->_mapping = mapping;
+	result->_data = static_cast<const char*>( MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) );
+	result->_size = size.LowPart;
+#else
+	const int fd = ::open( filename.c_str(), O_RDONLY );
+	if( fd < 0 )
+	{
+		delete result;
+		return NULL;
+	}
+
+	result->_file = reinterpret_cast<void*>( (size_t)fd + 1 );
+
+	struct stat info;
+	if( ( fstat( fd, &info ) != 0 ) || ( info.st_size == 0 ) || ( info.st_size != (off_t)(uint32)info.st_size ) )
+	{
+		delete result;
+		return NULL;
+	}
+
+	void* data = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	if( data != MAP_FAILED )
+	{
+		result->_data = static_cast<const char*>( data );
+		result->_size = (uint32)info.st_size;
+	}
+#endif
+
+	if( result->_data == NULL )
+	{
+		delete result;
+		return NULL;
+	}
+
+	return result;
+}
+
+const char* MappedFile::data() const
+{
+	return _data;
+}
+
+uint32 MappedFile::size() const
+{
+	return _size;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Protected
+//////////////////////////////////////////////////////////////////////////
+MappedFile::MappedFile()
+: _data( NULL ), _size( 0 ), _file( NULL ), _mapping( NULL )
+{
+	// empty
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if( _data != NULL )
+		UnmapViewOfFile( _data );
+	if( _mapping != NULL )
+		CloseHandle( _mapping );
+	if( _file != NULL )
+		CloseHandle( _file );
+#else
+	if( _data != NULL )
+		munmap( const_cast<char*>( _data ), _size );
+
+	// Descriptor is stored plus one, so that NULL means no file
+	if( _file != NULL )
+		close( (int)( reinterpret_cast<size_t>( _file ) - 1 ) );
+#endif
+}
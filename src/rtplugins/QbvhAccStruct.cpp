@@ -0,0 +1,265 @@
+#include <rtp/QbvhAccStruct.h>
+#include <rt/Context.h>
+#include <rt/AabbIntersection.h>
+#include <rt/RayTriIntersection.h>
+
+using namespace rtp;
+
+// Same tolerance as RayTriIntersection
+static const float HIT_EPSILON = rt::RayTriIntersection::HIT_EPSILON;
+
+// Static and thread-safe traversal stacks
+__declspec(thread) static QbvhAccStruct::TraversalStack s_instanceStack;
+__declspec(thread) static QbvhAccStruct::TraversalStack s_geometryStack;
+
+void QbvhAccStruct::clear()
+{
+	vr::vectorFreeMemory( nodes );
+	vr::vectorFreeMemory( elements );
+	vr::vectorFreeMemory( triangles );
+}
+
+void QbvhAccStruct::findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit )
+{
+	// If not hit bbox of entire scene, no need to trace any further
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	const rt::Ray originalRay( ray );
+
+	SimdRay simdRay;
+	initSimdRay( originalRay, simdRay );
+
+	float tnear[4];
+
+	s_instanceStack.clear();
+	s_instanceStack.push();
+	s_instanceStack.top().child = 0;
+	s_instanceStack.top().count = 0;
+	s_instanceStack.top().tnear = originalRay.tnear;
+
+	while( !s_instanceStack.empty() )
+	{
+		const StackEntry entry = s_instanceStack.top();
+		s_instanceStack.pop();
+
+		// Skip children that lie beyond closest hit found so far
+		if( entry.tnear > hit.distance )
+			continue;
+
+		if( entry.child & QbvhNode::LEAF_FLAG )
+		{
+			const uint32 start = entry.child & ~QbvhNode::LEAF_FLAG;
+			for( uint32 i = start, limit = start + entry.count; i < limit; ++i )
+			{
+				const rt::Instance& instance = instances[elements[i]];
+
+				// Transform ray to geometry's local space
+				instance.transform.inverseTransform( ray );
+				ray.update();
+
+				// Ask geometry's acceleration structure to trace the transformed ray
+				instance.geometry->accStruct->traceNearestGeometry( instance, ray, hit );
+
+				// Transform ray back to global space
+				ray = originalRay;
+			}
+			continue;
+		}
+
+		const QbvhNode& node = nodes[entry.child];
+		const int32 mask = hitChildren( node, simdRay, vr::min( originalRay.tfar, hit.distance ), tnear );
+		pushChildren( s_instanceStack, node, mask, tnear );
+	}
+}
+
+void QbvhAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// If don't hit bbox in local space, no need to trace underlying triangles
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	SimdRay simdRay;
+	initSimdRay( ray, simdRay );
+
+	float tnear[4];
+
+	// Best distance considers any previously found hits to prevent false hits in this geometry
+	float bestDistance = hit.distance;
+
+	s_geometryStack.clear();
+	s_geometryStack.push();
+	s_geometryStack.top().child = 0;
+	s_geometryStack.top().count = 0;
+	s_geometryStack.top().tnear = ray.tnear;
+
+	while( !s_geometryStack.empty() )
+	{
+		const StackEntry entry = s_geometryStack.top();
+		s_geometryStack.pop();
+
+		// Skip children that lie beyond closest hit found so far
+		if( entry.tnear > bestDistance )
+			continue;
+
+		if( entry.child & QbvhNode::LEAF_FLAG )
+		{
+			const uint32 start = entry.child & ~QbvhNode::LEAF_FLAG;
+			for( uint32 i = start, limit = start + entry.count; i < limit; ++i )
+			{
+				hitTriangles( triangles[i], simdRay, ray.tfar, hit, bestDistance );
+			}
+			continue;
+		}
+
+		const QbvhNode& node = nodes[entry.child];
+		const int32 mask = hitChildren( node, simdRay, vr::min( ray.tfar, bestDistance ), tnear );
+		pushChildren( s_geometryStack, node, mask, tnear );
+	}
+
+	if( bestDistance < hit.distance )
+	{
+		hit.distance = bestDistance;
+		hit.instance = &instance;
+	}
+}
+
+bool QbvhAccStruct::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// Hit is only needed by nearest hit traversals
+	hit;
+	instance;
+
+	// Node boxes are tested against the ray clipped to the tree, triangles against the whole ray
+	const rt::Ray originalRay( ray );
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	SimdRay simdRay;
+	initSimdRay( ray, simdRay );
+
+	const __m128 rayNear = _mm_set1_ps( originalRay.tnear );
+	float tnear[4];
+	bool blocked = false;
+
+	s_geometryStack.clear();
+	s_geometryStack.push();
+	s_geometryStack.top().child = 0;
+	s_geometryStack.top().count = 0;
+	s_geometryStack.top().tnear = ray.tnear;
+
+	while( !blocked && !s_geometryStack.empty() )
+	{
+		const StackEntry entry = s_geometryStack.top();
+		s_geometryStack.pop();
+
+		if( entry.child & QbvhNode::LEAF_FLAG )
+		{
+			const uint32 start = entry.child & ~QbvhNode::LEAF_FLAG;
+			for( uint32 i = start, limit = start + entry.count; ( i < limit ) && !blocked; ++i )
+			{
+				blocked = hitAnyTriangles( triangles[i], simdRay, rayNear, originalRay.tfar );
+			}
+			continue;
+		}
+
+		// Near children first finds near blockers sooner
+		const QbvhNode& node = nodes[entry.child];
+		const int32 mask = hitChildren( node, simdRay, ray.tfar, tnear );
+		pushChildren( s_geometryStack, node, mask, tnear );
+	}
+
+	ray = originalRay;
+	return blocked;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private
+//////////////////////////////////////////////////////////////////////////
+inline int32 QbvhAccStruct::intersectTriangles( const QbvhTriangle4& block, const SimdRay& ray, __m128 tnear, float tfar,
+											   __m128& u, __m128& v, __m128& f )
+{
+	const __m128 e1x = _mm_loadu_ps( block.e1[0] );
+	const __m128 e1y = _mm_loadu_ps( block.e1[1] );
+	const __m128 e1z = _mm_loadu_ps( block.e1[2] );
+	const __m128 e2x = _mm_loadu_ps( block.e2[0] );
+	const __m128 e2y = _mm_loadu_ps( block.e2[1] );
+	const __m128 e2z = _mm_loadu_ps( block.e2[2] );
+
+	// pvec = dir x e2
+	const __m128 px = _mm_sub_ps( _mm_mul_ps( ray.dir[1], e2z ), _mm_mul_ps( ray.dir[2], e2y ) );
+	const __m128 py = _mm_sub_ps( _mm_mul_ps( ray.dir[2], e2x ), _mm_mul_ps( ray.dir[0], e2z ) );
+	const __m128 pz = _mm_sub_ps( _mm_mul_ps( ray.dir[0], e2y ), _mm_mul_ps( ray.dir[1], e2x ) );
+
+	// Determinant is zero if ray lies in plane of triangle, or for unused lanes
+	const __m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, px ), _mm_mul_ps( e1y, py ) ), _mm_mul_ps( e1z, pz ) );
+	const __m128 invDet = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+	// tvec = orig - v0
+	const __m128 tx = _mm_sub_ps( ray.orig[0], _mm_loadu_ps( block.v0[0] ) );
+	const __m128 ty = _mm_sub_ps( ray.orig[1], _mm_loadu_ps( block.v0[1] ) );
+	const __m128 tz = _mm_sub_ps( ray.orig[2], _mm_loadu_ps( block.v0[2] ) );
+
+	u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( tx, px ), _mm_mul_ps( ty, py ) ), _mm_mul_ps( tz, pz ) ), invDet );
+
+	// qvec = tvec x e1
+	const __m128 qx = _mm_sub_ps( _mm_mul_ps( ty, e1z ), _mm_mul_ps( tz, e1y ) );
+	const __m128 qy = _mm_sub_ps( _mm_mul_ps( tz, e1x ), _mm_mul_ps( tx, e1z ) );
+	const __m128 qz = _mm_sub_ps( _mm_mul_ps( tx, e1y ), _mm_mul_ps( ty, e1x ) );
+
+	v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( ray.dir[0], qx ), _mm_mul_ps( ray.dir[1], qy ) ), _mm_mul_ps( ray.dir[2], qz ) ), invDet );
+	f = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ), invDet );
+
+	// Comparisons against NaN's are false, so invalid lanes are always rejected
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 epsilon = _mm_set1_ps( HIT_EPSILON );
+
+	__m128 valid = _mm_cmpneq_ps( det, zero );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( u, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( v, zero ) );
+	valid = _mm_and_ps( valid, _mm_cmple_ps( _mm_add_ps( u, v ), _mm_set1_ps( 1.0f ) ) );
+	valid = _mm_and_ps( valid, _mm_cmpge_ps( f, _mm_sub_ps( tnear, epsilon ) ) );
+	valid = _mm_and_ps( valid, _mm_cmple_ps( f, _mm_set1_ps( tfar + HIT_EPSILON ) ) );
+
+	return _mm_movemask_ps( valid );
+}
+
+inline void QbvhAccStruct::hitTriangles( const QbvhTriangle4& block, const SimdRay& ray, float tfar,
+										 rt::Hit& hit, float& bestDistance )
+{
+	__m128 u;
+	__m128 v;
+	__m128 f;
+	const int32 mask = intersectTriangles( block, ray, ray.tnear, tfar, u, v, f ) &
+		               _mm_movemask_ps( _mm_cmplt_ps( f, _mm_set1_ps( bestDistance ) ) );
+	if( !mask )
+		return;
+
+	float fs[4];
+	float us[4];
+	float vs[4];
+	_mm_storeu_ps( fs, f );
+	_mm_storeu_ps( us, u );
+	_mm_storeu_ps( vs, v );
+
+	// Have valid hit points here. Store the nearest one.
+	for( uint32 i = 0; i < 4; ++i )
+	{
+		if( !( mask & ( 1 << i ) ) || ( fs[i] >= bestDistance ) )
+			continue;
+
+		bestDistance = fs[i];
+		hit.triangleId = block.triangleIds[i];
+		hit.v0Coord = 1.0f - ( us[i] + vs[i] );
+		hit.v1Coord = us[i];
+		hit.v2Coord = vs[i];
+	}
+}
+
+inline bool QbvhAccStruct::hitAnyTriangles( const QbvhTriangle4& block, const SimdRay& ray, __m128 tnear, float tfar )
+{
+	__m128 u;
+	__m128 v;
+	__m128 f;
+	return ( intersectTriangles( block, ray, tnear, tfar, u, v, f ) != 0 );
+}
@@ -0,0 +1,249 @@
+#include <rtp/QbvhAccStructBuilder.h>
+#include <rtp/QbvhAccStruct.h>
+#include <rtp/BvhAccStruct.h>
+#include <vr/timer.h>
+
+using namespace rtp;
+
+QbvhAccStructBuilder::QbvhAccStructBuilder()
+: _maxLeafSize( 4 ), _geometry( NULL ), _qbvh( NULL ), _leafCount( 0 ), _treeDepth( 0 )
+{
+	// Let the binary hierarchy go down to single elements, collapsing decides the final leaf size
+	_bvhBuilder.setMaxLeafSize( 1 );
+}
+
+void QbvhAccStructBuilder::buildGeometry( rt::Geometry* geometry )
+{
+	vr::Timer timer;
+	timer.restart();
+
+	const uint32 triCount = geometry->triDesc.size();
+	std::vector<rt::Aabb> boxes( triCount );
+
+	// Compute triangle boxes
+	for( uint32 t = 0; t < triCount; ++t )
+	{
+		rt::Aabb& box = boxes[t];
+		box.minv = geometry->getVertex( t, 0 );
+		box.maxv = box.minv;
+		box.expandBy( geometry->getVertex( t, 1 ) );
+		box.expandBy( geometry->getVertex( t, 2 ) );
+	}
+
+	vr::ref_ptr<BvhAccStruct> bvh = _bvhBuilder.buildFromBoxes( boxes );
+	vr::vectorFreeMemory( boxes );
+
+	_geometry = geometry;
+	QbvhAccStruct* qbvh = collapseHierarchy( bvh.get() );
+	_geometry = NULL;
+
+	geometry->accStruct = qbvh;
+
+	// Print stats
+	printf( "\n***** QBVH *****\n" );
+	printf( "nodeCount: %d (%d leaves)\n", qbvh->nodes.size(), _leafCount );
+	printf( "treeDepth: %d\n", _treeDepth );
+	printf( "triangleBlocks: %d (%5.2f%% lanes used)\n", qbvh->triangles.size(),
+		    qbvh->triangles.empty() ? 0.0f : 100.0f * triCount / ( 4.0f * qbvh->triangles.size() ) );
+	printf( "buildTime: %.6f secs\n", timer.elapsed() );
+}
+
+rt::IAccStruct* QbvhAccStructBuilder::buildInstance( const std::vector<rt::Instance> instances )
+{
+	const uint32 instanceCount = instances.size();
+	std::vector<rt::Aabb> boxes( instanceCount );
+
+	for( uint32 i = 0; i < instanceCount; ++i )
+	{
+		boxes[i] = instances[i].bbox;
+	}
+
+	vr::ref_ptr<BvhAccStruct> bvh = _bvhBuilder.buildFromBoxes( boxes );
+	return collapseHierarchy( bvh.get() );
+}
+
+void QbvhAccStructBuilder::setMaxLeafSize( uint32 size )
+{
+	_maxLeafSize = vr::max( size, 1u );
+}
+
+uint32 QbvhAccStructBuilder::getMaxLeafSize() const
+{
+	return _maxLeafSize;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private
+//////////////////////////////////////////////////////////////////////////
+QbvhAccStruct* QbvhAccStructBuilder::collapseHierarchy( BvhAccStruct* bvh )
+{
+	// Reset stats
+	_leafCount = 0;
+	_treeDepth = 0;
+
+	_qbvh = new QbvhAccStruct();
+
+	// Collapsing roughly halves the node count of a binary tree
+	_qbvh->nodes.reserve( bvh->nodes.size() / 2 + 1 );
+	collapseNode( bvh, 0, 0 );
+
+	_qbvh->setBoundingBox( bvh->nodes[0].bbox );
+
+	QbvhAccStruct* result = _qbvh;
+	_qbvh = NULL;
+	return result;
+}
+
+uint32 QbvhAccStructBuilder::collapseNode( BvhAccStruct* bvh, uint32 bvhNodeId, uint32 treeDepth )
+{
+	// Binary nodes that will become children of this node
+	uint32 candidates[4];
+	bool expandable[4];
+	uint32 count = 1;
+	candidates[0] = bvhNodeId;
+
+	for( ;; )
+	{
+		uint32 begin;
+		uint32 end;
+		float bestArea = -1.0f;
+		uint32 best = 0;
+
+		for( uint32 i = 0; i < count; ++i )
+		{
+			const BvhNode& node = bvh->nodes[candidates[i]];
+			subtreeRange( bvh, candidates[i], begin, end );
+			expandable[i] = !node.isLeaf() && ( end - begin > _maxLeafSize );
+
+			// Largest candidate benefits most from being replaced by its children
+			if( expandable[i] && ( node.bbox.computeSurfaceArea() > bestArea ) )
+			{
+				bestArea = node.bbox.computeSurfaceArea();
+				best = i;
+			}
+		}
+
+		if( ( count == 4 ) || ( bestArea < 0.0f ) )
+			break;
+
+		// Left child is always next node
+		const uint32 parent = candidates[best];
+		candidates[best] = parent + 1;
+		candidates[count++] = bvh->nodes[parent].rightChild();
+	}
+
+	const uint32 nodeId = _qbvh->nodes.size();
+	_qbvh->nodes.push_back( QbvhNode() );
+
+	// Init all children as empty leaves
+	for( uint32 i = 0; i < 4; ++i )
+	{
+		QbvhNode& node = _qbvh->nodes[nodeId];
+		rt::Aabb bbox;
+		if( i < count )
+			bbox = bvh->nodes[candidates[i]].bbox;
+
+		for( uint32 k = 0; k < 3; ++k )
+		{
+			node.bounds[k][i] = bbox.minv[k];
+			node.bounds[k+3][i] = bbox.maxv[k];
+		}
+
+		node.children[i] = QbvhNode::LEAF_FLAG;
+		node.counts[i] = 0;
+	}
+
+	for( uint32 i = 0; i < count; ++i )
+	{
+		if( expandable[i] )
+		{
+			// Do not keep a reference to the node here, vector may be reallocated during recursion
+			const uint32 child = collapseNode( bvh, candidates[i], treeDepth + 1 );
+			_qbvh->nodes[nodeId].children[i] = child;
+		}
+		else
+		{
+			leafChild( bvh, candidates[i], nodeId, i, treeDepth + 1 );
+		}
+	}
+
+	return nodeId;
+}
+
+void QbvhAccStructBuilder::leafChild( BvhAccStruct* bvh, uint32 bvhNodeId, uint32 nodeId, uint32 child, uint32 treeDepth )
+{
+	if( treeDepth > _treeDepth )
+		_treeDepth = treeDepth;
+
+	++_leafCount;
+
+	uint32 begin;
+	uint32 end;
+	subtreeRange( bvh, bvhNodeId, begin, end );
+
+	QbvhNode& node = _qbvh->nodes[nodeId];
+
+	// Instance level: store element ids
+	if( !_geometry )
+	{
+		node.children[child] = QbvhNode::LEAF_FLAG | _qbvh->elements.size();
+		node.counts[child] = end - begin;
+		_qbvh->elements.insert( _qbvh->elements.end(), bvh->elements.begin() + begin, bvh->elements.begin() + end );
+		return;
+	}
+
+	// Geometry level: pack triangles into blocks of 4
+	const uint32 blockCount = ( end - begin + 3 ) / 4;
+	node.children[child] = QbvhNode::LEAF_FLAG | _qbvh->triangles.size();
+	node.counts[child] = blockCount;
+
+	for( uint32 b = 0; b < blockCount; ++b )
+	{
+		QbvhTriangle4 block;
+
+		for( uint32 i = 0; i < 4; ++i )
+		{
+			const uint32 idx = begin + 4*b + i;
+
+			// Unused lanes get degenerate triangles at the origin
+			vr::vec3f v0( 0.0f, 0.0f, 0.0f );
+			vr::vec3f e1( 0.0f, 0.0f, 0.0f );
+			vr::vec3f e2( 0.0f, 0.0f, 0.0f );
+			uint32 triangleId = 0;
+
+			if( idx < end )
+			{
+				triangleId = bvh->elements[idx];
+				v0 = _geometry->getVertex( triangleId, 0 );
+				e1 = _geometry->getVertex( triangleId, 1 ) - v0;
+				e2 = _geometry->getVertex( triangleId, 2 ) - v0;
+			}
+
+			for( uint32 k = 0; k < 3; ++k )
+			{
+				block.v0[k][i] = v0[k];
+				block.e1[k][i] = e1[k];
+				block.e2[k][i] = e2[k];
+			}
+
+			block.triangleIds[i] = triangleId;
+		}
+
+		_qbvh->triangles.push_back( block );
+	}
+}
+
+void QbvhAccStructBuilder::subtreeRange( BvhAccStruct* bvh, uint32 bvhNodeId, uint32& begin, uint32& end ) const
+{
+	// Leftmost leaf holds the first elements, rightmost leaf the last ones
+	uint32 left = bvhNodeId;
+	while( !bvh->nodes[left].isLeaf() )
+		left = left + 1;
+
+	uint32 right = bvhNodeId;
+	while( !bvh->nodes[right].isLeaf() )
+		right = bvh->nodes[right].rightChild();
+
+	begin = bvh->nodes[left].elemStart();
+	end = bvh->nodes[right].elemStart() + bvh->nodes[right].elemCount();
+}
@@ -0,0 +1,33 @@
+#include <rtp/QuantizedTriangle.h>
+
+using namespace rtp;
+
+void QuantizedTriangle::Frame::load( const rt::Aabb& box )
+{
+	origin = box.minv;
+
+	const float inv = 1.0f / (float)MAX_VALUE;
+	scale.set( ( box.maxv.x - box.minv.x ) * inv, ( box.maxv.y - box.minv.y ) * inv, ( box.maxv.z - box.minv.z ) * inv );
+}
+
+void QuantizedTriangle::set( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2, const rt::Aabb& box, uint32 id )
+{
+	const vr::vec3f* vertices[3] = { &v0, &v1, &v2 };
+
+	for( uint32 axis = 0; axis < 3; ++axis )
+	{
+		// Flat boxes decode every coordinate to their min
+		const float extent = box.maxv[axis] - box.minv[axis];
+		const float scale = ( extent > 0.0f ) ? (float)MAX_VALUE / extent : 0.0f;
+
+		for( uint32 i = 0; i < 3; ++i )
+		{
+			// Round to nearest, clamped in case vertex lies slightly outside box
+			const float q = ( (*vertices[i])[axis] - box.minv[axis] ) * scale + 0.5f;
+			v[i][axis] = (uint16)vr::min( vr::max( q, 0.0f ), (float)MAX_VALUE );
+		}
+	}
+
+	pad = 0;
+	triangleId = id;
+}
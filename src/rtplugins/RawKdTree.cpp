@@ -3,19 +3,19 @@
 using namespace rtp;
 
 RawKdNode::RawKdNode()
-: left( NULL ), right( NULL )
+: left( NULL ), right( NULL ), unbuilt( false ), treeDepth( 0 )
 {
 	// empty
 }
 
 RawKdNode::RawKdNode( const RawKdNode::Elements& ids )
-: left( NULL ), right( NULL ), elements( ids )
+: left( NULL ), right( NULL ), elements( ids ), unbuilt( false ), treeDepth( 0 )
 {
 	// empty
 }
 
 RawKdNode::RawKdNode( const rt::SplitPlane& plane, RawKdNode* leftChild, RawKdNode* rightChild )
-: split( plane ), left( leftChild ), right( rightChild )
+: split( plane ), left( leftChild ), right( rightChild ), unbuilt( false ), treeDepth( 0 )
 {
 	// empty
 }
@@ -32,4 +32,18 @@ void RawKdTree::Statistics::reset()
 	leafCount = 0;
 	treeDepth = 0;
 	elemIdCount = 0;
+	unbuiltCount = 0;
+	buildTime = 0.0;
+}
+
+void RawKdTree::Statistics::print( const char* title ) const
+{
+	printf( "\n***** %s *****\n", title );
+	printf( "nodeCount: %d (%d leaves)\n", nodeCount, leafCount );
+	printf( "treeDepth: %d\n", treeDepth );
+	printf( "elemIdCount: %d\n", elemIdCount );
+	if( unbuiltCount > 0 )
+		printf( "unbuiltSubtrees: %d\n", unbuiltCount );
+	printf( "averageLeafSize: %5.4f\n", ( leafCount > 0 ) ? (float)elemIdCount / (float)leafCount : 0.0f );
+	printf( "buildTime: %.6f secs\n", buildTime );
 }
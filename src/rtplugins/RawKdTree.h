@@ -23,6 +23,11 @@ struct RawKdNode : public vr::RefCounted
 	vr::ref_ptr<RawKdNode> left;
 	vr::ref_ptr<RawKdNode> right;
 	Elements elements;
+
+	// Leaf standing for a subtree left unbuilt by a lazy build, elements are the subtree's triangles
+	bool unbuilt;
+	rt::Aabb bbox;
+	uint32 treeDepth;
 };
 
 inline bool RawKdNode::isLeaf()
@@ -38,11 +43,14 @@ struct RawKdTree : public vr::RefCounted
 	{
 		Statistics();
 		void reset();
+		void print( const char* title ) const;
 
 		uint32 nodeCount;
 		uint32 leafCount;
 		uint32 treeDepth;
 		uint32 elemIdCount;
+		uint32 unbuiltCount;
+		double buildTime; // in seconds
 		// TODO: other useful stats
 	};
 
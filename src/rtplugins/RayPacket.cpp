@@ -0,0 +1,99 @@
+#include <rtp/RayPacket.h>
+
+using namespace rtp;
+
+bool RayPacket::isCoherent( const rt::Ray* rays, uint32 count )
+{
+	for( uint32 i = 1; i < count; ++i )
+	{
+		if( ( rays[i].dirSignBits[0] != rays[0].dirSignBits[0] ) ||
+			( rays[i].dirSignBits[1] != rays[0].dirSignBits[1] ) ||
+			( rays[i].dirSignBits[2] != rays[0].dirSignBits[2] ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void RayPacket::load( const rt::Ray* rays, uint32 count )
+{
+	float values[SIZE];
+
+	// Unused lanes repeat the last ray, so that they never produce NaN's or denormals
+	for( uint32 axis = 0; axis < 3; ++axis )
+	{
+		for( uint32 i = 0; i < SIZE; ++i )
+			values[i] = rays[vr::min( i, count - 1 )].orig[axis];
+		for( uint32 g = 0; g < GROUP_COUNT; ++g )
+			orig[axis][g] = _mm_loadu_ps( values + g * 4 );
+
+		for( uint32 i = 0; i < SIZE; ++i )
+			values[i] = rays[vr::min( i, count - 1 )].dir[axis];
+		for( uint32 g = 0; g < GROUP_COUNT; ++g )
+			dir[axis][g] = _mm_loadu_ps( values + g * 4 );
+
+		for( uint32 i = 0; i < SIZE; ++i )
+			values[i] = rays[vr::min( i, count - 1 )].invDir[axis];
+		for( uint32 g = 0; g < GROUP_COUNT; ++g )
+			invDir[axis][g] = _mm_loadu_ps( values + g * 4 );
+
+		dirSignBits[axis] = rays[0].dirSignBits[axis];
+	}
+
+	for( uint32 i = 0; i < SIZE; ++i )
+		values[i] = ( i < count ) ? rays[i].tnear : vr::Mathf::MAX_VALUE;
+	for( uint32 g = 0; g < GROUP_COUNT; ++g )
+		tnear[g] = _mm_loadu_ps( values + g * 4 );
+
+	for( uint32 i = 0; i < SIZE; ++i )
+		values[i] = ( i < count ) ? rays[i].tfar : -vr::Mathf::MAX_VALUE;
+	for( uint32 g = 0; g < GROUP_COUNT; ++g )
+		tfar[g] = _mm_loadu_ps( values + g * 4 );
+}
+
+void RayPacket::deactivate( uint32 lane )
+{
+	float values[4];
+
+	_mm_storeu_ps( values, tnear[lane / 4] );
+	values[lane % 4] = vr::Mathf::MAX_VALUE;
+	tnear[lane / 4] = _mm_loadu_ps( values );
+
+	_mm_storeu_ps( values, tfar[lane / 4] );
+	values[lane % 4] = -vr::Mathf::MAX_VALUE;
+	tfar[lane / 4] = _mm_loadu_ps( values );
+}
+
+void PacketHit::load( const rt::Hit* hits, uint32 count )
+{
+	float values[RayPacket::SIZE];
+
+	for( uint32 i = 0; i < RayPacket::SIZE; ++i )
+		values[i] = ( i < count ) ? hits[i].distance : vr::Mathf::MAX_VALUE;
+	for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+		distance[g] = _mm_loadu_ps( values + g * 4 );
+}
+
+void PacketHit::store( rt::Hit* hits, uint32 count, const rt::Instance* instance ) const
+{
+	float values[RayPacket::SIZE];
+
+	for( uint32 g = 0; g < RayPacket::GROUP_COUNT; ++g )
+		_mm_storeu_ps( values + g * 4, distance[g] );
+
+	for( uint32 i = 0; i < count; ++i )
+	{
+		rt::Hit& hit = hits[i];
+		if( values[i] >= hit.distance )
+			continue;
+
+		hit.distance = values[i];
+		hit.instance = instance;
+		hit.triangleId = triangleId[i];
+		hit.v0Coord = 1.0f - v1Coord[i] - v2Coord[i];
+		hit.v1Coord = v1Coord[i];
+		hit.v2Coord = v2Coord[i];
+	}
+}
@@ -0,0 +1,298 @@
+#include <rtp/RayTriBenchmark.h>
+#include <rt/RayTriIntersection.h>
+#include <vr/random.h>
+#include <vr/timer.h>
+
+using namespace rtp;
+
+// Relative tolerance when comparing hit distances against the reference
+static const float DISTANCE_TOLERANCE = 1e-4f;
+
+// Grazing rays run at most this far off their triangle's plane, relative to their length
+static const float GRAZING_SLOPE = 1e-3f;
+
+static vr::vec3f randomDirection()
+{
+	vr::vec3f dir( vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ) );
+	if( dir.normalize() == 0.0f )
+		dir = vr::vec3f( 0.0f, 0.0f, 1.0f );
+	return dir;
+}
+
+RayTriBenchmark::RayTriBenchmark()
+: _geometry( NULL ), _testCount( 1000000 ), _repeatCount( 4 )
+{
+	// empty
+}
+
+void RayTriBenchmark::setTestCount( uint32 count )
+{
+	_testCount = count;
+}
+
+uint32 RayTriBenchmark::getTestCount() const
+{
+	return _testCount;
+}
+
+void RayTriBenchmark::setRepeatCount( uint32 count )
+{
+	_repeatCount = vr::max( count, 1u );
+}
+
+uint32 RayTriBenchmark::getRepeatCount() const
+{
+	return _repeatCount;
+}
+
+void RayTriBenchmark::generateTriangles( rt::Geometry& geometry, uint32 count )
+{
+	geometry.clear();
+
+	while( geometry.triAccel.size() < count )
+	{
+		// Edges from 0.1% to 10% of the cube, some triangles long and thin
+		const vr::vec3f v0( vr::Random::real( 0.0f, 1.0f ), vr::Random::real( 0.0f, 1.0f ), vr::Random::real( 0.0f, 1.0f ) );
+		const vr::vec3f v1 = v0 + randomDirection() * vr::Random::real( 0.001f, 0.1f );
+		const vr::vec3f v2 = v0 + randomDirection() * vr::Random::real( 0.001f, 0.1f );
+
+		rt::TriAccel acc;
+		acc.buildFrom( v0, v1, v2 );
+		if( !acc.valid() )
+			continue;
+
+		rt::TriDesc desc;
+		for( uint32 i = 0; i < 3; ++i )
+		{
+			desc.v[i] = geometry.vertices.size() + i;
+		}
+
+		geometry.vertices.push_back( v0 );
+		geometry.vertices.push_back( v1 );
+		geometry.vertices.push_back( v2 );
+
+		acc.triangleId = geometry.triDesc.size();
+		geometry.triDesc.push_back( desc );
+		geometry.triAccel.push_back( acc );
+	}
+}
+
+void RayTriBenchmark::generateTests( const rt::Geometry& geometry, TestMix mix )
+{
+	_geometry = &geometry;
+	_tests.clear();
+
+	const uint32 triangleCount = geometry.triDesc.size();
+	if( triangleCount == 0 )
+		return;
+
+	// hitWald, the reference, reads the TriAccel's
+	if( !geometry.hasTriAccel() )
+	{
+		printf( "RayTriBenchmark: geometry has no TriAccel's, call rt::Geometry::buildTriAccel first\n" );
+		return;
+	}
+
+	_tests.resize( _testCount );
+
+	for( uint32 i = 0; i < _testCount; ++i )
+	{
+		Test& test = _tests[i];
+		test.triangleId = vr::min( (uint32)vr::Random::real( 0.0f, (float)triangleCount ), triangleCount - 1 );
+
+		const vr::vec3f& v0 = geometry.getVertex( test.triangleId, 0 );
+		const vr::vec3f& v1 = geometry.getVertex( test.triangleId, 1 );
+		const vr::vec3f& v2 = geometry.getVertex( test.triangleId, 2 );
+		const vr::vec3f e1 = v1 - v0;
+		const vr::vec3f e2 = v2 - v0;
+
+		vr::vec3f normal = e1.cross( e2 );
+		normal.normalize();
+
+		// Target point in barycentric coordinates (u, v) of v1 and v2
+		float u;
+		float v;
+		switch( mix )
+		{
+		case HIT:
+			u = vr::Random::real( 0.0f, 1.0f );
+			v = vr::Random::real( 0.0f, 1.0f );
+			if( u + v > 1.0f )
+			{
+				u = 1.0f - u;
+				v = 1.0f - v;
+			}
+			break;
+
+		case MISS:
+			do
+			{
+				u = vr::Random::real( -1.0f, 2.0f );
+				v = vr::Random::real( -1.0f, 2.0f );
+			}
+			while( ( u >= 0.0f ) && ( v >= 0.0f ) && ( u + v <= 1.0f ) );
+			break;
+
+		default:
+			// Point on one of the 3 edges
+			{
+				const float t = vr::Random::real( 0.0f, 1.0f );
+				const float edge = vr::Random::real( 0.0f, 3.0f );
+				u = ( edge < 1.0f ) ? t : ( edge < 2.0f ) ? 1.0f - t : 0.0f;
+				v = ( edge < 1.0f ) ? 0.0f : ( edge < 2.0f ) ? t : 1.0f - t;
+			}
+			break;
+		}
+
+		const vr::vec3f target = v0 + e1 * u + e2 * v;
+		const float size = vr::max( e1.length(), e2.length() );
+
+		vr::vec3f dir = randomDirection();
+
+		// Half of the grazing rays hit inside the triangle, but almost parallel to it
+		if( ( mix == GRAZING ) && ( i & 1 ) )
+		{
+			dir -= normal * dir.dot( normal );
+			if( dir.normalize() == 0.0f )
+				dir = e1 * ( 1.0f / e1.length() );
+			dir += normal * vr::Random::real( -GRAZING_SLOPE, GRAZING_SLOPE );
+		}
+
+		// Origin 1 to 10 triangle sizes away from the target
+		test.ray.orig = target - dir * ( size * vr::Random::real( 1.0f, 10.0f ) );
+		test.ray.dir = target - test.ray.orig;
+		test.ray.dir.normalize();
+		test.ray.tnear = 0.0f;
+		test.ray.tfar = vr::Mathf::MAX_VALUE;
+		test.ray.update();
+	}
+}
+
+void RayTriBenchmark::run( const char* name )
+{
+	static const uint32 KERNEL_COUNT = 12;
+	static const Kernel kernels[KERNEL_COUNT] = 
+	{
+		hitWald,
+		rt::RayTriIntersection::hitMT1,
+		rt::RayTriIntersection::hitMT2,
+		rt::RayTriIntersection::hitMT3,
+		rt::RayTriIntersection::hitMT4,
+		rt::RayTriIntersection::hitMT5,
+		rt::RayTriIntersection::hitMT6,
+		rt::RayTriIntersection::hitMT7,
+		rt::RayTriIntersection::hitTest,
+		rt::RayTriIntersection::hitChirkov,
+		rt::RayTriIntersection::hitHalfSpace,
+		rt::RayTriIntersection::hitSignedVolume
+	};
+	static const char* kernelNames[KERNEL_COUNT] = 
+	{
+		"hitWald", "hitMT1", "hitMT2", "hitMT3", "hitMT4", "hitMT5", "hitMT6", "hitMT7", 
+		"hitTest", "hitChirkov", "hitHalfSpace", "hitSignedVolume"
+	};
+
+	printf( "\n***** RayTri Benchmark: %s *****\n", name );
+	if( _tests.empty() )
+	{
+		printf( "no tests\n" );
+		return;
+	}
+
+	printf( "tests: %d x %d\n", _tests.size(), _repeatCount );
+	printf( "%-16s %10s %12s %10s %14s\n", "kernel", "ns/test", "Mtests/s", "hits", "disagreements" );
+
+	std::vector<float> reference;
+	std::vector<float> distances;
+
+	for( uint32 k = 0; k < KERNEL_COUNT; ++k )
+	{
+		const double time = runKernel( kernels[k], ( k == 0 ) ? reference : distances );
+		const double testCount = (double)_tests.size() * _repeatCount;
+
+		uint32 hitCount = 0;
+		uint32 disagreementCount = 0;
+		const std::vector<float>& results = ( k == 0 ) ? reference : distances;
+		for( uint32 i = 0, limit = results.size(); i < limit; ++i )
+		{
+			const bool hit = ( results[i] < vr::Mathf::MAX_VALUE );
+			const bool refHit = ( reference[i] < vr::Mathf::MAX_VALUE );
+
+			if( hit )
+				++hitCount;
+
+			if( ( hit != refHit ) || ( hit && 
+				( vr::abs( results[i] - reference[i] ) > DISTANCE_TOLERANCE * vr::max( reference[i], 1.0f ) ) ) )
+			{
+				++disagreementCount;
+			}
+		}
+
+		printf( "%-16s %10.2f %12.2f %10d %14d\n", kernelNames[k], 
+			    ( time > 0.0 ) ? time / testCount * 1e9 : 0.0, ( time > 0.0 ) ? testCount / time * 1e-6 : 0.0, 
+				hitCount, disagreementCount );
+	}
+}
+
+void RayTriBenchmark::runMixes( const char* name, rt::Geometry& geometry )
+{
+	static const TestMix mixes[] = { HIT, MISS, GRAZING };
+	static const char* mixNames[] = { "hits", "misses", "grazing" };
+
+	if( geometry.triDesc.empty() )
+		return;
+
+	// Geometry loaded for a compact BVH has no TriAccel's
+	const bool releaseTriAccel = !geometry.hasTriAccel();
+	if( releaseTriAccel )
+		geometry.buildTriAccel();
+
+	char mixName[128];
+	for( uint32 m = 0; m < 3; ++m )
+	{
+		generateTests( geometry, mixes[m] );
+		sprintf( mixName, "%.100s, %s", name, mixNames[m] );
+		run( mixName );
+	}
+
+	// Tests must not outlive the released TriAccel's
+	_tests.clear();
+	_geometry = NULL;
+
+	if( releaseTriAccel )
+		vr::vectorFreeMemory( geometry.triAccel );
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+double RayTriBenchmark::runKernel( Kernel kernel, std::vector<float>& distances ) const
+{
+	const rt::Geometry& geometry = *_geometry;
+	const uint32 testCount = _tests.size();
+	distances.resize( testCount );
+
+	rt::Hit hit;
+
+	vr::Timer timer;
+	timer.restart();
+	for( uint32 r = 0; r < _repeatCount; ++r )
+	{
+		for( uint32 i = 0; i < testCount; ++i )
+		{
+			const Test& test = _tests[i];
+			float bestDistance = vr::Mathf::MAX_VALUE;
+			kernel( geometry, test.triangleId, test.ray, hit, bestDistance );
+
+			// Keeps the result alive, so that the compiler cannot drop the test
+			distances[i] = bestDistance;
+		}
+	}
+	return timer.elapsed();
+}
+
+void RayTriBenchmark::hitWald( const rt::Geometry& geom, uint32 triId, const rt::Ray& ray, rt::Hit& hit, 
+							   float& bestDistance )
+{
+	rt::RayTriIntersection::hitWald( geom.triAccel[triId], ray, hit, bestDistance );
+}
@@ -0,0 +1,135 @@
+#include <rtp/RopeKdTreeAccStruct.h>
+#include <rt/Context.h>
+#include <rt/AabbIntersection.h>
+#include <rt/RayTriIntersection.h>
+
+using namespace rtp;
+
+void RopeKdTreeAccStruct::clear()
+{
+	vr::vectorFreeMemory( nodes );
+	vr::vectorFreeMemory( leaves );
+	vr::vectorFreeMemory( elements );
+}
+
+void RopeKdTreeAccStruct::findNearestInstance( const std::vector<rt::Instance>& instances, rt::Ray& ray, rt::Hit& hit )
+{
+	// If not hit bbox of entire scene, no need to trace any further
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	const rt::Ray originalRay( ray );
+	const RopeLeaf* leaf = &findLeaf( 0, ray.orig + ray.dir * ray.tnear, ray, nearBounds( ray ) );
+	float entry = originalRay.tnear;
+
+	while( true )
+	{
+		uint32 exitFace;
+		const float exit = exitDistance( *leaf, originalRay, exitFace );
+
+		for( uint32 i = leaf->elemStart, limit = i + leaf->elemCount; i < limit; ++i )
+		{
+			const rt::Instance& instance = instances[elements[i]];
+
+			// Transform ray to geometry's local space, limited to the part inside leaf
+			ray.tnear = entry;
+			ray.tfar = vr::min( exit, originalRay.tfar );
+			instance.transform.inverseTransform( ray );
+			ray.update();
+
+			// Ask geometry's acceleration structure to trace the transformed ray
+			instance.geometry->accStruct->traceNearestGeometry( instance, ray, hit );
+
+			// Transform ray back to global space
+			ray = originalRay;
+		}
+
+		// If found hit, or left the tree, return
+		if( hit.instance || ( exit >= originalRay.tfar ) || ( leaf->ropes[exitFace] == RopeLeaf::NO_ROPE ) )
+			break;
+
+		// Continue in the neighbor leaf behind exit face
+		leaf = &ropeLeaf( *leaf, exitFace, exit, originalRay );
+		entry = exit;
+	}
+}
+
+void RopeKdTreeAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// If don't hit bbox in local space, no need to trace underlying triangles
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	const rt::Geometry& geometry = *instance.geometry;
+	const float rayFar = ray.tfar;
+
+	// Best distance considers any previously found hits to prevent false hits in this geometry
+	float bestDistance = hit.distance;
+
+	// Rays starting inside the tree start at the leaf of their origin
+	const RopeLeaf* leaf = &findLeaf( 0, ray.orig + ray.dir * ray.tnear, ray, nearBounds( ray ) );
+
+	while( true )
+	{
+		uint32 exitFace;
+		const float exit = exitDistance( *leaf, ray, exitFace );
+		ray.tfar = vr::min( exit, rayFar );
+
+		for( uint32 i = leaf->elemStart, limit = i + leaf->elemCount; i < limit; ++i )
+		{
+			rt::RayTriIntersection::hitWald( geometry.triAccel[elements[i]], ray, hit, bestDistance );
+		}
+
+		// If found hit, return
+		if( bestDistance < hit.distance )
+		{
+			hit.distance = bestDistance;
+			hit.instance = &instance;
+			return;
+		}
+
+		// If left the tree, return
+		if( ( exit >= rayFar ) || ( leaf->ropes[exitFace] == RopeLeaf::NO_ROPE ) )
+			return;
+
+		// Continue in the neighbor leaf behind exit face
+		leaf = &ropeLeaf( *leaf, exitFace, exit, ray );
+		ray.tnear = exit;
+	}
+}
+
+bool RopeKdTreeAccStruct::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// Hit is only needed by nearest hit traversals
+	hit;
+
+	// Leaves are walked along the ray clipped to the tree, triangles are tested against the whole ray
+	const rt::Ray originalRay( ray );
+	if( nodes.empty() || !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	const rt::Geometry& geometry = *instance.geometry;
+	const RopeLeaf* leaf = &findLeaf( 0, ray.orig + ray.dir * ray.tnear, ray, nearBounds( ray ) );
+	bool blocked = false;
+
+	while( true )
+	{
+		for( uint32 i = leaf->elemStart, limit = i + leaf->elemCount; ( i < limit ) && !blocked; ++i )
+		{
+			blocked = rt::RayTriIntersection::hitAnyWald( geometry.triAccel[elements[i]], originalRay );
+		}
+
+		uint32 exitFace;
+		const float exit = exitDistance( *leaf, ray, exitFace );
+
+		// If blocked, or left the tree, return
+		if( blocked || ( exit >= ray.tfar ) || ( leaf->ropes[exitFace] == RopeLeaf::NO_ROPE ) )
+			break;
+
+		// Continue in the neighbor leaf behind exit face
+		leaf = &ropeLeaf( *leaf, exitFace, exit, ray );
+	}
+
+	ray = originalRay;
+	return blocked;
+}
@@ -0,0 +1,197 @@
+#include <rtp/RopeKdTreeAccStructBuilder.h>
+#include <rtp/RopeKdTreeAccStruct.h>
+#include <TriangleTreeBuilder.h>
+#include <InstanceTreeBuilder.h>
+#include <vr/timer.h>
+#include <queue>
+
+using namespace rtp;
+
+RopeKdTreeAccStructBuilder::RopeKdTreeAccStructBuilder()
+: _triangleTreeBuilder( new TriangleTreeBuilder ), _instanceTreeBuilder( new InstanceTreeBuilder )
+{
+	// empty
+}
+
+RopeKdTreeAccStructBuilder::~RopeKdTreeAccStructBuilder()
+{
+	delete _triangleTreeBuilder;
+	delete _instanceTreeBuilder;
+}
+
+void RopeKdTreeAccStructBuilder::buildGeometry( rt::Geometry* geometry )
+{
+	// Create kd-Tree using current geometry data. Ref_ptr will delete object in the end of this method.
+	vr::ref_ptr<RawKdTree> tree = _triangleTreeBuilder->buildTree( geometry );
+
+	vr::Timer timer;
+	timer.restart();
+
+	RopeKdTreeAccStruct* result = convertRawTree( tree.get() );
+
+	// Print stats
+	tree->stats.print( "Kd-Tree (ropes)" );
+	printf( "ropeTime: %.6f secs\n", timer.elapsed() );
+
+	geometry->accStruct = result;
+}
+
+rt::IAccStruct* RopeKdTreeAccStructBuilder::buildInstance( const std::vector<rt::Instance> instances )
+{
+	vr::ref_ptr<RawKdTree> tree = _instanceTreeBuilder->buildTree( instances );
+	return convertRawTree( tree.get() );
+}
+
+void RopeKdTreeAccStructBuilder::setBuildMode( KdTreeAccStructBuilder::BuildMode mode )
+{
+	_triangleTreeBuilder->setBuildMode( mode );
+}
+
+KdTreeAccStructBuilder::BuildMode RopeKdTreeAccStructBuilder::getBuildMode() const
+{
+	return _triangleTreeBuilder->getBuildMode();
+}
+
+void RopeKdTreeAccStructBuilder::setThreadCount( uint32 count )
+{
+	_triangleTreeBuilder->setThreadCount( count );
+	_instanceTreeBuilder->setThreadCount( count );
+}
+
+uint32 RopeKdTreeAccStructBuilder::getThreadCount() const
+{
+	return _triangleTreeBuilder->getThreadCount();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Private
+//////////////////////////////////////////////////////////////////////////
+RopeKdTreeAccStruct* RopeKdTreeAccStructBuilder::convertRawTree( RawKdTree* tree )
+{
+	RopeKdTreeAccStruct* result = new RopeKdTreeAccStruct();
+	result->setBoundingBox( tree->bbox );
+
+	result->nodes.resize( tree->stats.nodeCount );
+	result->leaves.resize( tree->stats.leafCount );
+	result->elements.reserve( tree->stats.elemIdCount );
+
+	// Breadth-first, so that children are next to each other
+	uint32 dstNode = 0;
+	uint32 dstLeaf = 0;
+	uint32 childId = 1;
+
+	std::queue<RawKdNode*> next;
+	next.push( tree->root.get() );
+
+	while( !next.empty() )
+	{
+		RawKdNode* current = next.front();
+		next.pop();
+
+		if( !current->isLeaf() )
+		{
+			result->nodes[dstNode].setInternalNode( current->split, childId );
+			next.push( current->left.get() );
+			next.push( current->right.get() );
+			childId += 2;
+		}
+		else
+		{
+			RopeLeaf& leaf = result->leaves[dstLeaf];
+			leaf.elemStart = result->elements.size();
+			leaf.elemCount = current->elements.size();
+			result->elements.insert( result->elements.end(), current->elements.begin(), current->elements.end() );
+
+			result->nodes[dstNode].setLeafNode( dstLeaf, leaf.elemCount );
+			++dstLeaf;
+		}
+
+		++dstNode;
+	}
+
+	// Root faces lie on the tree's boundary
+	const uint32 ropes[6] = { RopeLeaf::NO_ROPE, RopeLeaf::NO_ROPE, RopeLeaf::NO_ROPE, 
+		                      RopeLeaf::NO_ROPE, RopeLeaf::NO_ROPE, RopeLeaf::NO_ROPE };
+
+	if( !result->nodes.empty() )
+		buildRopes( result, 0, tree->bbox, ropes );
+
+	return result;
+}
+
+void RopeKdTreeAccStructBuilder::buildRopes( RopeKdTreeAccStruct* result, uint32 nodeId, const rt::Aabb& bbox, 
+											 const uint32* ropes )
+{
+	const KdNode& node = result->nodes[nodeId];
+
+	if( node.isLeaf() )
+	{
+		RopeLeaf& leaf = result->leaves[node.elemStart()];
+
+		for( uint32 f = 0; f < 6; ++f )
+		{
+			leaf.bounds[f] = ( f < 3 ) ? bbox.minv[f] : bbox.maxv[f - 3];
+			leaf.ropes[f] = optimizeRope( result, ropes[f], f, bbox );
+		}
+		return;
+	}
+
+	const uint32 axis = node.axis();
+	const uint32 left = node.leftChild();
+	const uint32 right = left + 1;
+
+	uint32 childRopes[6];
+	std::copy( ropes, ropes + 6, childRopes );
+
+	// Left child: max face on the split plane leads to right child
+	rt::Aabb childBox = bbox;
+	childBox.maxv[axis] = node.splitPos();
+	childRopes[axis + 3] = right;
+	buildRopes( result, left, childBox, childRopes );
+	childRopes[axis + 3] = ropes[axis + 3];
+
+	// Right child: min face on the split plane leads to left child
+	childBox = bbox;
+	childBox.minv[axis] = node.splitPos();
+	childRopes[axis] = left;
+	buildRopes( result, right, childBox, childRopes );
+}
+
+uint32 RopeKdTreeAccStructBuilder::optimizeRope( RopeKdTreeAccStruct* result, uint32 rope, uint32 face, 
+												 const rt::Aabb& bbox ) const
+{
+	if( rope == RopeLeaf::NO_ROPE )
+		return rope;
+
+	const uint32 faceAxis = face % 3;
+
+	while( !result->nodes[rope].isLeaf() )
+	{
+		const KdNode& node = result->nodes[rope];
+		const uint32 axis = node.axis();
+		const float split = node.splitPos();
+
+		if( axis == faceAxis )
+		{
+			// Split parallel to face: the child next to the face covers it, left one behind a max face
+			rope = node.leftChild() + ( ( face < 3 ) ? 1 : 0 );
+		}
+		else if( split >= bbox.maxv[axis] )
+		{
+			// Whole face lies on the left side
+			rope = node.leftChild();
+		}
+		else if( split <= bbox.minv[axis] )
+		{
+			// Whole face lies on the right side
+			rope = node.leftChild() + 1;
+		}
+		else
+		{
+			// Face is split among both children
+			break;
+		}
+	}
+
+	return rope;
+}
@@ -12,42 +12,56 @@ void TiledRenderer::render()
 	rt::Context* ctx = rt::Context::current();
 	ctx->getCamera()->getViewport( width, height );
 	float* frameBuffer = ctx->getFrameBuffer();
-	rt::Sample sample;
 	int32 w = (int32)width;
 	int32 h = (int32)height;
 
 	const int32 tileSize = 16;
 	const int32 chunk = 1;
 
+	// Primary rays of a block are traced as one packet, see Context::traceNearestPacket
+	const int32 blockSize = 4;
+
 	const int32 numTilesX = vr::round( (float)w / (float)tileSize );
 	const int32 numTilesY = vr::round( (float)h / (float)tileSize );
 	const float invNumTilesX = 1.0f / (float)numTilesX;
 	const int32 limit = numTilesX * numTilesY;
 
-	#pragma omp parallel for shared( frameBuffer, tileSize, h, w, numTilesX, ctx ) private( sample ) schedule( dynamic, chunk )
+	#pragma omp parallel for shared( frameBuffer, tileSize, h, w, numTilesX, ctx ) schedule( dynamic, chunk )
 	for( int32 i = 0; i < limit; ++i )
 	{
 		const int32 ty = ( i / numTilesX ) * tileSize;
 		const int32 tx = ( i % numTilesX ) * tileSize;
 
-		for( int32 dy = 0; dy < tileSize; ++dy )
-		{
-			const int32 y = ty + dy;
-			if( y >= h )
-				continue;
+		rt::Sample samples[blockSize * blockSize];
+		int32 pixels[blockSize * blockSize];
 
-			for( int32 dx = 0; dx < tileSize; ++dx )
+		for( int32 by = ty; by < ty + tileSize; by += blockSize )
+		{
+			for( int32 bx = tx; bx < tx + tileSize; bx += blockSize )
 			{
-				const int32 x = tx + dx;
-				if( x >= w )
+				uint32 count = 0;
+
+				for( int32 y = by; ( y < by + blockSize ) && ( y < h ); ++y )
+				{
+					for( int32 x = bx; ( x < bx + blockSize ) && ( x < w ); ++x )
+					{
+						samples[count].initPrimaryRay( x, y );
+						pixels[count] = x + y * w;
+						++count;
+					}
+				}
+
+				if( count == 0 )
 					continue;
 
-				sample.initPrimaryRay( x, y );
-				ctx->traceNearest( sample );
+				ctx->traceNearestPacket( samples, count );
 
-				frameBuffer[(x+y*w)*3]   = sample.color.r;
-				frameBuffer[(x+y*w)*3+1] = sample.color.g;
-				frameBuffer[(x+y*w)*3+2] = sample.color.b;
+				for( uint32 s = 0; s < count; ++s )
+				{
+					frameBuffer[pixels[s]*3]   = samples[s].color.r;
+					frameBuffer[pixels[s]*3+1] = samples[s].color.g;
+					frameBuffer[pixels[s]*3+2] = samples[s].color.b;
+				}
 			}
 		}
 	}
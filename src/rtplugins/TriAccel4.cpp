@@ -0,0 +1,64 @@
+#include <rtp/TriAccel4.h>
+#include <rt/RayTriIntersection.h>
+
+using namespace rtp;
+
+// Same tolerance as RayTriIntersection
+static const float HIT_EPSILON = rt::RayTriIntersection::HIT_EPSILON;
+
+void TriAccel4::SimdRay::load( const rt::Ray& ray )
+{
+	for( uint32 i = 0; i < 3; ++i )
+	{
+		orig[i] = _mm_set1_ps( ray.orig[i] );
+		dir[i] = _mm_set1_ps( ray.dir[i] );
+	}
+
+	setInterval( ray.tnear, ray.tfar );
+}
+
+void TriAccel4::SimdRay::setInterval( float rayNear, float rayFar )
+{
+	tnear = _mm_set1_ps( rayNear - HIT_EPSILON );
+	tfar = _mm_set1_ps( rayFar + HIT_EPSILON );
+}
+
+void TriAccel4::set( uint32 lane, const rt::TriAccel& acc )
+{
+	const uint32 k = acc.k;
+	const uint32 ku = ( k + 1 ) % 3;
+	const uint32 kv = ( k + 2 ) % 3;
+
+	n[k][lane] = 1.0f;
+	n[ku][lane] = acc.n_u;
+	n[kv][lane] = acc.n_v;
+	n_d[lane] = acc.n_d;
+
+	b[k][lane] = 0.0f;
+	b[ku][lane] = acc.b_nu;
+	b[kv][lane] = acc.b_nv;
+	b_d[lane] = acc.b_d;
+
+	c[k][lane] = 0.0f;
+	c[ku][lane] = acc.c_nu;
+	c[kv][lane] = acc.c_nv;
+	c_d[lane] = acc.c_d;
+
+	triangleIds[lane] = acc.triangleId;
+}
+
+void TriAccel4::pack( const std::vector<rt::TriAccel>& accels, const uint32* ids, uint32 count,
+					  std::vector<TriAccel4>& blocks )
+{
+	for( uint32 start = 0; start < count; start += 4 )
+	{
+		blocks.push_back( TriAccel4() );
+		TriAccel4& block = blocks.back();
+
+		// Last block repeats its last triangle in unused lanes
+		for( uint32 lane = 0; lane < 4; ++lane )
+		{
+			block.set( lane, accels[ids[vr::min( start + lane, count - 1 )]] );
+		}
+	}
+}
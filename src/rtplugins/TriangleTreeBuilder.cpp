@@ -1,69 +1,253 @@
 #include "TriangleTreeBuilder.h"
 #include <rt/AabbIntersection.h>
+#include <vr/timer.h>
 #include <algorithm>
+#include <omp.h>
 
 using namespace rtp;
 
+// Lazy build: smaller subtrees are cheaper to build right away than to revisit later
+static const uint32 MIN_UNBUILT_TRIANGLES = 256;
+
+TriangleTreeBuilder::BuildState::BuildState()
+: topLevel( false )
+{
+	// empty
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 TriangleTreeBuilder::TriangleTreeBuilder()
-: _events( 3 ), _traversalCost( 1.0f ), _intersectionCost( 1.4f )
+: _buildMode( KdTreeAccStructBuilder::SORT_PER_NODE ), _threadCount( 1 ), _taskDepth( 0 ), _lazyDepth( 0 ), 
+  _lazyLimit( 0 ), _traversalCost( 1.0f ), _intersectionCost( 1.4f )
 {
 	// empty
 }
 
 RawKdTree* TriangleTreeBuilder::buildTree( rt::Geometry* geometry )
 {
+	rt::Aabb bbox;
+	bbox.buildFrom( &geometry->vertices[0], geometry->vertices.size() );
+
+	return build( geometry, NULL, bbox, 0 );
+}
+
+RawKdTree* TriangleTreeBuilder::buildSubtree( rt::Geometry* geometry, const RawKdNode::Elements& triangles, 
+											  const rt::Aabb& bbox, uint32 treeDepth )
+{
+	return build( geometry, &triangles, bbox, treeDepth );
+}
+
+void TriangleTreeBuilder::setBuildMode( BuildMode mode )
+{
+	_buildMode = mode;
+}
+
+TriangleTreeBuilder::BuildMode TriangleTreeBuilder::getBuildMode() const
+{
+	return _buildMode;
+}
+
+void TriangleTreeBuilder::setThreadCount( uint32 count )
+{
+	_threadCount = vr::max( count, 1u );
+}
+
+uint32 TriangleTreeBuilder::getThreadCount() const
+{
+	return _threadCount;
+}
+
+void TriangleTreeBuilder::setLazyDepth( uint32 levels )
+{
+	_lazyDepth = levels;
+}
+
+uint32 TriangleTreeBuilder::getLazyDepth() const
+{
+	return _lazyDepth;
+}
+
+// Private methods
+
+RawKdTree* TriangleTreeBuilder::build( rt::Geometry* geometry, const RawKdNode::Elements* triangles, 
+									   const rt::Aabb& bbox, uint32 treeDepth )
+{
+	vr::Timer timer;
+	timer.restart();
+
 	// Store geometry reference
 	_geometry = geometry;
 	
-	uint32 triangleCount = _geometry->triDesc.size();
+	const uint32 triangleCount = ( triangles != NULL ) ? triangles->size() : _geometry->triDesc.size();
 
-	// Reset triangle data
-	vr::vectorExactResize( _triangleSides, triangleCount );
-	vr::vectorExactResize( _triangleBoxes, triangleCount );
+	// Create new raw kd tree
+	RawKdTree* tree = new RawKdTree();
+	tree->bbox = bbox;
+
+	// Root state works directly with the geometry's triangle ids, a subtree's with local ids
+	BuildState state;
+	state.topLevel = ( _threadCount > 1 );
+	if( triangles != NULL )
+		state.globalIds = *triangles;
+	vr::vectorExactResize( state.triangleSides, triangleCount );
+
+	// Defer subtrees once there are enough of them to keep all threads busy
+	_taskDepth = treeDepth + 3;
+	for( uint32 n = 1; n < _threadCount; n <<= 1 )
+	{
+		++_taskDepth;
+	}
 
-	// Pre-allocate event data
-	_events[0].reserve( triangleCount*2 );
-	_events[1].reserve( triangleCount*2 );
-	_events[2].reserve( triangleCount*2 );
+	// Subtrees below this depth are left unbuilt
+	_lazyLimit = ( _lazyDepth > 0 ) ? treeDepth + _lazyDepth : 0xFFFFFFFF;
 
-	// Create triangle id vector for entire scene
-	RawKdNode::Elements initialTriangles( triangleCount );
+	if( state.topLevel )
+		vr::vectorExactResize( _localIds, triangleCount );
 
-	for( uint32 i = 0; i < triangleCount; ++i )
+	if( _buildMode == KdTreeAccStructBuilder::PRESORTED_EVENTS )
 	{
-		initialTriangles[i] = i;
+		EventList events[3];
+
+		// Clip triangles to scene box
+		std::vector<rt::Aabb>& triangleBoxes = state.triangleBoxes;
+		vr::vectorExactResize( triangleBoxes, triangleCount );
+
+		#pragma omp parallel for if( state.topLevel ) num_threads( _threadCount ) schedule( static )
+		for( int32 t = 0; t < (int32)triangleCount; ++t )
+		{
+			const uint32 globalId = state.globalId( t );
+			rt::AabbIntersection::clipTriangle( _geometry->getVertex( globalId, 0 ), 
+				                                _geometry->getVertex( globalId, 1 ),
+				                                _geometry->getVertex( globalId, 2 ),
+				                                tree->bbox, triangleBoxes[t] );
+		}
+
+		uint32 validCount = 0;
+		for( uint32 t = 0; t < triangleCount; ++t )
+		{
+			if( !triangleBoxes[t].isDegenerate() )
+				++validCount;
+		}
+
+		// Compute event lists for entire scene and sort them only once, partition keeps them sorted from now on
+		#pragma omp parallel for if( state.topLevel ) num_threads( 3 )
+		for( int32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+		{
+			events[k].reserve( validCount*2 );
+
+			for( uint32 t = 0; t < triangleCount; ++t )
+			{
+				// Degenerate box, skip triangle
+				if( !triangleBoxes[t].isDegenerate() )
+					addAxisEvents( events[k], k, t, triangleBoxes[t] );
+			}
+
+			std::sort( events[k].begin(), events[k].end(), EventOrder() );
+		}
+
+		vr::vectorFreeMemory( triangleBoxes );
+
+		// Recursive tree build
+		tree->root = recursiveBuildPresorted( state, events, validCount, tree->bbox, treeDepth );
 	}
-	
-	// Create new raw kd tree
-	RawKdTree* tree = new RawKdTree();
-	tree->bbox.buildFrom( &_geometry->vertices[0], _geometry->vertices.size() );
-	_stats = &tree->stats;
-	_stats->reset();
+	else
+	{
+		// Pre-allocate event data
+		vr::vectorExactResize( state.triangleBoxes, triangleCount );
+		state.events[0].reserve( triangleCount*2 );
+		state.events[1].reserve( triangleCount*2 );
+		state.events[2].reserve( triangleCount*2 );
+
+		// Create triangle id vector for entire scene
+		RawKdNode::Elements initialTriangles( triangleCount );
+
+		for( uint32 i = 0; i < triangleCount; ++i )
+		{
+			initialTriangles[i] = i;
+		}
 
-	// Recursive tree build
-	tree->root = recursiveBuild( initialTriangles, tree->bbox, 0 );
+		// Recursive tree build
+		tree->root = recursiveBuild( state, initialTriangles, tree->bbox, treeDepth );
+	}
 
 	// Cleanup
-	vr::vectorFreeMemory( _triangleSides );
-	vr::vectorFreeMemory( _triangleBoxes );
-	vr::vectorFreeMemory( _events[0] );
-	vr::vectorFreeMemory( _events[1] );
-	vr::vectorFreeMemory( _events[2] );
+	vr::vectorFreeMemory( state.triangleSides );
+	vr::vectorFreeMemory( state.triangleBoxes );
+	vr::vectorFreeMemory( state.events[0] );
+	vr::vectorFreeMemory( state.events[1] );
+	vr::vectorFreeMemory( state.events[2] );
+	vr::vectorFreeMemory( _localIds );
+
+	// Build deferred subtrees in parallel
+	if( !_tasks.empty() )
+	{
+		std::sort( _tasks.begin(), _tasks.end(), TaskOrder() );
+		const int32 taskCount = _tasks.size();
+
+		#pragma omp parallel for num_threads( _threadCount ) schedule( dynamic, 1 )
+		for( int32 i = 0; i < taskCount; ++i )
+		{
+			runTask( *_tasks[i] );
+		}
+
+		for( int32 i = 0; i < taskCount; ++i )
+		{
+			mergeStats( state.stats, _tasks[i]->state.stats );
+			delete _tasks[i];
+		}
+
+		_tasks.clear();
+	}
+
+	tree->stats = state.stats;
+	tree->stats.buildTime = timer.elapsed();
 
 	return tree;
 }
 
-// Private methods
+RawKdNode* TriangleTreeBuilder::leafNode( BuildState& state, const RawKdNode::Elements& triangles, uint32 treeDepth )
+{
+	RawKdTree::Statistics& stats = state.stats;
 
-RawKdNode* TriangleTreeBuilder::leafNode( const RawKdNode::Elements& triangles, uint32 treeDepth )
+	if( treeDepth > stats.treeDepth )
+		stats.treeDepth = treeDepth;
+
+	stats.elemIdCount += triangles.size();
+	++stats.leafCount;
+
+	return createLeaf( state, triangles );
+}
+
+RawKdNode* TriangleTreeBuilder::unbuiltNode( BuildState& state, const RawKdNode::Elements& triangles, 
+											 const rt::Aabb& bbox, uint32 treeDepth )
 {
-	if( treeDepth > _stats->treeDepth )
-		_stats->treeDepth = treeDepth;
+	++state.stats.nodeCount;
+	++state.stats.unbuiltCount;
 
-	_stats->elemIdCount += triangles.size();
-	++_stats->leafCount;
+	// Everything needed to build the subtree later on
+	RawKdNode* node = createLeaf( state, triangles );
+	node->unbuilt = true;
+	node->bbox = bbox;
+	node->treeDepth = treeDepth;
 
-	return new RawKdNode( triangles );
+	return node;
+}
+
+RawKdNode* TriangleTreeBuilder::createLeaf( const BuildState& state, const RawKdNode::Elements& triangles ) const
+{
+	// Leaves always store the geometry's triangle ids
+	RawKdNode* leaf = new RawKdNode( triangles );
+
+	if( !state.globalIds.empty() )
+	{
+		for( uint32 i = 0, size = triangles.size(); i < size; ++i )
+		{
+			leaf->elements[i] = state.globalIds[triangles[i]];
+		}
+	}
+
+	return leaf;
 }
 
 bool TriangleTreeBuilder::terminate( const SahResult& bestResult, uint32 triangleCount ) const
@@ -73,7 +257,7 @@ bool TriangleTreeBuilder::terminate( const SahResult& bestResult, uint32 triangl
 }
 
 void TriangleTreeBuilder::sah( SahResult& result, const rt::SplitPlane& plane, const rt::Aabb& bbox, 
-							   uint32 nL, uint32 nP, uint32 nR )
+							   uint32 nL, uint32 nP, uint32 nR ) const
 {
 	rt::Aabb left;
 	rt::Aabb right;
@@ -119,19 +303,28 @@ void TriangleTreeBuilder::sah( SahResult& result, const rt::SplitPlane& plane, c
 	}
 }
 
-RawKdNode* TriangleTreeBuilder::recursiveBuild( const RawKdNode::Elements& triangles, const rt::Aabb& bbox, uint32 treeDepth )
+RawKdNode* TriangleTreeBuilder::recursiveBuild( BuildState& state, const RawKdNode::Elements& triangles, 
+												const rt::Aabb& bbox, uint32 treeDepth )
 {
+	// Lazy build leaves deeper subtrees for the first ray that reaches them
+	if( ( treeDepth >= _lazyLimit ) && ( triangles.size() > MIN_UNBUILT_TRIANGLES ) )
+		return unbuiltNode( state, triangles, bbox, treeDepth );
+
+	// Lower subtrees of a parallel build are built later as independent tasks
+	if( state.topLevel && ( treeDepth >= _taskDepth ) )
+		return deferTask( state, &triangles, NULL, triangles.size(), bbox, treeDepth );
+
 	rt::SplitPlane plane;
 	SahResult sahResult;
 	uint32 triangleCount = triangles.size();
-	++_stats->nodeCount;
+	++state.stats.nodeCount;
 
 	// Compute cost-optimized split plane for given set of triangles and enclosing bounding box
-	findPlane( plane, sahResult, triangleCount, triangles, bbox );
+	findPlane( state, plane, sahResult, triangleCount, triangles, bbox );
 
 	// Further subdivision does not pay off if even	the best split is more costly then not splitting at all
 	if( terminate( sahResult, triangleCount ) )
-		return leafNode( triangles, treeDepth );
+		return leafNode( state, triangles, treeDepth );
 
 	// Split current bounding box according to chosen split plane
 	rt::Aabb leftBox;
@@ -141,101 +334,314 @@ RawKdNode* TriangleTreeBuilder::recursiveBuild( const RawKdNode::Elements& trian
 	// Partition current triangles into both child bounding boxes
 	RawKdNode::Elements leftTriangles;
 	RawKdNode::Elements rightTriangles;
-	partition( leftTriangles, rightTriangles, sahResult, plane, triangles );
+	partition( state, leftTriangles, rightTriangles, sahResult, plane, triangles );
 
 	// Recursive tree build for both children
-	RawKdNode* left  = recursiveBuild( leftTriangles, leftBox, treeDepth + 1 );
+	RawKdNode* left  = recursiveBuild( state, leftTriangles, leftBox, treeDepth + 1 );
 	vr::vectorFreeMemory( leftTriangles );
-	RawKdNode* right = recursiveBuild( rightTriangles, rightBox, treeDepth + 1 );
+	RawKdNode* right = recursiveBuild( state, rightTriangles, rightBox, treeDepth + 1 );
 	vr::vectorFreeMemory( rightTriangles );
 
 	return new RawKdNode( plane, left, right );
 }
 
-void TriangleTreeBuilder::findPlane( rt::SplitPlane& plane, SahResult& sahResult, uint32& triangleCount, 
+void TriangleTreeBuilder::findPlane( BuildState& state, rt::SplitPlane& plane, SahResult& sahResult, uint32& triangleCount, 
 									 const RawKdNode::Elements& triangles, const rt::Aabb& bbox )
 {
-	// TODO: may put some of these as members of class, if it improves performance
-	rt::SplitPlane currentPlane;
-	SahResult currentSahResult;
-
-	vr::vec3f v0;
-	vr::vec3f v1;
-	vr::vec3f v2;
-
-	Event event;
-	EventOrder predicate;
-	uint32 nL;
-	uint32 nP;
-	uint32 nR;
-	uint32 numStartEvents;
-	uint32 numPlanarEvents;
-	uint32 numEndEvents;
-
-	const std::vector<vr::vec3f>& vertices = _geometry->vertices;
-
-	// Reset data, but preserve memory allocation
-	triangleCount = 0;
-	_events[0].clear();
-	_events[1].clear();
-	_events[2].clear();
+	const int32 size = triangles.size();
 
 	// Clip triangles to current bbox (perfect splits)
-	// Compute unsorted event lists
 	// Reset triangle classifications
-	for( uint32 t = 0, limit = triangles.size(); t < limit; ++t )
+	#pragma omp parallel for if( state.topLevel ) num_threads( _threadCount ) schedule( static )
+	for( int32 t = 0; t < size; ++t )
 	{
-		uint32 triangleId = triangles[t];
+		const uint32 triangleId = triangles[t];
+		const uint32 globalId = state.globalId( triangleId );
 		// Get triangle bbox
-		rt::Aabb& currentBox = _triangleBoxes[triangleId];
+		rt::Aabb& currentBox = state.triangleBoxes[triangleId];
 		// Get triangle vertices and update bbox
-		rt::AabbIntersection::clipTriangle( _geometry->getVertex(triangleId, 0), 
-			                    _geometry->getVertex(triangleId, 1),
-								_geometry->getVertex(triangleId, 2),
+		rt::AabbIntersection::clipTriangle( _geometry->getVertex(globalId, 0), 
+			                    _geometry->getVertex(globalId, 1),
+								_geometry->getVertex(globalId, 2),
 								bbox, currentBox );
 
 		// Degenerate box, skip triangle
-		if( currentBox.isDegenerate() )
+		state.triangleSides[triangleId] = currentBox.isDegenerate() ? INVALID : BOTH;
+	}
+
+	// Count valid triangles
+	triangleCount = 0;
+	for( int32 t = 0; t < size; ++t )
+	{
+		if( state.triangleSides[triangles[t]] == BOTH )
+			++triangleCount;
+	}
+
+	// Compute sorted event lists, reset data but preserve memory allocation
+	#pragma omp parallel for if( state.topLevel ) num_threads( 3 )
+	for( int32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		EventList& currentEvents = state.events[k];
+		currentEvents.clear();
+
+		for( int32 t = 0; t < size; ++t )
 		{
-			_triangleSides[triangleId] = INVALID;
-			continue;
+			const uint32 triangleId = triangles[t];
+			if( state.triangleSides[triangleId] == BOTH )
+				addAxisEvents( currentEvents, k, triangleId, state.triangleBoxes[triangleId] );
 		}
 
-		// Validate triangle
-		++triangleCount;
-		_triangleSides[triangleId] = BOTH;
+		std::sort( currentEvents.begin(), currentEvents.end(), EventOrder() );
+	}
 
-		// Insert triangle events in lists
-		for( RTenum k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	// Compute SAH for each sorted event
+	sweepEvents( state, plane, sahResult, state.events, triangleCount, bbox );
+}
+
+void TriangleTreeBuilder::partition( BuildState& state, RawKdNode::Elements& left, RawKdNode::Elements& right, 
+									 const SahResult& sahResult, const rt::SplitPlane& plane, const RawKdNode::Elements& triangles )
+{
+	// Iterate through events of chosen axis and reclassify triangles, if possible
+	classifyTriangles( state, sahResult, plane, state.events[plane.axis] );
+
+	// Iterate through triangle sides and partition triangles
+	for( uint32 i = 0, size = triangles.size(); i < size; ++i )
+	{
+		const uint32 triangleId = triangles[i];
+		const Side side = state.triangleSides[triangleId];
+
+		if( side == LEFT )
 		{
-			std::vector<Event>& currentEvents = _events[k];
+			left.push_back( triangleId );
+		}
+		else if( side == RIGHT )
+		{
+			right.push_back( triangleId );
+		}
+		else if( side == BOTH )
+		{
+			left.push_back( triangleId );
+			right.push_back( triangleId );
+		}
+		// else INVALID, so skip triangle
+	}
+}
+
+RawKdNode* TriangleTreeBuilder::recursiveBuildPresorted( BuildState& state, EventList* events, uint32 triangleCount, 
+														 const rt::Aabb& bbox, uint32 treeDepth )
+{
+	// Lazy build leaves deeper subtrees for the first ray that reaches them
+	if( ( treeDepth >= _lazyLimit ) && ( triangleCount > MIN_UNBUILT_TRIANGLES ) )
+	{
+		RawKdNode::Elements triangles;
+		eventTriangles( events, triangleCount, triangles );
+		return unbuiltNode( state, triangles, bbox, treeDepth );
+	}
+
+	// Lower subtrees of a parallel build are built later as independent tasks
+	if( state.topLevel && ( treeDepth >= _taskDepth ) )
+		return deferTask( state, NULL, events, triangleCount, bbox, treeDepth );
 
-			if( !currentBox.isPlanar( k ) )
+	rt::SplitPlane plane;
+	SahResult sahResult;
+	++state.stats.nodeCount;
+
+	// Event lists are already sorted, only need to sweep them
+	sweepEvents( state, plane, sahResult, events, triangleCount, bbox );
+
+	// Further subdivision does not pay off if even	the best split is more costly then not splitting at all
+	if( terminate( sahResult, triangleCount ) )
+	{
+		RawKdNode::Elements triangles;
+		eventTriangles( events, triangleCount, triangles );
+		return leafNode( state, triangles, treeDepth );
+	}
+
+	// Split current bounding box according to chosen split plane
+	rt::Aabb leftBox;
+	rt::Aabb rightBox;
+	rt::AabbIntersection::splitAabb( bbox, plane, leftBox, rightBox );
+
+	// Partition current events into both child bounding boxes, keeping them sorted
+	EventList leftEvents[3];
+	EventList rightEvents[3];
+	uint32 leftCount;
+	uint32 rightCount;
+	partitionEvents( state, leftEvents, rightEvents, leftCount, rightCount, sahResult, plane, events, leftBox, rightBox );
+
+	// Parent events are no longer needed
+	vr::vectorFreeMemory( events[0] );
+	vr::vectorFreeMemory( events[1] );
+	vr::vectorFreeMemory( events[2] );
+
+	// Recursive tree build for both children
+	RawKdNode* left = recursiveBuildPresorted( state, leftEvents, leftCount, leftBox, treeDepth + 1 );
+	vr::vectorFreeMemory( leftEvents[0] );
+	vr::vectorFreeMemory( leftEvents[1] );
+	vr::vectorFreeMemory( leftEvents[2] );
+	RawKdNode* right = recursiveBuildPresorted( state, rightEvents, rightCount, rightBox, treeDepth + 1 );
+	vr::vectorFreeMemory( rightEvents[0] );
+	vr::vectorFreeMemory( rightEvents[1] );
+	vr::vectorFreeMemory( rightEvents[2] );
+
+	return new RawKdNode( plane, left, right );
+}
+
+void TriangleTreeBuilder::partitionEvents( BuildState& state, EventList* leftEvents, EventList* rightEvents, 
+										   uint32& leftCount, uint32& rightCount,
+										   const SahResult& sahResult, const rt::SplitPlane& plane, const EventList* events,
+										   const rt::Aabb& leftBox, const rt::Aabb& rightBox )
+{
+	const EventList& bestEvents = events[plane.axis];
+	std::vector<Side>& triangleSides = state.triangleSides;
+
+	// Assume every triangle straddles the plane, then reclassify the ones we can
+	for( uint32 i = 0, size = bestEvents.size(); i < size; ++i )
+	{
+		triangleSides[bestEvents[i].triangleId] = BOTH;
+	}
+
+	classifyTriangles( state, sahResult, plane, bestEvents );
+
+	// Straddling triangles are clipped to each child box, which generates new events (unsorted)
+	EventList bothLeft[3];
+	EventList bothRight[3];
+	rt::Aabb clippedBox;
+
+	leftCount = 0;
+	rightCount = 0;
+
+	// Visit each triangle once: only start and planar events
+	for( uint32 i = 0, size = bestEvents.size(); i < size; ++i )
+	{
+		const Event& event = bestEvents[i];
+		if( event.type == Event::END )
+			continue;
+
+		const uint32 triangleId = event.triangleId;
+		const Side side = triangleSides[triangleId];
+
+		if( side == LEFT )
+		{
+			++leftCount;
+		}
+		else if( side == RIGHT )
+		{
+			++rightCount;
+		}
+		else
+		{
+			const uint32 globalId = state.globalId( triangleId );
+			const vr::vec3f& v0 = _geometry->getVertex( globalId, 0 );
+			const vr::vec3f& v1 = _geometry->getVertex( globalId, 1 );
+			const vr::vec3f& v2 = _geometry->getVertex( globalId, 2 );
+
+			rt::AabbIntersection::clipTriangle( v0, v1, v2, leftBox, clippedBox );
+			if( !clippedBox.isDegenerate() )
 			{
-				// Add two distinct events
-				event.triangleId = triangles[t];
-				event.position = currentBox.minv[k];
-				event.type = Event::START;
-				currentEvents.push_back( event );
-				event.position = currentBox.maxv[k];
-				event.type = Event::END;
-				currentEvents.push_back( event );
+				addEvents( bothLeft, triangleId, clippedBox );
+				++leftCount;
 			}
-			else
+
+			rt::AabbIntersection::clipTriangle( v0, v1, v2, rightBox, clippedBox );
+			if( !clippedBox.isDegenerate() )
 			{
-				// Add one planar event
-				event.triangleId = triangles[t];
-				event.position = currentBox.minv[k];
-				event.type = Event::PLANAR;
-				currentEvents.push_back( event );
+				addEvents( bothRight, triangleId, clippedBox );
+				++rightCount;
 			}
 		}
 	}
 
-	// Sort event lists
-	std::sort( _events[0].begin(), _events[0].end(), predicate );
-	std::sort( _events[1].begin(), _events[1].end(), predicate );
-	std::sort( _events[2].begin(), _events[2].end(), predicate );
+	EventOrder predicate;
+
+	#pragma omp parallel for if( state.topLevel ) num_threads( 3 )
+	for( int32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		const EventList& currentEvents = events[k];
+		EventList& left = leftEvents[k];
+		EventList& right = rightEvents[k];
+
+		// Events of one-sided triangles are simply split, so they remain sorted
+		for( uint32 i = 0, size = currentEvents.size(); i < size; ++i )
+		{
+			const Event& event = currentEvents[i];
+			const Side side = triangleSides[event.triangleId];
+
+			if( side == LEFT )
+				left.push_back( event );
+			else if( side == RIGHT )
+				right.push_back( event );
+		}
+
+		// Only the (usually few) new events need sorting, then merge both sorted sequences
+		std::sort( bothLeft[k].begin(), bothLeft[k].end(), predicate );
+		uint32 middle = left.size();
+		left.insert( left.end(), bothLeft[k].begin(), bothLeft[k].end() );
+		std::inplace_merge( left.begin(), left.begin() + middle, left.end(), predicate );
+
+		std::sort( bothRight[k].begin(), bothRight[k].end(), predicate );
+		middle = right.size();
+		right.insert( right.end(), bothRight[k].begin(), bothRight[k].end() );
+		std::inplace_merge( right.begin(), right.begin() + middle, right.end(), predicate );
+	}
+}
+
+void TriangleTreeBuilder::eventTriangles( const EventList* events, uint32 triangleCount, RawKdNode::Elements& triangles ) const
+{
+	// Each triangle has exactly one start or planar event in any axis
+	triangles.reserve( triangleCount );
+
+	for( uint32 i = 0, size = events[0].size(); i < size; ++i )
+	{
+		if( events[0][i].type != Event::END )
+			triangles.push_back( events[0][i].triangleId );
+	}
+}
+
+void TriangleTreeBuilder::addEvents( EventList* events, uint32 triangleId, const rt::Aabb& triangleBox ) const
+{
+	for( RTenum k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		addAxisEvents( events[k], k, triangleId, triangleBox );
+	}
+}
+
+void TriangleTreeBuilder::addAxisEvents( EventList& events, RTenum axis, uint32 triangleId, const rt::Aabb& triangleBox ) const
+{
+	Event event;
+	event.triangleId = triangleId;
+
+	if( !triangleBox.isPlanar( axis ) )
+	{
+		// Add two distinct events
+		event.position = triangleBox.minv[axis];
+		event.type = Event::START;
+		events.push_back( event );
+		event.position = triangleBox.maxv[axis];
+		event.type = Event::END;
+		events.push_back( event );
+	}
+	else
+	{
+		// Add one planar event
+		event.position = triangleBox.minv[axis];
+		event.type = Event::PLANAR;
+		events.push_back( event );
+	}
+}
+
+void TriangleTreeBuilder::sweepEvents( const BuildState& state, rt::SplitPlane& plane, SahResult& sahResult, 
+									   const EventList* events, uint32 triangleCount, const rt::Aabb& bbox ) const
+{
+	rt::SplitPlane axisPlanes[3];
+	SahResult axisResults[3];
+
+	// Iterate through all 3 axis computing SAH for each sorted event
+	#pragma omp parallel for if( state.topLevel ) num_threads( 3 )
+	for( int32 k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
+	{
+		sweepAxis( axisPlanes[k], axisResults[k], events[k], k, triangleCount, bbox );
+	}
 
 	// Reset best classification
 	plane.position = vr::Mathf::MAX_VALUE;
@@ -243,116 +649,224 @@ void TriangleTreeBuilder::findPlane( rt::SplitPlane& plane, SahResult& sahResult
 	sahResult.cost = vr::Mathf::MAX_VALUE;
 	sahResult.side = LEFT;
 
-	// Iterate through all 3 axis computing SAH for each sorted event
+	// Keep first best result in axis order, exactly as a single serial sweep would
 	for( RTenum k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
 	{
-		// Set current axis and get events
-		currentPlane.axis = k;
-		const std::vector<Event>& currentEvents = _events[k];
+		if( axisResults[k].cost < sahResult.cost )
+		{
+			sahResult = axisResults[k];
+			plane = axisPlanes[k];
+		}
+	}
+}
 
-		// Start with all triangles on the right
-		nL = 0;
-		nP = 0;
-		nR = triangleCount;
+void TriangleTreeBuilder::sweepAxis( rt::SplitPlane& plane, SahResult& sahResult, const EventList& events, RTenum axis,
+									 uint32 triangleCount, const rt::Aabb& bbox ) const
+{
+	rt::SplitPlane currentPlane;
+	SahResult currentSahResult;
 
-		// Iteratively sweep plane over all split candidates
-		for( uint32 i = 0, eventCount = currentEvents.size(); i < eventCount; /*empty*/ )
-		{
-			currentPlane.position = currentEvents[i].position;
-			numStartEvents = 0;
-			numPlanarEvents = 0;
-			numEndEvents = 0;
+	uint32 numStartEvents;
+	uint32 numPlanarEvents;
+	uint32 numEndEvents;
 
-			while( ( i < eventCount ) && ( currentPlane.position == currentEvents[i].position ) && 
-				   ( currentEvents[i].type == Event::END ) )
-			{
-				++numEndEvents;
-				++i;
-			}
+	// Reset best classification
+	plane.position = vr::Mathf::MAX_VALUE;
+	plane.axis = axis;
+	sahResult.cost = vr::Mathf::MAX_VALUE;
+	sahResult.side = LEFT;
 
-			while( ( i < eventCount ) && ( currentPlane.position == currentEvents[i].position ) && 
-				   ( currentEvents[i].type == Event::PLANAR ) )
-			{
-				++numPlanarEvents;
-				++i;
-			}
+	// Set current axis
+	currentPlane.axis = axis;
 
-			while( ( i < eventCount ) && ( currentPlane.position == currentEvents[i].position ) && 
-				   ( currentEvents[i].type == Event::START ) )
-			{
-				++numStartEvents;
-				++i;
-			}
+	// Start with all triangles on the right
+	uint32 nL = 0;
+	uint32 nP = 0;
+	uint32 nR = triangleCount;
 
-			// Update recurrence
-			nP = numPlanarEvents;
-			nR -= numPlanarEvents;
-			nR -= numEndEvents;
-			
-			// Compute SAH and save best result
-			sah( currentSahResult, currentPlane, bbox, nL, nP, nR );
+	// Iteratively sweep plane over all split candidates
+	for( uint32 i = 0, eventCount = events.size(); i < eventCount; /*empty*/ )
+	{
+		currentPlane.position = events[i].position;
+		numStartEvents = 0;
+		numPlanarEvents = 0;
+		numEndEvents = 0;
 
-			if( currentSahResult.cost < sahResult.cost )
-			{
-				sahResult = currentSahResult;
-				plane = currentPlane;
-			}
+		while( ( i < eventCount ) && ( currentPlane.position == events[i].position ) && 
+			   ( events[i].type == Event::END ) )
+		{
+			++numEndEvents;
+			++i;
+		}
+
+		while( ( i < eventCount ) && ( currentPlane.position == events[i].position ) && 
+			   ( events[i].type == Event::PLANAR ) )
+		{
+			++numPlanarEvents;
+			++i;
+		}
 
-			// Update recurrence
-			nL += numStartEvents;
-			nL += numPlanarEvents;
+		while( ( i < eventCount ) && ( currentPlane.position == events[i].position ) && 
+			   ( events[i].type == Event::START ) )
+		{
+			++numStartEvents;
+			++i;
 		}
+
+		// Update recurrence
+		nP = numPlanarEvents;
+		nR -= numPlanarEvents;
+		nR -= numEndEvents;
+		
+		// Compute SAH and save best result
+		sah( currentSahResult, currentPlane, bbox, nL, nP, nR );
+
+		if( currentSahResult.cost < sahResult.cost )
+		{
+			sahResult = currentSahResult;
+			plane = currentPlane;
+		}
+
+		// Update recurrence
+		nL += numStartEvents;
+		nL += numPlanarEvents;
 	}
 }
 
-void TriangleTreeBuilder::partition( RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
-									const rt::SplitPlane& plane, const RawKdNode::Elements& triangles )
+void TriangleTreeBuilder::classifyTriangles( BuildState& state, const SahResult& sahResult, 
+											 const rt::SplitPlane& plane, const EventList& events )
 {
-	const std::vector<Event>& bestEvents = _events[plane.axis];
+	std::vector<Side>& triangleSides = state.triangleSides;
 
 	// Iterate through events of chosen axis and reclassify triangles, if possible
-	for( uint32 i = 0, size = bestEvents.size(); i < size; ++i )
+	for( uint32 i = 0, size = events.size(); i < size; ++i )
 	{
-		const Event& event = bestEvents[i];
+		const Event& event = events[i];
 		if( ( event.type == Event::END ) && ( event.position <= plane.position ) )
 		{
-			_triangleSides[event.triangleId] = LEFT;
+			triangleSides[event.triangleId] = LEFT;
 		}
 		else if( ( event.type == Event::START ) && ( event.position >= plane.position ) )
 		{
-			_triangleSides[event.triangleId] = RIGHT;
+			triangleSides[event.triangleId] = RIGHT;
 		}
 		else if( event.type == Event::PLANAR )
 		{
 			if( ( event.position < plane.position ) || ( ( event.position == plane.position ) && ( sahResult.side == LEFT ) ) )
 			{
-				_triangleSides[event.triangleId] = LEFT;
+				triangleSides[event.triangleId] = LEFT;
 			}
 			if( ( event.position > plane.position ) || ( ( event.position == plane.position ) && ( sahResult.side == RIGHT ) ) )
 			{
-				_triangleSides[event.triangleId] = RIGHT;
+				triangleSides[event.triangleId] = RIGHT;
 			}
 		}
 	}
+}
 
-	// Iterate through triangle sides and partition triangles
-	for( uint32 i = 0, size = triangles.size(); i < size; ++i )
+RawKdNode* TriangleTreeBuilder::deferTask( const BuildState& state, const RawKdNode::Elements* triangles, EventList* events, 
+										   uint32 triangleCount, const rt::Aabb& bbox, uint32 treeDepth )
+{
+	BuildTask* task = new BuildTask();
+	task->node = new RawKdNode();
+	task->bbox = bbox;
+	task->treeDepth = treeDepth;
+	task->triangleCount = triangleCount;
+
+	// Remap triangles to task-local ids, so scratch buffers are sized by the task and not by the geometry
+	std::vector<uint32>& globalIds = task->state.globalIds;
+
+	if( triangles != NULL )
 	{
-		const uint32 triangleId = triangles[i];
+		globalIds.resize( triangles->size() );
+		task->triangles.resize( globalIds.size() );
 
-		if( _triangleSides[triangleId] == LEFT )
+		for( uint32 i = 0, size = globalIds.size(); i < size; ++i )
 		{
-			left.push_back( triangleId );
+			globalIds[i] = state.globalId( (*triangles)[i] );
+			task->triangles[i] = i;
 		}
-		else if( _triangleSides[triangleId] == RIGHT )
+	}
+	else
+	{
+		globalIds.reserve( triangleCount );
+
+		// Each triangle has exactly one start or planar event in any axis
+		for( uint32 i = 0, size = events[0].size(); i < size; ++i )
 		{
-			right.push_back( triangleId );
+			const Event& event = events[0][i];
+			if( event.type != Event::END )
+			{
+				_localIds[event.triangleId] = globalIds.size();
+				globalIds.push_back( state.globalId( event.triangleId ) );
+			}
 		}
-		else if( _triangleSides[triangleId] == BOTH )
+
+		for( RTenum k = RT_AXIS_X; k <= RT_AXIS_Z; ++k )
 		{
-			left.push_back( triangleId );
-			right.push_back( triangleId );
+			EventList& taskEvents = task->events[k];
+			taskEvents.swap( events[k] );
+
+			for( uint32 i = 0, size = taskEvents.size(); i < size; ++i )
+			{
+				taskEvents[i].triangleId = _localIds[taskEvents[i].triangleId];
+			}
 		}
-		// else INVALID, so skip triangle
 	}
+
+	_tasks.push_back( task );
+	return task->node;
+}
+
+void TriangleTreeBuilder::runTask( BuildTask& task )
+{
+	BuildState& state = task.state;
+	const uint32 localCount = state.globalIds.size();
+	vr::vectorExactResize( state.triangleSides, localCount );
+
+	vr::ref_ptr<RawKdNode> subtree;
+
+	if( _buildMode == KdTreeAccStructBuilder::PRESORTED_EVENTS )
+	{
+		subtree = recursiveBuildPresorted( state, task.events, task.triangleCount, task.bbox, task.treeDepth );
+	}
+	else
+	{
+		vr::vectorExactResize( state.triangleBoxes, localCount );
+		state.events[0].reserve( localCount*2 );
+		state.events[1].reserve( localCount*2 );
+		state.events[2].reserve( localCount*2 );
+
+		subtree = recursiveBuild( state, task.triangles, task.bbox, task.treeDepth );
+	}
+
+	// Move subtree into placeholder node, which is already linked to its parent
+	RawKdNode* node = task.node;
+	node->split = subtree->split;
+	node->left = subtree->left;
+	node->right = subtree->right;
+	node->elements.swap( subtree->elements );
+
+	// Cleanup
+	vr::vectorFreeMemory( task.triangles );
+	vr::vectorFreeMemory( task.events[0] );
+	vr::vectorFreeMemory( task.events[1] );
+	vr::vectorFreeMemory( task.events[2] );
+	vr::vectorFreeMemory( state.globalIds );
+	vr::vectorFreeMemory( state.triangleSides );
+	vr::vectorFreeMemory( state.triangleBoxes );
+	vr::vectorFreeMemory( state.events[0] );
+	vr::vectorFreeMemory( state.events[1] );
+	vr::vectorFreeMemory( state.events[2] );
+}
+
+void TriangleTreeBuilder::mergeStats( RawKdTree::Statistics& result, const RawKdTree::Statistics& other ) const
+{
+	result.nodeCount += other.nodeCount;
+	result.leafCount += other.leafCount;
+	result.elemIdCount += other.elemIdCount;
+	result.unbuiltCount += other.unbuiltCount;
+
+	if( other.treeDepth > result.treeDepth )
+		result.treeDepth = other.treeDepth;
 }
@@ -2,6 +2,7 @@
 #define _RTP_TRIANGLETREEBUILDER_H_
 
 #include <rt/Geometry.h>
+#include <rtp/KdTreeAccStructBuilder.h>
 #include "RawKdTree.h"
 
 namespace rtp {
@@ -9,10 +10,27 @@ namespace rtp {
 class TriangleTreeBuilder
 {
 public:
+	typedef KdTreeAccStructBuilder::BuildMode BuildMode;
+
 	TriangleTreeBuilder();
 
 	RawKdTree* buildTree( rt::Geometry* geometry );
 
+	// Builds the subtree over the given triangles clipped to bbox, its root being treeDepth levels below the tree's root
+	RawKdTree* buildSubtree( rt::Geometry* geometry, const RawKdNode::Elements& triangles, const rt::Aabb& bbox, uint32 treeDepth );
+
+	void setBuildMode( BuildMode mode );
+	BuildMode getBuildMode() const;
+
+	// 1 builds serially, otherwise top-level nodes use parallel split search
+	// and lower subtrees are built as independent tasks
+	void setThreadCount( uint32 count );
+	uint32 getThreadCount() const;
+
+	// Levels built per call, deeper subtrees become unbuilt leaves. 0 builds whole trees.
+	void setLazyDepth( uint32 levels );
+	uint32 getLazyDepth() const;
+
 private:
 	enum Side
 	{
@@ -47,29 +65,111 @@ private:
 		inline bool operator()( const Event& first, const Event& second ) const;
 	};
 
-	RawKdNode* leafNode( const RawKdNode::Elements& triangles, uint32 treeDepth );
+	// One sorted event list per axis
+	typedef std::vector<Event> EventList;
+
+	// Scratch buffers of a build task, indexed by task-local triangle ids
+	struct BuildState
+	{
+		BuildState();
+
+		inline uint32 globalId( uint32 localId ) const;
+
+		// Top level of a parallel build: split search runs in parallel and subtrees are deferred as tasks
+		bool topLevel;
+		RawKdTree::Statistics stats;
+		std::vector<uint32> globalIds; // empty if local ids are the geometry's triangle ids
+		std::vector<Side> triangleSides;
+		std::vector<rt::Aabb> triangleBoxes;
+		EventList events[3];
+	};
+
+	// Subtree deferred by the top level of a parallel build
+	struct BuildTask
+	{
+		RawKdNode* node; // placeholder already linked to its parent
+		rt::Aabb bbox;
+		uint32 treeDepth;
+		uint32 triangleCount;
+		RawKdNode::Elements triangles;
+		EventList events[3];
+		BuildState state;
+	};
+
+	struct TaskOrder
+	{
+		inline bool operator()( const BuildTask* first, const BuildTask* second ) const;
+	};
+
+	// Triangles are all of the geometry's if NULL
+	RawKdTree* build( rt::Geometry* geometry, const RawKdNode::Elements* triangles, const rt::Aabb& bbox, uint32 treeDepth );
+
+	RawKdNode* leafNode( BuildState& state, const RawKdNode::Elements& triangles, uint32 treeDepth );
+	RawKdNode* unbuiltNode( BuildState& state, const RawKdNode::Elements& triangles, const rt::Aabb& bbox, uint32 treeDepth );
+	RawKdNode* createLeaf( const BuildState& state, const RawKdNode::Elements& triangles ) const;
 	void getTriangleVertices( vr::vec3f& v0, vr::vec3f& v1, vr::vec3f& v2, uint32 triangleId ) const;
 	bool terminate( const SahResult& bestResult, uint32 triangleCount ) const;
-	void sah( SahResult& result, const rt::SplitPlane& plane, const rt::Aabb& bbox, uint32 nL, uint32 nP, uint32 nR );
+	void sah( SahResult& result, const rt::SplitPlane& plane, const rt::Aabb& bbox, uint32 nL, uint32 nP, uint32 nR ) const;
 
 	// O( n log^2 n ) implementation
-	RawKdNode* recursiveBuild( const RawKdNode::Elements& triangles, const rt::Aabb& bbox, uint32 treeDepth );
-	void findPlane( rt::SplitPlane& plane, SahResult& sahResult, uint32& triangleCount, 
+	RawKdNode* recursiveBuild( BuildState& state, const RawKdNode::Elements& triangles, const rt::Aabb& bbox, uint32 treeDepth );
+	void findPlane( BuildState& state, rt::SplitPlane& plane, SahResult& sahResult, uint32& triangleCount, 
 		            const RawKdNode::Elements& triangles, const rt::Aabb& bbox );
-	void partition( RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
+	void partition( BuildState& state, RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
 		            const rt::SplitPlane& plane, const RawKdNode::Elements& triangles );
 
+	// O( n log n ) implementation
+	RawKdNode* recursiveBuildPresorted( BuildState& state, EventList* events, uint32 triangleCount, 
+		                                const rt::Aabb& bbox, uint32 treeDepth );
+	void partitionEvents( BuildState& state, EventList* leftEvents, EventList* rightEvents, uint32& leftCount, uint32& rightCount,
+		                  const SahResult& sahResult, const rt::SplitPlane& plane, const EventList* events,
+		                  const rt::Aabb& leftBox, const rt::Aabb& rightBox );
+	// Triangles referenced by sorted events
+	void eventTriangles( const EventList* events, uint32 triangleCount, RawKdNode::Elements& triangles ) const;
+
+	// Shared by both implementations
+	void addEvents( EventList* events, uint32 triangleId, const rt::Aabb& triangleBox ) const;
+	void addAxisEvents( EventList& events, RTenum axis, uint32 triangleId, const rt::Aabb& triangleBox ) const;
+	void sweepEvents( const BuildState& state, rt::SplitPlane& plane, SahResult& sahResult, const EventList* events, 
+		              uint32 triangleCount, const rt::Aabb& bbox ) const;
+	void sweepAxis( rt::SplitPlane& plane, SahResult& sahResult, const EventList& events, RTenum axis,
+		            uint32 triangleCount, const rt::Aabb& bbox ) const;
+	void classifyTriangles( BuildState& state, const SahResult& sahResult, const rt::SplitPlane& plane, const EventList& events );
+
+	// Parallel build
+	RawKdNode* deferTask( const BuildState& state, const RawKdNode::Elements* triangles, EventList* events, 
+		                  uint32 triangleCount, const rt::Aabb& bbox, uint32 treeDepth );
+	void runTask( BuildTask& task );
+	void mergeStats( RawKdTree::Statistics& result, const RawKdTree::Statistics& other ) const;
+
+	BuildMode _buildMode;
+	uint32 _threadCount;
+	uint32 _taskDepth;
+	uint32 _lazyDepth;
+	uint32 _lazyLimit;
 	rt::Geometry* _geometry;
-	RawKdTree::Statistics* _stats;
 
-	std::vector< std::vector<Event> > _events;
-	std::vector<Side> _triangleSides;
-	std::vector<rt::Aabb> _triangleBoxes;
+	// Tasks deferred by the top level of a parallel build
+	std::vector<BuildTask*> _tasks;
+	// Maps triangle ids to task-local ids while deferring a task
+	std::vector<uint32> _localIds;
 
 	float _traversalCost;
 	float _intersectionCost;
 };
 
+inline uint32 TriangleTreeBuilder::BuildState::globalId( uint32 localId ) const
+{
+	return globalIds.empty() ? localId : globalIds[localId];
+}
+
+inline bool TriangleTreeBuilder::TaskOrder::operator()( const TriangleTreeBuilder::BuildTask* first, 
+	                                                    const TriangleTreeBuilder::BuildTask* second ) const
+{
+	// Largest tasks first, for better load balancing
+	return first->triangleCount > second->triangleCount;
+}
+
 inline bool TriangleTreeBuilder::EventOrder::operator()( const TriangleTreeBuilder::Event& first, 
 	                                                     const TriangleTreeBuilder::Event& second ) const
 {
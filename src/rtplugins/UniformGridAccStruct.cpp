@@ -6,11 +6,33 @@
 
 using namespace rtp;
 
+// Static and thread-safe mailbox
+__declspec(thread) static UniformGridAccStruct::Mailbox s_mailbox;
+
+// Starts a new ray for this thread's mailbox, invalidating all entries
+static void beginMailboxRay()
+{
+	if( ++s_mailbox.rayId == 0 )
+	{
+		// Ray ids wrapped around, old entries could match again
+		for( uint32 i = 0; i < UniformGridAccStruct::Mailbox::SIZE; ++i )
+		{
+			s_mailbox.entries[i].rayId = 0;
+		}
+
+		s_mailbox.rayId = 1;
+	}
+}
+
 UniformGridAccStruct::UniformGridAccStruct()
 {
 	_nx = 0;
 	_ny = 0;
 	_nz = 0;
+	_macroShift = 0;
+	_mnx = 0;
+	_mny = 0;
+	_mnz = 0;
 	_cellSize.set( 0,0,0 );
 	_invCellSize.set( 0,0,0 );
 }
@@ -22,7 +44,12 @@ UniformGridAccStruct::~UniformGridAccStruct()
 
 void UniformGridAccStruct::clear()
 {
-	vr::vectorFreeMemory( _data );
+	vr::vectorFreeMemory( _cellOffsets );
+	vr::vectorFreeMemory( _cellTriangleIds );
+	vr::vectorFreeMemory( _subGrids );
+	vr::vectorFreeMemory( _macroCellCounts );
+	vr::vectorFreeMemory( _cellBlockOffsets );
+	vr::vectorFreeMemory( _blocks );
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -33,7 +60,7 @@ void UniformGridAccStruct::traceNearestGeometry( const rt::Instance& instance, r
 	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
 		return;
 
-	traverse3ddda( instance, ray, hit );
+	traverse3ddda( instance, ray, hit, NULL );
 
 	// TODO: 28-2-2008
 	// TODO: we tried this grid in order to build inside GPU like Particle Simulation from Waldemar
@@ -41,17 +68,47 @@ void UniformGridAccStruct::traceNearestGeometry( const rt::Instance& instance, r
 	//traverseCubeGrid( instance, ray, hit );
 }
 
+void UniformGridAccStruct::traceNearestGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit, TraversalStats& stats )
+{
+	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return;
+
+	traverse3ddda( instance, ray, hit, &stats );
+}
+
+bool UniformGridAccStruct::traceAnyGeometry( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+{
+	// If don't hit bbox in local space, no need to trace underlying triangles
+	if( !rt::AabbIntersection::clipRay( _bbox, ray ) )
+		return false;
+
+	beginMailboxRay();
+
+	// Cells beyond ray.tfar (the light) cannot block the ray. Best distance is not used when looking for any hit.
+	float bestDistance = hit.distance;
+	const bool simd = ( rt::Context::current()->getSimdLevel() >= RT_SIMD_SSE );
+	return traverseCells( instance.geometry->triAccel, ray.tnear, ray.tfar, ray, hit, bestDistance, NULL, true, simd );
+}
+
 void UniformGridAccStruct::setResolution( int32 nCellsX, int32 nCellsY, int32 nCellsZ )
 {
 	// Just in case
 	if( _bbox.isDegenerate() )
 		return;
 
-	_data.resize( nCellsX*nCellsY*nCellsZ );
+	// All cells start empty
+	_cellOffsets.assign( nCellsX*nCellsY*nCellsZ + 1, 0 );
+	_cellTriangleIds.clear();
+	_subGrids.clear();
 	_nx = nCellsX;
 	_ny = nCellsY;
 	_nz = nCellsZ;
 
+	// Macro-cells and triangle blocks no longer match
+	setMacroCellShift( 0 );
+	vr::vectorFreeMemory( _cellBlockOffsets );
+	vr::vectorFreeMemory( _blocks );
+
 	// Update cell sizes
 	_cellSize.set( ( _bbox.maxv.x - _bbox.minv.x ) / (float)_nx, 
 		           ( _bbox.maxv.y - _bbox.minv.y ) / (float)_ny,
@@ -79,47 +136,229 @@ const vr::vec3f& UniformGridAccStruct::getInvCellSize() const
 	return _invCellSize;
 }
 
-const UniformGridAccStruct::Cell& UniformGridAccStruct::at( int32 x, int32 y, int32 z ) const
+int32 UniformGridAccStruct::worldToVoxel( float value, RTenum axis ) const
 {
-	return _data[x + y * _nx + z * _nx * _ny];
+	// Simulate GPU implementation by forcing all intermediary results to 32-bit precision
+	return (float)( (float)( value - _bbox.minv[axis] ) * _invCellSize[axis] );
+
+	//return (int32)( ( value - _bbox.minv[axis] ) * _invCellSize[axis] );
 }
 
-UniformGridAccStruct::Cell& UniformGridAccStruct::at( int32 x, int32 y, int32 z )
+float UniformGridAccStruct::voxelToWorld( int32 voxel, RTenum axis ) const
 {
-	return _data[x + y * _nx + z * _nx * _ny];
+	return (float)voxel * _cellSize[axis] + _bbox.minv[axis];
 }
 
-int32 UniformGridAccStruct::worldToVoxel( float value, RTenum axis )
+void UniformGridAccStruct::setMacroCellShift( uint32 shift )
 {
-	// Simulate GPU implementation by forcing all intermediary results to 32-bit precision
-	return (float)( (float)( value - _bbox.minv[axis] ) * _invCellSize[axis] );
+	_macroShift = shift;
 
-	//return (int32)( ( value - _bbox.minv[axis] ) * _invCellSize[axis] );
+	if( shift == 0 )
+	{
+		_mnx = 0;
+		_mny = 0;
+		_mnz = 0;
+		vr::vectorFreeMemory( _macroCellCounts );
+		return;
+	}
+
+	// Round up, last macro-cells may be partially outside grid
+	const int32 size = 1 << shift;
+	_mnx = ( _nx + size - 1 ) >> shift;
+	_mny = ( _ny + size - 1 ) >> shift;
+	_mnz = ( _nz + size - 1 ) >> shift;
+	_macroCellCounts.assign( _mnx * _mny * _mnz, 0 );
 }
 
-float UniformGridAccStruct::voxelToWorld( int32 voxel, RTenum axis )
+uint32 UniformGridAccStruct::getMacroCellShift() const
 {
-	return (float)voxel * _cellSize[axis] + _bbox.minv[axis];
+	return _macroShift;
+}
+
+void UniformGridAccStruct::getMacroResolution( int32& nMacroX, int32& nMacroY, int32& nMacroZ ) const
+{
+	nMacroX = _mnx;
+	nMacroY = _mny;
+	nMacroZ = _mnz;
+}
+
+const std::vector<uint32>& UniformGridAccStruct::getMacroCellCounts() const
+{
+	return _macroCellCounts;
+}
+
+std::vector<uint32>& UniformGridAccStruct::getMacroCellCounts()
+{
+	return _macroCellCounts;
+}
+
+const std::vector<uint32>& UniformGridAccStruct::getCellOffsets() const
+{
+	return _cellOffsets;
+}
+
+std::vector<uint32>& UniformGridAccStruct::getCellOffsets()
+{
+	return _cellOffsets;
+}
+
+const std::vector<int32>& UniformGridAccStruct::getCellTriangleIds() const
+{
+	return _cellTriangleIds;
 }
 
-const std::vector<UniformGridAccStruct::Cell>& UniformGridAccStruct::getGridData() const
+std::vector<int32>& UniformGridAccStruct::getCellTriangleIds()
 {
-	return _data;
+	return _cellTriangleIds;
+}
+
+// Cells with fewer triangles are not packed into blocks
+static const uint32 MIN_BLOCK_TRIANGLES = 3;
+
+void UniformGridAccStruct::buildTriangleBlocks( const std::vector<rt::TriAccel>& triAccel )
+{
+	const uint32 cellCount = _nx * _ny * _nz;
+	_cellBlockOffsets.resize( cellCount + 1 );
+	_blocks.clear();
+
+	for( uint32 c = 0; c < cellCount; ++c )
+	{
+		_cellBlockOffsets[c] = _blocks.size();
+
+		// Sub-grids hold their own blocks. Small cells are left to the mailboxed scalar test, 
+		// a mostly empty block costs more than the few triangles it would save.
+		const uint32 start = _cellOffsets[c];
+		const uint32 count = _cellOffsets[c+1] - start;
+		if( ( count < MIN_BLOCK_TRIANGLES ) || ( _cellTriangleIds[start] < 0 ) )
+			continue;
+
+		// Triangle ids of cells without sub-grid are never negative
+		TriAccel4::pack( triAccel, reinterpret_cast<const uint32*>( &_cellTriangleIds[start] ), count, _blocks );
+	}
+
+	_cellBlockOffsets[cellCount] = _blocks.size();
+
+	for( uint32 i = 0, limit = _subGrids.size(); i < limit; ++i )
+	{
+		_subGrids[i]->buildTriangleBlocks( triAccel );
+	}
+}
+
+uint32 UniformGridAccStruct::getTriangleBlockCount() const
+{
+	uint32 count = _blocks.size();
+	for( uint32 i = 0, limit = _subGrids.size(); i < limit; ++i )
+	{
+		count += _subGrids[i]->getTriangleBlockCount();
+	}
+	return count;
+}
+
+const std::vector< vr::ref_ptr<UniformGridAccStruct> >& UniformGridAccStruct::getSubGrids() const
+{
+	return _subGrids;
+}
+
+std::vector< vr::ref_ptr<UniformGridAccStruct> >& UniformGridAccStruct::getSubGrids()
+{
+	return _subGrids;
 }
 
 //////////////////////////////////////////////////////////////////////////
 // Private
 //////////////////////////////////////////////////////////////////////////
-void UniformGridAccStruct::traverse3ddda( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
+void UniformGridAccStruct::traverse3ddda( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit, TraversalStats* stats )
+{
+	beginMailboxRay();
+
+	// Best distance considers any previously found hits to prevent false hits in this geometry
+	float bestDistance = hit.distance;
+
+	const bool simd = ( rt::Context::current()->getSimdLevel() >= RT_SIMD_SSE );
+
+	// Since ray was already clipped against bbox (grid), ray.tnear gives us the starting t
+	if( traverseCells( instance.geometry->triAccel, ray.tnear, vr::Mathf::MAX_VALUE, ray, hit, bestDistance, stats, false, 
+		               simd ) )
+	{
+		hit.distance = bestDistance;
+		hit.instance = &instance;
+	}
+}
+
+bool UniformGridAccStruct::skipMacroCells( const rt::Ray& ray, float tEnd, int32& x, int32& y, int32& z, float& tEnter, 
+										   TraversalStats* stats ) const
+{
+	const int32 resolution[3] = { _nx, _ny, _nz };
+	const int32 macroResolution[3] = { _mnx, _mny, _mnz };
+	const int32 macroSize = 1 << _macroShift;
+
+	// Same DDA as for cells, with macro-cell sized steps
+	int32 macroCell[3] = { x >> _macroShift, y >> _macroShift, z >> _macroShift };
+	float tMax[3];
+	float tDelta[3];
+
+	for( uint32 k = 0; k < 3; ++k )
+	{
+		const int32 face = ( macroCell[k] + !ray.dirSignBits[k] ) << _macroShift;
+		tMax[k] = ( voxelToWorld( face, k ) - ray.orig[k] ) * ray.invDir[k];
+		tDelta[k] = vr::abs( _cellSize[k] * macroSize * ray.invDir[k] );
+	}
+
+	uint32 axis;
+	float t;
+
+	do
+	{
+		if( tMax[RT_AXIS_X] < tMax[RT_AXIS_Y] && tMax[RT_AXIS_X] < tMax[RT_AXIS_Z] )
+			axis = RT_AXIS_X;
+		else if( tMax[RT_AXIS_Y] < tMax[RT_AXIS_Z] )
+			axis = RT_AXIS_Y;
+		else
+			axis = RT_AXIS_Z;
+
+		t = tMax[axis];
+		macroCell[axis] += ray.dirSigns[axis];
+		tMax[axis] += tDelta[axis];
+
+		if( stats )
+			++stats->cellCount;
+
+		if( ( macroCell[axis] < 0 ) || ( macroCell[axis] >= macroResolution[axis] ) || ( t > tEnd ) )
+			return false;
+	}
+	while( _macroCellCounts[macroCell[0] + macroCell[1] * _mnx + macroCell[2] * _mnx * _mny] == 0 );
+
+	// Entry cell: first cell layer along step axis, entry point clamped to macro-cell for other axes
+	const vr::vec3f entryPoint = ray.orig + ray.dir * t;
+	int32 cell[3];
+
+	for( uint32 k = 0; k < 3; ++k )
+	{
+		const int32 first = macroCell[k] << _macroShift;
+		const int32 last = vr::min( first + macroSize, resolution[k] ) - 1;
+
+		if( k == axis )
+			cell[k] = ray.dirSignBits[k] ? last : first;
+		else
+			cell[k] = vr::clampTo( worldToVoxel( entryPoint[k], k ), first, last );
+	}
+
+	x = cell[0];
+	y = cell[1];
+	z = cell[2];
+	tEnter = t;
+	return true;
+}
+
+bool UniformGridAccStruct::traverseCells( const std::vector<rt::TriAccel>& triangles, float tStart, float tEnd, 
+										  rt::Ray& ray, rt::Hit& hit, float& bestDistance, TraversalStats* stats, 
+										  bool anyHit, bool simd )
 {
 	/************************************************************************/
 	/* Initial setup                                                        */
 	/************************************************************************/
 	// 1. Find initial cell where ray begins
-
-	// Since ray was already clipped against bbox (grid), 
-	// ray.tnear gives us the starting t (thus the start point as well)
-	const vr::vec3f startPoint = ray.orig + ray.dir * ray.tnear;
+	const vr::vec3f startPoint = ray.orig + ray.dir * tStart;
 
 	// TODO: check if this is the best solution
 	int32 x = vr::clampTo( worldToVoxel( startPoint.x, RT_AXIS_X ), 0, _nx - 1 );
@@ -148,29 +387,83 @@ void UniformGridAccStruct::traverse3ddda( const rt::Instance& instance, rt::Ray&
 	float tMaxY = ( voxelToWorld( y + !ray.dirSignBits[RT_AXIS_Y], RT_AXIS_Y ) - ray.orig.y ) * ray.invDir.y;
 	float tMaxZ = ( voxelToWorld( z + !ray.dirSignBits[RT_AXIS_Z], RT_AXIS_Z ) - ray.orig.z ) * ray.invDir.z;
 
+	// Distance where ray enters current cell
+	float tEnter = tStart;
+
+	// Blocks are tested against the whole ray, like triangles. They need SSE.
+	const bool useBlocks = simd && !_cellBlockOffsets.empty();
+	TriAccel4::SimdRay simdRay;
+	if( useBlocks )
+		simdRay.load( ray );
+
 	/************************************************************************/
 	/* Trace ray through grid                                               */
 	/************************************************************************/
-	const std::vector<rt::TriAccel>& triangles = instance.geometry->triAccel;
-
-	// Best distance considers any previously found hits to prevent false hits in this geometry
-	float bestDistance = hit.distance;
-
 	// While inside grid
 	do
 	{
+		if( stats )
+			++stats->cellCount;
+
+		// Cross empty macro-cells in a single step, without touching their cells
+		if( ( _macroShift > 0 ) && ( _macroCellCounts[macroCellId( x, y, z )] == 0 ) )
+		{
+			if( !skipMacroCells( ray, tEnd, x, y, z, tEnter, stats ) )
+				return false;
+
+			// Restart DDA at new cell
+			tMaxX = ( voxelToWorld( x + !ray.dirSignBits[RT_AXIS_X], RT_AXIS_X ) - ray.orig.x ) * ray.invDir.x;
+			tMaxY = ( voxelToWorld( y + !ray.dirSignBits[RT_AXIS_Y], RT_AXIS_Y ) - ray.orig.y ) * ray.invDir.y;
+			tMaxZ = ( voxelToWorld( z + !ray.dirSignBits[RT_AXIS_Z], RT_AXIS_Z ) - ray.orig.z ) * ray.invDir.z;
+			continue;
+		}
+
 		// Get current cell
-		const Cell& cell = at( x, y, z );
+		const Cell cell = at( x, y, z );
 
 		// If cell contains triangles, test intersection.
-		// We send the lesser tMax as the maximum valid distance. This avoids false intersections outside current cell.
+		// Closest hit is only valid when it lies before the lesser tMax. Hits beyond it may be hidden by triangles in next cells.
 		if( !cell.empty() )
 		{
-			if( intersectTriangles( triangles, cell, vr::min( vr::min( tMaxX, tMaxY ), tMaxZ ), ray, hit, bestDistance ) )
+			const float tExit = vr::min( vr::min( vr::min( tMaxX, tMaxY ), tMaxZ ), tEnd );
+
+			if( cell.hasSubGrid() )
+			{
+				// Sub-grid spans exactly this cell
+				UniformGridAccStruct* subGrid = _subGrids[cell.subGridId()].get();
+				if( subGrid->traverseCells( triangles, tEnter, tExit, ray, hit, bestDistance, stats, anyHit, simd ) )
+					return true;
+			}
+			else if( useBlocks && hasBlocks( cellId( x, y, z ) ) )
+			{
+				if( stats )
+					stats->triangleCount += cell.size();
+
+				if( anyHit )
+				{
+					if( occludeBlocks( cellId( x, y, z ), simdRay ) )
+						return true;
+				}
+				else
+				{
+					intersectBlocks( cellId( x, y, z ), simdRay, hit, bestDistance );
+
+					if( ( bestDistance < hit.distance ) && ( bestDistance <= tExit ) )
+						return true;
+				}
+			}
+			else if( anyHit )
 			{
-				hit.distance = bestDistance;
-				hit.instance = &instance;
-				return;
+				// Any hit blocks the ray, no matter in which cell it lies
+				if( occludeTriangles( triangles, cell, ray, stats ) )
+					return true;
+			}
+			else
+			{
+				intersectTriangles( triangles, cell, ray, hit, bestDistance, stats );
+
+				if( ( bestDistance < hit.distance ) && ( bestDistance <= tExit ) )
+					return true;
 			}
 		}
 
@@ -179,20 +472,25 @@ void UniformGridAccStruct::traverse3ddda( const rt::Instance& instance, rt::Ray&
 		if( tMaxX < tMaxY && tMaxX < tMaxZ )
 		{
 			x += stepX;
+			tEnter = tMaxX;
 			tMaxX += tDeltaX;
 		}
 		else if( tMaxY < tMaxZ )
 		{
 			y += stepY;
+			tEnter = tMaxY;
 			tMaxY += tDeltaY;
 		}
 		else
 		{
 			z += stepZ;
+			tEnter = tMaxZ;
 			tMaxZ += tDeltaZ;
 		}
 
-	}  while( x != outX && y != outY && z != outZ );
+	}  while( x != outX && y != outY && z != outZ && tEnter <= tEnd );
+
+	return false;
 }
 
 void UniformGridAccStruct::traverseCubeGrid( const rt::Instance& instance, rt::Ray& ray, rt::Hit& hit )
@@ -246,9 +544,10 @@ void UniformGridAccStruct::traverseCubeGrid( const rt::Instance& instance, rt::R
 	/************************************************************************/
 	const std::vector<rt::TriAccel>& triangles = instance.geometry->triAccel;
 
+	beginMailboxRay();
+
 	// Best distance considers any previously found hits to prevent false hits in this geometry
 	float bestDistance = hit.distance;
-	float maxValidDist;
 
 	// Code to access adjacent cells to be intersected during traversal
 	int32 sx = vr::clampAbove( x - 1, 0 );
@@ -273,9 +572,6 @@ void UniformGridAccStruct::traverseCubeGrid( const rt::Instance& instance, rt::R
 
 		// TODO: 
 		//maxValidDist = vr::min( vr::min( tMaxX, tMaxY ), tMaxZ );
-		maxValidDist = vr::Mathf::MAX_VALUE;
-
-		bool haveHit = false;
 
 		for( int32 k = sz; k <= ez; ++k )
 		{
@@ -283,19 +579,19 @@ void UniformGridAccStruct::traverseCubeGrid( const rt::Instance& instance, rt::R
 			{
 				for( int32 i = sx; i <= ex; ++i )
 				{
-					const Cell& cell = at( i, j, k );
+					const Cell cell = at( i, j, k );
 					//const Cell& cell = at( x, y, z );
 
 					//printf( "cell: %d, %d, %d\n", i, j, k );
 					//printf( "cell: %d, %d, %d\n", x, y, z );
 
 					if( !cell.empty() )
-						haveHit |= intersectTriangles( triangles, cell, maxValidDist, ray, hit, bestDistance );
+						intersectTriangles( triangles, cell, ray, hit, bestDistance, NULL );
 				}
 			}
 		}
 
-		if( haveHit )
+		if( bestDistance < hit.distance )
 		{
 			hit.distance = bestDistance;
 			hit.instance = &instance;
@@ -359,20 +655,93 @@ void UniformGridAccStruct::traverseCubeGrid( const rt::Instance& instance, rt::R
 	} while( x != outX && y != outY && z != outZ );
 }
 
-bool UniformGridAccStruct::intersectTriangles( const std::vector<rt::TriAccel>& triangles, 
-											   const Cell& cell, float maxValidDistance, 
-											   rt::Ray& ray, rt::Hit& hit, float& bestDistance )
+void UniformGridAccStruct::intersectTriangles( const std::vector<rt::TriAccel>& triangles, const Cell& cell, 
+											   const rt::Ray& ray, rt::Hit& hit, float& bestDistance, TraversalStats* stats )
 {
-	// Ray.tfar keeps an upper bound on intersection distances we find
-	// This avoids false intersections when the ray actually hits the primitive in another cell outside current one
-	ray.tfar = maxValidDistance;
+	Mailbox& mailbox = s_mailbox;
+	uint32 skipped = 0;
 
 	// Intersect triangles in cell and keep closest hit
 	for( int32 t = 0, limit = cell.size(); t < limit; ++t )
 	{
-		rt::RayTriIntersection::hitWald( triangles[cell[t]], ray, hit, bestDistance );
+		const int32 triangleId = cell[t];
+		Mailbox::Entry& entry = mailbox.entries[triangleId & ( Mailbox::SIZE - 1 )];
+
+		if( ( entry.rayId == mailbox.rayId ) && ( entry.triangleId == triangleId ) )
+		{
+			++skipped;
+			continue;
+		}
+
+		entry.rayId = mailbox.rayId;
+		entry.triangleId = triangleId;
+
+		rt::RayTriIntersection::hitWald( triangles[triangleId], ray, hit, bestDistance );
+	}
+
+	if( stats )
+	{
+		stats->triangleCount += cell.size() - skipped;
+		stats->mailboxCount += skipped;
+	}
+}
+
+bool UniformGridAccStruct::occludeTriangles( const std::vector<rt::TriAccel>& triangles, const Cell& cell, 
+											 const rt::Ray& ray, TraversalStats* stats )
+{
+	Mailbox& mailbox = s_mailbox;
+	uint32 tested = 0;
+	uint32 skipped = 0;
+	bool occluded = false;
+
+	for( int32 t = 0, limit = cell.size(); t < limit; ++t )
+	{
+		const int32 triangleId = cell[t];
+		Mailbox::Entry& entry = mailbox.entries[triangleId & ( Mailbox::SIZE - 1 )];
+
+		// Triangles tested in previous cells already missed the whole ray
+		if( ( entry.rayId == mailbox.rayId ) && ( entry.triangleId == triangleId ) )
+		{
+			++skipped;
+			continue;
+		}
+
+		entry.rayId = mailbox.rayId;
+		entry.triangleId = triangleId;
+		++tested;
+
+		if( rt::RayTriIntersection::hitAnyWald( triangles[triangleId], ray ) )
+		{
+			occluded = true;
+			break;
+		}
+	}
+
+	if( stats )
+	{
+		stats->triangleCount += tested;
+		stats->mailboxCount += skipped;
+	}
+
+	return occluded;
+}
+
+void UniformGridAccStruct::intersectBlocks( uint32 cellId, const TriAccel4::SimdRay& ray, rt::Hit& hit, 
+										    float& bestDistance ) const
+{
+	for( uint32 i = _cellBlockOffsets[cellId], limit = _cellBlockOffsets[cellId+1]; i < limit; ++i )
+	{
+		_blocks[i].hit( ray, hit, bestDistance );
+	}
+}
+
+bool UniformGridAccStruct::occludeBlocks( uint32 cellId, const TriAccel4::SimdRay& ray ) const
+{
+	for( uint32 i = _cellBlockOffsets[cellId], limit = _cellBlockOffsets[cellId+1]; i < limit; ++i )
+	{
+		if( _blocks[i].hitAny( ray ) )
+			return true;
 	}
 
-	// return ( found hit )
-	return ( bestDistance < hit.distance );
+	return false;
 }
@@ -3,20 +3,164 @@
 
 #include <rt/AabbIntersection.h>
 #include <rt/Sphere.h>
+#include <vr/random.h>
+#include <vr/timer.h>
+#include <omp.h>
+#include <stdio.h>
+#include <xmmintrin.h>
 
 using namespace rtp;
 
-void printGridStats( const UniformGridAccStruct* grid )
+// Densities evaluated by the auto-tuner
+static const float CANDIDATE_DENSITIES[] = { 1.0f, 2.0f, 3.0f, 4.0f, 6.0f, 8.0f, 12.0f, 16.0f };
+static const uint32 CANDIDATE_COUNT = sizeof( CANDIDATE_DENSITIES ) / sizeof( CANDIDATE_DENSITIES[0] );
+
+// Cells are slightly enlarged in exact overlap tests, so that round-off never drops a triangle
+// touching a cell boundary from both neighboring cells
+static const float OVERLAP_TOLERANCE = 1e-3f;
+
+// Separating axis test of a triangle against 4 consecutive cells of a grid row at once.
+// Triangle's bounding box must already overlap the cells, so only the triangle normal and
+// the 9 cross products of triangle edges with coordinate axes remain to be tested.
+// Since all cells have the same size, the projected radius of a cell on each axis is constant.
+class TriangleCellTest
+{
+public:
+	// Coordinates are taken relative to the center of cell, which becomes cell (0,0,0) in overlaps4
+	void setup( UniformGridAccStruct* grid, const int32 cell[3], const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2 );
+
+	// Bit i of result is set if triangle overlaps cell ( x + i, y, z )
+	int32 overlaps4( int32 x, int32 y, int32 z ) const;
+
+private:
+	static const uint32 AXIS_COUNT = 10;
+
+	void setAxis( uint32 i, const vr::vec3f& axis, const vr::vec3f& halfSizes, 
+		          const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2 );
+
+	vr::vec3f _cellSize;
+	vr::vec3f _axes[AXIS_COUNT];
+
+	// Cell centers projected on axis i must lie in [_low[i], _high[i]] for cell to overlap triangle
+	float _low[AXIS_COUNT];
+	float _high[AXIS_COUNT];
+};
+
+void TriangleCellTest::setup( UniformGridAccStruct* grid, const int32 cell[3], 
+							  const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2 )
+{
+	_cellSize = grid->getCellSize();
+	const vr::vec3f halfSizes = _cellSize * ( 0.5f + OVERLAP_TOLERANCE );
+
+	// Moving origin close to the triangle keeps round-off relative to triangle size
+	const vr::vec3f origin( grid->voxelToWorld( cell[0], RT_AXIS_X ) + _cellSize.x * 0.5f, 
+		                    grid->voxelToWorld( cell[1], RT_AXIS_Y ) + _cellSize.y * 0.5f, 
+							grid->voxelToWorld( cell[2], RT_AXIS_Z ) + _cellSize.z * 0.5f );
+
+	const vr::vec3f vv0 = v0 - origin;
+	const vr::vec3f vv1 = v1 - origin;
+	const vr::vec3f vv2 = v2 - origin;
+
+	const vr::vec3f edges[3] = { vv1 - vv0, vv2 - vv1, vv0 - vv2 };
+
+	for( uint32 e = 0; e < 3; ++e )
+	{
+		const vr::vec3f& edge = edges[e];
+		setAxis( e*3 + 0, vr::vec3f( 0.0f, edge.z, -edge.y ), halfSizes, vv0, vv1, vv2 );
+		setAxis( e*3 + 1, vr::vec3f( -edge.z, 0.0f, edge.x ), halfSizes, vv0, vv1, vv2 );
+		setAxis( e*3 + 2, vr::vec3f( edge.y, -edge.x, 0.0f ), halfSizes, vv0, vv1, vv2 );
+	}
+
+	setAxis( 9, edges[0].cross( edges[1] ), halfSizes, vv0, vv1, vv2 );
+}
+
+int32 TriangleCellTest::overlaps4( int32 x, int32 y, int32 z ) const
+{
+	// Centers of the 4 cells
+	const __m128 centerX = _mm_mul_ps( _mm_add_ps( _mm_set1_ps( (float)x ), _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f ) ), 
+		                               _mm_set1_ps( _cellSize.x ) );
+	const float centerY = y * _cellSize.y;
+	const float centerZ = z * _cellSize.z;
+
+	__m128 overlap = _mm_cmpeq_ps( centerX, centerX );
+
+	for( uint32 i = 0; i < AXIS_COUNT; ++i )
+	{
+		const vr::vec3f& axis = _axes[i];
+		const __m128 d = _mm_add_ps( _mm_mul_ps( centerX, _mm_set1_ps( axis.x ) ), 
+			                         _mm_set1_ps( centerY * axis.y + centerZ * axis.z ) );
+
+		overlap = _mm_and_ps( overlap, _mm_and_ps( _mm_cmpge_ps( d, _mm_set1_ps( _low[i] ) ), 
+			                                       _mm_cmple_ps( d, _mm_set1_ps( _high[i] ) ) ) );
+	}
+
+	return _mm_movemask_ps( overlap );
+}
+
+void TriangleCellTest::setAxis( uint32 i, const vr::vec3f& axis, const vr::vec3f& halfSizes, 
+							    const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2 )
+{
+	const float p0 = axis.dot( v0 );
+	const float p1 = axis.dot( v1 );
+	const float p2 = axis.dot( v2 );
+
+	// Projected cell radius
+	const float radius = halfSizes.x * vr::abs( axis.x ) + halfSizes.y * vr::abs( axis.y ) + halfSizes.z * vr::abs( axis.z );
+
+	_axes[i] = axis;
+	_low[i] = vr::min( vr::min( p0, p1 ), p2 ) - radius;
+	_high[i] = vr::max( vr::max( p0, p1 ), p2 ) + radius;
+}
+
+// Insertion passes
+struct CountVisitor
+{
+	void operator()( uint32 cellId )
+	{
+		++offsets[cellId + 1];
+	}
+
+	uint32* offsets;
+};
+
+struct ScatterVisitor
+{
+	void operator()( uint32 cellId )
+	{
+		triangleIds[cursors[cellId]++] = rangeId;
+	}
+
+	int32* triangleIds;
+	uint32* cursors;
+	int32 rangeId;
+};
+
+// Cell statistics of one grid level, cells refined by a sub-grid are not included
+struct CellStats
+{
+	CellStats()
+	: gridCount( 0 ), cellCount( 0 ), minCellSize( INT_MAX ), minCellSizeCount( 0 ), 
+	  maxCellSize( -INT_MAX ), maxCellSizeCount( 0 ), totalCellSize( 0.0 ), memory( 0.0 )
+	{
+	}
+
+	int32 gridCount;
+	int32 cellCount;
+	int32 minCellSize;
+	int32 minCellSizeCount;
+	int32 maxCellSize;
+	int32 maxCellSizeCount;
+	double totalCellSize;
+	double memory;
+};
+
+void accumulateCellStats( const UniformGridAccStruct* grid, CellStats& stats )
 {
 	int32 nx, ny, nz;
 	grid->getResolution( nx, ny, nz );
 
-	// stats
-	int32 minCellSize = INT_MAX;
-	int32 minCellSizeCount = 0;
-	int32 maxCellSize = -INT_MAX;
-	int32 maxCellSizeCount = 0;
-	float avgCellSize = 0.0f;
+	++stats.gridCount;
+	stats.memory += grid->getCellOffsets().size() * sizeof( uint32 ) + grid->getCellTriangleIds().size() * sizeof( int32 );
 
 	for( int32 z = 0; z < nz; ++z )
 	{
@@ -24,40 +168,127 @@ void printGridStats( const UniformGridAccStruct* grid )
 		{
 			for( int32 x = 0; x < nx; ++x )
 			{
-				const UniformGridAccStruct::Cell& cell = grid->at( x, y, z );
+				const UniformGridAccStruct::Cell cell = grid->at( x, y, z );
+				if( cell.hasSubGrid() )
+					continue;
 
-				// stats
-				if( (int32)cell.size() <= minCellSize )
+				const int32 size = cell.size();
+				++stats.cellCount;
+				stats.totalCellSize += size;
+
+				if( size < stats.minCellSize )
 				{
-					minCellSize = cell.size();
-					++minCellSizeCount;
+					stats.minCellSize = size;
+					stats.minCellSizeCount = 1;
 				}
-				else if( (int32)cell.size() >= maxCellSize )
+				else if( size == stats.minCellSize )
 				{
-					maxCellSize = cell.size();
-					++maxCellSizeCount;
+					++stats.minCellSizeCount;
 				}
 
-				avgCellSize += (float)cell.size();
+				if( size > stats.maxCellSize )
+				{
+					stats.maxCellSize = size;
+					stats.maxCellSizeCount = 1;
+				}
+				else if( size == stats.maxCellSize )
+				{
+					++stats.maxCellSizeCount;
+				}
 			}
 		}
 	}
+}
+
+void printCellStats( const char* prefix, const CellStats& stats )
+{
+	printf( "%sminCellSize: %d (%d cells)\n", prefix, stats.minCellSize, stats.minCellSizeCount );
+	printf( "%smaxCellSize: %d (%d cells)\n", prefix, stats.maxCellSize, stats.maxCellSizeCount );
+	printf( "%saverageCellSize: %5.4f\n", prefix, ( stats.cellCount > 0 ) ? stats.totalCellSize / stats.cellCount : 0.0 );
+}
+
+void printGridStats( const UniformGridAccStruct* grid, uint32 referenceCount, uint32 boxReferenceCount, double buildTime )
+{
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
 
-	// divide by cell total
-	avgCellSize /= (float)( nx * ny * nz );
+	CellStats topLevel;
+	accumulateCellStats( grid, topLevel );
+
+	CellStats subLevel;
+	const std::vector< vr::ref_ptr<UniformGridAccStruct> >& subGrids = grid->getSubGrids();
+	for( uint32 i = 0; i < subGrids.size(); ++i )
+	{
+		accumulateCellStats( subGrids[i].get(), subLevel );
+	}
 
 	printf( "\n***** Uniform Grid *****\n" );
 	printf( "numCells: %d, %d, %d (%d cells)\n", nx, ny, nz, nx * ny * nz );
-	printf( "minCellSize: %d (%d cells)\n", minCellSize, minCellSizeCount );
-	printf( "maxCellSize: %d (%d cells)\n", maxCellSize, maxCellSizeCount );
-	printf( "averageCellSize: %5.4f\n", avgCellSize );
+	printCellStats( "", topLevel );
+
+	if( !subGrids.empty() )
+	{
+		printf( "subGrids: %d (%d cells)\n", subLevel.gridCount, subLevel.cellCount );
+		printCellStats( "subGrid ", subLevel );
+		printf( "subGrid memory: %.2f MB\n", subLevel.memory / ( 1024.0 * 1024.0 ) );
+	}
+
+	const std::vector<uint32>& macroCellCounts = grid->getMacroCellCounts();
+	if( !macroCellCounts.empty() )
+	{
+		int32 mnx, mny, mnz;
+		grid->getMacroResolution( mnx, mny, mnz );
+
+		uint32 emptyCount = 0;
+		for( uint32 i = 0; i < macroCellCounts.size(); ++i )
+		{
+			if( macroCellCounts[i] == 0 )
+				++emptyCount;
+		}
+
+		printf( "macroCells: %d, %d, %d (%d empty, %5.2f%%)\n", mnx, mny, mnz, emptyCount, 
+			    100.0f * emptyCount / macroCellCounts.size() );
+	}
+
+	printf( "references: %d (%d bounding box references, %.2f%% removed)\n", referenceCount, boxReferenceCount, 
+		    ( boxReferenceCount > 0 ) ? 100.0 * ( boxReferenceCount - referenceCount ) / boxReferenceCount : 0.0 );
+	if( grid->getTriangleBlockCount() > 0 )
+		printf( "triangleBlocks: %d\n", grid->getTriangleBlockCount() );
+	printf( "memory: %.2f MB\n", ( topLevel.memory + subLevel.memory ) / ( 1024.0 * 1024.0 ) );
+	printf( "buildTime: %.6f secs\n", buildTime );
+}
+
+// First block of each cached grid, followed by its cell offsets, cell triangle ids, macro-cell counts and sub-grids
+struct CachedGridInfo
+{
+	rt::Aabb bbox;
+	int32 nx;
+	int32 ny;
+	int32 nz;
+	uint32 macroShift;
+	uint32 referenceCount;
+	uint32 subGridCount;
+};
+
+template<class T>
+const T* vectorData( const std::vector<T>& v )
+{
+	return v.empty() ? NULL : &v[0];
 }
 
 //////////////////////////////////////////////////////////////////////////
 
+UniformGridAccStructBuilder::UniformGridAccStructBuilder()
+: _threadCount( 1 ), _gridMode( SINGLE_LEVEL ), _subGridThreshold( 64 ), _density( 6.0f ), _exactInsertion( false ), _macroCellShift( 1 ), 
+  _triangleBlocks( false ), _autoTune( false ), _probeRayCount( 4096 ), _traversalCost( 1.0f ), _intersectionCost( 1.4f ),
+  _referenceCount( 0 ), _boxReferenceCount( 0 )
+{
+	// empty
+}
+
 void UniformGridAccStructBuilder::buildGeometry( rt::Geometry* geometry )
 {
-	buildUniformGrid( geometry );
+	buildUniformGrid( geometry, _cache.isEnabled() );
 
 	// TODO: 28-2-2008
 	// TODO: we tried this grid in order to build inside GPU like Particle Simulation from Waldemar
@@ -65,11 +296,132 @@ void UniformGridAccStructBuilder::buildGeometry( rt::Geometry* geometry )
 	//buildCubeGrid( geometry );
 }
 
+void UniformGridAccStructBuilder::updateGeometry( rt::Geometry* geometry )
+{
+	buildUniformGrid( geometry, false );
+}
+
+void UniformGridAccStructBuilder::setThreadCount( uint32 count )
+{
+	_threadCount = vr::max( count, 1u );
+}
+
+uint32 UniformGridAccStructBuilder::getThreadCount() const
+{
+	return _threadCount;
+}
+
+void UniformGridAccStructBuilder::setGridMode( GridMode mode )
+{
+	_gridMode = mode;
+}
+
+UniformGridAccStructBuilder::GridMode UniformGridAccStructBuilder::getGridMode() const
+{
+	return _gridMode;
+}
+
+void UniformGridAccStructBuilder::setSubGridThreshold( uint32 count )
+{
+	_subGridThreshold = count;
+}
+
+uint32 UniformGridAccStructBuilder::getSubGridThreshold() const
+{
+	return _subGridThreshold;
+}
+
+void UniformGridAccStructBuilder::setExactInsertion( bool enabled )
+{
+	_exactInsertion = enabled;
+}
+
+bool UniformGridAccStructBuilder::getExactInsertion() const
+{
+	return _exactInsertion;
+}
+
+void UniformGridAccStructBuilder::setTriangleBlocks( bool enabled )
+{
+	_triangleBlocks = enabled;
+}
+
+bool UniformGridAccStructBuilder::getTriangleBlocks() const
+{
+	return _triangleBlocks;
+}
+
+void UniformGridAccStructBuilder::setMacroCellSize( uint32 size )
+{
+	_macroCellShift = 0;
+	while( ( 2u << _macroCellShift ) <= size )
+		++_macroCellShift;
+}
+
+uint32 UniformGridAccStructBuilder::getMacroCellSize() const
+{
+	return 1 << _macroCellShift;
+}
+
+void UniformGridAccStructBuilder::setDensity( float density )
+{
+	_density = density;
+}
+
+float UniformGridAccStructBuilder::getDensity() const
+{
+	return _density;
+}
+
+void UniformGridAccStructBuilder::setAutoTune( bool enabled )
+{
+	_autoTune = enabled;
+}
+
+bool UniformGridAccStructBuilder::getAutoTune() const
+{
+	return _autoTune;
+}
+
+void UniformGridAccStructBuilder::setProbeRayCount( uint32 count )
+{
+	_probeRayCount = vr::max( count, 1u );
+}
+
+uint32 UniformGridAccStructBuilder::getProbeRayCount() const
+{
+	return _probeRayCount;
+}
+
+void UniformGridAccStructBuilder::setTuningCacheFile( const std::string& filename )
+{
+	_tuningCacheFile = filename;
+	loadTuningCache();
+}
+
+const std::string& UniformGridAccStructBuilder::getTuningCacheFile() const
+{
+	return _tuningCacheFile;
+}
+
+void UniformGridAccStructBuilder::setCacheDirectory( const std::string& directory )
+{
+	_cache.setDirectory( directory );
+}
+
+const std::string& UniformGridAccStructBuilder::getCacheDirectory() const
+{
+	return _cache.getDirectory();
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Private
 //////////////////////////////////////////////////////////////////////////
-void UniformGridAccStructBuilder::buildUniformGrid( rt::Geometry* geometry )
+void UniformGridAccStructBuilder::buildUniformGrid( rt::Geometry* geometry, bool useCache )
 {
+	vr::Timer timer;
+	timer.restart();
+
 	// Compute scene box
 	rt::Aabb bbox;
 	bbox.buildFrom( &geometry->vertices[0], geometry->vertices.size() );
@@ -78,78 +430,41 @@ void UniformGridAccStructBuilder::buildUniformGrid( rt::Geometry* geometry )
 	// Also avoid precision problems during triangle insertion, ray traversal and ray intersection
 	bbox.scaleBy( 0.01f );
 
-	// Create uniform grid
-	UniformGridAccStruct* grid = new UniformGridAccStruct();
-	geometry->accStruct = grid;
-
-	// Compute total geometry volume
-	vr::vec3f diagonal = bbox.maxv - bbox.minv;
-	float V = ( diagonal.x * diagonal.y * diagonal.z );
-
-	// TODO: improve this equation / heuristic
-	// TODO: magic user-supplied number
-	int32 k = 6;
-	int32 triCount = geometry->triDesc.size();
-	float factor = powf( (float)( k * triCount ) / V, 1.0f / 3.0f );
-
-	// Compute actual number of cells in each dimension
-	int32 nx = (int32)ceilf( diagonal.x * factor );
-	int32 ny = (int32)ceilf( diagonal.y * factor );
-	int32 nz = (int32)ceilf( diagonal.z * factor );
-
-	// Store grid data
-	grid->setBoundingBox( bbox );
-	grid->setResolution( nx, ny, nz );
-
-	// Reference cell box for triangle overlap test
-	rt::Aabb cellBox;
-	rt::Aabb triBox;
-
-	// For each triangle, compute which cells it could overlap and check overlap only for them O(n)
-	for( int32 t = 0; t < triCount; ++t )
+	AccStructCache::Key key;
+	if( useCache )
 	{
-		// Set initial triangle Aabb to v0 and expand to include other 2 vertices
-		const vr::vec3f& v0 = geometry->getVertex( t, 0 );
-		const vr::vec3f& v1 = geometry->getVertex( t, 1 );
-		const vr::vec3f& v2 = geometry->getVertex( t, 2 );
-		triBox.minv = v0;
-		triBox.maxv = v0;
-		triBox.expandBy( v1 );
-		triBox.expandBy( v2 );
+		key = _cache.makeKey( geometry, AccStructCache::UNIFORM_GRID, cacheSettings() );
 
-		// Now that we have the triangle box, need to find which grid cells it overlaps
-		const int32 xStart = grid->worldToVoxel( triBox.minv.x, RT_AXIS_X );
-		const int32 yStart = grid->worldToVoxel( triBox.minv.y, RT_AXIS_Y );
-		const int32 zStart = grid->worldToVoxel( triBox.minv.z, RT_AXIS_Z );
-
-		const int32 xEnd = grid->worldToVoxel( triBox.maxv.x, RT_AXIS_X );
-		const int32 yEnd = grid->worldToVoxel( triBox.maxv.y, RT_AXIS_Y );
-		const int32 zEnd = grid->worldToVoxel( triBox.maxv.z, RT_AXIS_Z );
-
-		// Loop over all cells overlapped by AABB and check if triangle actually overlaps any
-		for( int32 z = zStart; z <= zEnd; ++z )
+		UniformGridAccStruct* cached = loadCachedGrid( key );
+		if( cached != NULL )
 		{
-			for( int32 y = yStart; y <= yEnd; ++y )
-			{
-				for( int32 x = xStart; x <= xEnd; ++x )
-				{
-					// Update cell box to check for triangle overlap
-					cellBox.minv = bbox.minv + vr::vec3f( x, y, z ) * grid->getCellSize();
-					cellBox.maxv = cellBox.minv + grid->getCellSize();
+			// Blocks are not cached, they are quickly packed again from the loaded cells
+			if( _triangleBlocks )
+				cached->buildTriangleBlocks( geometry->triAccel );
 
-					//if( rt::AabbIntersection::triangleOverlaps( cellBox, v0, v1, v2 ) )
-						grid->at( x, y, z ).push_back( t );
-				}
-			}
+			geometry->accStruct = cached;
+			return;
 		}
 	}
 
+	const float density = _autoTune ? tuneDensity( geometry, bbox ) : _density;
+
+	// Create uniform grid
+	UniformGridAccStruct* grid = createGrid( geometry, bbox, density );
+	geometry->accStruct = grid;
+
 	// Print stats
-	printGridStats( grid );
+	printGridStats( grid, _referenceCount, _boxReferenceCount, timer.elapsed() );
+
+	if( useCache )
+		saveCachedGrid( key, grid );
 }
 
 void UniformGridAccStructBuilder::buildCubeGrid( rt::Geometry* geometry )
 {
+	vr::Timer timer;
+	timer.restart();
+
 	// Compute scene box
 	rt::Aabb bbox;
 	bbox.buildFrom( &geometry->vertices[0], geometry->vertices.size() );
@@ -250,17 +565,22 @@ void UniformGridAccStructBuilder::buildCubeGrid( rt::Geometry* geometry )
 
 	// Set cell triangles according to their centers
 	// Each triangle must only occupy a single cell!
+	vr::vectorExactResize( _cellRanges, triCount );
+
 	for( int32 t = 0; t < triCount; ++t )
 	{
-		const int32 x = grid->worldToVoxel( spheres[t].center.x, RT_AXIS_X );
-		const int32 y = grid->worldToVoxel( spheres[t].center.y, RT_AXIS_Y );
-		const int32 z = grid->worldToVoxel( spheres[t].center.z, RT_AXIS_Z );
-
-		grid->at( x, y, z ).push_back( t );
+		CellRange& range = _cellRanges[t];
+		range.minCell[0] = range.maxCell[0] = grid->worldToVoxel( spheres[t].center.x, RT_AXIS_X );
+		range.minCell[1] = range.maxCell[1] = grid->worldToVoxel( spheres[t].center.y, RT_AXIS_Y );
+		range.minCell[2] = range.maxCell[2] = grid->worldToVoxel( spheres[t].center.z, RT_AXIS_Z );
 	}
 
+	_boxReferenceCount = insertTriangles( grid, _cellRanges, NULL, NULL, _threadCount );
+	_referenceCount = grid->getCellTriangleIds().size();
+	vr::vectorFreeMemory( _cellRanges );
+
 	// Print stats
-	printGridStats( grid );
+	printGridStats( grid, _referenceCount, _boxReferenceCount, timer.elapsed() );
 
 	// Code to check grid integrity
 
@@ -273,7 +593,7 @@ void UniformGridAccStructBuilder::buildCubeGrid( rt::Geometry* geometry )
 		{
 			for( int32 x = 0; x < nx; ++x )
 			{
-				const std::vector<int32>& cell = grid->at( x, y, z );
+				const UniformGridAccStruct::Cell cell = grid->at( x, y, z );
 
 				int32 id = x + y*nx + z*nx*ny;
 
@@ -302,3 +622,695 @@ void UniformGridAccStructBuilder::buildCubeGrid( rt::Geometry* geometry )
 		}
 	}
 }
+
+UniformGridAccStruct* UniformGridAccStructBuilder::createGrid( rt::Geometry* geometry, const rt::Aabb& bbox, float density )
+{
+	UniformGridAccStruct* grid = new UniformGridAccStruct();
+
+	// Compute actual number of cells in each dimension
+	const int32 triCount = geometry->triDesc.size();
+	int32 nx, ny, nz;
+	computeResolution( bbox, triCount, density, nx, ny, nz );
+
+	// Store grid data
+	grid->setBoundingBox( bbox );
+	grid->setResolution( nx, ny, nz );
+
+	// For each triangle, compute which cells it could overlap O(n)
+	computeCellRanges( geometry, grid, NULL, triCount, _threadCount, _cellRanges );
+	_boxReferenceCount = insertTriangles( grid, _cellRanges, geometry, NULL, _threadCount );
+	_referenceCount = grid->getCellTriangleIds().size();
+	vr::vectorFreeMemory( _cellRanges );
+
+	if( _gridMode == TWO_LEVEL )
+		buildSubGrids( geometry, grid, density );
+
+	if( _macroCellShift > 0 )
+		buildMacroCells( grid );
+
+	if( _triangleBlocks )
+		grid->buildTriangleBlocks( geometry->triAccel );
+
+	return grid;
+}
+
+float UniformGridAccStructBuilder::tuneDensity( rt::Geometry* geometry, const rt::Aabb& bbox )
+{
+	const std::pair<uint32, uint64> key( geometry->triDesc.size(), AccStructCache::hashGeometry( geometry ) );
+
+	TuningCache::const_iterator it = _tuningCache.find( key );
+	if( it != _tuningCache.end() )
+	{
+		printf( "\n***** Uniform Grid Tuning *****\n" );
+		printf( "cachedDensity: %5.2f\n", it->second );
+		return it->second;
+	}
+
+	vr::Timer timer;
+	timer.restart();
+
+	// Probe rays start on a sphere enclosing the box and point towards random positions inside it
+	std::vector<rt::Ray> probes( _probeRayCount );
+	const vr::vec3f center = ( bbox.minv + bbox.maxv ) * 0.5f;
+	const float radius = ( bbox.maxv - bbox.minv ).length();
+
+	for( uint32 i = 0; i < _probeRayCount; ++i )
+	{
+		rt::Ray& ray = probes[i];
+
+		vr::vec3f dir( vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ), vr::Random::real( -1.0f, 1.0f ) );
+		if( dir.normalize() == 0.0f )
+			dir = vr::vec3f( 0.0f, 0.0f, 1.0f );
+
+		ray.orig = center + dir * radius;
+
+		vr::vec3f target( vr::Random::real( bbox.minv.x, bbox.maxv.x ),
+			              vr::Random::real( bbox.minv.y, bbox.maxv.y ),
+						  vr::Random::real( bbox.minv.z, bbox.maxv.z ) );
+
+		ray.dir = target - ray.orig;
+		ray.dir.normalize();
+	}
+
+	rt::Instance instance;
+	instance.geometry = geometry;
+
+	float bestDensity = _density;
+	float bestCost = vr::Mathf::MAX_VALUE;
+
+	printf( "\n***** Uniform Grid Tuning *****\n" );
+
+	for( uint32 c = 0; c < CANDIDATE_COUNT; ++c )
+	{
+		vr::ref_ptr<UniformGridAccStruct> grid = createGrid( geometry, bbox, CANDIDATE_DENSITIES[c] );
+
+		UniformGridAccStruct::TraversalStats stats;
+		stats.cellCount = 0;
+		stats.triangleCount = 0;
+		stats.mailboxCount = 0;
+
+		for( uint32 i = 0; i < _probeRayCount; ++i )
+		{
+			rt::Ray ray = probes[i];
+			ray.tnear = 0.0f;
+			ray.tfar = vr::Mathf::MAX_VALUE;
+			ray.update();
+
+			rt::Hit hit;
+			hit.instance = NULL;
+			hit.distance = vr::Mathf::MAX_VALUE;
+
+			grid->traceNearestGeometry( instance, ray, hit, stats );
+		}
+
+		// Expected cost per ray
+		const float cost = ( _traversalCost * stats.cellCount + _intersectionCost * stats.triangleCount ) / _probeRayCount;
+		printf( "density %5.2f: cost %8.2f (%.2f cells, %.2f triangles, %.2f mailboxed per ray)\n", CANDIDATE_DENSITIES[c], cost,
+			    (float)stats.cellCount / _probeRayCount, (float)stats.triangleCount / _probeRayCount, 
+				(float)stats.mailboxCount / _probeRayCount );
+
+		if( cost < bestCost )
+		{
+			bestCost = cost;
+			bestDensity = CANDIDATE_DENSITIES[c];
+		}
+	}
+
+	printf( "bestDensity: %5.2f\n", bestDensity );
+	printf( "tuneTime: %.6f secs\n", timer.elapsed() );
+
+	_tuningCache[key] = bestDensity;
+	saveTuningCache();
+
+	return bestDensity;
+}
+
+void UniformGridAccStructBuilder::loadTuningCache()
+{
+	if( _tuningCacheFile.empty() )
+		return;
+
+	FILE* file = fopen( _tuningCacheFile.c_str(), "r" );
+	if( !file )
+		return;
+
+	// One mesh per line: triangle count, high and low half of the geometry hash, density.
+	// Lines written with 32-bit hashes do not parse into a valid density and are dropped.
+	uint32 triCount;
+	uint32 hashHigh;
+	uint32 hashLow;
+	float density;
+	while( fscanf( file, "%u %x %x %f", &triCount, &hashHigh, &hashLow, &density ) == 4 )
+	{
+		if( density > 0.0f )
+			_tuningCache[std::make_pair( triCount, ( (uint64)hashHigh << 32 ) | hashLow )] = density;
+	}
+
+	fclose( file );
+}
+
+void UniformGridAccStructBuilder::saveTuningCache() const
+{
+	if( _tuningCacheFile.empty() )
+		return;
+
+	FILE* file = fopen( _tuningCacheFile.c_str(), "w" );
+	if( !file )
+	{
+		printf( "Could not write grid tuning cache: %s\n", _tuningCacheFile.c_str() );
+		return;
+	}
+
+	for( TuningCache::const_iterator it = _tuningCache.begin(); it != _tuningCache.end(); ++it )
+	{
+		fprintf( file, "%u %08x %08x %f\n", it->first.first, (uint32)( it->first.second >> 32 ), 
+			     (uint32)it->first.second, it->second );
+	}
+
+	fclose( file );
+}
+
+void UniformGridAccStructBuilder::computeResolution( const rt::Aabb& bbox, int32 triCount, float density, 
+													 int32& nx, int32& ny, int32& nz ) const
+{
+	// Compute total geometry volume
+	vr::vec3f diagonal = bbox.maxv - bbox.minv;
+	float V = ( diagonal.x * diagonal.y * diagonal.z );
+
+	float factor = powf( density * triCount / V, 1.0f / 3.0f );
+
+	// Compute actual number of cells in each dimension
+	nx = vr::max( (int32)ceilf( diagonal.x * factor ), 1 );
+	ny = vr::max( (int32)ceilf( diagonal.y * factor ), 1 );
+	nz = vr::max( (int32)ceilf( diagonal.z * factor ), 1 );
+}
+
+void UniformGridAccStructBuilder::computeCellRanges( rt::Geometry* geometry, UniformGridAccStruct* grid, const int32* triangleIds, 
+													 int32 triCount, uint32 threadCount, std::vector<CellRange>& ranges ) const
+{
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
+
+	vr::vectorExactResize( ranges, triCount );
+
+	#pragma omp parallel for if( threadCount > 1 ) num_threads( threadCount ) schedule( static )
+	for( int32 i = 0; i < triCount; ++i )
+	{
+		const int32 t = triangleIds ? triangleIds[i] : i;
+
+		// Set initial triangle Aabb to v0 and expand to include other 2 vertices
+		rt::Aabb triBox;
+		triBox.minv = geometry->getVertex( t, 0 );
+		triBox.maxv = triBox.minv;
+		triBox.expandBy( geometry->getVertex( t, 1 ) );
+		triBox.expandBy( geometry->getVertex( t, 2 ) );
+
+		// Now that we have the triangle box, need to find which grid cells it overlaps
+		// Cells overlapped by the box but not by the triangle itself are discarded later with exact insertion
+		CellRange& range = ranges[i];
+		range.minCell[0] = vr::clampTo( grid->worldToVoxel( triBox.minv.x, RT_AXIS_X ), 0, nx - 1 );
+		range.minCell[1] = vr::clampTo( grid->worldToVoxel( triBox.minv.y, RT_AXIS_Y ), 0, ny - 1 );
+		range.minCell[2] = vr::clampTo( grid->worldToVoxel( triBox.minv.z, RT_AXIS_Z ), 0, nz - 1 );
+
+		range.maxCell[0] = vr::clampTo( grid->worldToVoxel( triBox.maxv.x, RT_AXIS_X ), 0, nx - 1 );
+		range.maxCell[1] = vr::clampTo( grid->worldToVoxel( triBox.maxv.y, RT_AXIS_Y ), 0, ny - 1 );
+		range.maxCell[2] = vr::clampTo( grid->worldToVoxel( triBox.maxv.z, RT_AXIS_Z ), 0, nz - 1 );
+	}
+}
+
+uint32 UniformGridAccStructBuilder::insertTriangles( UniformGridAccStruct* grid, const std::vector<CellRange>& ranges, 
+													  rt::Geometry* geometry, const int32* triangleIds, uint32 threadCount ) const
+{
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
+
+	const int32 triCount = ranges.size();
+	const uint32 layerSize = nx * ny;
+	const uint32 cellCount = layerSize * nz;
+
+	std::vector<int32> slabs;
+	computeSlabs( grid, ranges, threadCount, slabs );
+	const int32 slabCount = slabs.size() - 1;
+	std::vector<uint32> slabTotals( slabCount );
+	std::vector<uint32> slabBoxTotals( slabCount );
+
+	// Exact tests need the triangles
+	if( !_exactInsertion )
+		geometry = NULL;
+
+	// Offsets were zeroed by setResolution. The count of cell c is accumulated in offsets[c+1],
+	// so that an inclusive prefix sum turns offsets[c] into the start of cell c.
+	std::vector<uint32>& offsets = grid->getCellOffsets();
+
+	// Pass 1: count references per cell and prefix-sum them inside each slab
+	#pragma omp parallel for if( slabCount > 1 ) num_threads( threadCount ) schedule( static, 1 )
+	for( int32 s = 0; s < slabCount; ++s )
+	{
+		const int32 z0 = slabs[s];
+		const int32 z1 = slabs[s+1];
+
+		CountVisitor visitor;
+		visitor.offsets = &offsets[0];
+		uint32 boxTotal = 0;
+
+		for( int32 t = 0; t < triCount; ++t )
+		{
+			const CellRange& range = ranges[t];
+			if( ( range.maxCell[2] < z0 ) || ( range.minCell[2] >= z1 ) )
+				continue;
+
+			boxTotal += ( range.maxCell[0] - range.minCell[0] + 1 ) * ( range.maxCell[1] - range.minCell[1] + 1 ) *
+				        ( vr::min( range.maxCell[2], z1 - 1 ) - vr::max( range.minCell[2], z0 ) + 1 );
+
+			visitCells( grid, range, geometry, triangleIds ? triangleIds[t] : t, z0, z1, visitor );
+		}
+
+		uint32 sum = 0;
+		for( uint32 c = z0 * layerSize, limit = z1 * layerSize; c < limit; ++c )
+		{
+			sum += offsets[c+1];
+			offsets[c+1] = sum;
+		}
+
+		slabTotals[s] = sum;
+		slabBoxTotals[s] = boxTotal;
+	}
+
+	// Pass 2: add start of each slab, serial over slabs only
+	uint32 slabStart = 0;
+	uint32 boxReferenceCount = 0;
+	for( int32 s = 0; s < slabCount; ++s )
+	{
+		const uint32 total = slabTotals[s];
+		slabTotals[s] = slabStart;
+		slabStart += total;
+		boxReferenceCount += slabBoxTotals[s];
+	}
+
+	#pragma omp parallel for if( slabCount > 1 ) num_threads( threadCount ) schedule( static, 1 )
+	for( int32 s = 1; s < slabCount; ++s )
+	{
+		for( uint32 c = slabs[s] * layerSize, limit = slabs[s+1] * layerSize; c < limit; ++c )
+		{
+			offsets[c+1] += slabTotals[s];
+		}
+	}
+
+	// Pass 3: scatter triangle ids, in increasing order inside each cell
+	std::vector<int32>& cellTriangleIds = grid->getCellTriangleIds();
+	vr::vectorExactResize( cellTriangleIds, offsets[cellCount] );
+	std::vector<uint32> cursors( offsets.begin(), offsets.end() - 1 );
+
+	#pragma omp parallel for if( slabCount > 1 ) num_threads( threadCount ) schedule( static, 1 )
+	for( int32 s = 0; s < slabCount; ++s )
+	{
+		const int32 z0 = slabs[s];
+		const int32 z1 = slabs[s+1];
+
+		ScatterVisitor visitor;
+		visitor.triangleIds = cellTriangleIds.empty() ? NULL : &cellTriangleIds[0];
+		visitor.cursors = &cursors[0];
+
+		for( int32 t = 0; t < triCount; ++t )
+		{
+			const CellRange& range = ranges[t];
+			if( ( range.maxCell[2] < z0 ) || ( range.minCell[2] >= z1 ) )
+				continue;
+
+			visitor.rangeId = t;
+			visitCells( grid, range, geometry, triangleIds ? triangleIds[t] : t, z0, z1, visitor );
+		}
+	}
+
+	return boxReferenceCount;
+}
+
+template<class Visitor>
+void UniformGridAccStructBuilder::visitCells( UniformGridAccStruct* grid, const CellRange& range, rt::Geometry* geometry, 
+											  int32 triangleId, int32 z0, int32 z1, Visitor& visitor ) const
+{
+	const int32 zStart = vr::max( range.minCell[2], z0 );
+	const int32 zEnd = vr::min( range.maxCell[2], z1 - 1 );
+
+	// A triangle overlaps every cell of its box when the box is a single row of cells
+	const int32 spannedAxes = ( range.minCell[0] != range.maxCell[0] ) + ( range.minCell[1] != range.maxCell[1] ) + 
+		                      ( range.minCell[2] != range.maxCell[2] );
+
+	if( !geometry || ( spannedAxes < 2 ) )
+	{
+		for( int32 z = zStart; z <= zEnd; ++z )
+		{
+			for( int32 y = range.minCell[1]; y <= range.maxCell[1]; ++y )
+			{
+				for( int32 x = range.minCell[0]; x <= range.maxCell[0]; ++x )
+				{
+					visitor( grid->cellId( x, y, z ) );
+				}
+			}
+		}
+
+		return;
+	}
+
+	TriangleCellTest test;
+	test.setup( grid, range.minCell, geometry->getVertex( triangleId, 0 ), geometry->getVertex( triangleId, 1 ), 
+		        geometry->getVertex( triangleId, 2 ) );
+
+	for( int32 z = zStart; z <= zEnd; ++z )
+	{
+		for( int32 y = range.minCell[1]; y <= range.maxCell[1]; ++y )
+		{
+			for( int32 x = range.minCell[0]; x <= range.maxCell[0]; x += 4 )
+			{
+				int32 mask = test.overlaps4( x - range.minCell[0], y - range.minCell[1], z - range.minCell[2] );
+
+				// Ignore cells past the end of the row
+				mask &= ( 1 << vr::min( range.maxCell[0] - x + 1, 4 ) ) - 1;
+
+				for( int32 i = 0; mask != 0; ++i, mask >>= 1 )
+				{
+					if( mask & 1 )
+						visitor( grid->cellId( x + i, y, z ) );
+				}
+			}
+		}
+	}
+}
+
+void UniformGridAccStructBuilder::computeSlabs( UniformGridAccStruct* grid, const std::vector<CellRange>& ranges, 
+												uint32 threadCount, std::vector<int32>& slabs ) const
+{
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
+
+	const int32 slabCount = vr::min( (int32)threadCount, nz );
+	slabs.clear();
+	slabs.push_back( 0 );
+
+	if( slabCount > 1 )
+	{
+		// Count references of each z-layer, one histogram per thread
+		const int32 triCount = ranges.size();
+		std::vector< std::vector<uint32> > histograms( threadCount, std::vector<uint32>( nz, 0 ) );
+
+		#pragma omp parallel for num_threads( threadCount ) schedule( static )
+		for( int32 t = 0; t < triCount; ++t )
+		{
+			const CellRange& range = ranges[t];
+			const uint32 layerRefs = ( range.maxCell[0] - range.minCell[0] + 1 ) * ( range.maxCell[1] - range.minCell[1] + 1 );
+
+			std::vector<uint32>& histogram = histograms[omp_get_thread_num()];
+			for( int32 z = range.minCell[2]; z <= range.maxCell[2]; ++z )
+			{
+				histogram[z] += layerRefs;
+			}
+		}
+
+		std::vector<double> layerRefs( nz, 0.0 );
+		double total = 0.0;
+		for( int32 z = 0; z < nz; ++z )
+		{
+			for( uint32 i = 0; i < threadCount; ++i )
+			{
+				layerRefs[z] += histograms[i][z];
+			}
+
+			total += layerRefs[z];
+		}
+
+		// Close a slab whenever its share of references is reached, leaving at least one layer for each remaining slab
+		double sum = 0.0;
+		for( int32 z = 0; z < nz - 1; ++z )
+		{
+			sum += layerRefs[z];
+
+			const int32 slab = slabs.size();
+			if( slab == slabCount )
+				break;
+
+			if( ( sum >= total * slab / slabCount ) || ( nz - ( z + 1 ) == slabCount - slab ) )
+				slabs.push_back( z + 1 );
+		}
+	}
+
+	slabs.push_back( nz );
+}
+
+void UniformGridAccStructBuilder::buildMacroCells( UniformGridAccStruct* grid ) const
+{
+	grid->setMacroCellShift( _macroCellShift );
+
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
+
+	int32 mnx, mny, mnz;
+	grid->getMacroResolution( mnx, mny, mnz );
+
+	const std::vector<uint32>& offsets = grid->getCellOffsets();
+	std::vector<uint32>& counts = grid->getMacroCellCounts();
+
+	#pragma omp parallel for if( _threadCount > 1 ) num_threads( _threadCount ) schedule( static )
+	for( int32 mz = 0; mz < mnz; ++mz )
+	{
+		for( int32 z = mz << _macroCellShift, zEnd = vr::min( ( mz + 1 ) << _macroCellShift, nz ); z < zEnd; ++z )
+		{
+			for( int32 y = 0; y < ny; ++y )
+			{
+				for( int32 x = 0; x < nx; ++x )
+				{
+					const uint32 c = grid->cellId( x, y, z );
+					counts[grid->macroCellId( x, y, z )] += offsets[c+1] - offsets[c];
+				}
+			}
+		}
+	}
+}
+
+void UniformGridAccStructBuilder::buildSubGrids( rt::Geometry* geometry, UniformGridAccStruct* grid, float density )
+{
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
+
+	const int32 cellCount = nx * ny * nz;
+	std::vector<uint32>& offsets = grid->getCellOffsets();
+	std::vector<int32>& triangleIds = grid->getCellTriangleIds();
+
+	// Find crowded cells
+	std::vector<int32> crowdedCells;
+	uint32 refCount = offsets[cellCount];
+
+	for( int32 c = 0; c < cellCount; ++c )
+	{
+		const uint32 count = offsets[c+1] - offsets[c];
+		if( count > _subGridThreshold )
+		{
+			crowdedCells.push_back( c );
+			refCount -= count - 1;
+		}
+	}
+
+	if( crowdedCells.empty() )
+		return;
+
+	const int32 subGridCount = crowdedCells.size();
+	std::vector< vr::ref_ptr<UniformGridAccStruct> >& subGrids = grid->getSubGrids();
+	subGrids.resize( subGridCount );
+	std::vector<uint32> boxReferenceCounts( subGridCount );
+
+	// Sub-grids are independent, each one is built serially
+	#pragma omp parallel for if( _threadCount > 1 ) num_threads( _threadCount ) schedule( dynamic, 1 )
+	for( int32 i = 0; i < subGridCount; ++i )
+	{
+		const int32 c = crowdedCells[i];
+		const int32 x = c % nx;
+		const int32 y = ( c / nx ) % ny;
+		const int32 z = c / ( nx * ny );
+
+		// Sub-grid spans exactly its cell
+		rt::Aabb cellBox;
+		cellBox.minv.set( grid->voxelToWorld( x, RT_AXIS_X ), grid->voxelToWorld( y, RT_AXIS_Y ), grid->voxelToWorld( z, RT_AXIS_Z ) );
+		cellBox.maxv.set( grid->voxelToWorld( x + 1, RT_AXIS_X ), grid->voxelToWorld( y + 1, RT_AXIS_Y ), grid->voxelToWorld( z + 1, RT_AXIS_Z ) );
+
+		const int32* cellTriangleIds = &triangleIds[offsets[c]];
+		const int32 cellTriCount = offsets[c+1] - offsets[c];
+
+		int32 sx, sy, sz;
+		computeResolution( cellBox, cellTriCount, density, sx, sy, sz );
+
+		UniformGridAccStruct* subGrid = new UniformGridAccStruct();
+		subGrid->setBoundingBox( cellBox );
+		subGrid->setResolution( sx, sy, sz );
+
+		std::vector<CellRange> ranges;
+		computeCellRanges( geometry, subGrid, cellTriangleIds, cellTriCount, 1, ranges );
+		boxReferenceCounts[i] = insertTriangles( subGrid, ranges, geometry, cellTriangleIds, 1 );
+
+		// Insertion stored positions in the parent cell, map them back to triangle ids
+		std::vector<int32>& subGridIds = subGrid->getCellTriangleIds();
+		for( uint32 j = 0, limit = subGridIds.size(); j < limit; ++j )
+		{
+			subGridIds[j] = cellTriangleIds[subGridIds[j]];
+		}
+
+		subGrids[i] = subGrid;
+	}
+
+	for( int32 i = 0; i < subGridCount; ++i )
+	{
+		_referenceCount += subGrids[i]->getCellTriangleIds().size();
+		_boxReferenceCount += boxReferenceCounts[i];
+	}
+
+	// Crowded cells now only reference their sub-grid
+	std::vector<uint32> newOffsets( cellCount + 1 );
+	std::vector<int32> newTriangleIds;
+	newTriangleIds.reserve( refCount );
+
+	int32 nextSubGrid = 0;
+	for( int32 c = 0; c < cellCount; ++c )
+	{
+		newOffsets[c] = newTriangleIds.size();
+
+		if( ( nextSubGrid < subGridCount ) && ( crowdedCells[nextSubGrid] == c ) )
+		{
+			newTriangleIds.push_back( ~nextSubGrid );
+			++nextSubGrid;
+		}
+		else
+		{
+			newTriangleIds.insert( newTriangleIds.end(), triangleIds.begin() + offsets[c], triangleIds.begin() + offsets[c+1] );
+		}
+	}
+
+	newOffsets[cellCount] = newTriangleIds.size();
+
+	offsets.swap( newOffsets );
+	triangleIds.swap( newTriangleIds );
+}
+
+uint32 UniformGridAccStructBuilder::cacheSettings() const
+{
+	const uint32 settings[] = { _gridMode, _subGridThreshold, _exactInsertion, _macroCellShift, _autoTune };
+	const uint32 hash = AccStructCache::hashData( settings, sizeof( settings ) );
+	return AccStructCache::hashData( &_density, sizeof( float ), hash );
+}
+
+UniformGridAccStruct* UniformGridAccStructBuilder::loadCachedGrid( const AccStructCache::Key& key )
+{
+	vr::Timer timer;
+	timer.restart();
+
+	if( !_cache.load( key ) )
+		return NULL;
+
+	UniformGridAccStruct* grid = readGrid();
+	_cache.endLoad();
+
+	// Header matched but blocks do not, file is damaged
+	if( grid == NULL )
+	{
+		printf( "Invalid acceleration structure cache: %s\n", _cache.filename( key ).c_str() );
+		return NULL;
+	}
+
+	int32 nx, ny, nz;
+	grid->getResolution( nx, ny, nz );
+
+	uint32 referenceCount = grid->getCellTriangleIds().size();
+	const std::vector< vr::ref_ptr<UniformGridAccStruct> >& subGrids = grid->getSubGrids();
+	for( uint32 i = 0; i < subGrids.size(); ++i )
+	{
+		referenceCount += subGrids[i]->getCellTriangleIds().size();
+	}
+
+	// Print stats
+	printf( "\n***** Uniform Grid (cached) *****\n" );
+	printf( "numCells: %d, %d, %d (%d cells)\n", nx, ny, nz, nx * ny * nz );
+	if( !subGrids.empty() )
+		printf( "subGrids: %d\n", subGrids.size() );
+	printf( "references: %d\n", referenceCount );
+	printf( "file: %s\n", _cache.filename( key ).c_str() );
+	printf( "loadTime: %.6f secs\n", timer.elapsed() );
+
+	return grid;
+}
+
+UniformGridAccStruct* UniformGridAccStructBuilder::readGrid()
+{
+	const CachedGridInfo* info = static_cast<const CachedGridInfo*>( _cache.readBlock( sizeof( CachedGridInfo ) ) );
+	if( ( info == NULL ) || ( info->nx <= 0 ) || ( info->ny <= 0 ) || ( info->nz <= 0 ) || ( info->macroShift >= 16 ) )
+		return NULL;
+
+	UniformGridAccStruct* grid = new UniformGridAccStruct();
+	grid->setBoundingBox( info->bbox );
+	grid->setResolution( info->nx, info->ny, info->nz );
+	grid->setMacroCellShift( info->macroShift );
+
+	std::vector<uint32>& offsets = grid->getCellOffsets();
+	std::vector<int32>& triangleIds = grid->getCellTriangleIds();
+	std::vector<uint32>& macroCellCounts = grid->getMacroCellCounts();
+
+	// Sizes of all arrays follow from the info block, readBlock checks them against the file
+	const uint32* mappedOffsets = static_cast<const uint32*>( _cache.readBlock( offsets.size() * sizeof( uint32 ) ) );
+	const int32* mappedIds = static_cast<const int32*>( _cache.readBlock( info->referenceCount * sizeof( int32 ) ) );
+	const uint32* mappedCounts = static_cast<const uint32*>( _cache.readBlock( macroCellCounts.size() * sizeof( uint32 ) ) );
+
+	if( offsets.empty() || !mappedOffsets || !mappedIds || !mappedCounts || ( mappedOffsets[offsets.size()-1] != info->referenceCount ) )
+	{
+		delete grid;
+		return NULL;
+	}
+
+	offsets.assign( mappedOffsets, mappedOffsets + offsets.size() );
+	triangleIds.assign( mappedIds, mappedIds + info->referenceCount );
+	macroCellCounts.assign( mappedCounts, mappedCounts + macroCellCounts.size() );
+
+	std::vector< vr::ref_ptr<UniformGridAccStruct> >& subGrids = grid->getSubGrids();
+	subGrids.resize( info->subGridCount );
+
+	for( uint32 i = 0; i < info->subGridCount; ++i )
+	{
+		subGrids[i] = readGrid();
+		if( subGrids[i] == NULL )
+		{
+			delete grid;
+			return NULL;
+		}
+	}
+
+	return grid;
+}
+
+void UniformGridAccStructBuilder::saveCachedGrid( const AccStructCache::Key& key, UniformGridAccStruct* grid )
+{
+	if( !_cache.beginSave( key ) )
+		return;
+
+	writeGrid( grid );
+	_cache.endSave();
+}
+
+void UniformGridAccStructBuilder::writeGrid( UniformGridAccStruct* grid )
+{
+	const std::vector<uint32>& offsets = grid->getCellOffsets();
+	const std::vector<int32>& triangleIds = grid->getCellTriangleIds();
+	const std::vector<uint32>& macroCellCounts = grid->getMacroCellCounts();
+	const std::vector< vr::ref_ptr<UniformGridAccStruct> >& subGrids = grid->getSubGrids();
+
+	CachedGridInfo info;
+	info.bbox = grid->getBoundingBox();
+	grid->getResolution( info.nx, info.ny, info.nz );
+	info.macroShift = grid->getMacroCellShift();
+	info.referenceCount = triangleIds.size();
+	info.subGridCount = subGrids.size();
+
+	_cache.writeBlock( &info, sizeof( CachedGridInfo ) );
+	_cache.writeBlock( vectorData( offsets ), offsets.size() * sizeof( uint32 ) );
+	_cache.writeBlock( vectorData( triangleIds ), triangleIds.size() * sizeof( int32 ) );
+	_cache.writeBlock( vectorData( macroCellCounts ), macroCellCounts.size() * sizeof( uint32 ) );
+
+	for( uint32 i = 0; i < info.subGridCount; ++i )
+	{
+		writeGrid( subGrids[i].get() );
+	}
+}
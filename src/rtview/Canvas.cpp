@@ -9,6 +9,7 @@
 // Main rt class
 #include <rt/Context.h>
 #include <rt/Scene.h>
+#include <rt/CpuInfo.h>
 
 // Needed for camera manipulation
 #include <rt/ICamera.h>
@@ -37,7 +38,13 @@
 
 // Acceleration structures
 #include <rtp/UniformGridAccStructBuilder.h>
+#include <rtp/BvhAccStructBuilder.h>
 #include <rtp/KdTreeAccStructBuilder.h>
+#include <rtp/QbvhAccStructBuilder.h>
+#include <rtp/RopeKdTreeAccStructBuilder.h>
+#include <rtp/AccStructBenchmark.h>
+#include <rtp/RayTriBenchmark.h>
+#include <rtp/RayPacket.h>
 
 Canvas::Canvas( QWidget* parent )
 : QGLWidget( createDefaultGLFormat(), parent )
@@ -49,6 +56,8 @@ Canvas::Canvas( QWidget* parent )
 	_cameraFilename = "DefaultCamera.bin";
 	_currentPath = "../data/utah";
 	_gpur = new rtgl::GpuRenderer();
+	_animationGeometryId = -1;
+	_cpuFrameId = 0;
 }
 
 void Canvas::loadDefaultScene()
@@ -104,6 +113,8 @@ void Canvas::loadGeometryFile()
 	_gpur->objAnimation.printStats();
 
 	_gpur->update();
+
+	loadCpuAnimation();
 	/**
 	// TODO: 
 
@@ -274,6 +285,11 @@ void Canvas::initializeGL()
 	// Testing acc structs
 	ctx->setAccStructBuilder( new rtp::UniformGridAccStructBuilder() );
 	//ctx->setAccStructBuilder( new rtp::KdTreeAccStructBuilder() );
+	//ctx->setAccStructBuilder( new rtp::MtKdTreeAccStructBuilder() );
+	//ctx->setAccStructBuilder( new rtp::BvhAccStructBuilder() );
+	//ctx->setAccStructBuilder( new rtp::MtBvhAccStructBuilder() );
+	//ctx->setAccStructBuilder( new rtp::QbvhAccStructBuilder() );
+	//ctx->setAccStructBuilder( new rtp::RopeKdTreeAccStructBuilder() );
 
 	// Setup default material
 	rtp::HeadlightMaterialColor* mat = new rtp::HeadlightMaterialColor;
@@ -346,6 +362,8 @@ void Canvas::paintGL()
 		void* deviceMem = _pbo->beginWrite();
 		rt::Context::current()->setFrameBuffer( static_cast<float*>( deviceMem ) );
 
+		updateCpuAnimation();
+
 		// Do actual ray tracing of current frame
 		rt::Context::current()->renderFrame();
 
@@ -387,6 +405,12 @@ void Canvas::keyPressEvent( QKeyEvent* e )
 	if( e->key() == Qt::Key_Space )
 		updateCameraFromScene();
 
+	if( e->key() == Qt::Key_B )
+		benchmarkAccStructs();
+
+	if( e->key() == Qt::Key_K )
+		benchmarkRayTriKernels();
+
 	if( e->isAutoRepeat() )
 		return;
 
@@ -598,3 +622,215 @@ void Canvas::printCurrentGeometryStats()
 	printf( "texCoords:  %6d\n", geom->texCoords.size() );
 	printf( "expanded:   %6d\n\n", geom->triDesc.size() * 3 );
 }
+
+void Canvas::benchmarkAccStructs()
+{
+	rt::Context* ctx = rt::Context::current();
+	printf( "simdLevel: %s\n", rt::CpuInfo::getSimdLevelName( ctx->getSimdLevel() ) );
+
+	rtp::KdTreeAccStructBuilder kdTreeBuilder;
+	rtp::MtKdTreeAccStructBuilder mtKdTreeBuilder;
+	rtp::BvhAccStructBuilder bvhBuilder;
+	rtp::MtBvhAccStructBuilder mtBvhBuilder;
+	rtp::QbvhAccStructBuilder qbvhBuilder;
+	rtp::RopeKdTreeAccStructBuilder ropeKdTreeBuilder;
+	rtp::UniformGridAccStructBuilder gridBuilder;
+
+	for( uint32 i = 0; i < ctx->getGeometryCount(); ++i )
+	{
+		rt::Geometry* geom = ctx->getGeometry( i );
+		if( geom->vertices.empty() )
+			continue;
+
+		rt::Aabb bbox;
+		bbox.buildFrom( &geom->vertices[0], geom->vertices.size() );
+
+		// Geometry loaded for a compact BVH has no TriAccel's, the other structures get them for the benchmark
+		const bool releaseTriAccel = !geom->hasTriAccel();
+
+		// Kd-tree with breadth-first layout is the reference
+		rtp::AccStructBenchmark benchmark;
+		benchmark.generateRays( bbox );
+
+		kdTreeBuilder.setNodeLayout( rtp::KdTreeAccStructBuilder::BREADTH_FIRST );
+		benchmark.run( "Kd-Tree (breadth-first)", geom, &kdTreeBuilder );
+
+		// Same tree with scalar kernels only
+		const RTenum simdLevel = ctx->getSimdLevel();
+		ctx->setSimdLevel( RT_SIMD_NONE );
+		benchmark.run( "Kd-Tree (breadth-first, no SIMD)", geom, &kdTreeBuilder );
+		ctx->setSimdLevel( simdLevel );
+
+		kdTreeBuilder.setNodeLayout( rtp::KdTreeAccStructBuilder::TREELETS );
+		benchmark.run( "Kd-Tree (treelets)", geom, &kdTreeBuilder );
+
+		benchmark.run( "Kd-Tree (ropes)", geom, &ropeKdTreeBuilder );
+
+		benchmark.run( "Kd-Tree (Moller-Trumbore)", geom, &mtKdTreeBuilder );
+
+		kdTreeBuilder.setLazyDepth( 8 );
+		benchmark.run( "Kd-Tree (lazy)", geom, &kdTreeBuilder );
+		kdTreeBuilder.setLazyDepth( 0 );
+
+		// First run of a new mesh saves the tree, following ones load it
+		kdTreeBuilder.setCacheDirectory( "." );
+		benchmark.run( "Kd-Tree (cached)", geom, &kdTreeBuilder );
+		kdTreeBuilder.setCacheDirectory( "" );
+
+		benchmark.run( "BVH", geom, &bvhBuilder );
+		benchmark.run( "BVH (Moller-Trumbore)", geom, &mtBvhBuilder );
+
+		// Compact mode releases the geometry's TriAccel's, the benchmark rebuilds them for the following structures
+		bvhBuilder.setQuantizedTriangles( true );
+		benchmark.run( "BVH (quantized)", geom, &bvhBuilder );
+		bvhBuilder.setQuantizedTriangles( false );
+
+		bvhBuilder.setSpatialSplits( true );
+		benchmark.run( "SBVH", geom, &bvhBuilder );
+		bvhBuilder.setSpatialSplits( false );
+
+		benchmark.run( "QBVH", geom, &qbvhBuilder );
+
+		gridBuilder.setGridMode( rtp::UniformGridAccStructBuilder::SINGLE_LEVEL );
+		benchmark.run( "Uniform Grid", geom, &gridBuilder );
+
+		gridBuilder.setGridMode( rtp::UniformGridAccStructBuilder::TWO_LEVEL );
+		benchmark.run( "Two-Level Grid", geom, &gridBuilder );
+
+		gridBuilder.setGridMode( rtp::UniformGridAccStructBuilder::SINGLE_LEVEL );
+		gridBuilder.setAutoTune( true );
+		benchmark.run( "Uniform Grid (auto-tuned)", geom, &gridBuilder );
+		gridBuilder.setAutoTune( false );
+
+		gridBuilder.setExactInsertion( true );
+		benchmark.run( "Uniform Grid (exact insertion)", geom, &gridBuilder );
+		gridBuilder.setExactInsertion( false );
+
+		gridBuilder.setMacroCellSize( 1 );
+		benchmark.run( "Uniform Grid (no macro-cells)", geom, &gridBuilder );
+		gridBuilder.setMacroCellSize( 2 );
+
+		gridBuilder.setCacheDirectory( "." );
+		benchmark.run( "Uniform Grid (cached)", geom, &gridBuilder );
+		gridBuilder.setCacheDirectory( "" );
+
+		// Coherent primary rays, traced one by one as reference and then in packets
+		rtp::AccStructBenchmark primaryBenchmark;
+		primaryBenchmark.generatePrimaryRays( bbox );
+
+		kdTreeBuilder.setNodeLayout( rtp::KdTreeAccStructBuilder::BREADTH_FIRST );
+		primaryBenchmark.run( "Kd-Tree (primary rays)", geom, &kdTreeBuilder );
+
+		primaryBenchmark.setPacketSize( rtp::RayPacket::SIZE );
+		primaryBenchmark.run( "Kd-Tree (primary ray packets)", geom, &kdTreeBuilder );
+
+		primaryBenchmark.setPacketSize( 1 );
+		primaryBenchmark.run( "Kd-Tree (ropes, primary rays)", geom, &ropeKdTreeBuilder );
+
+		// Incoherent rays starting inside the scene, where stackless traversal starts at the leaf of the origin
+		rtp::AccStructBenchmark secondaryBenchmark;
+		secondaryBenchmark.generateSecondaryRays( bbox );
+
+		kdTreeBuilder.setNodeLayout( rtp::KdTreeAccStructBuilder::BREADTH_FIRST );
+		secondaryBenchmark.run( "Kd-Tree (secondary rays)", geom, &kdTreeBuilder );
+		secondaryBenchmark.run( "Kd-Tree (ropes, secondary rays)", geom, &ropeKdTreeBuilder );
+
+		// Shadow rays, nearest hit traversal as reference for any hit traversal
+		rtp::AccStructBenchmark shadowBenchmark;
+		shadowBenchmark.generateShadowRays( bbox );
+		shadowBenchmark.run( "Kd-Tree (shadow rays, nearest hit)", geom, &kdTreeBuilder );
+
+		shadowBenchmark.setAnyHit( true );
+		shadowBenchmark.run( "Kd-Tree (shadow rays, any hit)", geom, &kdTreeBuilder );
+		shadowBenchmark.run( "Uniform Grid (shadow rays, any hit)", geom, &gridBuilder );
+
+		// Triangles tested one by one against blocks of 4 SIMD triangles
+		kdTreeBuilder.setTriangleBlocks( false );
+		shadowBenchmark.run( "Kd-Tree (shadow rays, any hit, no triangle blocks)", geom, &kdTreeBuilder );
+
+		gridBuilder.setTriangleBlocks( true );
+		shadowBenchmark.run( "Uniform Grid (shadow rays, any hit, triangle blocks)", geom, &gridBuilder );
+
+		shadowBenchmark.setAnyHit( false );
+		shadowBenchmark.run( "Kd-Tree (shadow rays, nearest hit, no triangle blocks)", geom, &kdTreeBuilder );
+		shadowBenchmark.run( "Uniform Grid (shadow rays, nearest hit, triangle blocks)", geom, &gridBuilder );
+
+		kdTreeBuilder.setTriangleBlocks( true );
+		gridBuilder.setTriangleBlocks( false );
+
+		if( releaseTriAccel )
+			vr::vectorFreeMemory( geom->triAccel );
+	}
+}
+
+void Canvas::benchmarkRayTriKernels()
+{
+	rt::Context* ctx = rt::Context::current();
+	rtp::RayTriBenchmark benchmark;
+
+	// Random triangles, then triangles of each scene geometry (numbered from 1)
+	vr::ref_ptr<rt::Geometry> synthetic = new rt::Geometry();
+	rtp::RayTriBenchmark::generateTriangles( *synthetic, 100000 );
+
+	for( uint32 i = 0; i <= ctx->getGeometryCount(); ++i )
+	{
+		rt::Geometry* geom = ( i == 0 ) ? synthetic.get() : ctx->getGeometry( i - 1 );
+
+		char name[64];
+		sprintf( name, "%s %d", ( i == 0 ) ? "synthetic" : "geometry", i );
+		benchmark.runMixes( name, *geom );
+	}
+}
+
+void Canvas::loadCpuAnimation()
+{
+	const rtgl::ObjAnimation& animation = _gpur->objAnimation;
+	if( animation.frameObjs.empty() )
+		return;
+
+	rt::Context* ctx = rt::Context::current();
+	ctx->bindMaterial( _defaultMaterialId );
+
+	// First keyframe gives the triangles, following ones only move their vertices
+	const rtgl::KeyFrameObj* frame = animation.frameObjs[0].get();
+	uint32 geometryId = ctx->createGeometries( 1 );
+	ctx->beginGeometry( geometryId );
+	ctx->beginPrimitive( RT_TRIANGLES );
+
+	for( uint32 v = 0, limit = frame->vertices.size(); v < limit; ++v )
+	{
+		ctx->setNormal( frame->normals[v].ptr );
+		ctx->addVertex( frame->vertices[v].ptr );
+	}
+
+	ctx->endPrimitive();
+	ctx->endGeometry();
+
+	uint32 instId = ctx->createInstances( 1 );
+	ctx->instantiateLastGeometry( instId );
+
+	_animationGeometryId = geometryId;
+	_cpuFrameId = 0;
+	_cpuFrameTimer.restart();
+}
+
+void Canvas::updateCpuAnimation()
+{
+	const rtgl::ObjAnimation& animation = _gpur->objAnimation;
+	const int numKeyFrames = animation.frameObjs.size();
+
+	if( ( _animationGeometryId < 0 ) || ( numKeyFrames < 2 ) || !_gpur->isAnimationEnabled() )
+		return;
+
+	// Same keyframe rate as GPU renderer
+	const double FRAME_TIME = 0.1;
+	if( _cpuFrameTimer.elapsed() <= FRAME_TIME )
+		return;
+
+	_cpuFrameId = ( _cpuFrameId + 1 ) % numKeyFrames;
+	_cpuFrameTimer.restart();
+
+	// Acceleration structure is refitted when its builder supports it (e.g. BVH), rebuilt otherwise
+	const rtgl::KeyFrameObj* frame = animation.frameObjs[_cpuFrameId].get();
+	rt::Context::current()->updateGeometryVertices( _animationGeometryId, frame->vertices[0].ptr, frame->normals[0].ptr );
+}
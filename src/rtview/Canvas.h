@@ -61,6 +61,12 @@ private:
 	void initContexts();
 	void updateCameraFromScene();
 	void printCurrentGeometryStats();
+	void benchmarkAccStructs();
+	void benchmarkRayTriKernels();
+
+	// Keyframe animation on CPU renderers
+	void loadCpuAnimation();
+	void updateCpuAnimation();
 
 	RedrawPolicy _redrawPolicy;
 	RenderMode _renderMode;
@@ -79,6 +85,11 @@ private:
 	QString _currentPath;
 
 	vr::ref_ptr<rtgl::GpuRenderer> _gpur;
+
+	// CPU copy of loaded animation, -1 if none
+	int _animationGeometryId;
+	int _cpuFrameId;
+	vr::Timer _cpuFrameTimer;
 };
 
 #endif // _CANVAS_H_